@@ -0,0 +1,88 @@
+#include <string>
+#include <algorithm>
+
+#include "src/dfs-utils.h"
+#include "dfslib-admission-p1.h"
+
+using grpc::Status;
+using grpc::StatusCode;
+
+DFSAdmissionControl::Ticket::Ticket(DFSAdmissionControl *control, const std::string &op, int64_t bytes)
+    : control(control), op(op), bytes(bytes), start(std::chrono::steady_clock::now()) {}
+
+DFSAdmissionControl::Ticket::~Ticket()
+{
+    control->Release(op, bytes, std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - start));
+}
+
+DFSAdmissionControl::DFSAdmissionControl(int max_inflight, int64_t max_queued_bytes, bool shed_late)
+    : max_inflight(max_inflight), max_queued_bytes(max_queued_bytes), shed_late(shed_late),
+      inflight(0), queued_bytes(0), bytes_per_us(0) {}
+
+Status DFSAdmissionControl::Admit(grpc::ServerContext *context, const std::string &op, int64_t bytes,
+                                  std::unique_ptr<Ticket> *ticket)
+{
+    bytes = std::max<int64_t>(bytes, 0);
+
+    if (shed_late && context->deadline() != std::chrono::system_clock::time_point::max())
+    {
+        auto remaining = context->deadline() - std::chrono::system_clock::now();
+        if (remaining < Estimate(op, bytes))
+        {
+            dfs_log(LL_SYSINFO) << "Shedding " << op << ": deadline is shorter than the expected service time";
+            return Status(StatusCode::DEADLINE_EXCEEDED, "Request cannot finish before its deadline");
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (max_inflight > 0 && inflight >= max_inflight)
+        {
+            dfs_log(LL_SYSINFO) << "Rejecting " << op << ": " << inflight << " streams in flight";
+            return Status(StatusCode::RESOURCE_EXHAUSTED, "Server is overloaded: too many streams in flight");
+        }
+        // a single oversized request is still admitted when nothing else is queued
+        if (max_queued_bytes > 0 && queued_bytes > 0 && queued_bytes + bytes > max_queued_bytes)
+        {
+            dfs_log(LL_SYSINFO) << "Rejecting " << op << ": " << queued_bytes << " bytes queued";
+            return Status(StatusCode::RESOURCE_EXHAUSTED, "Server is overloaded: too many bytes queued");
+        }
+        inflight++;
+        queued_bytes += bytes;
+    }
+
+    ticket->reset(new Ticket(this, op, bytes));
+    return Status::OK;
+}
+
+std::chrono::microseconds DFSAdmissionControl::Estimate(const std::string &op, int64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    double estimate = base_us[op];
+    if (bytes_per_us > 0)
+    {
+        estimate += bytes / bytes_per_us;
+    }
+    return std::chrono::microseconds(static_cast<int64_t>(estimate));
+}
+
+void DFSAdmissionControl::Release(const std::string &op, int64_t bytes, std::chrono::microseconds elapsed)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    inflight--;
+    queued_bytes -= bytes;
+
+    // exponentially weighted moving averages, alpha = 1/5
+    double &base = base_us[op];
+    if (bytes >= THROUGHPUT_SAMPLE_BYTES)
+    {
+        double transfer_us = std::max<double>(1.0, elapsed.count() - base);
+        double sample = bytes / transfer_us;
+        bytes_per_us = bytes_per_us == 0 ? sample : bytes_per_us + (sample - bytes_per_us) / 5;
+    }
+    else
+    {
+        base = base == 0 ? elapsed.count() : base + (elapsed.count() - base) / 5;
+    }
+}
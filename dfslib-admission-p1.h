@@ -0,0 +1,96 @@
+#ifndef _DFSLIB_ADMISSION_H
+#define _DFSLIB_ADMISSION_H
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <grpcpp/grpcpp.h>
+
+/**
+ * Admission control and load shedding for the server.
+ *
+ * Every RPC asks for admission before it touches the disk. A request is
+ * rejected with RESOURCE_EXHAUSTED when too many streams are already in
+ * flight or too many bytes are already queued for transfer. With late
+ * shedding on, a request is also dropped with DEADLINE_EXCEEDED when its
+ * remaining deadline is shorter than the service time we expect for it,
+ * since it would time out after wasting the work anyway.
+ *
+ * Service time is estimated per operation as a fixed cost plus the
+ * request's bytes divided by the observed transfer throughput.
+ */
+class DFSAdmissionControl
+{
+
+public:
+    /**
+     * An admitted request. Releases its slot and bytes, and records
+     * its service time, when destroyed.
+     */
+    class Ticket
+    {
+
+    private:
+        DFSAdmissionControl *control;
+        std::string op;
+        int64_t bytes;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        Ticket(DFSAdmissionControl *control, const std::string &op, int64_t bytes);
+        ~Ticket();
+    };
+
+    /**
+     * @param max_inflight - streams admitted at once (0 = unlimited)
+     * @param max_queued_bytes - bytes of admitted transfers at once (0 = unlimited)
+     * @param shed_late - drop requests that cannot finish before their deadline
+     */
+    DFSAdmissionControl(int max_inflight = 0, int64_t max_queued_bytes = 0, bool shed_late = false);
+
+    /**
+     * Ask for admission.
+     *
+     * @param context
+     * @param op - the operation name, used to keep separate estimates
+     * @param bytes - bytes the request will transfer, if known
+     * @param ticket - filled in when the request is admitted
+     * @return OK, RESOURCE_EXHAUSTED or DEADLINE_EXCEEDED
+     */
+    grpc::Status Admit(grpc::ServerContext *context, const std::string &op, int64_t bytes,
+                       std::unique_ptr<Ticket> *ticket);
+
+    /**
+     * Expected service time for a request.
+     *
+     * @param op
+     * @param bytes
+     * @return
+     */
+    std::chrono::microseconds Estimate(const std::string &op, int64_t bytes);
+
+private:
+    /** Transfers smaller than this only feed the fixed-cost estimate **/
+    static const int64_t THROUGHPUT_SAMPLE_BYTES = 256 * 1024;
+
+    int max_inflight;
+    int64_t max_queued_bytes;
+    bool shed_late;
+
+    std::mutex mutex;
+    int inflight;
+    int64_t queued_bytes;
+
+    /** Smoothed fixed cost per operation, in microseconds **/
+    std::map<std::string, double> base_us;
+
+    /** Smoothed transfer throughput in bytes per microsecond (0 until measured) **/
+    double bytes_per_us;
+
+    void Release(const std::string &op, int64_t bytes, std::chrono::microseconds elapsed);
+};
+
+#endif
@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dfslib-shared-p1.h"
+#include "dfslib-zfile-p1.h"
+#include "dfslib-async-p1.h"
+#include "dfslib-clientnode-p1.h"
+
+DFSAsyncEngine::DFSAsyncEngine(const DFSAsyncOptions &options)
+    : options(options), next_queue(0), running(0)
+{
+    const int count = std::max(1, options.threads);
+    for (int i = 0; i < count; i++)
+    {
+        queues.emplace_back(new grpc::CompletionQueue());
+    }
+    for (auto &queue : queues)
+    {
+        threads.emplace_back(&DFSAsyncEngine::Run, this, queue.get());
+    }
+}
+
+DFSAsyncEngine::~DFSAsyncEngine()
+{
+    Wait();
+    for (auto &queue : queues)
+    {
+        queue->Shutdown();
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+}
+
+void DFSAsyncEngine::Submit(DFSAsyncCall *call)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (running >= std::max(1, options.max_inflight))
+        {
+            waiting.push_back(call);
+            return;
+        }
+        running++;
+    }
+    Launch(call);
+}
+
+void DFSAsyncEngine::Wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]() { return running == 0; });
+}
+
+void DFSAsyncEngine::Launch(DFSAsyncCall *call)
+{
+    // a call that completes on the spot hands its slot straight on
+    while (call != nullptr)
+    {
+        if (call->Start(queues[next_queue++ % queues.size()].get()))
+        {
+            return;
+        }
+        delete call;
+        call = Release();
+    }
+}
+
+DFSAsyncCall *DFSAsyncEngine::Release()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!waiting.empty())
+    {
+        DFSAsyncCall *next = waiting.front();
+        waiting.pop_front();
+        return next;
+    }
+    if (--running == 0)
+    {
+        idle.notify_all();
+    }
+    return nullptr;
+}
+
+void DFSAsyncEngine::Run(grpc::CompletionQueue *cq)
+{
+    void *tag;
+    bool ok;
+    while (cq->Next(&tag, &ok))
+    {
+        DFSAsyncCall *call = static_cast<DFSAsyncCall *>(tag);
+        if (!call->Proceed(ok))
+        {
+            delete call;
+            Launch(Release());
+        }
+    }
+}
+
+DFSAsyncStore::DFSAsyncStore(DFSReplica *replica, const std::string &filename, const std::string &local_filepath,
+                             const DFSAsyncDone &done)
+    : replica(replica), filename(filename), local_filepath(local_filepath), done(done), state(STARTING), fd(-1)
+{
+}
+
+DFSAsyncStore::~DFSAsyncStore()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+grpc::ClientContext *DFSAsyncStore::Context()
+{
+    return &context;
+}
+
+bool DFSAsyncStore::Start(grpc::CompletionQueue *cq)
+{
+    // the file is opened only now, so calls waiting for a slot hold no descriptor
+    fd = open(local_filepath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        dfs_log(LL_ERROR) << "File not found: " << local_filepath;
+        done(grpc::Status(grpc::StatusCode::NOT_FOUND, "File not found: " + local_filepath));
+        return false;
+    }
+    context.AddMetadata("filename", filename);
+    struct stat local_stat;
+    if (fstat(fd, &local_stat) == 0)
+    {
+        context.AddMetadata("filesize", std::to_string(local_stat.st_size));
+        context.AddMetadata("mtime", std::to_string(local_stat.st_mtime));
+    }
+    infile.reset(new DFSChunkReader(fd, BUF_SIZE));
+    chunk = DFSChunkPool::Acquire();
+
+    call.reset(new DFSReplicaCall(replica, false));
+    std::lock_guard<std::mutex> lock(start_mutex);
+    writer = call->Stub()->AsyncstoreFile(&context, &response, cq, this);
+    return true;
+}
+
+bool DFSAsyncStore::Proceed(bool ok)
+{
+    if (state == STARTING)
+    {
+        // the start can complete before AsyncstoreFile() has returned the writer
+        std::lock_guard<std::mutex> lock(start_mutex);
+    }
+    switch (state)
+    {
+    case STARTING:
+    case WRITING:
+        if (!ok)
+        {
+            // the stream broke; Finish says why
+            Finish();
+        }
+        else if (infile->Next(chunk.get()))
+        {
+            state = WRITING;
+            writer->Write(*chunk, this);
+        }
+        else if (infile->Failed())
+        {
+            // cancel rather than let the server keep a truncated file
+            dfs_log(LL_ERROR) << "Failed to read file: " << local_filepath;
+            context.TryCancel();
+            Finish();
+        }
+        else
+        {
+            state = CLOSING;
+            writer->WritesDone(this);
+        }
+        return true;
+    case CLOSING:
+        Finish();
+        return true;
+    case FINISHING:
+        break;
+    }
+
+    close(fd);
+    fd = -1;
+    call.reset();
+    if (!status.ok())
+    {
+        dfs_log(LL_ERROR) << "Failed to store " << filename << ": " << status.error_message();
+    }
+    done(status);
+    return false;
+}
+
+void DFSAsyncStore::Finish()
+{
+    state = FINISHING;
+    writer->Finish(&status, this);
+}
+
+DFSAsyncFetch::DFSAsyncFetch(DFSReplica *replica, const std::string &filename, const std::string &local_filepath,
+                             const DFSAsyncDone &done)
+    : replica(replica), filename(filename), local_filepath(local_filepath), done(done), state(STARTING)
+{
+}
+
+grpc::ClientContext *DFSAsyncFetch::Context()
+{
+    return &context;
+}
+
+bool DFSAsyncFetch::Start(grpc::CompletionQueue *cq)
+{
+    dfs_service::FilePath request;
+    request.set_path(filename);
+    // compressed files may arrive as stored, for this client to inflate
+    request.set_frames(true);
+    chunk = DFSChunkPool::Acquire();
+
+    call.reset(new DFSReplicaCall(replica));
+    std::lock_guard<std::mutex> lock(start_mutex);
+    reader = call->Stub()->AsyncfetchFile(&context, request, cq, this);
+    return true;
+}
+
+bool DFSAsyncFetch::Proceed(bool ok)
+{
+    if (state == STARTING)
+    {
+        // the start can complete before AsyncfetchFile() has returned the reader
+        std::lock_guard<std::mutex> lock(start_mutex);
+    }
+    switch (state)
+    {
+    case STARTING:
+    case READING:
+        // a failed read is the end of the stream
+        if (ok && (state == STARTING || WriteChunk()))
+        {
+            state = READING;
+            reader->Read(chunk.get(), this);
+            return true;
+        }
+        state = FINISHING;
+        reader->Finish(&status, this);
+        return true;
+    case FINISHING:
+        break;
+    }
+
+    if (!local_error.ok())
+    {
+        status = local_error;
+    }
+    else if (status.ok())
+    {
+        Complete();
+    }
+    if (!status.ok() && status.error_code() != grpc::NOT_FOUND && local_error.ok())
+    {
+        call->Failed();
+    }
+    call.reset();
+    if (!status.ok())
+    {
+        dfs_log(LL_ERROR) << "Failed to fetch " << filename << ": " << status.error_message();
+    }
+    done(status);
+    return false;
+}
+
+bool DFSAsyncFetch::WriteChunk()
+{
+    if (!dfs_zfile_expand(chunk.get()))
+    {
+        local_error = grpc::Status(grpc::StatusCode::INTERNAL, "Corrupt compressed chunk: " + std::to_string(chunk->chunk_num()));
+    }
+    else if (!outfile.IsOpen() && (!dfs_make_parents(local_filepath) || !outfile.Open(local_filepath)))
+    {
+        local_error = grpc::Status(grpc::StatusCode::INTERNAL, "Failed to open file for writing: " + local_filepath);
+    }
+    else if (!outfile.Write(*chunk))
+    {
+        local_error = grpc::Status(grpc::StatusCode::INTERNAL, "Failed to write to file: " + local_filepath);
+    }
+    else
+    {
+        return true;
+    }
+    context.TryCancel();
+    return false;
+}
+
+void DFSAsyncFetch::Complete()
+{
+    // an empty file arrives without any chunk
+    if (!outfile.IsOpen() && (!dfs_make_parents(local_filepath) || !outfile.Open(local_filepath)))
+    {
+        local_error = status = grpc::Status(grpc::StatusCode::INTERNAL, "Failed to open file for writing: " + local_filepath);
+        return;
+    }
+    if (!outfile.Close())
+    {
+        local_error = status = grpc::Status(grpc::StatusCode::INTERNAL, "Failed to write to file: " + local_filepath);
+        return;
+    }
+    // keep the server's mtime, so the two copies compare equal later
+    const auto &server_metadata = context.GetServerInitialMetadata();
+    auto mtime = server_metadata.find("mtime");
+    if (mtime != server_metadata.end())
+    {
+        dfs_set_mtime(local_filepath, std::atoll(std::string(mtime->second.data(), mtime->second.size()).c_str()));
+    }
+}
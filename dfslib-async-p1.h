@@ -0,0 +1,299 @@
+#ifndef _DFSLIB_ASYNC_H
+#define _DFSLIB_ASYNC_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+#include <grpcpp/grpcpp.h>
+
+#include "dfslib-chunkpool-p1.h"
+#include "src/dfslibx-clientnode-p1.h"
+#include "proto-src/dfs-service.grpc.pb.h"
+
+/**
+ * Settings of the asynchronous client API
+ */
+struct DFSAsyncOptions
+{
+    /** Threads polling the completion queues, one queue each **/
+    int threads = 2;
+
+    /** Operations running at once at most; later ones wait in submission order **/
+    int max_inflight = 256;
+};
+
+/**
+ * Called once when an operation completes: on a completion-queue thread,
+ * or on the submitting one if the call fails before it starts
+ */
+typedef std::function<void(const grpc::Status &status)> DFSAsyncDone;
+
+/**
+ * One operation driven by the completion queues. The call is the tag of
+ * every operation it queues, and queues at most one at a time.
+ */
+class DFSAsyncCall
+{
+
+public:
+    virtual ~DFSAsyncCall() {}
+
+    /**
+     * Start the call on `cq`, once the concurrency limit lets it run.
+     *
+     * @param cq
+     * @return false if it completed without queueing anything (e.g. the local file is missing)
+     */
+    virtual bool Start(grpc::CompletionQueue *cq) = 0;
+
+    /**
+     * Handle the completion of the operation queued last.
+     *
+     * @param ok - as reported by the completion queue
+     * @return false once the call has completed; it is then deleted
+     */
+    virtual bool Proceed(bool ok) = 0;
+};
+
+/**
+ * Runs asynchronous calls on a few completion-queue threads.
+ *
+ * Every thread polls a completion queue of its own, and calls are spread
+ * over the queues round-robin. At most `max_inflight` calls run at once;
+ * a call submitted beyond that waits in a queue, not on a thread, and is
+ * started when a running one completes. A thousand operations in flight
+ * therefore cost a thousand small state machines, not a thousand threads.
+ *
+ * Completion callbacks and local disk I/O run on the queue threads, so
+ * callbacks must not block; they may submit further calls.
+ */
+class DFSAsyncEngine
+{
+
+public:
+    explicit DFSAsyncEngine(const DFSAsyncOptions &options);
+
+    /** Wait for every submitted call, then stop the threads. Not from a queue thread. **/
+    ~DFSAsyncEngine();
+
+    DFSAsyncEngine(const DFSAsyncEngine &) = delete;
+    DFSAsyncEngine &operator=(const DFSAsyncEngine &) = delete;
+
+    /**
+     * Start a call, or queue it until a running one completes.
+     *
+     * @param call - owned by the engine from now on
+     */
+    void Submit(DFSAsyncCall *call);
+
+    /**
+     * Wait until every call submitted so far has completed. Not from a
+     * queue thread.
+     */
+    void Wait();
+
+private:
+    DFSAsyncOptions options;
+
+    std::vector<std::unique_ptr<grpc::CompletionQueue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<unsigned int> next_queue;
+
+    std::mutex mutex;
+    std::condition_variable idle;
+
+    /** Calls waiting for a slot **/
+    std::deque<DFSAsyncCall *> waiting;
+
+    /** Calls holding a slot **/
+    int running;
+
+    /** Start calls until one is running on a queue, or none is left to start **/
+    void Launch(DFSAsyncCall *call);
+
+    /** Give up a finished call's slot: the next waiting call, to be started on it, or null **/
+    DFSAsyncCall *Release();
+
+    void Run(grpc::CompletionQueue *cq);
+};
+
+/**
+ * A unary request. The response is handed to `done` with the status.
+ */
+template <typename Request, typename Response>
+class DFSAsyncUnary : public DFSAsyncCall
+{
+
+public:
+    typedef std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> (dfs_service::DFSService::Stub::*Method)(
+        grpc::ClientContext *, const Request &, grpc::CompletionQueue *);
+
+    typedef std::function<void(const grpc::Status &status, Response *response)> Done;
+
+    /**
+     * @param replica - the server to ask
+     * @param timed - feed the latency into the replica's average
+     * @param method - e.g. &DFSService::Stub::PrepareAsyncstatusFile
+     * @param done
+     */
+    DFSAsyncUnary(DFSReplica *replica, bool timed, Method method, const Done &done)
+        : replica(replica), timed(timed), method(method), done(done)
+    {
+    }
+
+    /** To prepare before submitting **/
+    grpc::ClientContext *Context() { return &context; }
+    Request *MutableRequest() { return &request; }
+
+    bool Start(grpc::CompletionQueue *cq) override
+    {
+        call.reset(new DFSReplicaCall(replica, timed));
+        reader = (call->Stub()->*method)(&context, request, cq);
+        reader->StartCall();
+        reader->Finish(&response, &status, this);
+        return true;
+    }
+
+    bool Proceed(bool) override
+    {
+        if (!status.ok() && status.error_code() != grpc::NOT_FOUND)
+        {
+            call->Failed();
+        }
+        call.reset();
+        done(status, &response);
+        return false;
+    }
+
+private:
+    DFSReplica *replica;
+    bool timed;
+    Method method;
+    Done done;
+
+    grpc::ClientContext context;
+    Request request;
+    Response response;
+    grpc::Status status;
+    std::unique_ptr<DFSReplicaCall> call;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> reader;
+};
+
+/**
+ * Streams a local file to storeFile, as Store does.
+ */
+class DFSAsyncStore : public DFSAsyncCall
+{
+
+public:
+    /**
+     * @param replica - the primary of the file
+     * @param filename - the name on the server
+     * @param local_filepath - the file to send; opened when the call starts
+     * @param done - NOT_FOUND if the local file cannot be opened
+     */
+    DFSAsyncStore(DFSReplica *replica, const std::string &filename, const std::string &local_filepath,
+                  const DFSAsyncDone &done);
+    ~DFSAsyncStore();
+
+    /** To prepare before submitting **/
+    grpc::ClientContext *Context();
+
+    bool Start(grpc::CompletionQueue *cq) override;
+    bool Proceed(bool ok) override;
+
+private:
+    enum State
+    {
+        STARTING,
+        WRITING,
+        CLOSING,
+        FINISHING
+    };
+
+    DFSReplica *replica;
+    std::string filename;
+    std::string local_filepath;
+    DFSAsyncDone done;
+
+    State state;
+    int fd;
+
+    /** Held while the stream is started, which its first event waits for **/
+    std::mutex start_mutex;
+    grpc::ClientContext context;
+    dfs_service::ResponseStatus response;
+    grpc::Status status;
+    std::unique_ptr<DFSReplicaCall> call;
+    std::unique_ptr<grpc::ClientAsyncWriter<dfs_service::FileChunk>> writer;
+    std::unique_ptr<DFSChunkReader> infile;
+    DFSChunkPool::Chunk chunk;
+
+    /** Queue the Finish of the stream **/
+    void Finish();
+};
+
+/**
+ * Streams a file from fetchFile into a local file, as Fetch does.
+ */
+class DFSAsyncFetch : public DFSAsyncCall
+{
+
+public:
+    /**
+     * @param replica - the server to fetch from
+     * @param filename - the name on the server
+     * @param local_filepath - the file to write; created once data or the end of the stream arrives
+     * @param done - INTERNAL if the data could not be inflated or written
+     */
+    DFSAsyncFetch(DFSReplica *replica, const std::string &filename, const std::string &local_filepath,
+                  const DFSAsyncDone &done);
+
+    /** To prepare before submitting **/
+    grpc::ClientContext *Context();
+
+    bool Start(grpc::CompletionQueue *cq) override;
+    bool Proceed(bool ok) override;
+
+private:
+    enum State
+    {
+        STARTING,
+        READING,
+        FINISHING
+    };
+
+    DFSReplica *replica;
+    std::string filename;
+    std::string local_filepath;
+    DFSAsyncDone done;
+
+    State state;
+
+    /** Held while the stream is started, which its first event waits for **/
+    std::mutex start_mutex;
+    grpc::ClientContext context;
+    grpc::Status status;
+
+    /** A local failure, which overrides the status of the cancelled stream **/
+    grpc::Status local_error;
+    std::unique_ptr<DFSReplicaCall> call;
+    std::unique_ptr<grpc::ClientAsyncReader<dfs_service::FileChunk>> reader;
+    DFSChunkWriter outfile;
+    DFSChunkPool::Chunk chunk;
+
+    /** Write the chunk just read; false after setting local_error **/
+    bool WriteChunk();
+
+    /** Create the file if no chunk did, close it and give it the server's mtime **/
+    void Complete();
+};
+
+#endif
@@ -0,0 +1,160 @@
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "dfslib-shared-p1.h"
+#include "dfslib-bandwidth-p1.h"
+
+/** Smallest bucket depth, so one chunk always fits **/
+#define DFS_MIN_BURST_BYTES (64 * 1024)
+
+constexpr double DFSBandwidthScheduler::ACTIVE_WINDOW_S;
+constexpr double DFSBandwidthScheduler::BURST_S;
+
+DFSBandwidthScheduler::DFSBandwidthScheduler(double global_bytes, const DFSClientShare &default_share,
+                                             const std::map<std::string, DFSClientShare> &shares)
+    : global_bytes(global_bytes), default_share(default_share), shares(shares) {}
+
+bool DFSBandwidthScheduler::Enabled() const
+{
+    if (global_bytes > 0 || default_share.ceil_bytes > 0)
+    {
+        return true;
+    }
+    for (const auto &share : shares)
+    {
+        if (share.second.ceil_bytes > 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DFSBandwidthScheduler::Acquire(const std::string &client, int64_t bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    auto now = std::chrono::steady_clock::now();
+
+    auto found = buckets.find(client);
+    if (found == buckets.end())
+    {
+        Bucket bucket;
+        auto configured = shares.find(client);
+        bucket.share = configured != shares.end() ? configured->second : default_share;
+        bucket.refilled = now;
+        found = buckets.insert(std::make_pair(client, bucket)).first;
+    }
+    Bucket &bucket = found->second;
+    bucket.last_active = now;
+    bucket.waiting++;
+
+    while (true)
+    {
+        Rebalance(now);
+        Refill(bucket, now);
+        if (bucket.rate <= 0 || bucket.tokens >= 0)
+        {
+            // a chunk may overdraw the bucket; the debt delays the next one
+            bucket.tokens -= bytes;
+            break;
+        }
+        // wake up at least every 10ms, since other clients going idle raises our rate
+        double wait_s = std::min(-bucket.tokens / bucket.rate, 0.01);
+        cv.wait_for(lock, std::chrono::duration<double>(wait_s));
+        now = std::chrono::steady_clock::now();
+        bucket.last_active = now;
+    }
+    bucket.waiting--;
+}
+
+void DFSBandwidthScheduler::Rebalance(std::chrono::steady_clock::time_point now)
+{
+    std::vector<Bucket *> active;
+    for (auto iter = buckets.begin(); iter != buckets.end();)
+    {
+        Bucket &bucket = iter->second;
+        double idle_s = std::chrono::duration<double>(now - bucket.last_active).count();
+        if (bucket.waiting > 0 || idle_s < ACTIVE_WINDOW_S)
+        {
+            active.push_back(&bucket);
+        }
+        else if (idle_s > 100 * ACTIVE_WINDOW_S)
+        {
+            iter = buckets.erase(iter);
+            continue;
+        }
+        ++iter;
+    }
+
+    if (global_bytes <= 0)
+    {
+        for (Bucket *bucket : active)
+        {
+            bucket->rate = bucket->share.ceil_bytes;
+        }
+        return;
+    }
+
+    // Weighted max-min fairness: serve the clients whose ceiling is below
+    // their weighted share first, then split what is left by weight.
+    auto ceil_per_weight = [](const Bucket *bucket)
+    {
+        return bucket->share.ceil_bytes > 0 ? bucket->share.ceil_bytes / bucket->share.weight : 1e300;
+    };
+    std::sort(active.begin(), active.end(), [&](const Bucket *a, const Bucket *b)
+              { return ceil_per_weight(a) < ceil_per_weight(b); });
+
+    double remaining = global_bytes;
+    double weights = 0;
+    for (Bucket *bucket : active)
+    {
+        weights += bucket->share.weight;
+    }
+    for (Bucket *bucket : active)
+    {
+        double fair = remaining * bucket->share.weight / weights;
+        bucket->rate = bucket->share.ceil_bytes > 0 ? std::min(fair, bucket->share.ceil_bytes) : fair;
+        remaining -= bucket->rate;
+        weights -= bucket->share.weight;
+    }
+}
+
+void DFSBandwidthScheduler::Refill(Bucket &bucket, std::chrono::steady_clock::time_point now)
+{
+    double elapsed_s = std::chrono::duration<double>(now - bucket.refilled).count();
+    bucket.refilled = now;
+    if (bucket.rate <= 0)
+    {
+        bucket.tokens = 0;
+        return;
+    }
+    double burst = std::max<double>(bucket.rate * BURST_S, DFS_MIN_BURST_BYTES);
+    bucket.tokens = std::min(bucket.tokens + bucket.rate * elapsed_s, burst);
+}
+
+std::map<std::string, DFSClientShare> DFSBandwidthScheduler::ParseShares(const std::string &spec)
+{
+    std::map<std::string, DFSClientShare> parsed;
+    for (const std::string &entry : dfs_split(spec, ','))
+    {
+        size_t equals = entry.find('=');
+        if (equals == std::string::npos)
+        {
+            dfs_log(LL_ERROR) << "Ignoring client limit without '=': " << entry;
+            continue;
+        }
+        std::vector<std::string> values = dfs_split(entry.substr(equals + 1), ':');
+        DFSClientShare share;
+        if (!values.empty())
+        {
+            share.ceil_bytes = std::stod(values[0]) * (1 << 20);
+        }
+        if (values.size() > 1 && std::stod(values[1]) > 0)
+        {
+            share.weight = std::stod(values[1]);
+        }
+        parsed[entry.substr(0, equals)] = share;
+    }
+    return parsed;
+}
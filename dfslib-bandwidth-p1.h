@@ -0,0 +1,101 @@
+#ifndef _DFSLIB_BANDWIDTH_H
+#define _DFSLIB_BANDWIDTH_H
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <condition_variable>
+
+/**
+ * Per-client limits for the bandwidth scheduler
+ */
+struct DFSClientShare
+{
+    /** Ceiling for this client in bytes per second (0 = only the global limit applies) **/
+    double ceil_bytes = 0;
+
+    /** Weight used to share the global rate between active clients **/
+    double weight = 1;
+};
+
+/**
+ * Hierarchical token-bucket scheduler for transfer bandwidth.
+ *
+ * The root of the hierarchy is the global rate; each client that is
+ * currently transferring gets a child bucket. The global rate is split
+ * between active clients by weight, no client gets more than its own
+ * ceiling, and whatever a capped client leaves over is shared out by
+ * weight among the others (weighted max-min fairness). When a client goes
+ * idle its share goes back to the rest.
+ *
+ * The chunk loops call Acquire() before moving each chunk, which blocks
+ * until the client's bucket has the tokens for it.
+ */
+class DFSBandwidthScheduler
+{
+
+public:
+    /**
+     * @param global_bytes - total rate in bytes per second (0 = unlimited)
+     * @param default_share - limits for clients without an entry in `shares`
+     * @param shares - per-client limits keyed by client id
+     */
+    DFSBandwidthScheduler(double global_bytes = 0, const DFSClientShare &default_share = DFSClientShare(),
+                          const std::map<std::string, DFSClientShare> &shares = {});
+
+    /**
+     * Whether any limit is configured. The chunk loops skip pacing otherwise.
+     */
+    bool Enabled() const;
+
+    /**
+     * Block until `client` may move `bytes` more bytes.
+     *
+     * @param client
+     * @param bytes
+     */
+    void Acquire(const std::string &client, int64_t bytes);
+
+    /**
+     * Parse per-client limits written as "id=MiBps:weight,id2=MiBps:weight".
+     * The weight may be left out.
+     *
+     * @param spec
+     * @return
+     */
+    static std::map<std::string, DFSClientShare> ParseShares(const std::string &spec);
+
+private:
+    /** A client is active while it transferred within this window **/
+    static constexpr double ACTIVE_WINDOW_S = 0.2;
+
+    /** Bucket depth, as seconds of the client's current rate **/
+    static constexpr double BURST_S = 0.05;
+
+    struct Bucket
+    {
+        DFSClientShare share;
+        double rate = 0;
+        double tokens = 0;
+        int waiting = 0;
+        std::chrono::steady_clock::time_point refilled;
+        std::chrono::steady_clock::time_point last_active;
+    };
+
+    double global_bytes;
+    DFSClientShare default_share;
+    std::map<std::string, DFSClientShare> shares;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::map<std::string, Bucket> buckets;
+
+    /** Recompute every active client's rate by weighted max-min fairness **/
+    void Rebalance(std::chrono::steady_clock::time_point now);
+
+    void Refill(Bucket &bucket, std::chrono::steady_clock::time_point now);
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include <mutex>
+#include <vector>
+
+#include "dfslib-chunkpool-p1.h"
+
+namespace
+{
+    /** A thread's own chunks; handed to the shared list when the thread exits **/
+    struct LocalCache
+    {
+        std::vector<dfs_service::FileChunk *> chunks;
+        bool closed = false;
+
+        ~LocalCache()
+        {
+            closed = true;
+            for (dfs_service::FileChunk *chunk : chunks)
+            {
+                DFSChunkPool::Release(chunk);
+            }
+        }
+    };
+
+    thread_local LocalCache local_cache;
+}
+
+DFSChunkPool &DFSChunkPool::Instance()
+{
+    static DFSChunkPool pool;
+    return pool;
+}
+
+DFSChunkPool::~DFSChunkPool()
+{
+    for (dfs_service::FileChunk *chunk : shared)
+    {
+        delete chunk;
+    }
+}
+
+void DFSChunkPool::Releaser::operator()(dfs_service::FileChunk *chunk) const
+{
+    DFSChunkPool::Release(chunk);
+}
+
+DFSChunkPool::Chunk DFSChunkPool::Acquire()
+{
+    if (!local_cache.closed && !local_cache.chunks.empty())
+    {
+        dfs_service::FileChunk *chunk = local_cache.chunks.back();
+        local_cache.chunks.pop_back();
+        return Chunk(chunk);
+    }
+
+    DFSChunkPool &pool = Instance();
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (!pool.shared.empty())
+        {
+            dfs_service::FileChunk *chunk = pool.shared.back();
+            pool.shared.pop_back();
+            return Chunk(chunk);
+        }
+    }
+    return Chunk(new dfs_service::FileChunk());
+}
+
+void DFSChunkPool::Release(dfs_service::FileChunk *chunk)
+{
+    if (chunk == nullptr)
+    {
+        return;
+    }
+    // Clear() keeps the content string's capacity for the next transfer
+    chunk->Clear();
+    if (!local_cache.closed && local_cache.chunks.size() < DFS_CHUNK_CACHE_LOCAL)
+    {
+        local_cache.chunks.push_back(chunk);
+        return;
+    }
+
+    DFSChunkPool &pool = Instance();
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (pool.shared.size() < DFS_CHUNK_CACHE_SHARED)
+        {
+            pool.shared.push_back(chunk);
+            return;
+        }
+    }
+    delete chunk;
+}
+
+google::protobuf::ArenaOptions dfs_arena_options()
+{
+    google::protobuf::ArenaOptions options;
+    options.start_block_size = 16 * 1024;
+    options.max_block_size = 1024 * 1024;
+    return options;
+}
@@ -0,0 +1,69 @@
+#ifndef _DFSLIB_CHUNKPOOL_H
+#define _DFSLIB_CHUNKPOOL_H
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <google/protobuf/arena.h>
+
+#include "proto-src/dfs-service.pb.h"
+
+/** Chunks each thread keeps for itself **/
+#define DFS_CHUNK_CACHE_LOCAL 4
+
+/** Chunks the shared free list keeps; more are freed **/
+#define DFS_CHUNK_CACHE_SHARED 256
+
+/**
+ * Process-wide pool of FileChunk messages.
+ *
+ * A chunk's content string keeps its capacity across Clear(), so a chunk
+ * that has carried one buffer's worth of data can carry the next one
+ * without allocating. The transfer loops take one chunk per stream from
+ * the pool, reuse it for every iteration, and give it back at the end, so
+ * after warm-up a stream allocates no chunk buffers at all.
+ *
+ * Every thread keeps a few chunks in a cache of its own, which serves the
+ * common case without a lock; the shared free list behind it moves chunks
+ * between threads (e.g. from the gRPC thread that finished a store to the
+ * one that starts the next fetch).
+ */
+class DFSChunkPool
+{
+
+public:
+    /** Returns a chunk to the pool when it goes out of scope **/
+    struct Releaser
+    {
+        void operator()(dfs_service::FileChunk *chunk) const;
+    };
+
+    typedef std::unique_ptr<dfs_service::FileChunk, Releaser> Chunk;
+
+    /**
+     * Take an empty chunk.
+     */
+    static Chunk Acquire();
+
+    /**
+     * Give a chunk back. Prefer letting a Chunk go out of scope.
+     *
+     * @param chunk
+     */
+    static void Release(dfs_service::FileChunk *chunk);
+
+private:
+    std::mutex mutex;
+    std::vector<dfs_service::FileChunk *> shared;
+
+    static DFSChunkPool &Instance();
+    ~DFSChunkPool();
+};
+
+/**
+ * Arena settings for protobuf messages built per request (listings, status).
+ * The first block covers a small listing; large ones grow up to 1 MiB per block.
+ */
+google::protobuf::ArenaOptions dfs_arena_options();
+
+#endif
@@ -1,8 +1,12 @@
 #include <regex>
+#include <mutex>
+#include <atomic>
 #include <vector>
 #include <string>
 #include <thread>
+#include <future>
 #include <cstdio>
+#include <cstring>
 #include <chrono>
 #include <errno.h>
 #include <csignal>
@@ -11,12 +15,18 @@
 #include <fstream>
 #include <iomanip>
 #include <getopt.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <limits.h>
+#include <sys/stat.h>
 #include <sys/inotify.h>
 #include <grpcpp/grpcpp.h>
 
 #include "dfslib-shared-p1.h"
+#include "dfslib-chunkpool-p1.h"
+#include "dfslib-listcodec-p1.h"
+#include "dfslib-zfile-p1.h"
+#include "dfslib-trace-p1.h"
 #include "dfslib-clientnode-p1.h"
 #include "proto-src/dfs-service.grpc.pb.h"
 
@@ -30,11 +40,15 @@ using grpc::StatusCode;
 using dfs_service::DFSService;
 using dfs_service::FileChunk;
 using dfs_service::FileInfo;
+using dfs_service::FilePair;
 using dfs_service::FilePath;
 using dfs_service::FileStatus;
 using dfs_service::ListFilesRequest;
 using dfs_service::LSResponse;
 using dfs_service::ResponseStatus;
+using dfs_service::UploadHandle;
+using dfs_service::UploadRequest;
+using dfs_service::WriteMode;
 
 //
 // STUDENT INSTRUCTION:
@@ -48,7 +62,8 @@ using dfs_service::ResponseStatus;
 //      using dfs_service::MyMethod
 //
 
-DFSClientNodeP1::DFSClientNodeP1() : DFSClientNode() {}
+DFSClientNodeP1::DFSClientNodeP1()
+    : DFSClientNode(), stat_hedger(new DFSHedger(DFSHedgeOptions())), fetch_hedger(new DFSHedger(DFSHedgeOptions())) {}
 
 DFSClientNodeP1::~DFSClientNodeP1() noexcept {}
 
@@ -72,10 +87,15 @@ StatusCode DFSClientNodeP1::Store(const std::string &filename)
     // StatusCode::NOT_FOUND - if the file cannot be found on the client
     // StatusCode::CANCELLED otherwise
     //
-    std::string local_filepath = WrapPath(filename);
+    DFSTrace trace("store", filename);
+    return stripes > 1 ? StoreStriped(filename, WrapPath(filename)) : StoreFrom(filename, WrapPath(filename));
+}
+
+StatusCode DFSClientNodeP1::StoreFrom(const std::string &filename, const std::string &local_filepath)
+{
     // Check if the file exists
-    std::ifstream infile(local_filepath, std::ios::in | std::ios::binary);
-    if (!infile.is_open())
+    int fd = open(local_filepath.c_str(), O_RDONLY);
+    if (fd < 0)
     {
         dfs_log(LL_ERROR) << "File not found: " << local_filepath;
         return StatusCode::NOT_FOUND;
@@ -85,40 +105,64 @@ StatusCode DFSClientNodeP1::Store(const std::string &filename)
     grpc::ClientContext context;
     // Set the metadata
     context.AddMetadata("filename", filename);
-    // Set the deadline
-    std::chrono::system_clock::time_point deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout);
-    context.set_deadline(deadline);
+    // the size lets the server account for the transfer before admitting it
+    struct stat local_stat;
+    if (fstat(fd, &local_stat) == 0)
+    {
+        context.AddMetadata("filesize", std::to_string(local_stat.st_size));
+        // the server gives its copy the same mtime, so the two compare equal later
+        context.AddMetadata("mtime", std::to_string(local_stat.st_mtime));
+    }
+    // Set the deadline and client id
+    PrepareContext(&context);
     // prepare the response
     ResponseStatus response;
 
+    // Writes go to the primary; their duration says little about its read latency
+    DFSReplicaCall call(PrimaryFor(filename), false);
+
     // Create a ClientWriter for the streaming call
     std::unique_ptr<grpc::ClientWriter<dfs_service::FileChunk>> writer(
-        service_stub->storeFile(&context, &response));
+        call.Stub()->storeFile(&context, &response));
 
-    // Create a buffer for the file chunk
-    char buffer[BUF_SIZE];
-    int32_t chunk_num = 0;
+    // Only the data extents are read and sent, holes go out as descriptors
+    DFSChunkReader infile(fd, BUF_SIZE);
+    // one pooled chunk carries every buffer of the file
+    DFSChunkPool::Chunk chunk = DFSChunkPool::Acquire();
 
-    while (infile.read(buffer, BUF_SIZE) || infile.gcount())
+    for (;;)
     {
-        // Create a FileChunk message
-        dfs_service::FileChunk chunk;
-        chunk.set_content(buffer, infile.gcount());
-        chunk.set_chunk_num(chunk_num++);
+        {
+            DFSSpan span("disk_read");
+            if (!infile.Next(chunk.get()))
+            {
+                break;
+            }
+        }
         // Write the chunk
-        if (!writer->Write(chunk))
+        DFSSpan span("stream_write");
+        if (!writer->Write(*chunk))
         {
             dfs_log(LL_ERROR) << "Failed to write chunk to server";
             break;
         }
-        dfs_log(LL_DEBUG) << "Sending chunk No. " << chunk_num << " size: " << infile.gcount();
+        dfs_log(LL_DEBUG) << "Sending chunk No. " << chunk->chunk_num() << " size: " << chunk->content().size() << " hole: " << chunk->hole_length();
+    }
+    if (infile.Failed())
+    {
+        // cancel rather than let the server keep a truncated file
+        dfs_log(LL_ERROR) << "Failed to read file: " << local_filepath;
+        context.TryCancel();
     }
 
     // Close the writer
-    writer->WritesDone();
-
-    grpc::Status status = writer->Finish();
-    infile.close();
+    grpc::Status status;
+    {
+        DFSSpan span("finish");
+        writer->WritesDone();
+        status = writer->Finish();
+    }
+    close(fd);
 
     if (status.ok())
     {
@@ -138,6 +182,145 @@ StatusCode DFSClientNodeP1::Store(const std::string &filename)
     }
 }
 
+StatusCode DFSClientNodeP1::StoreStriped(const std::string &filename, const std::string &local_filepath)
+{
+    int fd = open(local_filepath.c_str(), O_RDONLY);
+    struct stat local_stat;
+    if (fd < 0 || fstat(fd, &local_stat) != 0)
+    {
+        dfs_log(LL_ERROR) << "File not found: " << local_filepath;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return StatusCode::NOT_FOUND;
+    }
+    const int64_t size = local_stat.st_size;
+    if (size <= DFS_STRIPE_BYTES)
+    {
+        close(fd);
+        return StoreFrom(filename, local_filepath);
+    }
+
+    // the server preallocates the whole file before any range arrives
+    DFSReplica *primary = PrimaryFor(filename);
+    UploadRequest request;
+    request.set_filename(filename);
+    request.set_size(size);
+    request.set_modified_time(local_stat.st_mtime);
+    UploadHandle handle;
+    grpc::Status status;
+    {
+        DFSSpan span("start");
+        DFSReplicaCall call(primary, false);
+        grpc::ClientContext context;
+        PrepareContext(&context);
+        status = call.Stub()->startUpload(&context, request, &handle);
+    }
+    if (status.error_code() == grpc::UNIMPLEMENTED)
+    {
+        // the server takes one stream per file
+        close(fd);
+        return StoreFrom(filename, local_filepath);
+    }
+
+    // ranges are handed out in order, so a stream that runs ahead takes on more of them
+    const int64_t stripe = std::min<int64_t>(DFS_STRIPE_BYTES, (size + stripes - 1) / stripes);
+    std::atomic<int64_t> next(0);
+    std::mutex failure_mutex;
+    grpc::Status failure = status;
+    std::vector<std::thread> workers;
+    for (int i = 0; status.ok() && i < stripes && i * stripe < size; i++)
+    {
+        workers.emplace_back([&]()
+                             {
+            for (;;)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(failure_mutex);
+                    if (!failure.ok())
+                    {
+                        return;
+                    }
+                }
+                const int64_t offset = next.fetch_add(stripe);
+                if (offset >= size)
+                {
+                    return;
+                }
+                grpc::Status range = UploadRange(primary, handle.id(), fd, offset, std::min(stripe, size - offset));
+                if (!range.ok())
+                {
+                    std::lock_guard<std::mutex> lock(failure_mutex);
+                    if (failure.ok())
+                    {
+                        failure = range;
+                    }
+                    return;
+                }
+            } });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    close(fd);
+
+    // commit once every range is acknowledged, or drop what was sent
+    if (status.ok())
+    {
+        DFSSpan span("finish");
+        handle.set_abort(!failure.ok());
+        DFSReplicaCall call(primary, false);
+        grpc::ClientContext context;
+        PrepareContext(&context);
+        FileStatus response;
+        status = call.Stub()->finishUpload(&context, handle, &response);
+    }
+    if (!failure.ok())
+    {
+        status = failure;
+    }
+    if (status.ok())
+    {
+        dfs_log(LL_SYSINFO) << "File stored successfully over " << workers.size() << " streams";
+        return StatusCode::OK;
+    }
+    dfs_log(LL_ERROR) << "Failed to store " << filename << ": " << status.error_message();
+    return status.error_code() == grpc::DEADLINE_EXCEEDED ? StatusCode::DEADLINE_EXCEEDED : StatusCode::CANCELLED;
+}
+
+Status DFSClientNodeP1::UploadRange(DFSReplica *replica, const std::string &id, int fd, int64_t offset, int64_t length)
+{
+    grpc::ClientContext context;
+    context.AddMetadata("upload", id);
+    context.AddMetadata("filesize", std::to_string(length));
+    PrepareContext(&context);
+    ResponseStatus response;
+
+    DFSReplicaCall call(replica, false);
+    std::unique_ptr<ClientWriter<FileChunk>> writer(call.Stub()->uploadRange(&context, &response));
+
+    // the chunks carry their offsets in the file, which is where the server writes them
+    DFSChunkReader infile(fd, BUF_SIZE, offset, length);
+    DFSChunkPool::Chunk chunk = DFSChunkPool::Acquire();
+    while (infile.Next(chunk.get()))
+    {
+        if (!writer->Write(*chunk))
+        {
+            dfs_log(LL_ERROR) << "Failed to write chunk to server";
+            break;
+        }
+    }
+    if (infile.Failed())
+    {
+        dfs_log(LL_ERROR) << "Failed to read the range at " << offset << " of the upload " << id;
+        context.TryCancel();
+    }
+    writer->WritesDone();
+    return writer->Finish();
+}
+
 StatusCode DFSClientNodeP1::Fetch(const std::string &filename)
 {
 
@@ -160,63 +343,158 @@ StatusCode DFSClientNodeP1::Fetch(const std::string &filename)
     // StatusCode::CANCELLED otherwise
     //
     //
-    std::string local_filepath = WrapPath(filename);
+    DFSTrace trace("fetch", filename);
+    if (prefetcher && prefetcher->Claim(filename))
+    {
+        prefetcher->Fetched(filename);
+        return StatusCode::OK;
+    }
+    StatusCode code = FetchTo(filename, WrapPath(filename));
+    if (prefetcher && code == StatusCode::OK)
+    {
+        prefetcher->Fetched(filename);
+    }
+    return code;
+}
 
-    // Create the context
-    grpc::ClientContext context;
-    // Set the deadline
-    std::chrono::system_clock::time_point deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout);
-    context.set_deadline(deadline);
+StatusCode DFSClientNodeP1::FetchTo(const std::string &filename, const std::string &local_filepath)
+{
+    // the name comes from a listing or the command line and becomes a local path
+    if (!dfs_valid_path(filename))
+    {
+        dfs_log(LL_ERROR) << "Refusing to fetch " << filename << ": the name leaves the mount";
+        return StatusCode::INVALID_ARGUMENT;
+    }
+    std::vector<DFSReplica *> replicas = ReplicasFor(filename);
+    // a backup fetches next to the destination and is renamed over it if it wins
+    static std::atomic<uint64_t> backups(0);
+    const size_t slash = local_filepath.rfind('/') + 1;
+    const std::string backup_filepath = local_filepath.substr(0, slash) + ".dfs-hedge-" + std::to_string(getpid()) + "." +
+                                        std::to_string(backups++) + "-" + local_filepath.substr(slash);
+    const DFSTraceContext parent = DFSTracer::Current();
+    bool backed_up = false;
+    size_t winner;
+    StatusCode code = fetch_hedger->Run(replicas.size(), [&](size_t target, DFSHedgeAttempt *attempt)
+                                        {
+        DFSTrace adopt(parent);
+        if (target == 1)
+        {
+            backed_up = true;
+        }
+        return FetchFrom(replicas[target], filename, target == 0 ? local_filepath : backup_filepath, attempt); }, &winner);
+    if (winner == 1 && code == StatusCode::OK && rename(backup_filepath.c_str(), local_filepath.c_str()) != 0)
+    {
+        dfs_log(LL_ERROR) << "Failed to move " << backup_filepath << " into place: " << strerror(errno);
+        code = StatusCode::INTERNAL;
+    }
+    if (backed_up)
+    {
+        unlink(backup_filepath.c_str());
+    }
+    DFSReplica *replica = replicas[winner];
+
+    // a replica may be down or not have caught up with its primary yet
+    if (code != StatusCode::OK && code != StatusCode::DEADLINE_EXCEEDED && replica != PrimaryFor(filename))
+    {
+        code = FetchFrom(PrimaryFor(filename), filename, local_filepath);
+    }
+    return code;
+}
+
+StatusCode DFSClientNodeP1::FetchFrom(DFSReplica *replica, const std::string &filename, const std::string &local_filepath,
+                                      DFSHedgeAttempt *attempt)
+{
+    DFSReplicaCall call(replica);
+
+    // Create the context, or use the hedged attempt's, which the hedger may cancel
+    grpc::ClientContext local_context;
+    grpc::ClientContext &context = attempt ? *attempt->Context() : local_context;
+    // Set the deadline and client id
+    PrepareContext(&context);
     // prepare request
     FilePath request;
     request.set_path(filename);
+    // compressed files may arrive as stored, for this client to inflate
+    request.set_frames(true);
 
     // Start request
-    std::unique_ptr<grpc::ClientReader<dfs_service::FileChunk>> reader(service_stub->fetchFile(&context, request));
+    std::unique_ptr<grpc::ClientReader<dfs_service::FileChunk>> reader(call.Stub()->fetchFile(&context, request));
 
-    // Create a buffer for the file chunk
-    dfs_service::FileChunk chunk;
+    // Create a buffer for the file chunk, reused for every read
+    DFSChunkPool::Chunk chunk = DFSChunkPool::Acquire();
     int64_t bytes_written = 0;
-    bool local_file_exists = false;
-    std::ofstream outfile;
+    DFSChunkWriter outfile;
 
-    try
+    for (;;)
     {
-        while (reader->Read(&chunk))
         {
-            if (local_file_exists == false)
-            {
-                local_file_exists = true;
-                // prepare local file for writing
-                outfile.open(local_filepath, std::ios::out | std::ios::binary);
-                if (!outfile.is_open())
-                {
-                    dfs_log(LL_ERROR) << "Failed to open file for writing: " << local_filepath;
-                    return StatusCode::INTERNAL;
-                }
-            }
-            if (!outfile.is_open())
+            DFSSpan span("stream_read");
+            if (!reader->Read(chunk.get()))
             {
-                dfs_log(LL_ERROR) << "Failed to open file for writing: " << local_filepath;
-                return StatusCode::INTERNAL;
+                break;
             }
-            const std::string &content = chunk.content();
-            outfile.write(content.data(), content.size());
-            bytes_written += content.size();
-            dfs_log(LL_DEBUG) << "Receiving No." << chunk.chunk_num() << " chunk: " << content.size() << " bytes";
         }
-        outfile.close();
+        if (attempt && chunk->chunk_num() == 0)
+        {
+            attempt->Responding();
+        }
+        if (!dfs_zfile_expand(chunk.get()))
+        {
+            dfs_log(LL_ERROR) << "Corrupt compressed chunk: " << chunk->chunk_num();
+            context.TryCancel();
+            return StatusCode::INTERNAL;
+        }
+        if (!outfile.IsOpen() && (!dfs_make_parents(local_filepath) || !outfile.Open(local_filepath)))
+        {
+            dfs_log(LL_ERROR) << "Failed to open file for writing: " << local_filepath;
+            context.TryCancel();
+            return StatusCode::INTERNAL;
+        }
+        DFSSpan span("disk_write");
+        if (!outfile.Write(*chunk))
+        {
+            dfs_log(LL_ERROR) << "Failed to write to file: " << local_filepath;
+            context.TryCancel();
+            return StatusCode::INTERNAL;
+        }
+        bytes_written += chunk->content().size();
+        dfs_log(LL_DEBUG) << "Receiving No." << chunk->chunk_num() << " chunk: " << chunk->content().size() << " bytes, hole: " << chunk->hole_length();
+    }
+
+    grpc::Status status;
+    {
+        DFSSpan span("finish");
+        status = reader->Finish();
     }
-    catch (const std::exception &e)
+    if (attempt && status.error_code() == grpc::CANCELLED)
     {
-        dfs_log(LL_ERROR) << "Failed to send chunk to stream(from client to server)";
-        outfile.close();
+        // the other attempt of a hedged fetch won
         return StatusCode::CANCELLED;
     }
-
-    grpc::Status status = reader->Finish();
+    if (!status.ok() && status.error_code() != grpc::NOT_FOUND)
+    {
+        call.Failed();
+    }
     if (status.ok())
     {
+        // an empty file arrives without any chunk
+        if (!outfile.IsOpen() && (!dfs_make_parents(local_filepath) || !outfile.Open(local_filepath)))
+        {
+            dfs_log(LL_ERROR) << "Failed to open file for writing: " << local_filepath;
+            return StatusCode::INTERNAL;
+        }
+        if (!outfile.Close())
+        {
+            dfs_log(LL_ERROR) << "Failed to write to file: " << local_filepath;
+            return StatusCode::INTERNAL;
+        }
+        // keep the server's mtime, so the two copies compare equal later
+        const auto &server_metadata = context.GetServerInitialMetadata();
+        auto mtime = server_metadata.find("mtime");
+        if (mtime != server_metadata.end())
+        {
+            dfs_set_mtime(local_filepath, std::atoll(std::string(mtime->second.data(), mtime->second.size()).c_str()));
+        }
         dfs_log(LL_SYSINFO) << "File received successfully";
         return StatusCode::OK;
     }
@@ -237,6 +515,71 @@ StatusCode DFSClientNodeP1::Fetch(const std::string &filename)
     }
 }
 
+StatusCode DFSClientNodeP1::Read(const std::string &filename, int64_t offset, int64_t length, std::string *data)
+{
+    DFSTrace trace("read", filename);
+    DFSReplica *replica = ReplicaFor(filename);
+    StatusCode code = ReadFrom(replica, filename, offset, length, data);
+    if (code != StatusCode::OK && code != StatusCode::DEADLINE_EXCEEDED && replica != PrimaryFor(filename))
+    {
+        code = ReadFrom(PrimaryFor(filename), filename, offset, length, data);
+    }
+    return code;
+}
+
+StatusCode DFSClientNodeP1::ReadFrom(DFSReplica *replica, const std::string &filename, int64_t offset, int64_t length,
+                                     std::string *data)
+{
+    DFSReplicaCall call(replica);
+    grpc::ClientContext context;
+    PrepareContext(&context);
+    FilePath request;
+    request.set_path(filename);
+    request.set_offset(offset);
+    request.set_length(length);
+    request.set_frames(true);
+
+    std::unique_ptr<grpc::ClientReader<dfs_service::FileChunk>> reader(call.Stub()->fetchFile(&context, request));
+    DFSChunkPool::Chunk chunk = DFSChunkPool::Acquire();
+    data->clear();
+    while (reader->Read(chunk.get()))
+    {
+        if (!dfs_zfile_expand(chunk.get()) || chunk->offset() < offset)
+        {
+            dfs_log(LL_ERROR) << "Corrupt chunk: " << chunk->chunk_num();
+            context.TryCancel();
+            reader->Finish();
+            return StatusCode::INTERNAL;
+        }
+        // chunks carry file offsets; holes read as zeros
+        const size_t start = chunk->offset() - offset;
+        const size_t bytes = chunk->hole_length() > 0 ? chunk->hole_length() : chunk->content().size();
+        if (data->size() < start + bytes)
+        {
+            data->resize(start + bytes);
+        }
+        if (chunk->hole_length() == 0)
+        {
+            data->replace(start, bytes, chunk->content());
+        }
+    }
+
+    grpc::Status status = reader->Finish();
+    if (!status.ok() && status.error_code() != grpc::NOT_FOUND)
+    {
+        call.Failed();
+    }
+    if (status.ok())
+    {
+        return StatusCode::OK;
+    }
+    dfs_log(LL_ERROR) << "Failed to read " << filename << ": " << status.error_message();
+    return status.error_code() == grpc::DEADLINE_EXCEEDED || status.error_code() == grpc::NOT_FOUND ||
+                   status.error_code() == grpc::INVALID_ARGUMENT
+               ? status.error_code()
+               : StatusCode::CANCELLED;
+}
+
 StatusCode DFSClientNodeP1::Delete(const std::string &filename)
 {
 
@@ -253,12 +596,12 @@ StatusCode DFSClientNodeP1::Delete(const std::string &filename)
     // StatusCode::NOT_FOUND - if the file cannot be found on the server
     // StatusCode::CANCELLED otherwise
     //
+    DFSTrace trace("delete", filename);
 
     // Create the context
     grpc::ClientContext context;
-    // Set the deadline
-    std::chrono::system_clock::time_point deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout);
-    context.set_deadline(deadline);
+    // Set the deadline and client id
+    PrepareContext(&context);
     // prepare request
     dfs_service::FilePath request;
     request.set_path(filename);
@@ -266,7 +609,8 @@ StatusCode DFSClientNodeP1::Delete(const std::string &filename)
     dfs_service::ResponseStatus response;
 
     // Call the service
-    grpc::Status status = service_stub->deleteFile(&context, request, &response);
+    DFSReplicaCall call(PrimaryFor(filename), false);
+    grpc::Status status = call.Stub()->deleteFile(&context, request, &response);
 
     if (!status.ok())
     {
@@ -290,6 +634,238 @@ StatusCode DFSClientNodeP1::Delete(const std::string &filename)
     return StatusCode::OK;
 }
 
+StatusCode DFSClientNodeP1::Copy(const std::string &source, const std::string &destination)
+{
+    DFSTrace trace("copy", source);
+    return CopyOrRename(source, destination, false);
+}
+
+StatusCode DFSClientNodeP1::Rename(const std::string &source, const std::string &destination)
+{
+    DFSTrace trace("rename", source);
+    return CopyOrRename(source, destination, true);
+}
+
+StatusCode DFSClientNodeP1::CopyOrRename(const std::string &source, const std::string &destination, bool rename)
+{
+    if (!dfs_valid_path(source) || !dfs_valid_path(destination))
+    {
+        dfs_log(LL_ERROR) << "Refusing to " << (rename ? "rename " : "copy ") << source << " to " << destination
+                          << ": a name leaves the mount";
+        return StatusCode::INVALID_ARGUMENT;
+    }
+    DFSReplica *primary = PrimaryFor(source);
+    if (primary == PrimaryFor(destination))
+    {
+        DFSReplicaCall call(primary, false);
+        grpc::ClientContext context;
+        PrepareContext(&context);
+        FilePair request;
+        request.set_source(source);
+        request.set_destination(destination);
+        ResponseStatus response;
+        grpc::Status status = rename ? call.Stub()->renameFile(&context, request, &response)
+                                     : call.Stub()->copyFile(&context, request, &response);
+        if (status.ok())
+        {
+            dfs_log(LL_SYSINFO) << (rename ? "File renamed successfully" : "File copied successfully");
+            return StatusCode::OK;
+        }
+        // an older server does not know the request; the contents go through this client after all
+        if (status.error_code() != grpc::UNIMPLEMENTED)
+        {
+            dfs_log(LL_ERROR) << "Failed to " << (rename ? "rename " : "copy ") << source << ": " << status.error_message();
+            return status.error_code() == grpc::DEADLINE_EXCEEDED || status.error_code() == grpc::NOT_FOUND
+                       ? status.error_code()
+                       : StatusCode::CANCELLED;
+        }
+    }
+
+    // the names live on different servers: fetch into a staging file and store that under the new name
+    static std::atomic<uint64_t> copies(0);
+    const std::string staging = WrapPath(".dfs-copy-" + std::to_string(getpid()) + "." + std::to_string(copies++));
+    StatusCode code = FetchTo(source, staging);
+    // a copy is a new file, a renamed file keeps its mtime, as on the server
+    if (code == StatusCode::OK && !rename)
+    {
+        dfs_set_mtime(staging, time(nullptr));
+    }
+    if (code == StatusCode::OK)
+    {
+        code = StoreFrom(destination, staging);
+    }
+    unlink(staging.c_str());
+    if (code == StatusCode::OK && rename)
+    {
+        code = Delete(source);
+    }
+    return code;
+}
+
+/**
+ * Hands out a buffer in chunks of BUF_SIZE bytes, with offsets from its start
+ */
+class DFSDataReader
+{
+
+public:
+    explicit DFSDataReader(const std::string &data) : data(data), offset(0), chunk_num(0) {}
+
+    bool Next(dfs_service::FileChunk *chunk)
+    {
+        if (offset >= data.size())
+        {
+            return false;
+        }
+        const size_t length = std::min<size_t>(BUF_SIZE, data.size() - offset);
+        chunk->mutable_content()->assign(data, offset, length);
+        chunk->set_chunk_num(chunk_num++);
+        chunk->set_offset(offset);
+        chunk->set_hole_length(0);
+        chunk->set_raw_length(0);
+        offset += length;
+        return true;
+    }
+
+    bool Failed() const
+    {
+        return false;
+    }
+
+private:
+    const std::string &data;
+    size_t offset;
+    int32_t chunk_num;
+};
+
+template <typename Reader>
+StatusCode DFSClientNodeP1::WriteChunks(const std::string &filename, WriteMode mode, int64_t offset,
+                                        int64_t expected_size, Reader *infile, int64_t start, int64_t length,
+                                        int64_t mtime, dfs_service::FileStatus *result)
+{
+    grpc::ClientContext context;
+    context.AddMetadata("filename", filename);
+    context.AddMetadata("mode", dfs_service::WriteMode_Name(mode));
+    context.AddMetadata("offset", std::to_string(offset));
+    context.AddMetadata("filesize", std::to_string(length));
+    if (expected_size >= 0)
+    {
+        context.AddMetadata("expected_size", std::to_string(expected_size));
+    }
+    if (mtime > 0)
+    {
+        context.AddMetadata("mtime", std::to_string(mtime));
+    }
+    PrepareContext(&context);
+    dfs_service::FileStatus response;
+
+    DFSReplicaCall call(PrimaryFor(filename), false);
+    std::unique_ptr<grpc::ClientWriter<dfs_service::FileChunk>> writer(call.Stub()->writeFile(&context, &response));
+
+    DFSChunkPool::Chunk chunk = DFSChunkPool::Acquire();
+    for (;;)
+    {
+        {
+            DFSSpan span("disk_read");
+            if (!infile->Next(chunk.get()))
+            {
+                break;
+            }
+        }
+        chunk->set_offset(chunk->offset() - start);
+        DFSSpan span("stream_write");
+        if (!writer->Write(*chunk))
+        {
+            dfs_log(LL_ERROR) << "Failed to write chunk to server";
+            break;
+        }
+    }
+    if (infile->Failed())
+    {
+        // cancel rather than let the server keep part of the change
+        dfs_log(LL_ERROR) << "Failed to read the data for " << filename;
+        context.TryCancel();
+    }
+
+    grpc::Status status;
+    {
+        DFSSpan span("finish");
+        writer->WritesDone();
+        status = writer->Finish();
+    }
+    if (status.ok())
+    {
+        dfs_log(LL_SYSINFO) << "File written successfully, now " << response.size() << " bytes";
+        if (result != nullptr)
+        {
+            *result = response;
+        }
+        return StatusCode::OK;
+    }
+    dfs_log(LL_ERROR) << "Failed to write " << filename << ": " << status.error_message();
+    switch (status.error_code())
+    {
+    case grpc::DEADLINE_EXCEEDED:
+    case grpc::NOT_FOUND:
+    case grpc::FAILED_PRECONDITION:
+        return status.error_code();
+    default:
+        return StatusCode::CANCELLED;
+    }
+}
+
+StatusCode DFSClientNodeP1::Write(const std::string &filename, WriteMode mode, int64_t offset,
+                                  const std::string &data, int64_t expected_size, dfs_service::FileStatus *result)
+{
+    DFSTrace trace("write", filename);
+    DFSDataReader infile(data);
+    return WriteChunks(filename, mode, offset, expected_size, &infile, 0, data.size(), 0, result);
+}
+
+StatusCode DFSClientNodeP1::Append(const std::string &filename)
+{
+    DFSTrace trace("append", filename);
+    const std::string local_filepath = WrapPath(filename);
+    int fd = open(local_filepath.c_str(), O_RDONLY);
+    struct stat local_stat;
+    if (fd < 0 || fstat(fd, &local_stat) != 0)
+    {
+        dfs_log(LL_ERROR) << "File not found: " << local_filepath;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return StatusCode::NOT_FOUND;
+    }
+
+    // the primary is asked, as a replica may not have the last append yet
+    dfs_service::FileStatus server_status;
+    StatusCode code = StatFrom(PrimaryFor(filename), filename, &server_status);
+    if (code == StatusCode::NOT_FOUND)
+    {
+        server_status.set_size(0);
+    }
+    else if (code != StatusCode::OK)
+    {
+        close(fd);
+        return code;
+    }
+    const int64_t start = server_status.size();
+    if (local_stat.st_size < start)
+    {
+        dfs_log(LL_ERROR) << "The server's copy of " << filename << " is longer than the local file; store it instead";
+        close(fd);
+        return StatusCode::CANCELLED;
+    }
+
+    // the size the server had is the precondition, so an append that raced this one is not overwritten
+    DFSChunkReader infile(fd, BUF_SIZE, start, local_stat.st_size - start);
+    code = WriteChunks(filename, dfs_service::APPEND, 0, start, &infile, start, local_stat.st_size - start,
+                       local_stat.st_mtime, nullptr);
+    close(fd);
+    return code;
+}
+
 StatusCode DFSClientNodeP1::List(std::map<std::string, int> *file_map, bool display)
 {
 
@@ -313,18 +889,456 @@ StatusCode DFSClientNodeP1::List(std::map<std::string, int> *file_map, bool disp
     //
     //
 
+    DFSTrace trace("list");
+    // the listings live on an arena, freed at once when the map is filled
+    google::protobuf::Arena arena(dfs_arena_options());
+    std::vector<dfs_service::LSResponse *> responses;
+    StatusCode result = ListAll(&arena, &responses);
+    if (result != StatusCode::OK)
+    {
+        return result;
+    }
+
+    // merge the per-server listings into the file_map
+    DFSSpan span("decode");
+    for (const auto *response : responses)
+    {
+        bool valid = VisitListing(*response, [file_map](const std::string &path, int64_t mtime, int64_t size)
+                                  {
+            dfs_log(LL_DEBUG) << "File: " << path << " - " << mtime;
+            if (file_map != NULL)
+            {
+                // packed listings arrive sorted, so the hint is usually right
+                file_map->emplace_hint(file_map->end(), path, mtime);
+            } });
+        if (!valid)
+        {
+            dfs_log(LL_ERROR) << "Malformed packed listing";
+            return StatusCode::CANCELLED;
+        }
+    }
+
+    return StatusCode::OK;
+}
+
+StatusCode DFSClientNodeP1::ListDetails(std::map<std::string, dfs_service::FileInfo> *files)
+{
+    DFSTrace trace("list");
+    google::protobuf::Arena arena(dfs_arena_options());
+    std::vector<dfs_service::LSResponse *> responses;
+    StatusCode result = ListAll(&arena, &responses);
+    if (result != StatusCode::OK)
+    {
+        return result;
+    }
+    DFSSpan span("decode");
+    for (const auto *response : responses)
+    {
+        bool valid = VisitListing(*response, [files](const std::string &path, int64_t mtime, int64_t size)
+                                  {
+            dfs_service::FileInfo &file_info = (*files)[path];
+            file_info.set_filename(path);
+            file_info.set_modified_time(mtime);
+            file_info.set_size(size); });
+        if (!valid)
+        {
+            dfs_log(LL_ERROR) << "Malformed packed listing";
+            return StatusCode::CANCELLED;
+        }
+    }
+    return StatusCode::OK;
+}
+
+bool DFSClientNodeP1::VisitListing(const dfs_service::LSResponse &response,
+                                   const std::function<void(const std::string &, int64_t, int64_t)> &visit)
+{
+    for (const auto &file_info : response.filesinfolist())
+    {
+        visit(file_info.filename(), file_info.modified_time(), file_info.size());
+    }
+    if (response.packed().empty())
+    {
+        return true;
+    }
+    // decoded in place, without a message per file
+    DFSListDecoder decoder(response.packed());
+    while (decoder.Next())
+    {
+        visit(decoder.Path(), decoder.ModifiedTime(), decoder.Size());
+    }
+    return !decoder.Failed();
+}
+
+void DFSClientNodeP1::SetPackedListing(bool packed)
+{
+    packed_listing = packed;
+}
+
+void DFSClientNodeP1::SetStripes(int streams)
+{
+    stripes = std::max(1, streams);
+}
+
+void DFSClientNodeP1::SetPrefetchOptions(const DFSPrefetchOptions &options)
+{
+    // the old prefetcher finishes and saves its model first
+    prefetcher.reset();
+    if (options.enabled)
+    {
+        prefetcher.reset(new DFSPrefetcher(mount_path, options, [this](const std::string &filename, const std::string &path)
+                                           {
+            DFSTrace trace("prefetch", filename);
+            return FetchTo(filename, path); }));
+    }
+}
+
+DFSPrefetchStats DFSClientNodeP1::PrefetchStats()
+{
+    return prefetcher ? prefetcher->Stats() : DFSPrefetchStats();
+}
+
+void DFSClientNodeP1::SetHedgeOptions(const DFSHedgeOptions &options)
+{
+    stat_hedger.reset(new DFSHedger(options));
+    fetch_hedger.reset(new DFSHedger(options));
+}
+
+std::map<std::string, DFSHedgeStats> DFSClientNodeP1::HedgeStats()
+{
+    return {{"stat", stat_hedger->Stats()}, {"fetch", fetch_hedger->Stats()}};
+}
+
+/**
+ * Where an asynchronous operation's code goes: the callback, then the future
+ */
+struct DFSAsyncResult
+{
+    std::promise<StatusCode> promise;
+    DFSAsyncCallback callback;
+
+    void Complete(StatusCode code)
+    {
+        if (callback)
+        {
+            callback(code);
+        }
+        promise.set_value(code);
+    }
+};
+
+/** The code a blocking operation returns for `status` **/
+static StatusCode AsyncCode(const grpc::Status &status)
+{
+    switch (status.error_code())
+    {
+    case grpc::OK:
+    case grpc::DEADLINE_EXCEEDED:
+    case grpc::NOT_FOUND:
+    case grpc::INTERNAL:
+        return status.error_code();
+    default:
+        return StatusCode::CANCELLED;
+    }
+}
+
+void DFSClientNodeP1::SetAsyncOptions(const DFSAsyncOptions &options)
+{
+    std::unique_ptr<DFSAsyncEngine> engine(new DFSAsyncEngine(options));
+    // the old engine finishes its operations first, retries included, which need AsyncEngine()
+    AsyncEngine()->Wait();
+    {
+        std::lock_guard<std::mutex> lock(async_mutex);
+        async_engine.swap(engine);
+    }
+}
+
+DFSAsyncEngine *DFSClientNodeP1::AsyncEngine()
+{
+    std::lock_guard<std::mutex> lock(async_mutex);
+    if (!async_engine)
+    {
+        async_engine.reset(new DFSAsyncEngine(DFSAsyncOptions()));
+    }
+    return async_engine.get();
+}
+
+void DFSClientNodeP1::WaitAsync()
+{
+    AsyncEngine()->Wait();
+}
+
+std::future<StatusCode> DFSClientNodeP1::StoreAsync(const std::string &filename, const DFSAsyncCallback &callback)
+{
+    auto result = std::make_shared<DFSAsyncResult>();
+    result->callback = callback;
+    std::future<StatusCode> future = result->promise.get_future();
+    auto *call = new DFSAsyncStore(PrimaryFor(filename), filename, WrapPath(filename), [result](const grpc::Status &status)
+                                   { result->Complete(AsyncCode(status)); });
+    PrepareContext(call->Context());
+    AsyncEngine()->Submit(call);
+    return future;
+}
+
+std::future<StatusCode> DFSClientNodeP1::FetchAsync(const std::string &filename, const DFSAsyncCallback &callback)
+{
+    auto result = std::make_shared<DFSAsyncResult>();
+    result->callback = callback;
+    std::future<StatusCode> future = result->promise.get_future();
+    FetchAsyncFrom(ReplicaFor(filename), filename, result);
+    return future;
+}
+
+void DFSClientNodeP1::FetchAsyncFrom(DFSReplica *replica, const std::string &filename,
+                                     const std::shared_ptr<DFSAsyncResult> &result)
+{
+    auto *call = new DFSAsyncFetch(replica, filename, WrapPath(filename), [this, replica, filename, result](const grpc::Status &status)
+                                   {
+        StatusCode code = AsyncCode(status);
+        // a replica may be down or not have caught up with its primary yet
+        if (code != StatusCode::OK && code != StatusCode::DEADLINE_EXCEEDED && replica != PrimaryFor(filename))
+        {
+            FetchAsyncFrom(PrimaryFor(filename), filename, result);
+            return;
+        }
+        result->Complete(code); });
+    PrepareContext(call->Context());
+    AsyncEngine()->Submit(call);
+}
+
+std::future<StatusCode> DFSClientNodeP1::DeleteAsync(const std::string &filename, const DFSAsyncCallback &callback)
+{
+    auto result = std::make_shared<DFSAsyncResult>();
+    result->callback = callback;
+    std::future<StatusCode> future = result->promise.get_future();
+    auto *call = new DFSAsyncUnary<FilePath, ResponseStatus>(PrimaryFor(filename), false, &DFSService::Stub::PrepareAsyncdeleteFile,
+                                                             [result, filename](const grpc::Status &status, ResponseStatus *)
+                                                             {
+        if (!status.ok())
+        {
+            dfs_log(LL_ERROR) << "Failed to delete " << filename << ": " << status.error_message();
+        }
+        result->Complete(AsyncCode(status)); });
+    call->MutableRequest()->set_path(filename);
+    PrepareContext(call->Context());
+    AsyncEngine()->Submit(call);
+    return future;
+}
+
+std::future<StatusCode> DFSClientNodeP1::StatAsync(const std::string &filename, dfs_service::FileStatus *file_status,
+                                                   const DFSAsyncCallback &callback)
+{
+    auto result = std::make_shared<DFSAsyncResult>();
+    result->callback = callback;
+    std::future<StatusCode> future = result->promise.get_future();
+    StatAsyncFrom(ReplicaFor(filename), filename, file_status, result);
+    return future;
+}
+
+void DFSClientNodeP1::StatAsyncFrom(DFSReplica *replica, const std::string &filename, dfs_service::FileStatus *file_status,
+                                    const std::shared_ptr<DFSAsyncResult> &result)
+{
+    auto *call = new DFSAsyncUnary<FilePath, FileStatus>(replica, true, &DFSService::Stub::PrepareAsyncstatusFile,
+                                                         [this, replica, filename, file_status, result](const grpc::Status &status, FileStatus *response)
+                                                         {
+        StatusCode code = AsyncCode(status);
+        // a replica may be down or not have caught up with its primary yet
+        if (code != StatusCode::OK && code != StatusCode::DEADLINE_EXCEEDED && replica != PrimaryFor(filename))
+        {
+            StatAsyncFrom(PrimaryFor(filename), filename, file_status, result);
+            return;
+        }
+        if (code == StatusCode::OK && file_status != nullptr)
+        {
+            file_status->Swap(response);
+        }
+        result->Complete(code); });
+    call->MutableRequest()->set_path(filename);
+    PrepareContext(call->Context());
+    AsyncEngine()->Submit(call);
+}
+
+std::future<StatusCode> DFSClientNodeP1::ListAsync(std::map<std::string, int> *file_map, const DFSAsyncCallback &callback)
+{
+    // the shards' listings are merged as they arrive; the last one completes the list
+    struct Listing
+    {
+        std::mutex mutex;
+        size_t remaining;
+        StatusCode code = StatusCode::OK;
+        std::shared_ptr<DFSAsyncResult> result;
+    };
+    auto listing = std::make_shared<Listing>();
+    listing->remaining = server_groups.size();
+    listing->result = std::make_shared<DFSAsyncResult>();
+    listing->result->callback = callback;
+    std::future<StatusCode> future = listing->result->promise.get_future();
+
+    for (auto &group : server_groups)
+    {
+        auto *call = new DFSAsyncUnary<ListFilesRequest, LSResponse>(group.second.front().get(), false, &DFSService::Stub::PrepareAsynclistFiles,
+                                                                     [listing, file_map](const grpc::Status &status, LSResponse *response)
+                                                                     {
+            std::unique_lock<std::mutex> lock(listing->mutex);
+            StatusCode code = AsyncCode(status);
+            if (code == StatusCode::OK && !VisitListing(*response, [file_map](const std::string &path, int64_t mtime, int64_t)
+                                                        {
+                    if (file_map != NULL)
+                    {
+                        file_map->emplace(path, mtime);
+                    } }))
+            {
+                dfs_log(LL_ERROR) << "Malformed packed listing";
+                code = StatusCode::CANCELLED;
+            }
+            else if (code != StatusCode::OK)
+            {
+                dfs_log(LL_ERROR) << "Failed to list files: " << status.error_message();
+            }
+            // a deadline on any server fails the whole listing, since it is incomplete
+            if (code == StatusCode::DEADLINE_EXCEEDED || (code != StatusCode::OK && listing->code == StatusCode::OK))
+            {
+                listing->code = code;
+            }
+            if (--listing->remaining == 0)
+            {
+                lock.unlock();
+                listing->result->Complete(listing->code);
+            } });
+        call->MutableRequest()->set_recursive(true);
+        call->MutableRequest()->set_packed(packed_listing);
+        PrepareContext(call->Context());
+        AsyncEngine()->Submit(call);
+    }
+    if (server_groups.empty())
+    {
+        listing->result->Complete(StatusCode::OK);
+    }
+    return future;
+}
+
+StatusCode DFSClientNodeP1::ListAll(google::protobuf::Arena *arena, std::vector<dfs_service::LSResponse *> *responses)
+{
+    // Fan the listing out to every primary server in parallel
+    responses->clear();
+    for (size_t i = 0; i < server_groups.size(); i++)
+    {
+        responses->push_back(google::protobuf::Arena::CreateMessage<dfs_service::LSResponse>(arena));
+    }
+    std::vector<StatusCode> codes(server_groups.size(), StatusCode::OK);
+    std::vector<std::thread> workers;
+    const DFSTraceContext parent = DFSTracer::Current();
+    size_t index = 0;
+    for (auto &group : server_groups)
+    {
+        DFSReplica *primary = group.second.front().get();
+        workers.emplace_back([this, primary, index, responses, &codes, parent]()
+                             {
+            DFSTrace adopt(parent);
+            DFSSpan span("list_server");
+            codes[index] = ListServer(primary, (*responses)[index]); });
+        index++;
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    // A deadline on any server fails the whole listing, since it is incomplete
+    StatusCode result = StatusCode::OK;
+    for (StatusCode code : codes)
+    {
+        if (code == StatusCode::DEADLINE_EXCEEDED || (code != StatusCode::OK && result == StatusCode::OK))
+        {
+            result = code;
+        }
+    }
+    return result;
+}
+
+StatusCode DFSClientNodeP1::Watch(const std::function<bool(const dfs_service::FileEvent &)> &callback,
+                                  const std::string &prefix)
+{
+    // one stream per primary; replicas see the same changes later
+    std::vector<std::unique_ptr<grpc::ClientContext>> contexts;
+    std::vector<DFSReplica *> primaries;
+    for (auto &group : server_groups)
+    {
+        contexts.emplace_back(new grpc::ClientContext());
+        PrepareContext(contexts.back().get(), false);
+        primaries.push_back(group.second.front().get());
+    }
+
+    std::mutex mutex;
+    bool stopped = false;
+    StatusCode result = StatusCode::OK;
+    auto stop_all = [&]()
+    {
+        stopped = true;
+        for (auto &context : contexts)
+        {
+            context->TryCancel();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < primaries.size(); i++)
+    {
+        workers.emplace_back([&, i]()
+                             {
+            DFSReplicaCall call(primaries[i], false);
+            dfs_service::WatchRequest request;
+            request.set_prefix(prefix);
+            std::unique_ptr<grpc::ClientReader<dfs_service::FileEvent>> reader(call.Stub()->watch(contexts[i].get(), request));
+
+            dfs_service::FileEvent event;
+            while (reader->Read(&event))
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopped)
+                {
+                    break;
+                }
+                if (!callback(event))
+                {
+                    stop_all();
+                    break;
+                }
+            }
+            grpc::Status status = reader->Finish();
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!stopped)
+            {
+                // the listing is incomplete without this server, so end the whole watch
+                dfs_log(LL_ERROR) << "Watch on " << primaries[i]->address << " ended: " << status.error_message();
+                result = status.error_code() == grpc::UNAVAILABLE ? StatusCode::UNAVAILABLE : StatusCode::CANCELLED;
+                stop_all();
+            } });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    return result;
+}
+
+StatusCode DFSClientNodeP1::ListServer(DFSReplica *server, dfs_service::LSResponse *response)
+{
+    DFSReplicaCall call(server, false);
+
     // Create the context
     grpc::ClientContext context;
-    // Set the deadline
-    std::chrono::system_clock::time_point deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout);
-    context.set_deadline(deadline);
+    // Set the deadline and client id
+    PrepareContext(&context);
     // prepare request
     dfs_service::ListFilesRequest request;
-    // prepare response
-    dfs_service::LSResponse response;
+    // files in subdirectories are listed by their path relative to the mount
+    request.set_recursive(true);
+    request.set_packed(packed_listing);
 
     // Call the service
-    grpc::Status status = service_stub->listFiles(&context, request, &response);
+    grpc::Status status = call.Stub()->listFiles(&context, request, response);
 
     if (!status.ok())
     {
@@ -340,13 +1354,6 @@ StatusCode DFSClientNodeP1::List(std::map<std::string, int> *file_map, bool disp
         }
     }
 
-    // fill the file_map
-    for (const auto &file_info : response.filesinfolist())
-    {
-        dfs_log(LL_DEBUG) << "File: " << file_info.filename() << " - " << file_info.modified_time();
-        file_map->insert(std::pair<std::string, int>(file_info.filename(), file_info.modified_time()));
-    }
-
     return StatusCode::OK;
 }
 
@@ -375,23 +1382,212 @@ StatusCode DFSClientNodeP1::Stat(const std::string &filename, void *file_status)
     // StatusCode::CANCELLED otherwise
     //
     //
+    DFSTrace trace("stat", filename);
+    std::vector<DFSReplica *> replicas = ReplicasFor(filename);
+    // each attempt fills in its own status; the winner's is handed back
+    dfs_service::FileStatus statuses[2];
+    const DFSTraceContext parent = DFSTracer::Current();
+    size_t winner;
+    StatusCode code = stat_hedger->Run(replicas.size(), [&](size_t target, DFSHedgeAttempt *attempt)
+                                       {
+        DFSTrace adopt(parent);
+        return StatFrom(replicas[target], filename, &statuses[target], attempt); }, &winner);
+    if (code == StatusCode::OK && file_status != NULL)
+    {
+        static_cast<dfs_service::FileStatus *>(file_status)->Swap(&statuses[winner]);
+    }
+    DFSReplica *replica = replicas[winner];
 
-    // Create the context
+    // a replica may be down or not have caught up with its primary yet
+    if (code != StatusCode::OK && code != StatusCode::DEADLINE_EXCEEDED && replica != PrimaryFor(filename))
+    {
+        code = StatFrom(PrimaryFor(filename), filename, file_status);
+    }
+    return code;
+}
+
+StatusCode DFSClientNodeP1::StatFiles(const std::vector<std::string> &filenames,
+                                      std::map<std::string, dfs_service::FileStatus> *statuses,
+                                      std::map<std::string, grpc::StatusCode> *codes)
+{
+    DFSTrace trace("stat_files", std::to_string(filenames.size()) + " files");
+
+    // a batch only holds files of one shard
+    std::map<std::string, std::vector<std::string>> shards;
+    for (const std::string &filename : filenames)
+    {
+        shards[server_ring.NodeFor(filename)].push_back(filename);
+    }
+    std::vector<std::vector<std::string>> batches;
+    for (auto &shard : shards)
+    {
+        for (size_t i = 0; i < shard.second.size(); i += DFS_STAT_BATCH)
+        {
+            batches.emplace_back(shard.second.begin() + i,
+                                 shard.second.begin() + std::min<size_t>(i + DFS_STAT_BATCH, shard.second.size()));
+        }
+    }
+
+    std::mutex mutex;
+    StatusCode result = StatusCode::OK;
+    auto merge = [&](const std::string &filename, StatusCode code, dfs_service::FileStatus *status)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (code == StatusCode::OK)
+        {
+            (*statuses)[filename].Swap(status);
+        }
+        if (codes != nullptr)
+        {
+            (*codes)[filename] = code;
+        }
+    };
+    auto run = [&](const std::vector<std::string> &batch)
+    {
+        DFSReplica *primary = PrimaryFor(batch.front());
+        DFSReplica *replica = ReplicaFor(batch.front());
+        google::protobuf::Arena arena(dfs_arena_options());
+        auto *response = google::protobuf::Arena::CreateMessage<dfs_service::FileStatuses>(&arena);
+        StatusCode code = StatBatch(replica, batch, response);
+        if (code != StatusCode::OK && code != StatusCode::DEADLINE_EXCEEDED && code != StatusCode::UNIMPLEMENTED &&
+            replica != primary)
+        {
+            replica = primary;
+            code = StatBatch(replica, batch, response);
+        }
+        if (code == StatusCode::UNIMPLEMENTED)
+        {
+            code = StatusCode::OK;
+            for (const std::string &filename : batch)
+            {
+                dfs_service::FileStatus status;
+                StatusCode one = Stat(filename, &status);
+                if (one == StatusCode::OK || one == StatusCode::NOT_FOUND)
+                {
+                    merge(filename, one, &status);
+                }
+                else if (code == StatusCode::OK)
+                {
+                    code = one;
+                }
+            }
+        }
+        else if (code == StatusCode::OK)
+        {
+            // a replica may not have caught up with its primary yet
+            std::vector<std::string> missing;
+            for (auto &entry : *response->mutable_entries())
+            {
+                if (entry.code() == StatusCode::NOT_FOUND && replica != primary)
+                {
+                    missing.push_back(entry.path());
+                    continue;
+                }
+                merge(entry.path(), static_cast<StatusCode>(entry.code()), entry.mutable_status());
+            }
+            if (!missing.empty() && (code = StatBatch(primary, missing, response)) == StatusCode::OK)
+            {
+                for (auto &entry : *response->mutable_entries())
+                {
+                    merge(entry.path(), static_cast<StatusCode>(entry.code()), entry.mutable_status());
+                }
+            }
+        }
+        if (code != StatusCode::OK)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (result == StatusCode::OK)
+            {
+                result = code;
+            }
+        }
+    };
+
+    std::atomic<size_t> next(0);
+    const DFSTraceContext parent = DFSTracer::Current();
+    auto work = [&]()
+    {
+        DFSTrace adopt(parent);
+        for (size_t i = next++; i < batches.size(); i = next++)
+        {
+            run(batches[i]);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < std::min<size_t>(DFS_STAT_REQUESTS, batches.size()); i++)
+    {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    return result;
+}
+
+StatusCode DFSClientNodeP1::StatBatch(DFSReplica *replica, const std::vector<std::string> &filenames,
+                                      dfs_service::FileStatuses *response)
+{
+    DFSReplicaCall call(replica);
     grpc::ClientContext context;
-    // Set the deadline
-    std::chrono::system_clock::time_point deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(deadline_timeout);
-    context.set_deadline(deadline);
-    // prepare request
-    dfs_service::FilePath request;
-    request.set_path(filename);
-    // prepare response
-    dfs_service::FileStatus response;
+    PrepareContext(&context);
+    dfs_service::FilePaths request;
+    for (const std::string &filename : filenames)
+    {
+        request.add_paths(filename);
+    }
+    response->Clear();
+
+    grpc::Status status = call.Stub()->statusFiles(&context, request, response);
+    if (status.ok() && response->entries_size() != static_cast<int>(filenames.size()))
+    {
+        status = grpc::Status(StatusCode::INTERNAL, "Wrong number of entries");
+    }
+    if (status.ok())
+    {
+        return StatusCode::OK;
+    }
+    if (status.error_code() != grpc::UNIMPLEMENTED)
+    {
+        call.Failed();
+        dfs_log(LL_ERROR) << "Failed to get the status of " << filenames.size() << " files: " << status.error_message();
+    }
+    return status.error_code() == grpc::DEADLINE_EXCEEDED || status.error_code() == grpc::UNIMPLEMENTED
+               ? status.error_code()
+               : StatusCode::CANCELLED;
+}
+
+StatusCode DFSClientNodeP1::StatFrom(DFSReplica *replica, const std::string &filename, void *file_status,
+                                     DFSHedgeAttempt *attempt)
+{
+    DFSReplicaCall call(replica);
+
+    // Create the context, or use the hedged attempt's, which the hedger may cancel
+    grpc::ClientContext local_context;
+    grpc::ClientContext &context = attempt ? *attempt->Context() : local_context;
+    // Set the deadline and client id
+    PrepareContext(&context);
+    // prepare request and response on an arena, released together
+    google::protobuf::Arena arena(dfs_arena_options());
+    auto *request = google::protobuf::Arena::CreateMessage<dfs_service::FilePath>(&arena);
+    request->set_path(filename);
+    auto *response = google::protobuf::Arena::CreateMessage<dfs_service::FileStatus>(&arena);
 
     // Call the service
-    grpc::Status status = service_stub->statusFile(&context, request, &response);
+    grpc::Status status = call.Stub()->statusFile(&context, *request, response);
 
+    if (attempt && status.error_code() == grpc::CANCELLED)
+    {
+        // the other attempt of a hedged stat won
+        return StatusCode::CANCELLED;
+    }
     if (!status.ok())
     {
+        if (status.error_code() != grpc::NOT_FOUND)
+        {
+            call.Failed();
+        }
         if (status.error_code() == grpc::DEADLINE_EXCEEDED)
         {
             dfs_log(LL_ERROR) << "Deadline exceeded";
@@ -409,10 +1605,14 @@ StatusCode DFSClientNodeP1::Stat(const std::string &filename, void *file_status)
         }
     }
 
-    // define file_status as dfs_service::FileStatus
-    file_status = &response;
+    // file_status, when given, is a dfs_service::FileStatus
+    if (file_status != NULL)
+    {
+        static_cast<dfs_service::FileStatus *>(file_status)->CopyFrom(*response);
+    }
 
-    dfs_log(LL_DEBUG) << "File " << filename << " size: " << response.size() << " mtime: " << response.modified_time() << " ctime: " << response.creation_time();
+    dfs_log(LL_DEBUG) << "File " << filename << " size: " << response->size() << " mtime: " << response->modified_time() << " ctime: " << response->creation_time()
+                      << " hash: " << std::hex << response->content_hash() << std::dec;
 
     return StatusCode::OK;
 }
@@ -7,13 +7,29 @@
 #include <map>
 #include <limits.h>
 #include <chrono>
+#include <future>
+#include <functional>
 
 #include <grpcpp/grpcpp.h>
 #include "src/dfslibx-clientnode-p1.h"
+#include "dfslib-prefetch-p1.h"
+#include "dfslib-hedge-p1.h"
+#include "dfslib-async-p1.h"
 #include "proto-src/dfs-service.grpc.pb.h"
 
 #define BUF_SIZE 1024
 
+/** statusFiles requests StatFiles keeps in flight **/
+#define DFS_STAT_REQUESTS 8
+
+/** Bytes a striped store sends per range at most; smaller files are stored in one stream **/
+#define DFS_STRIPE_BYTES (64LL * 1024 * 1024)
+
+/** Called once with the code of an asynchronous operation, before its future is ready **/
+typedef std::function<void(grpc::StatusCode code)> DFSAsyncCallback;
+
+struct DFSAsyncResult;
+
 class DFSClientNodeP1 : public DFSClientNode
 {
 
@@ -53,6 +69,19 @@ public:
          */
         grpc::StatusCode Delete(const std::string &filename) override;
 
+        /**
+         * Read part of a file from the RPC server into memory. Only the
+         * part is sent, and a compressed file is only inflated where the
+         * part lies.
+         *
+         * @param filename
+         * @param offset
+         * @param length - bytes to read (0 = to the end of the file)
+         * @param data - set to the bytes read, short at the end of the file
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode Read(const std::string &filename, int64_t offset, int64_t length, std::string *data);
+
         /**
          * Get or print a list from the RPC server.
          *
@@ -94,5 +123,386 @@ public:
         //
         // Add your additional declarations here
         //
+
+        /**
+         * Get the status of many files with a few statusFiles requests:
+         * the names are grouped by server and sent DFS_STAT_BATCH at a
+         * time, DFS_STAT_REQUESTS requests at once. Servers that do not
+         * know statusFiles are asked one file at a time.
+         *
+         * @param filenames
+         * @param statuses - filled in with the status of every file found
+         * @param codes - if not null, filled in with every file's own code (OK, NOT_FOUND or INVALID_ARGUMENT)
+         * @return grpc::StatusCode - OK if every request was answered, even if some files were not found
+         */
+        grpc::StatusCode StatFiles(const std::vector<std::string> &filenames,
+                                   std::map<std::string, dfs_service::FileStatus> *statuses,
+                                   std::map<std::string, grpc::StatusCode> *codes = nullptr);
+
+        /**
+         * Copy a file on the RPC server to another name, replacing any
+         * file of that name. The server copies it without sending the
+         * contents; only if the two names belong to different servers
+         * do they go through this client. The copy's mtime is now.
+         *
+         * @param source
+         * @param destination
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode Copy(const std::string &source, const std::string &destination);
+
+        /**
+         * Give a file on the RPC server another name, replacing any file
+         * of that name, as Copy does but keeping its mtime.
+         *
+         * @param source
+         * @param destination
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode Rename(const std::string &source, const std::string &destination);
+
+        /**
+         * Change part of a file on the RPC server without sending the rest
+         * of it: append `data`, write it over the bytes at `offset`, or cut
+         * the file at `offset` and write it there. A missing file is
+         * created. The file's mtime becomes the time of the write.
+         *
+         * @param filename
+         * @param mode
+         * @param offset - where the data goes, unless appended
+         * @param data
+         * @param expected_size - fail with FAILED_PRECONDITION unless the file has this size, so a writer racing another finds out (-1 = do not check)
+         * @param result - if not null, filled in with the file's new size and mtime
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode Write(const std::string &filename, dfs_service::WriteMode mode, int64_t offset,
+                               const std::string &data, int64_t expected_size = -1,
+                               dfs_service::FileStatus *result = nullptr);
+
+        /**
+         * Send the bytes of a local file beyond the end of the server's
+         * copy, for files that only grow, such as logs. The server's copy
+         * gets the local mtime.
+         *
+         * @param filename
+         * @return grpc::StatusCode - FAILED_PRECONDITION if the server's copy changed meanwhile, CANCELLED if it is longer than the local file
+         */
+        grpc::StatusCode Append(const std::string &filename);
+
+        /**
+         * List every file on the servers with its mtime and size.
+         *
+         * @param files - filled in, keyed by path
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode ListDetails(std::map<std::string, dfs_service::FileInfo> *files);
+
+        /**
+         * Follow file changes on every server until the callback returns
+         * false or a server stream ends.
+         *
+         * The callback is called for one event at a time. A RESYNC event
+         * means changes were dropped and the caller should List() again.
+         *
+         * @param callback
+         * @param prefix - only report files whose path starts with this
+         * @return grpc::StatusCode - OK when the callback stopped the watch
+         */
+        grpc::StatusCode Watch(const std::function<bool(const dfs_service::FileEvent &)> &callback,
+                               const std::string &prefix = "");
+
+        /**
+         * Ask the servers for listings in the packed format (the default).
+         * Servers that do not know it answer with the plain one.
+         *
+         * @param packed
+         */
+        void SetPackedListing(bool packed);
+
+        /**
+         * Store files larger than DFS_STRIPE_BYTES over `streams` streams
+         * at once. The server preallocates the file, every stream writes a
+         * range of at most DFS_STRIPE_BYTES in place, and the file appears
+         * once all of them are written. Servers without striped uploads
+         * get one stream.
+         *
+         * @param streams - 1 = one stream per file
+         */
+        void SetStripes(int streams);
+
+        /**
+         * Learn the order files are fetched in and prefetch the likely
+         * next ones (see DFSPrefetcher). Call after SetMountPath; disabled
+         * options stop prefetching and save the model.
+         *
+         * @param options
+         */
+        void SetPrefetchOptions(const DFSPrefetchOptions &options);
+
+        /** Hit rate and waste of prefetching **/
+        DFSPrefetchStats PrefetchStats();
+
+        /**
+         * Send a backup of a Stat or Fetch that is slower than usual to
+         * another server of its shard (see DFSHedger). Stats and fetches
+         * keep separate latency histories; a fetch counts as answered once
+         * its first chunk arrives, so only a stalled one is hedged. Must
+         * not be called while requests are running.
+         *
+         * @param options
+         */
+        void SetHedgeOptions(const DFSHedgeOptions &options);
+
+        /** What hedging did, by request kind ("stat", "fetch") **/
+        std::map<std::string, DFSHedgeStats> HedgeStats();
+
+        /**
+         * Set the threads and the concurrency limit of the asynchronous
+         * operations (see DFSAsyncEngine). Waits for the running ones;
+         * must not be called while other threads submit operations.
+         *
+         * @param options
+         */
+        void SetAsyncOptions(const DFSAsyncOptions &options);
+
+        //
+        // Asynchronous operations. Each returns at once with a future of
+        // the code its blocking counterpart would return, and calls
+        // `callback`, if given, with the same code just before the future
+        // becomes ready. Requests are routed, retried on the primary and
+        // given their deadline and mount path as the blocking ones are;
+        // the deadline runs from submission, so time spent waiting for a
+        // slot counts against it. They are not hedged, prefetched or
+        // traced.
+        //
+
+        /**
+         * Store a file from the mount path on to the RPC server
+         *
+         * @param filename
+         * @param callback
+         * @return std::future<grpc::StatusCode>
+         */
+        std::future<grpc::StatusCode> StoreAsync(const std::string &filename, const DFSAsyncCallback &callback = nullptr);
+
+        /**
+         * Fetch a file from the RPC server and put it in the mount path
+         *
+         * @param filename
+         * @param callback
+         * @return std::future<grpc::StatusCode>
+         */
+        std::future<grpc::StatusCode> FetchAsync(const std::string &filename, const DFSAsyncCallback &callback = nullptr);
+
+        /**
+         * Delete a file from the RPC server
+         *
+         * @param filename
+         * @param callback
+         * @return std::future<grpc::StatusCode>
+         */
+        std::future<grpc::StatusCode> DeleteAsync(const std::string &filename, const DFSAsyncCallback &callback = nullptr);
+
+        /**
+         * Get the status of a file from the RPC server
+         *
+         * @param filename
+         * @param file_status - if not null, filled in before completion; must outlive the operation
+         * @param callback
+         * @return std::future<grpc::StatusCode>
+         */
+        std::future<grpc::StatusCode> StatAsync(const std::string &filename, dfs_service::FileStatus *file_status,
+                                                const DFSAsyncCallback &callback = nullptr);
+
+        /**
+         * List the files of every server, as List does
+         *
+         * @param file_map - if not null, filled in before completion; must outlive the operation
+         * @param callback
+         * @return std::future<grpc::StatusCode>
+         */
+        std::future<grpc::StatusCode> ListAsync(std::map<std::string, int> *file_map,
+                                                const DFSAsyncCallback &callback = nullptr);
+
+        /**
+         * Wait until every asynchronous operation submitted so far has
+         * completed. Not from a callback.
+         */
+        void WaitAsync();
+
+private:
+        /**
+         * Store a local file under a name of its own.
+         *
+         * @param filename - the name on the server
+         * @param local_filepath
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode StoreFrom(const std::string &filename, const std::string &local_filepath);
+
+        /**
+         * Store a local file as a striped upload, or with StoreFrom if it
+         * is small or the server does not take striped uploads.
+         *
+         * @param filename - the name on the server
+         * @param local_filepath
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode StoreStriped(const std::string &filename, const std::string &local_filepath);
+
+        /**
+         * Send one range of a local file to an upload.
+         *
+         * @param replica - the server of the upload
+         * @param id
+         * @param fd
+         * @param offset
+         * @param length
+         * @return grpc::Status
+         */
+        grpc::Status UploadRange(DFSReplica *replica, const std::string &id, int fd, int64_t offset, int64_t length);
+
+        /**
+         * Copy or rename a file on its server, or through this client
+         * when the two names belong to different servers. Names that
+         * would leave the mount are refused with INVALID_ARGUMENT.
+         *
+         * @param source
+         * @param destination
+         * @param rename - remove the source
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode CopyOrRename(const std::string &source, const std::string &destination, bool rename);
+
+        /**
+         * Send a writeFile request to the primary of the file.
+         *
+         * @param filename
+         * @param mode
+         * @param offset
+         * @param expected_size - -1 = do not check
+         * @param infile - a DFSChunkReader or DFSDataReader over the data to write
+         * @param start - where the reader's range starts; the server counts chunk offsets from the data
+         * @param length - bytes in the range
+         * @param mtime - for the server's copy (0 = the time of the write)
+         * @param result - may be null
+         * @return grpc::StatusCode
+         */
+        template <typename Reader>
+        grpc::StatusCode WriteChunks(const std::string &filename, dfs_service::WriteMode mode, int64_t offset,
+                                     int64_t expected_size, Reader *infile, int64_t start, int64_t length,
+                                     int64_t mtime, dfs_service::FileStatus *result);
+
+        /**
+         * Fetch a file from a replica of its server, or the primary if
+         * that fails, into a local file. A name that would leave the
+         * mount is refused with INVALID_ARGUMENT.
+         *
+         * @param filename
+         * @param local_filepath
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode FetchTo(const std::string &filename, const std::string &local_filepath);
+
+        /**
+         * Fetch a file from one particular server.
+         *
+         * @param replica
+         * @param filename
+         * @param local_filepath
+         * @param attempt - the hedged attempt this is, if any
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode FetchFrom(DFSReplica *replica, const std::string &filename, const std::string &local_filepath,
+                                   DFSHedgeAttempt *attempt = nullptr);
+
+        /**
+         * Read part of a file from one particular server.
+         *
+         * @param replica
+         * @param filename
+         * @param offset
+         * @param length
+         * @param data
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode ReadFrom(DFSReplica *replica, const std::string &filename, int64_t offset, int64_t length,
+                                  std::string *data);
+
+        /**
+         * Get the status of a file from one particular server.
+         *
+         * @param replica
+         * @param filename
+         * @param file_status
+         * @param attempt - the hedged attempt this is, if any
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode StatFrom(DFSReplica *replica, const std::string &filename, void *file_status,
+                                  DFSHedgeAttempt *attempt = nullptr);
+
+        /**
+         * Get the status of a batch of files from one particular server.
+         *
+         * @param replica
+         * @param filenames
+         * @param response - one entry per filename, in order
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode StatBatch(DFSReplica *replica, const std::vector<std::string> &filenames,
+                                   dfs_service::FileStatuses *response);
+
+        /**
+         * List the files held by a single server.
+         *
+         * @param server
+         * @param response
+         * @return grpc::StatusCode
+         */
+        grpc::StatusCode ListServer(DFSReplica *server, dfs_service::LSResponse *response);
+
+        /**
+         * List every shard's primary in parallel.
+         *
+         * @param arena - owns the responses
+         * @param responses - one listing per shard
+         * @return grpc::StatusCode - DEADLINE_EXCEEDED if any shard timed out
+         */
+        grpc::StatusCode ListAll(google::protobuf::Arena *arena, std::vector<dfs_service::LSResponse *> *responses);
+
+        /**
+         * Call `visit` with the path, mtime and size of every file in a
+         * listing, whether it came packed or as FileInfo messages.
+         *
+         * @param response
+         * @param visit
+         * @return false if the packed listing is malformed
+         */
+        static bool VisitListing(const dfs_service::LSResponse &response,
+                                 const std::function<void(const std::string &, int64_t, int64_t)> &visit);
+
+        /** Submit a fetch from one server, retried on the primary **/
+        void FetchAsyncFrom(DFSReplica *replica, const std::string &filename, const std::shared_ptr<DFSAsyncResult> &result);
+
+        /** Submit a stat of one server, retried on the primary **/
+        void StatAsyncFrom(DFSReplica *replica, const std::string &filename, dfs_service::FileStatus *file_status,
+                           const std::shared_ptr<DFSAsyncResult> &result);
+
+        /** The engine of the asynchronous operations, started with default options on first use **/
+        DFSAsyncEngine *AsyncEngine();
+
+        bool packed_listing = true;
+
+        /** Streams a large store is striped over **/
+        int stripes = 1;
+
+        std::unique_ptr<DFSHedger> stat_hedger;
+        std::unique_ptr<DFSHedger> fetch_hedger;
+
+        std::mutex async_mutex;
+        std::unique_ptr<DFSAsyncEngine> async_engine;
+
+        /** Declared last, so it stops before the rest of the node goes away **/
+        std::unique_ptr<DFSPrefetcher> prefetcher;
 };
 #endif
@@ -0,0 +1,184 @@
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "src/dfs-utils.h"
+#include "dfslib-events-p1.h"
+
+/** File changes inotify reports for the mount and its subdirectories **/
+#define DFS_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+DFSEventHub::DFSEventHub(const std::string &root, size_t capacity, int coalesce_ms)
+    : root(root), capacity(capacity), coalesce(coalesce_ms), ring(capacity), next_sequence(1),
+      notifier(root, DFS_WATCH_MASK), stopping(false)
+{
+    // without inotify, the store and delete handlers still publish their own changes
+    worker = std::thread(&DFSEventHub::Run, this);
+}
+
+DFSEventHub::~DFSEventHub()
+{
+    Stop();
+}
+
+void DFSEventHub::Stop()
+{
+    stopping = true;
+    cv.notify_all();
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+}
+
+void DFSEventHub::Publish(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    // a path already waiting keeps its place; only the final state is reported
+    pending.insert(std::make_pair(path, Pending{false, std::chrono::steady_clock::now()}));
+}
+
+void DFSEventHub::SetFallback(const std::function<bool(const std::string &, int64_t *)> &fallback)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->fallback = fallback;
+}
+
+void DFSEventHub::PublishResync(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto inserted = pending.insert(std::make_pair(path, Pending{true, std::chrono::steady_clock::now()}));
+    inserted.first->second.resync = true;
+}
+
+uint64_t DFSEventHub::Head()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return next_sequence;
+}
+
+bool DFSEventHub::Wait(uint64_t *cursor, std::vector<DFSEvent> *events, bool *resync,
+                       std::chrono::milliseconds timeout, size_t max_events)
+{
+    events->clear();
+    *resync = false;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait_for(lock, timeout, [&]()
+                { return next_sequence > *cursor || stopping; });
+    if (next_sequence <= *cursor)
+    {
+        return false;
+    }
+    if (next_sequence - *cursor > capacity)
+    {
+        // the events this watcher missed are overwritten; it has to relist
+        *resync = true;
+        *cursor = next_sequence;
+        return true;
+    }
+    for (; *cursor < next_sequence && events->size() < max_events; (*cursor)++)
+    {
+        events->push_back(ring[*cursor % capacity]);
+    }
+    return true;
+}
+
+void DFSEventHub::Run()
+{
+    DFSTreeNotifier::Handler handler = [this](const std::string &path, uint32_t mask)
+    {
+        if (mask & (IN_Q_OVERFLOW | IN_ISDIR))
+        {
+            // an overflow or a directory moved away: the file-level events are lost
+            PublishResync(path);
+        }
+        else
+        {
+            Publish(path);
+        }
+    };
+    while (!stopping)
+    {
+        if (!notifier.Ok())
+        {
+            std::this_thread::sleep_for(coalesce / 2);
+        }
+        else if (notifier.Poll(coalesce.count() / 2))
+        {
+            notifier.Read(handler);
+        }
+        Flush();
+    }
+}
+
+void DFSEventHub::Flush()
+{
+    std::vector<std::pair<std::string, bool>> matured;
+    std::function<bool(const std::string &, int64_t *)> elsewhere;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        for (auto iter = pending.begin(); iter != pending.end();)
+        {
+            if (now - iter->second.first_seen < coalesce)
+            {
+                ++iter;
+                continue;
+            }
+            matured.push_back(std::make_pair(iter->first, iter->second.resync));
+            iter = pending.erase(iter);
+        }
+        if (!matured.empty())
+        {
+            elsewhere = fallback;
+        }
+    }
+    if (matured.empty())
+    {
+        return;
+    }
+
+    // the file's state at the end of the window decides the event
+    std::vector<DFSEvent> events;
+    struct stat file_stat;
+    for (auto &change : matured)
+    {
+        DFSEvent event;
+        event.path = std::move(change.first);
+        event.modified_time = 0;
+        if (change.second)
+        {
+            event.kind = DFSEvent::RESYNC;
+        }
+        else if (stat((root + event.path).c_str(), &file_stat) == 0)
+        {
+            if (!S_ISREG(file_stat.st_mode))
+            {
+                continue;
+            }
+            event.kind = DFSEvent::CHANGED;
+            event.modified_time = file_stat.st_mtime;
+        }
+        else if (elsewhere && elsewhere(event.path, &event.modified_time))
+        {
+            event.kind = DFSEvent::CHANGED;
+        }
+        else
+        {
+            event.kind = DFSEvent::DELETED;
+        }
+        events.push_back(std::move(event));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (DFSEvent &event : events)
+    {
+        event.sequence = next_sequence;
+        ring[next_sequence % capacity] = std::move(event);
+        next_sequence++;
+    }
+    cv.notify_all();
+}
@@ -0,0 +1,151 @@
+#ifndef _DFSLIB_EVENTS_H
+#define _DFSLIB_EVENTS_H
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+#include "dfslib-notify-p1.h"
+
+/** Events the ring keeps for subscribers that fall behind **/
+#define DFS_EVENT_RING 4096
+
+/** Window in which repeated events for one path collapse into one, in milliseconds **/
+#define DFS_EVENT_COALESCE_MS 100
+
+/**
+ * A change to one file, as published to watchers
+ */
+struct DFSEvent
+{
+    enum Kind
+    {
+        CHANGED,
+        DELETED,
+        /** Changes were not tracked file by file (e.g. a directory moved); relist **/
+        RESYNC
+    };
+
+    uint64_t sequence;
+    Kind kind;
+
+    /** Path relative to the mount **/
+    std::string path;
+
+    int64_t modified_time;
+};
+
+/**
+ * Collects file changes on the server and fans them out to watchers.
+ *
+ * Changes come from inotify on the mount (including subdirectories) and
+ * from the store and delete handlers, which publish directly so their
+ * events do not depend on inotify limits. Bursts are coalesced per path:
+ * an event is held for DFS_EVENT_COALESCE_MS and later events for the same
+ * path replace it, so a file written in many steps yields one event.
+ *
+ * Coalesced events go into a fixed-size ring with increasing sequence
+ * numbers. Every watcher keeps its own cursor into the ring, so one copy
+ * of each event serves all of them. A watcher that falls more than the
+ * ring's capacity behind skips to the head and is told to resync, instead
+ * of the server buffering events for it without bound.
+ */
+class DFSEventHub
+{
+
+public:
+    /**
+     * Starts watching the mount in a background thread.
+     *
+     * @param root - the mount path, with a trailing '/'
+     * @param capacity - events in the ring
+     * @param coalesce_ms - coalescing window
+     */
+    DFSEventHub(const std::string &root, size_t capacity = DFS_EVENT_RING, int coalesce_ms = DFS_EVENT_COALESCE_MS);
+    ~DFSEventHub();
+
+    /**
+     * Stop and join the background thread. After this the fallback is no
+     * longer called, so its owner may destroy what it refers to. Watchers
+     * get no new events.
+     */
+    void Stop();
+
+    /**
+     * Report a change to a file. Whether it still exists is checked when
+     * the event leaves the coalescing window.
+     *
+     * @param path - relative to the mount
+     */
+    void Publish(const std::string &path);
+
+    /**
+     * Look up files missing from the mount here before reporting them
+     * deleted, e.g. files another storage tier holds.
+     *
+     * @param fallback - gives whether the file exists and, if so, its mtime
+     */
+    void SetFallback(const std::function<bool(const std::string &, int64_t *)> &fallback);
+
+    /**
+     * The sequence number the next event will get, i.e. where a new watcher starts.
+     */
+    uint64_t Head();
+
+    /**
+     * Wait for events after `cursor` and advance the cursor past them.
+     *
+     * @param cursor - the next sequence number the watcher wants
+     * @param events - replaced with the new events, at most max_events
+     * @param resync - set when the watcher fell behind and events were skipped
+     * @param timeout
+     * @param max_events
+     * @return false if nothing arrived within the timeout
+     */
+    bool Wait(uint64_t *cursor, std::vector<DFSEvent> *events, bool *resync,
+              std::chrono::milliseconds timeout, size_t max_events = 256);
+
+private:
+    struct Pending
+    {
+        bool resync;
+        std::chrono::steady_clock::time_point first_seen;
+    };
+
+    std::string root;
+    size_t capacity;
+    std::chrono::milliseconds coalesce;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::function<bool(const std::string &, int64_t *)> fallback;
+
+    /** Events waiting out the coalescing window, by path **/
+    std::map<std::string, Pending> pending;
+
+    std::vector<DFSEvent> ring;
+    uint64_t next_sequence;
+
+    DFSTreeNotifier notifier;
+
+    std::atomic<bool> stopping;
+    std::thread worker;
+
+    /** Read inotify events and flush coalesced events until stopped **/
+    void Run();
+
+    void PublishResync(const std::string &path);
+
+    /** Move events that have outlived the coalescing window into the ring **/
+    void Flush();
+};
+
+#endif
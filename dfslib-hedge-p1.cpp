@@ -0,0 +1,259 @@
+#include <cmath>
+#include <algorithm>
+
+#include "dfslib-hedge-p1.h"
+
+using grpc::StatusCode;
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * The state of one hedged request, shared by its attempts and the timer.
+ * Guarded by the hedger's mutex.
+ */
+struct DFSHedgeCall
+{
+    const DFSHedger::Attempt *attempt;
+    std::unique_ptr<DFSHedgeAttempt> attempts[2];
+    StatusCode codes[2];
+    bool finished[2] = {false, false};
+
+    /** Index of the first attempt that succeeded, or -1 **/
+    int winner = -1;
+
+    /** Some attempt has started to answer **/
+    bool responded = false;
+
+    /** Waiting in the timers, at `timer` **/
+    bool armed = false;
+    std::multimap<Clock::time_point, std::shared_ptr<DFSHedgeCall>>::iterator timer;
+
+    /** The backup was taken by a worker **/
+    bool started = false;
+};
+
+DFSHedgeAttempt::DFSHedgeAttempt(DFSHedger *hedger, DFSHedgeCall *call, size_t index)
+    : hedger(hedger), call(call), index(index), start(Clock::now()), responded(false)
+{
+}
+
+grpc::ClientContext *DFSHedgeAttempt::Context()
+{
+    return &context;
+}
+
+void DFSHedgeAttempt::Responding()
+{
+    if (call == nullptr)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(hedger->mutex);
+    if (!responded)
+    {
+        responded = true;
+        call->responded = true;
+        hedger->RecordLocked(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count());
+    }
+}
+
+DFSHedger::DFSHedger(const DFSHedgeOptions &options)
+    : options(options), next_sample(0), delay_us(0), samples_since_delay(0), tokens(DFS_HEDGE_BURST), stopping(false)
+{
+    samples.reserve(DFS_HEDGE_WINDOW);
+    if (options.enabled)
+    {
+        timer = std::thread(&DFSHedger::RunTimers, this);
+        for (int i = 0; i < DFS_HEDGE_BURST; i++)
+        {
+            workers.emplace_back(&DFSHedger::RunBackups, this);
+        }
+    }
+}
+
+DFSHedger::~DFSHedger()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        wake.notify_all();
+        queued.notify_all();
+    }
+    if (timer.joinable())
+    {
+        timer.join();
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+StatusCode DFSHedger::Run(size_t targets, const Attempt &attempt, size_t *winner)
+{
+    *winner = 0;
+    if (!options.enabled || targets < 2)
+    {
+        DFSHedgeAttempt single(this, nullptr, 0);
+        return attempt(0, &single);
+    }
+
+    auto call = std::make_shared<DFSHedgeCall>();
+    call->attempt = &attempt;
+    call->attempts[0].reset(new DFSHedgeAttempt(this, call.get(), 0));
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.requests++;
+        tokens = std::min<double>(DFS_HEDGE_BURST, tokens + options.budget);
+        call->timer = timers.emplace(Clock::now() + DelayLocked(), call);
+        call->armed = true;
+        wake.notify_all();
+    }
+
+    Finish(call->attempts[0].get(), attempt(0, call->attempts[0].get()));
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (call->armed)
+    {
+        timers.erase(call->timer);
+        call->armed = false;
+    }
+    // the timer can no longer queue a backup; drop one no worker has taken yet
+    if (call->attempts[1] && !call->started)
+    {
+        backups.erase(std::find(backups.begin(), backups.end(), call));
+        call->codes[1] = StatusCode::CANCELLED;
+        call->finished[1] = true;
+    }
+    // a running one was cancelled if the first attempt won, and is waited for either way
+    changed.wait(lock, [&call]() { return !call->attempts[1] || call->finished[1]; });
+    *winner = call->winner >= 0 ? call->winner : 0;
+    if (*winner == 1)
+    {
+        stats.backup_wins++;
+    }
+    return call->codes[*winner];
+}
+
+DFSHedgeStats DFSHedger::Stats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+std::chrono::microseconds DFSHedger::DelayLocked() const
+{
+    int64_t delay = samples.size() < DFS_HEDGE_WARMUP ? options.initial_delay_ms * 1000LL : delay_us;
+    return std::chrono::microseconds(std::max<int64_t>(delay, options.min_delay_ms * 1000LL));
+}
+
+void DFSHedger::RecordLocked(int64_t latency_us)
+{
+    if (samples.size() < DFS_HEDGE_WINDOW)
+    {
+        samples.push_back(latency_us);
+    }
+    else
+    {
+        samples[next_sample] = latency_us;
+        next_sample = (next_sample + 1) % DFS_HEDGE_WINDOW;
+    }
+    // selecting the percentile costs a copy of the window, so it is only redone every 16 samples
+    if (samples.size() < DFS_HEDGE_WARMUP || (++samples_since_delay < 16 && delay_us > 0))
+    {
+        return;
+    }
+    samples_since_delay = 0;
+    std::vector<int64_t> window(samples);
+    size_t rank = static_cast<size_t>(std::ceil(options.percentile * window.size()));
+    rank = std::min(std::max<size_t>(rank, 1), window.size()) - 1;
+    std::nth_element(window.begin(), window.begin() + rank, window.end());
+    delay_us = window[rank];
+}
+
+void DFSHedger::HedgeLocked(const std::shared_ptr<DFSHedgeCall> &call)
+{
+    if (call->responded || call->finished[0])
+    {
+        return;
+    }
+    if (tokens < 1)
+    {
+        stats.over_budget++;
+        return;
+    }
+    tokens -= 1;
+    stats.hedged++;
+    call->attempts[1].reset(new DFSHedgeAttempt(this, call.get(), 1));
+    backups.push_back(call);
+    queued.notify_one();
+}
+
+void DFSHedger::Finish(DFSHedgeAttempt *attempt, StatusCode code)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    DFSHedgeCall *call = attempt->call;
+    call->codes[attempt->index] = code;
+    call->finished[attempt->index] = true;
+    // an answer counts as a response; a loser cut off by the winner does not
+    if (!attempt->responded && code != StatusCode::CANCELLED)
+    {
+        attempt->responded = true;
+        call->responded = true;
+        RecordLocked(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - attempt->start).count());
+    }
+    if (code == StatusCode::OK && call->winner < 0)
+    {
+        call->winner = attempt->index;
+        DFSHedgeAttempt *other = call->attempts[1 - attempt->index].get();
+        if (other != nullptr && !call->finished[other->index])
+        {
+            other->context.TryCancel();
+        }
+    }
+    changed.notify_all();
+}
+
+void DFSHedger::RunTimers()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping)
+    {
+        if (timers.empty())
+        {
+            wake.wait(lock);
+            continue;
+        }
+        auto due = timers.begin();
+        if (Clock::now() < due->first)
+        {
+            wake.wait_until(lock, due->first);
+            continue;
+        }
+        std::shared_ptr<DFSHedgeCall> call = due->second;
+        timers.erase(due);
+        call->armed = false;
+        HedgeLocked(call);
+    }
+}
+
+void DFSHedger::RunBackups()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        queued.wait(lock, [this]() { return stopping || !backups.empty(); });
+        if (backups.empty())
+        {
+            return;
+        }
+        std::shared_ptr<DFSHedgeCall> call = backups.front();
+        backups.pop_front();
+        call->started = true;
+        DFSHedgeAttempt *attempt = call->attempts[1].get();
+        attempt->start = Clock::now();
+        lock.unlock();
+        Finish(attempt, (*call->attempt)(1, attempt));
+        lock.lock();
+    }
+}
@@ -0,0 +1,199 @@
+#ifndef _DFSLIB_HEDGE_H
+#define _DFSLIB_HEDGE_H
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+#include <grpcpp/grpcpp.h>
+
+/** Recent response times the hedge delay is taken from **/
+#define DFS_HEDGE_WINDOW 256
+
+/** Samples needed before the tracked percentile replaces the initial delay **/
+#define DFS_HEDGE_WARMUP 32
+
+/** Unused hedging budget saved up for bursts, in requests; also the number of backup workers **/
+#define DFS_HEDGE_BURST 10
+
+class DFSHedger;
+struct DFSHedgeCall;
+
+/**
+ * Settings of hedged requests
+ */
+struct DFSHedgeOptions
+{
+    /** Hedge at all **/
+    bool enabled = false;
+
+    /** A request still unanswered after this share of recent requests were answered gets a backup **/
+    double percentile = 0.95;
+
+    /** Backups sent, as a share of requests, at most (over time; DFS_HEDGE_BURST may go at once) **/
+    double budget = 0.05;
+
+    /** Never hedge sooner than this many milliseconds **/
+    int min_delay_ms = 1;
+
+    /** Hedge delay in milliseconds until DFS_HEDGE_WARMUP responses have been seen **/
+    int initial_delay_ms = 50;
+};
+
+/**
+ * What hedging did
+ */
+struct DFSHedgeStats
+{
+    uint64_t requests = 0;
+
+    /** Backups sent **/
+    uint64_t hedged = 0;
+
+    /** Requests the backup answered first **/
+    uint64_t backup_wins = 0;
+
+    /** Backups not sent because the budget was spent **/
+    uint64_t over_budget = 0;
+};
+
+/**
+ * One attempt of a hedged request: the context to issue it with, which
+ * the hedger cancels if another attempt wins.
+ */
+class DFSHedgeAttempt
+{
+
+public:
+    /**
+     * @param hedger
+     * @param call - null for a request that is not hedged
+     * @param index - 0 for the first attempt, 1 for the backup
+     */
+    DFSHedgeAttempt(DFSHedger *hedger, DFSHedgeCall *call, size_t index);
+
+    grpc::ClientContext *Context();
+
+    /**
+     * The server has started to answer, e.g. the first chunk of a fetch
+     * arrived; a stall is no longer likely, so no backup is sent after
+     * this. An attempt that completes without calling it responds then.
+     */
+    void Responding();
+
+private:
+    friend class DFSHedger;
+
+    DFSHedger *hedger;
+    DFSHedgeCall *call;
+    size_t index;
+    grpc::ClientContext context;
+    std::chrono::steady_clock::time_point start;
+    bool responded;
+};
+
+/**
+ * Sends a backup of a slow request to another server and takes whichever
+ * answer comes first.
+ *
+ * The time to the first response of recent requests is kept, and a request
+ * that has not been answered after its `percentile` gets one backup
+ * attempt against the next target. The first attempt to succeed wins and
+ * the other is cancelled; if one fails, the other is waited for. Backups
+ * are paid for from a token bucket that every request adds `budget` to and
+ * every backup takes one from, so hedging adds at most `budget` extra
+ * load however slow the servers get.
+ *
+ * The first attempt runs on the caller's thread; a timer thread queues
+ * backups for DFS_HEDGE_BURST worker threads, and Run() waits for its
+ * backup, if any, to finish or be cancelled before it returns. The
+ * requests being hedged must be idempotent and write their results per
+ * attempt.
+ */
+class DFSHedger
+{
+
+public:
+    /** Issue the request against target `target` (0 first, 1 for the backup) with the attempt's context **/
+    typedef std::function<grpc::StatusCode(size_t target, DFSHedgeAttempt *attempt)> Attempt;
+
+    explicit DFSHedger(const DFSHedgeOptions &options);
+
+    /** Stop the timer; every Run() must have returned **/
+    ~DFSHedger();
+
+    DFSHedger(const DFSHedger &) = delete;
+    DFSHedger &operator=(const DFSHedger &) = delete;
+
+    /**
+     * Run a request, hedged onto the second target if it is slow.
+     *
+     * @param targets - equivalent targets, best first; one means no hedging
+     * @param attempt
+     * @param winner - set to the index of the attempt whose result is returned
+     * @return the winning attempt's code, or the first attempt's if none succeeded
+     */
+    grpc::StatusCode Run(size_t targets, const Attempt &attempt, size_t *winner);
+
+    DFSHedgeStats Stats();
+
+private:
+    friend class DFSHedgeAttempt;
+
+    DFSHedgeOptions options;
+
+    std::mutex mutex;
+
+    /** An attempt finished **/
+    std::condition_variable changed;
+
+    /** A timer was added, or the hedger is stopping **/
+    std::condition_variable wake;
+
+    /** A backup was queued, or the hedger is stopping **/
+    std::condition_variable queued;
+
+    /** Ring of recent response times, in microseconds **/
+    std::vector<int64_t> samples;
+    size_t next_sample;
+    int64_t delay_us;
+    size_t samples_since_delay;
+
+    double tokens;
+    DFSHedgeStats stats;
+
+    /** Requests waiting for their hedge delay to pass **/
+    std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<DFSHedgeCall>> timers;
+
+    /** Backups waiting for a worker **/
+    std::deque<std::shared_ptr<DFSHedgeCall>> backups;
+
+    bool stopping;
+    std::thread timer;
+    std::vector<std::thread> workers;
+
+    /** Delay after which a request that has not been answered is hedged **/
+    std::chrono::microseconds DelayLocked() const;
+
+    /** Record a response time and, every few samples, recompute the delay **/
+    void RecordLocked(int64_t latency_us);
+
+    /** Queue the backup of a request whose delay has passed, if it is still unanswered **/
+    void HedgeLocked(const std::shared_ptr<DFSHedgeCall> &call);
+
+    /** An attempt finished with `code` **/
+    void Finish(DFSHedgeAttempt *attempt, grpc::StatusCode code);
+
+    void RunTimers();
+    void RunBackups();
+};
+
+#endif
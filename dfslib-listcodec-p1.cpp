@@ -0,0 +1,139 @@
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "dfslib-listcodec-p1.h"
+
+namespace
+{
+    void WriteVarint(std::string *out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out->push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out->push_back(static_cast<char>(value));
+    }
+
+    uint64_t ZigZag(int64_t value)
+    {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    int64_t UnZigZag(uint64_t value)
+    {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+}
+
+void dfs_pack_listing(const std::vector<DFSWalkEntry> &entries, std::string *packed)
+{
+    // sort pointers, the entries themselves stay where they are
+    std::vector<const DFSWalkEntry *> sorted;
+    sorted.reserve(entries.size());
+    for (const DFSWalkEntry &entry : entries)
+    {
+        sorted.push_back(&entry);
+    }
+    std::sort(sorted.begin(), sorted.end(), [](const DFSWalkEntry *a, const DFSWalkEntry *b)
+              { return a->path < b->path; });
+
+    packed->clear();
+    packed->push_back(static_cast<char>(DFS_LIST_FORMAT));
+
+    const std::string *previous = nullptr;
+    int64_t previous_mtime = 0;
+    for (const DFSWalkEntry *entry : sorted)
+    {
+        size_t shared = 0;
+        if (previous != nullptr)
+        {
+            const size_t limit = std::min(previous->size(), entry->path.size());
+            while (shared < limit && (*previous)[shared] == entry->path[shared])
+            {
+                shared++;
+            }
+        }
+        WriteVarint(packed, shared);
+        WriteVarint(packed, entry->path.size() - shared);
+        packed->append(entry->path, shared, std::string::npos);
+        WriteVarint(packed, ZigZag(entry->modified_time - previous_mtime));
+        WriteVarint(packed, static_cast<uint64_t>(entry->size));
+
+        previous = &entry->path;
+        previous_mtime = entry->modified_time;
+    }
+}
+
+DFSListDecoder::DFSListDecoder(const std::string &packed)
+    : cursor(packed.data()), end(packed.data() + packed.size()), failed(false), modified_time(0), size(0)
+{
+    if (cursor == end || *cursor != static_cast<char>(DFS_LIST_FORMAT))
+    {
+        failed = true;
+        return;
+    }
+    cursor++;
+}
+
+bool DFSListDecoder::Next()
+{
+    if (failed || cursor == end)
+    {
+        return false;
+    }
+    uint64_t shared, suffix, mtime_delta, file_size;
+    if (!ReadVarint(&shared) || !ReadVarint(&suffix) || shared > path.size() ||
+        suffix > static_cast<uint64_t>(end - cursor))
+    {
+        failed = true;
+        return false;
+    }
+    path.resize(shared);
+    path.append(cursor, suffix);
+    cursor += suffix;
+    if (!ReadVarint(&mtime_delta) || !ReadVarint(&file_size))
+    {
+        failed = true;
+        return false;
+    }
+    modified_time += UnZigZag(mtime_delta);
+    size = static_cast<int64_t>(file_size);
+    return true;
+}
+
+bool DFSListDecoder::ReadVarint(uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64 && cursor != end; shift += 7)
+    {
+        const uint8_t byte = static_cast<uint8_t>(*cursor++);
+        *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool DFSListDecoder::Failed() const
+{
+    return failed;
+}
+
+const std::string &DFSListDecoder::Path() const
+{
+    return path;
+}
+
+int64_t DFSListDecoder::ModifiedTime() const
+{
+    return modified_time;
+}
+
+int64_t DFSListDecoder::Size() const
+{
+    return size;
+}
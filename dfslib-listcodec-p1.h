@@ -0,0 +1,75 @@
+#ifndef _DFSLIB_LISTCODEC_H
+#define _DFSLIB_LISTCODEC_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "dfslib-walker-p1.h"
+
+/** Version byte that starts every packed listing **/
+#define DFS_LIST_FORMAT 1
+
+/**
+ * Packs a listing into LSResponse.packed.
+ *
+ * The entries are sorted by path and each one is written as
+ *
+ *   varint  length of the prefix shared with the previous path
+ *   varint  length of the rest of the path
+ *   bytes   the rest of the path
+ *   varint  mtime minus the previous entry's mtime, zigzag-encoded
+ *   varint  size
+ *
+ * after a single DFS_LIST_FORMAT byte. Sorted paths below a common
+ * directory share most of their bytes, and files written together have
+ * close mtimes, so a deep tree packs to a fraction of the repeated
+ * FileInfo messages.
+ *
+ * @param entries - in any order
+ * @param packed - replaced with the encoding
+ */
+void dfs_pack_listing(const std::vector<DFSWalkEntry> &entries, std::string *packed);
+
+/**
+ * Reads a packed listing one entry at a time.
+ *
+ * The path is rebuilt in a buffer the decoder owns and reuses, so walking
+ * a listing allocates nothing per entry; copy Path() to keep it.
+ */
+class DFSListDecoder
+{
+
+public:
+    /**
+     * @param packed - must outlive the decoder
+     */
+    explicit DFSListDecoder(const std::string &packed);
+
+    /**
+     * Move to the next entry.
+     *
+     * @return false at the end of the listing or if it is malformed
+     */
+    bool Next();
+
+    /** Whether Next() stopped because the listing is malformed **/
+    bool Failed() const;
+
+    const std::string &Path() const;
+    int64_t ModifiedTime() const;
+    int64_t Size() const;
+
+private:
+    const char *cursor;
+    const char *end;
+    bool failed;
+
+    std::string path;
+    int64_t modified_time;
+    int64_t size;
+
+    bool ReadVarint(uint64_t *value);
+};
+
+#endif
@@ -0,0 +1,985 @@
+#include <set>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "src/dfs-utils.h"
+#include "dfslib-metaindex-p1.h"
+
+namespace
+{
+    const uint64_t P1 = 11400714785074694791ULL;
+    const uint64_t P2 = 14029467366897019727ULL;
+    const uint64_t P3 = 1609587929392839161ULL;
+    const uint64_t P4 = 9650029242287828579ULL;
+    const uint64_t P5 = 2870177450012600261ULL;
+
+    uint64_t Rotl(uint64_t value, int bits)
+    {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    uint64_t Read64(const uint8_t *p)
+    {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    uint32_t Read32(const uint8_t *p)
+    {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    uint64_t Round(uint64_t acc, uint64_t input)
+    {
+        acc += input * P2;
+        return Rotl(acc, 31) * P1;
+    }
+
+    uint64_t Merge(uint64_t acc, uint64_t lane)
+    {
+        acc ^= Round(0, lane);
+        return acc * P1 + P4;
+    }
+
+    /** Incremental content hash; see dfs_content_hash() **/
+    class Hasher
+    {
+
+    public:
+        Hasher() : lanes{P1 + P2, P2, 0, 0 - P1}, tail_length(0), total(0) {}
+
+        void Update(const void *data, size_t length)
+        {
+            const uint8_t *p = static_cast<const uint8_t *>(data);
+            total += length;
+            if (tail_length > 0)
+            {
+                size_t take = std::min(sizeof(tail) - tail_length, length);
+                memcpy(tail + tail_length, p, take);
+                tail_length += take;
+                p += take;
+                length -= take;
+                if (tail_length < sizeof(tail))
+                {
+                    return;
+                }
+                Stripe(tail);
+                tail_length = 0;
+            }
+            for (; length >= sizeof(tail); p += sizeof(tail), length -= sizeof(tail))
+            {
+                Stripe(p);
+            }
+            memcpy(tail, p, length);
+            tail_length = length;
+        }
+
+        uint64_t Digest() const
+        {
+            uint64_t hash;
+            if (total >= sizeof(tail))
+            {
+                hash = Rotl(lanes[0], 1) + Rotl(lanes[1], 7) + Rotl(lanes[2], 12) + Rotl(lanes[3], 18);
+                for (uint64_t lane : lanes)
+                {
+                    hash = Merge(hash, lane);
+                }
+            }
+            else
+            {
+                hash = P5;
+            }
+            hash += total;
+
+            const uint8_t *p = tail;
+            size_t left = tail_length;
+            for (; left >= 8; p += 8, left -= 8)
+            {
+                hash ^= Round(0, Read64(p));
+                hash = Rotl(hash, 27) * P1 + P4;
+            }
+            if (left >= 4)
+            {
+                hash ^= Read32(p) * P1;
+                hash = Rotl(hash, 23) * P2 + P3;
+                p += 4;
+                left -= 4;
+            }
+            for (; left > 0; p++, left--)
+            {
+                hash ^= *p * P5;
+                hash = Rotl(hash, 11) * P1;
+            }
+
+            hash ^= hash >> 33;
+            hash *= P2;
+            hash ^= hash >> 29;
+            hash *= P3;
+            hash ^= hash >> 32;
+            return hash;
+        }
+
+    private:
+        uint64_t lanes[4];
+        uint8_t tail[32];
+        size_t tail_length;
+        uint64_t total;
+
+        void Stripe(const uint8_t *p)
+        {
+            for (int i = 0; i < 4; i++)
+            {
+                lanes[i] = Round(lanes[i], Read64(p + 8 * i));
+            }
+        }
+    };
+
+    //
+    // Snapshot layout: the header, dir_count SnapshotDir records, file_count
+    // SnapshotFile records, then string_bytes of names. Names are offsets
+    // into the string table; a directory's name is its path relative to the
+    // mount, a file's name is its last component. A directory's files are
+    // the file records [first_file, first_file + file_count).
+    //
+    struct SnapshotHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+
+        /** Wall-clock time the index was copied out, in nanoseconds **/
+        int64_t written_ns;
+
+        /** The mount the snapshot describes **/
+        uint64_t root;
+        uint64_t root_length;
+
+        uint64_t dir_count;
+        uint64_t file_count;
+        uint64_t string_bytes;
+
+        /** Content hash of everything after the header **/
+        uint64_t checksum;
+    };
+
+    struct SnapshotDir
+    {
+        uint64_t name;
+        uint32_t name_length;
+        uint32_t reserved;
+        int64_t mtime_ns;
+        uint64_t first_file;
+        uint64_t file_count;
+    };
+
+    struct SnapshotFile
+    {
+        uint64_t name;
+        uint32_t name_length;
+        uint32_t hashed;
+        int64_t size;
+        int64_t mtime_ns;
+        int64_t ctime_ns;
+        uint64_t hash;
+    };
+
+    static_assert(sizeof(SnapshotHeader) == 72, "snapshot header must not have padding");
+    static_assert(sizeof(SnapshotDir) == 40, "snapshot directory record must not have padding");
+    static_assert(sizeof(SnapshotFile) == 48, "snapshot file record must not have padding");
+
+    int64_t Nanos(const struct timespec &time)
+    {
+        return static_cast<int64_t>(time.tv_sec) * 1000000000LL + time.tv_nsec;
+    }
+
+    int64_t NowNanos()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    std::string Join(const std::string &dir, const std::string &name)
+    {
+        return dir.empty() ? name : dir + "/" + name;
+    }
+
+    std::string ParentOf(const std::string &path)
+    {
+        size_t slash = path.rfind('/');
+        return slash == std::string::npos ? "" : path.substr(0, slash);
+    }
+
+    /** Indexes alive, saved when the process exits (in case it exits with indexes still alive) **/
+    std::mutex live_mutex;
+    std::set<DFSMetadataIndex *> live;
+
+    void SaveAll()
+    {
+        std::lock_guard<std::mutex> lock(live_mutex);
+        for (DFSMetadataIndex *index : live)
+        {
+            index->Save();
+        }
+    }
+}
+
+bool dfs_content_hash(int fd, uint64_t *hash)
+{
+    const size_t block = 1 << 20;
+    std::unique_ptr<char[]> buffer(new char[block]);
+    Hasher hasher;
+    off_t offset = 0;
+    for (;;)
+    {
+        ssize_t n = pread(fd, buffer.get(), block, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            return false;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        hasher.Update(buffer.get(), n);
+        offset += n;
+    }
+    *hash = hasher.Digest();
+    return true;
+}
+
+/**
+ * What a scan compares the disk against
+ */
+class DFSMetadataIndex::Baseline
+{
+
+public:
+    virtual ~Baseline() {}
+
+    /**
+     * If `dir` still has the mtime the baseline recorded, and can be
+     * trusted, give its files and subdirectories.
+     *
+     * @return false if the directory has to be read
+     */
+    virtual bool Unchanged(const std::string &dir, int64_t mtime_ns,
+                           std::vector<std::pair<std::string, FileEntry>> *dir_files,
+                           std::vector<std::string> *subdirs) = 0;
+
+    /**
+     * The baseline's entry for a file, if it has one.
+     */
+    virtual bool Find(const std::string &dir, const std::string &name, FileEntry *entry) = 0;
+};
+
+/**
+ * A snapshot file, mapped read-only
+ */
+class DFSMetadataIndex::SnapshotBaseline : public DFSMetadataIndex::Baseline
+{
+
+public:
+    SnapshotBaseline(const std::string &path, const std::string &root)
+        : base(nullptr), length(0), header(nullptr), dirs(nullptr), files(nullptr), strings(nullptr)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            problem = strerror(errno);
+            return;
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0 || file_stat.st_size < static_cast<off_t>(sizeof(SnapshotHeader)))
+        {
+            problem = "truncated";
+            close(fd);
+            return;
+        }
+        length = file_stat.st_size;
+        void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            problem = strerror(errno);
+            length = 0;
+            return;
+        }
+        base = static_cast<const char *>(mapped);
+        madvise(mapped, length, MADV_SEQUENTIAL);
+        Validate(root);
+    }
+
+    ~SnapshotBaseline()
+    {
+        if (base != nullptr)
+        {
+            munmap(const_cast<char *>(base), length);
+        }
+    }
+
+    bool Valid() const
+    {
+        return problem.empty();
+    }
+
+    /** Why the snapshot cannot be used **/
+    const std::string &Problem() const
+    {
+        return problem;
+    }
+
+    bool Unchanged(const std::string &dir, int64_t mtime_ns,
+                   std::vector<std::pair<std::string, FileEntry>> *dir_files,
+                   std::vector<std::string> *subdirs) override
+    {
+        auto iter = dir_index.find(dir);
+        if (iter == dir_index.end())
+        {
+            return false;
+        }
+        const SnapshotDir &record = dirs[iter->second];
+        if (record.mtime_ns != mtime_ns || mtime_ns >= header->written_ns - DFS_SNAPSHOT_RACY_NS)
+        {
+            return false;
+        }
+        for (uint64_t i = record.first_file; i < record.first_file + record.file_count; i++)
+        {
+            dir_files->emplace_back(Join(dir, Name(files[i])), Entry(files[i]));
+        }
+        for (size_t child : children[iter->second])
+        {
+            subdirs->push_back(Name(dirs[child]));
+        }
+        return true;
+    }
+
+    bool Find(const std::string &dir, const std::string &name, FileEntry *entry) override
+    {
+        auto iter = dir_index.find(dir);
+        if (iter == dir_index.end())
+        {
+            return false;
+        }
+        // a directory's files are sorted by name
+        const SnapshotDir &record = dirs[iter->second];
+        const SnapshotFile *first = files + record.first_file;
+        const SnapshotFile *last = first + record.file_count;
+        const SnapshotFile *found = std::lower_bound(first, last, name, [this](const SnapshotFile &file, const std::string &key)
+                                                     { return Compare(file, key) < 0; });
+        if (found == last || Compare(*found, name) != 0)
+        {
+            return false;
+        }
+        *entry = Entry(*found);
+        return true;
+    }
+
+private:
+    const char *base;
+    size_t length;
+    std::string problem;
+
+    const SnapshotHeader *header;
+    const SnapshotDir *dirs;
+    const SnapshotFile *files;
+    const char *strings;
+
+    std::unordered_map<std::string, size_t> dir_index;
+    std::vector<std::vector<size_t>> children;
+
+    bool Validate(const std::string &root)
+    {
+        header = reinterpret_cast<const SnapshotHeader *>(base);
+        if (memcmp(header->magic, DFS_SNAPSHOT_MAGIC, sizeof(DFS_SNAPSHOT_MAGIC)) != 0)
+        {
+            problem = "not a metadata snapshot";
+            return false;
+        }
+        if (header->version != DFS_SNAPSHOT_VERSION)
+        {
+            problem = "version " + std::to_string(header->version);
+            return false;
+        }
+        const uint64_t body = length - sizeof(SnapshotHeader);
+        if (header->dir_count > body / sizeof(SnapshotDir) || header->file_count > body / sizeof(SnapshotFile) ||
+            header->dir_count * sizeof(SnapshotDir) + header->file_count * sizeof(SnapshotFile) + header->string_bytes != body)
+        {
+            problem = "truncated";
+            return false;
+        }
+        Hasher hasher;
+        hasher.Update(base + sizeof(SnapshotHeader), body);
+        if (hasher.Digest() != header->checksum)
+        {
+            problem = "checksum mismatch";
+            return false;
+        }
+
+        dirs = reinterpret_cast<const SnapshotDir *>(base + sizeof(SnapshotHeader));
+        files = reinterpret_cast<const SnapshotFile *>(dirs + header->dir_count);
+        strings = reinterpret_cast<const char *>(files + header->file_count);
+        if (header->root > header->string_bytes || header->root_length > header->string_bytes - header->root ||
+            std::string(strings + header->root, header->root_length) != root)
+        {
+            problem = "taken of another mount";
+            return false;
+        }
+        for (uint64_t i = 0; i < header->file_count; i++)
+        {
+            if (!InStrings(files[i].name, files[i].name_length))
+            {
+                problem = "corrupt file record";
+                return false;
+            }
+        }
+        children.resize(header->dir_count);
+        for (uint64_t i = 0; i < header->dir_count; i++)
+        {
+            const SnapshotDir &record = dirs[i];
+            if (!InStrings(record.name, record.name_length) || record.first_file > header->file_count ||
+                record.file_count > header->file_count - record.first_file)
+            {
+                problem = "corrupt directory record";
+                return false;
+            }
+            dir_index.emplace(Name(record), i);
+        }
+        for (uint64_t i = 0; i < header->dir_count; i++)
+        {
+            const std::string name = Name(dirs[i]);
+            if (name.empty())
+            {
+                continue;
+            }
+            auto parent = dir_index.find(ParentOf(name));
+            if (parent != dir_index.end())
+            {
+                children[parent->second].push_back(i);
+            }
+        }
+        return true;
+    }
+
+    bool InStrings(uint64_t offset, uint64_t size) const
+    {
+        return offset <= header->string_bytes && size <= header->string_bytes - offset;
+    }
+
+    template <typename Record>
+    std::string Name(const Record &record) const
+    {
+        return std::string(strings + record.name, record.name_length);
+    }
+
+    int Compare(const SnapshotFile &file, const std::string &key) const
+    {
+        int order = memcmp(strings + file.name, key.data(), std::min<size_t>(file.name_length, key.size()));
+        if (order != 0)
+        {
+            return order;
+        }
+        return file.name_length < key.size() ? -1 : file.name_length > key.size() ? 1
+                                                                                   : 0;
+    }
+
+    static FileEntry Entry(const SnapshotFile &file)
+    {
+        return FileEntry{file.size, file.mtime_ns, file.ctime_ns, file.hash, file.hashed != 0};
+    }
+};
+
+/**
+ * The index's own entries, for a rescan while running; never trusts a directory
+ */
+class DFSMetadataIndex::IndexBaseline : public DFSMetadataIndex::Baseline
+{
+
+public:
+    explicit IndexBaseline(const std::map<std::string, FileEntry> &files) : files(files) {}
+
+    bool Unchanged(const std::string &, int64_t, std::vector<std::pair<std::string, FileEntry>> *,
+                   std::vector<std::string> *) override
+    {
+        return false;
+    }
+
+    bool Find(const std::string &dir, const std::string &name, FileEntry *entry) override
+    {
+        auto iter = files.find(Join(dir, name));
+        if (iter == files.end())
+        {
+            return false;
+        }
+        *entry = iter->second;
+        return true;
+    }
+
+private:
+    std::map<std::string, FileEntry> files;
+};
+
+DFSMetadataIndex::DFSMetadataIndex(const std::string &root, const std::string &snapshot_path, int interval,
+                                   DFSEventHub *events)
+    : root(root), snapshot_path(snapshot_path), interval(std::max(1, interval)), events(events),
+      version(0), saved_version(0), stopping(false)
+{
+    // events published while the index is built are applied afterwards
+    const uint64_t cursor = events->Head();
+    {
+        SnapshotBaseline snapshot(snapshot_path, root);
+        if (!snapshot.Valid())
+        {
+            dfs_log(LL_SYSINFO) << "No usable metadata snapshot at " << snapshot_path << " (" << snapshot.Problem()
+                                << "), scanning the mount";
+        }
+        Scan(snapshot.Valid() ? &snapshot : nullptr);
+    }
+    Save();
+
+    static std::once_flag registered;
+    std::call_once(registered, []()
+                   { std::atexit(SaveAll); });
+    {
+        std::lock_guard<std::mutex> lock(live_mutex);
+        live.insert(this);
+    }
+    follower = std::thread(&DFSMetadataIndex::Follow, this, cursor);
+    saver = std::thread(&DFSMetadataIndex::SaveLoop, this);
+}
+
+DFSMetadataIndex::~DFSMetadataIndex()
+{
+    {
+        std::lock_guard<std::mutex> lock(live_mutex);
+        live.erase(this);
+    }
+    {
+        std::lock_guard<std::mutex> lock(stop_mutex);
+        stopping = true;
+    }
+    stop_cv.notify_all();
+    follower.join();
+    saver.join();
+    Save();
+}
+
+void DFSMetadataIndex::Scan(Baseline *baseline)
+{
+    const auto started = std::chrono::steady_clock::now();
+    std::map<std::string, FileEntry> found;
+    std::map<std::string, int64_t> found_dirs;
+    int64_t trusted = 0, read = 0, stated = 0;
+
+    std::vector<std::string> pending{""};
+    std::vector<std::pair<std::string, FileEntry>> dir_files;
+    std::vector<std::string> subdirs;
+    while (!pending.empty())
+    {
+        const std::string dir = pending.back();
+        pending.pop_back();
+        const std::string path = root + dir;
+
+        struct stat dir_stat;
+        if (stat(path.c_str(), &dir_stat) != 0 || !S_ISDIR(dir_stat.st_mode))
+        {
+            continue;
+        }
+        const int64_t mtime_ns = Nanos(dir_stat.st_mtim);
+        found_dirs[dir] = mtime_ns;
+
+        dir_files.clear();
+        subdirs.clear();
+        if (baseline != nullptr && baseline->Unchanged(dir, mtime_ns, &dir_files, &subdirs))
+        {
+            for (auto &file : dir_files)
+            {
+                found.emplace(std::move(file.first), file.second);
+            }
+            pending.insert(pending.end(), subdirs.begin(), subdirs.end());
+            trusted++;
+            continue;
+        }
+
+        DIR *handle = opendir(path.c_str());
+        if (handle == nullptr)
+        {
+            dfs_log(LL_ERROR) << "Failed to open directory " << path << ": " << strerror(errno);
+            continue;
+        }
+        read++;
+        const int fd = dirfd(handle);
+        struct dirent *entry;
+        while ((entry = readdir(handle)) != nullptr)
+        {
+            const std::string name = entry->d_name;
+            if (name == "." || name == "..")
+            {
+                continue;
+            }
+            if (entry->d_type == DT_DIR)
+            {
+                pending.push_back(Join(dir, name));
+                continue;
+            }
+            if (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)
+            {
+                continue;
+            }
+            struct stat file_stat;
+            if (fstatat(fd, entry->d_name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+                continue;
+            }
+            stated++;
+            if (S_ISDIR(file_stat.st_mode))
+            {
+                pending.push_back(Join(dir, name));
+                continue;
+            }
+            if (!S_ISREG(file_stat.st_mode))
+            {
+                continue;
+            }
+            FileEntry current{file_stat.st_size, Nanos(file_stat.st_mtim), Nanos(file_stat.st_ctim), 0, false};
+            FileEntry previous;
+            if (baseline != nullptr && baseline->Find(dir, name, &previous) && previous.hashed &&
+                previous.size == current.size && previous.mtime_ns == current.mtime_ns &&
+                previous.ctime_ns == current.ctime_ns)
+            {
+                current.hash = previous.hash;
+                current.hashed = true;
+            }
+            found[Join(dir, name)] = current;
+        }
+        closedir(handle);
+    }
+
+    const size_t count = found.size();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        files.swap(found);
+        dirs.swap(found_dirs);
+        version++;
+    }
+    dfs_log(LL_SYSINFO) << "Indexed " << count << " files: " << trusted << " directories unchanged, "
+                        << read << " read, " << stated << " entries stat'ed in "
+                        << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count()
+                        << " ms";
+}
+
+void DFSMetadataIndex::Refresh(const std::string &path, bool touch)
+{
+    if (touch)
+    {
+        // an overwrite in place leaves the directory's mtime alone
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = 0;
+        times[1].tv_nsec = UTIME_NOW;
+        utimensat(AT_FDCWD, (root + ParentOf(path)).c_str(), times, 0);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    RefreshLocked(path);
+}
+
+void DFSMetadataIndex::RefreshLocked(const std::string &path)
+{
+    struct stat file_stat;
+    if (lstat((root + path).c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode))
+    {
+        FileEntry current{file_stat.st_size, Nanos(file_stat.st_mtim), Nanos(file_stat.st_ctim), 0, false};
+        auto iter = files.find(path);
+        if (iter == files.end())
+        {
+            files.emplace(path, current);
+        }
+        else if (iter->second.size != current.size || iter->second.mtime_ns != current.mtime_ns ||
+                 iter->second.ctime_ns != current.ctime_ns)
+        {
+            iter->second = current;
+        }
+    }
+    else
+    {
+        files.erase(path);
+    }
+
+    // the directories above it may have been created or pruned
+    std::string dir = path;
+    do
+    {
+        dir = ParentOf(dir);
+        struct stat dir_stat;
+        if (stat((root + dir).c_str(), &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode))
+        {
+            dirs[dir] = Nanos(dir_stat.st_mtim);
+        }
+        else
+        {
+            dirs.erase(dir);
+        }
+    } while (!dir.empty());
+    version++;
+}
+
+void DFSMetadataIndex::List(std::vector<DFSWalkEntry> *entries)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries->reserve(entries->size() + files.size());
+    for (const auto &file : files)
+    {
+        entries->push_back(DFSWalkEntry{file.first, file.second.size, file.second.mtime_ns / 1000000000LL});
+    }
+}
+
+bool DFSMetadataIndex::Hash(const std::string &path, const struct stat &file_stat, uint64_t *hash)
+{
+    auto matches = [&file_stat](const FileEntry &entry)
+    {
+        return entry.size == file_stat.st_size && entry.mtime_ns == Nanos(file_stat.st_mtim) &&
+               entry.ctime_ns == Nanos(file_stat.st_ctim);
+    };
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = files.find(path);
+        if (iter != files.end() && iter->second.hashed && matches(iter->second))
+        {
+            *hash = iter->second.hash;
+            return true;
+        }
+    }
+
+    int fd = open((root + path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat after;
+    bool hashed = dfs_content_hash(fd, hash) && fstat(fd, &after) == 0;
+    close(fd);
+    if (!hashed)
+    {
+        return false;
+    }
+
+    // keep it only if the file did not change while it was read
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = files.find(path);
+    if (iter != files.end() && matches(iter->second) && Nanos(after.st_ctim) == iter->second.ctime_ns)
+    {
+        iter->second.hash = *hash;
+        iter->second.hashed = true;
+        version++;
+    }
+    return true;
+}
+
+bool DFSMetadataIndex::Lookup(const std::string &path, Info *info)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = files.find(path);
+    if (iter == files.end() || !iter->second.hashed)
+    {
+        return false;
+    }
+    info->size = iter->second.size;
+    info->modified_time = iter->second.mtime_ns / 1000000000;
+    info->creation_time = iter->second.ctime_ns / 1000000000;
+    info->hash = iter->second.hash;
+    return true;
+}
+
+bool DFSMetadataIndex::Save()
+{
+    std::lock_guard<std::mutex> save_lock(save_mutex);
+
+    struct Group
+    {
+        int64_t mtime_ns = 0;
+        std::vector<const std::pair<const std::string, FileEntry> *> files;
+    };
+    std::string image;
+    uint64_t image_version;
+    {
+        // copied out under the lock, which holds up handlers for the length of one pass over the index
+        std::lock_guard<std::mutex> lock(mutex);
+        if (version == saved_version)
+        {
+            return true;
+        }
+        image_version = version;
+
+        // a directory's files are contiguous and, being in path order, sorted by name
+        std::map<std::string, Group> groups;
+        for (const auto &dir : dirs)
+        {
+            groups[dir.first].mtime_ns = dir.second;
+        }
+        for (const auto &file : files)
+        {
+            groups[ParentOf(file.first)].files.push_back(&file);
+        }
+
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, DFS_SNAPSHOT_MAGIC, sizeof(DFS_SNAPSHOT_MAGIC));
+        header.version = DFS_SNAPSHOT_VERSION;
+        header.written_ns = NowNanos();
+        header.dir_count = groups.size();
+        header.file_count = files.size();
+
+        std::string strings = root;
+        header.root = 0;
+        header.root_length = root.size();
+        std::vector<SnapshotDir> dir_records;
+        std::vector<SnapshotFile> file_records;
+        dir_records.reserve(groups.size());
+        file_records.reserve(files.size());
+        for (const auto &group : groups)
+        {
+            SnapshotDir record;
+            memset(&record, 0, sizeof(record));
+            record.name = strings.size();
+            record.name_length = group.first.size();
+            record.mtime_ns = group.second.mtime_ns;
+            record.first_file = file_records.size();
+            record.file_count = group.second.files.size();
+            strings += group.first;
+            dir_records.push_back(record);
+
+            const size_t skip = group.first.empty() ? 0 : group.first.size() + 1;
+            for (const auto *file : group.second.files)
+            {
+                SnapshotFile file_record;
+                memset(&file_record, 0, sizeof(file_record));
+                file_record.name = strings.size();
+                file_record.name_length = file->first.size() - skip;
+                file_record.hashed = file->second.hashed ? 1 : 0;
+                file_record.size = file->second.size;
+                file_record.mtime_ns = file->second.mtime_ns;
+                file_record.ctime_ns = file->second.ctime_ns;
+                file_record.hash = file->second.hash;
+                strings.append(file->first, skip, std::string::npos);
+                file_records.push_back(file_record);
+            }
+        }
+        header.string_bytes = strings.size();
+
+        image.reserve(sizeof(header) + dir_records.size() * sizeof(SnapshotDir) +
+                      file_records.size() * sizeof(SnapshotFile) + strings.size());
+        image.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        image.append(reinterpret_cast<const char *>(dir_records.data()), dir_records.size() * sizeof(SnapshotDir));
+        image.append(reinterpret_cast<const char *>(file_records.data()), file_records.size() * sizeof(SnapshotFile));
+        image.append(strings);
+    }
+    Hasher hasher;
+    hasher.Update(image.data() + sizeof(SnapshotHeader), image.size() - sizeof(SnapshotHeader));
+    const uint64_t checksum = hasher.Digest();
+    memcpy(&image[offsetof(SnapshotHeader, checksum)], &checksum, sizeof(checksum));
+
+    // written aside, synced and renamed, so a crash leaves the old snapshot or the new one
+    const std::string temporary = snapshot_path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool written = fd >= 0;
+    for (size_t offset = 0; written && offset < image.size();)
+    {
+        ssize_t n = write(fd, image.data() + offset, image.size() - offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        written = n > 0;
+        offset += written ? n : 0;
+    }
+    written = written && fsync(fd) == 0;
+    if (fd >= 0)
+    {
+        written = close(fd) == 0 && written;
+    }
+    if (!written || rename(temporary.c_str(), snapshot_path.c_str()) != 0)
+    {
+        dfs_log(LL_ERROR) << "Failed to write metadata snapshot " << snapshot_path << ": " << strerror(errno);
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    saved_version = image_version;
+    dfs_log(LL_DEBUG) << "Wrote metadata snapshot of " << image.size() << " bytes";
+    return true;
+}
+
+void DFSMetadataIndex::Follow(uint64_t cursor)
+{
+    std::vector<DFSEvent> batch;
+    bool resync;
+    while (!stopping)
+    {
+        if (!events->Wait(&cursor, &batch, &resync, std::chrono::milliseconds(500)))
+        {
+            continue;
+        }
+        bool rescan = resync;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const DFSEvent &event : batch)
+            {
+                if (event.kind == DFSEvent::RESYNC)
+                {
+                    rescan = true;
+                }
+                else
+                {
+                    RefreshLocked(event.path);
+                }
+            }
+        }
+        if (rescan)
+        {
+            // a directory moved or inotify overflowed: read everything, keeping the hashes still valid
+            std::unique_ptr<IndexBaseline> baseline;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                baseline.reset(new IndexBaseline(files));
+            }
+            Scan(baseline.get());
+        }
+    }
+}
+
+void DFSMetadataIndex::SaveLoop()
+{
+    std::unique_lock<std::mutex> lock(stop_mutex);
+    while (!stop_cv.wait_for(lock, std::chrono::seconds(interval), [this]()
+                             { return stopping.load(); }))
+    {
+        lock.unlock();
+        Save();
+        lock.lock();
+    }
+}
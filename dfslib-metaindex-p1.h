@@ -0,0 +1,193 @@
+#ifndef _DFSLIB_METAINDEX_H
+#define _DFSLIB_METAINDEX_H
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <condition_variable>
+#include <sys/stat.h>
+
+#include "dfslib-events-p1.h"
+#include "dfslib-walker-p1.h"
+
+/** First bytes of a metadata snapshot **/
+#define DFS_SNAPSHOT_MAGIC "DFSMETA"
+
+/** Bumped whenever the record layout changes; other versions are rebuilt from disk **/
+#define DFS_SNAPSHOT_VERSION 1
+
+/** Directories modified this close to the snapshot are rescanned, in nanoseconds **/
+#define DFS_SNAPSHOT_RACY_NS 2000000000LL
+
+/**
+ * 64-bit hash of a file's contents.
+ *
+ * Four independent multiply-rotate lanes consume 32-byte stripes (the
+ * structure of XXH64), so the hash runs at memory speed rather than a
+ * byte at a time.
+ *
+ * @param fd - read from offset 0 with pread
+ * @param hash - set on success
+ * @return false on a read error
+ */
+bool dfs_content_hash(int fd, uint64_t *hash);
+
+/**
+ * Metadata of every file below the mount, kept in memory and persisted.
+ *
+ * The index holds each file's size, mtime, ctime and content hash, and the
+ * mtime of every directory. It serves recursive listings without walking
+ * the tree, and content hashes without rereading unchanged files. Handlers
+ * report their own stores and deletes through Refresh(); changes made
+ * behind the server's back arrive from the event hub.
+ *
+ * Every `interval` seconds, if anything changed, the index is written to a
+ * snapshot file: a fixed header, fixed-size directory and file records and
+ * a string table, checksummed, in native byte order, so loading it is one
+ * mmap and no parsing. Files are grouped by directory and sorted by name
+ * within it.
+ *
+ * On startup the snapshot is mapped and reconciled with the disk. A
+ * directory whose mtime still matches its record is trusted: its files
+ * are taken from the snapshot without a stat, and only its subdirectories
+ * are visited. Any other directory is read again, and its files are
+ * stat'ed; a file whose size, mtime and ctime match its record keeps its
+ * hash. Adding, removing or renaming an entry changes its directory's
+ * mtime; rewriting a file in place does not, so the store handler touches
+ * the directory as well. Files rewritten in place by another program
+ * while the server is down are not noticed until they change again.
+ * Directories modified within DFS_SNAPSHOT_RACY_NS of the snapshot are
+ * never trusted, since a later change may have kept the same timestamp.
+ */
+class DFSMetadataIndex
+{
+
+public:
+    /**
+     * Metadata of an indexed file
+     */
+    struct Info
+    {
+        int64_t size;
+        int64_t modified_time;
+        int64_t creation_time;
+        uint64_t hash;
+    };
+
+    /**
+     * Load the snapshot, reconcile it with the disk and start following
+     * `events`. Without a usable snapshot the whole tree is scanned.
+     *
+     * @param root - the mount path, with a trailing '/'
+     * @param snapshot_path - should be outside the mount
+     * @param interval - seconds between snapshots
+     * @param events - changes made outside the handlers
+     */
+    DFSMetadataIndex(const std::string &root, const std::string &snapshot_path, int interval, DFSEventHub *events);
+    ~DFSMetadataIndex();
+
+    DFSMetadataIndex(const DFSMetadataIndex &) = delete;
+    DFSMetadataIndex &operator=(const DFSMetadataIndex &) = delete;
+
+    /**
+     * Bring one file's entry up to date with the disk, after a store or
+     * a delete, along with the directories above it.
+     *
+     * @param path - relative to the mount
+     * @param touch - mark its directory modified (the file was written in place)
+     */
+    void Refresh(const std::string &path, bool touch = false);
+
+    /**
+     * Every file, sorted by path.
+     *
+     * @param entries - appended to
+     */
+    void List(std::vector<DFSWalkEntry> *entries);
+
+    /**
+     * The content hash of a file, reused while its size, mtime and ctime
+     * are unchanged and computed otherwise.
+     *
+     * @param path - relative to the mount
+     * @param file_stat - the file's current stat
+     * @param hash - set on success
+     * @return false if the file could not be read
+     */
+    bool Hash(const std::string &path, const struct stat &file_stat, uint64_t *hash);
+
+    /**
+     * A file's metadata and content hash from memory, without touching the
+     * disk. Changes made behind the server's back show up once the event
+     * hub reports them.
+     *
+     * @param path - relative to the mount
+     * @param info - set when found
+     * @return false if the file is not indexed or its hash was never computed
+     */
+    bool Lookup(const std::string &path, Info *info);
+
+    /**
+     * Write the snapshot now, if anything changed since the last one.
+     *
+     * @return false if it could not be written
+     */
+    bool Save();
+
+private:
+    struct FileEntry
+    {
+        int64_t size;
+        int64_t mtime_ns;
+        int64_t ctime_ns;
+        uint64_t hash;
+        bool hashed;
+    };
+
+    class Baseline;
+    class SnapshotBaseline;
+    class IndexBaseline;
+
+    std::string root;
+    std::string snapshot_path;
+    int interval;
+    DFSEventHub *events;
+
+    std::mutex mutex;
+    std::map<std::string, FileEntry> files;
+
+    /** Directory mtimes in nanoseconds, by path relative to the mount ("" is the root) **/
+    std::map<std::string, int64_t> dirs;
+
+    /** Bumped by every change; the snapshot is written when it moved **/
+    uint64_t version;
+    uint64_t saved_version;
+
+    /** Serialises Save() **/
+    std::mutex save_mutex;
+
+    std::atomic<bool> stopping;
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+    std::thread follower;
+    std::thread saver;
+
+    /**
+     * Rebuild the index from the disk, reusing what `baseline` still vouches for.
+     */
+    void Scan(Baseline *baseline);
+
+    /** Apply hub events from `cursor` on until stopped **/
+    void Follow(uint64_t cursor);
+
+    /** Save every `interval` seconds until stopped **/
+    void SaveLoop();
+
+    void RefreshLocked(const std::string &path);
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include <string>
+#include <cstring>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "src/dfs-utils.h"
+#include "dfslib-notify-p1.h"
+
+/** Directory events needed to follow the tree itself **/
+#define DFS_TREE_MASK (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_ONLYDIR)
+
+DFSTreeNotifier::DFSTreeNotifier(const std::string &root, uint32_t file_mask)
+    : root(root), file_mask(file_mask)
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0)
+    {
+        dfs_log(LL_ERROR) << "Failed to initialize inotify: " << strerror(errno);
+        return;
+    }
+    AddWatches("", nullptr);
+}
+
+DFSTreeNotifier::~DFSTreeNotifier()
+{
+    if (inotify_fd >= 0)
+    {
+        close(inotify_fd);
+    }
+}
+
+bool DFSTreeNotifier::Ok() const
+{
+    return inotify_fd >= 0;
+}
+
+bool DFSTreeNotifier::Poll(int timeout_ms)
+{
+    struct pollfd descriptor = {inotify_fd, POLLIN, 0};
+    return poll(&descriptor, 1, timeout_ms) > 0;
+}
+
+void DFSTreeNotifier::AddWatches(const std::string &dir, const Handler *handler)
+{
+    const std::string path = root + dir;
+    int wd = inotify_add_watch(inotify_fd, path.c_str(), file_mask | DFS_TREE_MASK);
+    if (wd < 0)
+    {
+        // typically ENOSPC: the tree has more directories than fs.inotify.max_user_watches
+        dfs_log(LL_ERROR) << "Failed to watch " << path << ": " << strerror(errno);
+        return;
+    }
+    watches[wd] = dir;
+
+    DIR *stream = opendir(path.c_str());
+    if (stream == nullptr)
+    {
+        return;
+    }
+    const std::string prefix = dir.empty() ? dir : dir + "/";
+    struct dirent *entry;
+    struct stat file_stat;
+    while ((entry = readdir(stream)) != nullptr)
+    {
+        const std::string name = entry->d_name;
+        if (name == "." || name == "..")
+        {
+            continue;
+        }
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN && fstatat(dirfd(stream), name.c_str(), &file_stat, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+            type = S_ISDIR(file_stat.st_mode) ? DT_DIR : S_ISREG(file_stat.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR)
+        {
+            AddWatches(prefix + name, handler);
+        }
+        else if (type == DT_REG && handler != nullptr)
+        {
+            // files that appeared in a new directory before we watched it
+            (*handler)(prefix + name, IN_MOVED_TO);
+        }
+    }
+    closedir(stream);
+}
+
+void DFSTreeNotifier::Read(const Handler &handler)
+{
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    while (true)
+    {
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if (length <= 0)
+        {
+            return;
+        }
+        for (char *next = buffer; next < buffer + length;)
+        {
+            const struct inotify_event *event = reinterpret_cast<const struct inotify_event *>(next);
+            next += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                dfs_log(LL_ERROR) << "inotify queue overflowed under " << root;
+                handler("", IN_Q_OVERFLOW);
+                continue;
+            }
+            auto found = watches.find(event->wd);
+            if (found == watches.end())
+            {
+                continue;
+            }
+            if (event->mask & IN_IGNORED)
+            {
+                watches.erase(found);
+                continue;
+            }
+            if (event->len == 0)
+            {
+                continue;
+            }
+            const std::string path = found->second.empty() ? std::string(event->name) : found->second + "/" + event->name;
+
+            if (event->mask & IN_ISDIR)
+            {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                {
+                    AddWatches(path, &handler);
+                }
+                else if (event->mask & IN_MOVED_FROM)
+                {
+                    handler(path, IN_MOVED_FROM | IN_ISDIR);
+                }
+            }
+            else if (event->mask & file_mask)
+            {
+                handler(path, event->mask);
+            }
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef _DFSLIB_NOTIFY_H
+#define _DFSLIB_NOTIFY_H
+
+#include <map>
+#include <string>
+#include <cstdint>
+#include <functional>
+
+/**
+ * inotify on a whole directory tree.
+ *
+ * inotify only watches single directories, so every subdirectory gets its
+ * own watch, and directories created or moved into the tree later are
+ * watched as they appear. Files that were already inside such a directory
+ * before its watch existed are reported as if they had just been moved in.
+ *
+ * Changes are reported as (path relative to the root, inotify mask):
+ *  - file events carry the mask inotify reported;
+ *  - a directory moved out of the tree is reported once, as
+ *    IN_MOVED_FROM | IN_ISDIR, since its files get no events of their own;
+ *  - a queue overflow is reported as IN_Q_OVERFLOW with an empty path.
+ * In the last two cases the caller has to rescan to learn what changed.
+ *
+ * Not thread-safe; one thread polls and reads.
+ */
+class DFSTreeNotifier
+{
+
+public:
+    /** Callback for one change **/
+    typedef std::function<void(const std::string &path, uint32_t mask)> Handler;
+
+    /**
+     * @param root - the directory to watch, with a trailing '/'
+     * @param file_mask - the file events of interest, e.g. IN_CLOSE_WRITE | IN_DELETE
+     */
+    DFSTreeNotifier(const std::string &root, uint32_t file_mask);
+    ~DFSTreeNotifier();
+
+    /**
+     * Whether inotify could be set up
+     */
+    bool Ok() const;
+
+    /**
+     * Wait for notifications.
+     *
+     * @param timeout_ms
+     * @return true if there is something to Read()
+     */
+    bool Poll(int timeout_ms);
+
+    /**
+     * Read the queued notifications and report them to `handler`.
+     *
+     * @param handler
+     */
+    void Read(const Handler &handler);
+
+private:
+    std::string root;
+    uint32_t file_mask;
+    int inotify_fd;
+
+    /** Watch descriptor -> directory relative to the root ("" for the root itself) **/
+    std::map<int, std::string> watches;
+
+    /** Watch `dir` and its subdirectories; with a handler, report the files already in them **/
+    void AddWatches(const std::string &dir, const Handler *handler);
+};
+
+#endif
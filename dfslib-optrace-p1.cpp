@@ -0,0 +1,123 @@
+#include <set>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "dfslib-optrace-p1.h"
+
+/** Buffered bytes that trigger a write regardless of time **/
+#define DFS_OPTRACE_BUFFER (64 * 1024)
+
+namespace
+{
+    /** Recorders alive, flushed when the process exits (in case it exits with recorders still alive) **/
+    std::mutex live_mutex;
+    std::set<DFSOpRecorder *> live;
+
+    void FlushAll()
+    {
+        std::lock_guard<std::mutex> lock(live_mutex);
+        for (DFSOpRecorder *recorder : live)
+        {
+            recorder->Flush();
+        }
+    }
+}
+
+bool dfs_read_op_trace(const std::string &path, std::vector<DFSOpRecord> *records)
+{
+    std::ifstream in(path);
+    if (!in.is_open())
+    {
+        return false;
+    }
+    records->clear();
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        std::istringstream fields(line);
+        DFSOpRecord record;
+        if (!(fields >> record.time_us >> record.op >> record.size))
+        {
+            continue;
+        }
+        // the path is the rest of the line
+        fields.get();
+        std::getline(fields, record.path);
+        records->push_back(record);
+    }
+    std::stable_sort(records->begin(), records->end(), [](const DFSOpRecord &a, const DFSOpRecord &b)
+                     { return a.time_us < b.time_us; });
+    return true;
+}
+
+DFSOpRecorder::DFSOpRecorder(const std::string &path)
+    : out(path, std::ios::out | std::ios::app), last_flush(std::chrono::steady_clock::now())
+{
+    out << "# time_us op size path\n";
+    out.flush();
+
+    static std::once_flag registered;
+    std::call_once(registered, []()
+                   { std::atexit(FlushAll); });
+    std::lock_guard<std::mutex> lock(live_mutex);
+    live.insert(this);
+}
+
+DFSOpRecorder::~DFSOpRecorder()
+{
+    {
+        std::lock_guard<std::mutex> lock(live_mutex);
+        live.erase(this);
+    }
+    Flush();
+}
+
+bool DFSOpRecorder::Ok() const
+{
+    return out.good();
+}
+
+void DFSOpRecorder::Record(const char *op, const std::string &path, int64_t size)
+{
+    const int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::system_clock::now().time_since_epoch())
+                            .count();
+    std::lock_guard<std::mutex> lock(mutex);
+    buffer += std::to_string(now);
+    buffer += ' ';
+    buffer += op;
+    buffer += ' ';
+    buffer += std::to_string(size);
+    buffer += ' ';
+    buffer += path;
+    buffer += '\n';
+    if (buffer.size() >= DFS_OPTRACE_BUFFER ||
+        std::chrono::steady_clock::now() - last_flush >= std::chrono::seconds(1))
+    {
+        FlushLocked();
+    }
+}
+
+void DFSOpRecorder::Flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    FlushLocked();
+}
+
+void DFSOpRecorder::FlushLocked()
+{
+    out << buffer;
+    out.flush();
+    buffer.clear();
+    last_flush = std::chrono::steady_clock::now();
+}
@@ -0,0 +1,80 @@
+#ifndef _DFSLIB_OPTRACE_H
+#define _DFSLIB_OPTRACE_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+
+/**
+ * One operation of a workload trace.
+ *
+ * A trace file holds one operation per line,
+ *
+ *   <time in microseconds> <op> <size> <path>
+ *
+ * where op is one of store, fetch, list, stat and delete, and size is the
+ * file's size in bytes (0 where it does not apply). The path comes last so
+ * it may contain spaces. Lines starting with '#' are comments.
+ */
+struct DFSOpRecord
+{
+    int64_t time_us;
+    std::string op;
+    int64_t size;
+    std::string path;
+};
+
+/**
+ * Read a trace file.
+ *
+ * @param path
+ * @param records - filled in, sorted by time
+ * @return false if the file could not be read
+ */
+bool dfs_read_op_trace(const std::string &path, std::vector<DFSOpRecord> *records);
+
+/**
+ * Appends the operations a server receives to a trace file.
+ *
+ * Lines are buffered and written out once a second or 64 KiB of them have
+ * piled up, so recording costs a lock and a formatted append per request.
+ * Whatever is buffered is also written when the recorder is destroyed or
+ * the process calls exit().
+ */
+class DFSOpRecorder
+{
+
+public:
+    /**
+     * @param path - appended to if it exists
+     */
+    explicit DFSOpRecorder(const std::string &path);
+    ~DFSOpRecorder();
+
+    /** Whether the trace file could be opened **/
+    bool Ok() const;
+
+    /**
+     * Record an operation arriving now.
+     *
+     * @param op
+     * @param path
+     * @param size
+     */
+    void Record(const char *op, const std::string &path, int64_t size);
+
+    void Flush();
+
+private:
+    std::mutex mutex;
+    std::ofstream out;
+    std::string buffer;
+    std::chrono::steady_clock::time_point last_flush;
+
+    void FlushLocked();
+};
+
+#endif
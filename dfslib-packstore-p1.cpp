@@ -0,0 +1,549 @@
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <ctime>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "dfslib-shared-p1.h"
+#include "dfslib-packstore-p1.h"
+
+/** Record kinds **/
+#define DFS_PACK_PUT 1
+#define DFS_PACK_TOMBSTONE 2
+
+/** Longest name a record may carry **/
+#define DFS_PACK_MAX_NAME 4096
+
+namespace
+{
+    struct PackRecord
+    {
+        uint32_t magic;
+        uint32_t kind;
+        uint32_t name_length;
+        /** CRC-32 of the record with this field zeroed **/
+        uint32_t crc;
+        int64_t size;
+        int64_t modified_time;
+        int64_t creation_time;
+    };
+
+    static_assert(sizeof(PackRecord) == 40, "pack record header must not have padding");
+
+    uint32_t RecordCrc(PackRecord header, const char *name, const char *data)
+    {
+        header.crc = 0;
+        uLong crc = crc32(0L, Z_NULL, 0);
+        crc = crc32(crc, reinterpret_cast<const Bytef *>(&header), sizeof(header));
+        crc = crc32(crc, reinterpret_cast<const Bytef *>(name), header.name_length);
+        crc = crc32(crc, reinterpret_cast<const Bytef *>(data), header.size);
+        return crc;
+    }
+
+    bool ReadAll(int fd, char *data, size_t length, int64_t offset)
+    {
+        size_t done = 0;
+        while (done < length)
+        {
+            ssize_t bytes = pread(fd, data + done, length - done, offset + done);
+            if (bytes < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes <= 0)
+            {
+                return false;
+            }
+            done += bytes;
+        }
+        return true;
+    }
+
+    /**
+     * Read the record at `offset`, which must end by `limit`. The contents
+     * are read, and the CRC checked, only if `data` is given.
+     */
+    bool ReadRecord(int fd, int64_t offset, int64_t limit, PackRecord *header, std::string *name, std::string *data)
+    {
+        if (offset + static_cast<int64_t>(sizeof(*header)) > limit ||
+            !ReadAll(fd, reinterpret_cast<char *>(header), sizeof(*header), offset) ||
+            header->magic != DFS_PACK_MAGIC || (header->kind != DFS_PACK_PUT && header->kind != DFS_PACK_TOMBSTONE) ||
+            header->name_length == 0 || header->name_length > DFS_PACK_MAX_NAME || header->size < 0 ||
+            offset + static_cast<int64_t>(sizeof(*header) + header->name_length) + header->size > limit)
+        {
+            return false;
+        }
+        name->resize(header->name_length);
+        if (!ReadAll(fd, &(*name)[0], name->size(), offset + sizeof(*header)))
+        {
+            return false;
+        }
+        if (data == nullptr)
+        {
+            return true;
+        }
+        data->resize(header->size);
+        return (header->size == 0 || ReadAll(fd, &(*data)[0], data->size(), offset + sizeof(*header) + name->size())) &&
+               RecordCrc(*header, name->data(), data->data()) == header->crc;
+    }
+
+    /**
+     * Read a record the index points at into `data` with a single pread,
+     * check that it stores `path` intact, and keep only the contents.
+     */
+    bool ReadIndexedRecord(int fd, int64_t offset, int64_t record_length, const std::string &path, std::string *data)
+    {
+        PackRecord header;
+        const int64_t contents_offset = sizeof(header) + path.size();
+        if (record_length < contents_offset)
+        {
+            return false;
+        }
+        data->resize(record_length);
+        if (!ReadAll(fd, &(*data)[0], data->size(), offset))
+        {
+            return false;
+        }
+        memcpy(&header, data->data(), sizeof(header));
+        const char *name = data->data() + sizeof(header);
+        if (header.magic != DFS_PACK_MAGIC || header.kind != DFS_PACK_PUT || header.name_length != path.size() ||
+            contents_offset + header.size != record_length || memcmp(name, path.data(), path.size()) != 0 ||
+            RecordCrc(header, name, name + header.name_length) != header.crc)
+        {
+            return false;
+        }
+        data->erase(0, contents_offset);
+        return true;
+    }
+}
+
+DFSPackStore::Pack::~Pack()
+{
+    close(fd);
+}
+
+DFSPackStore::DFSPackStore(const DFSPackOptions &options)
+    : root(options.pack_path), options(options), active(0), stopping(false)
+{
+    if (root.empty() || root.back() != '/')
+    {
+        root += '/';
+    }
+    if (!dfs_make_parents(root))
+    {
+        dfs_log(LL_ERROR) << "Failed to create the pack directory " << root;
+    }
+
+    std::vector<uint32_t> numbers;
+    DIR *dir = opendir(root.c_str());
+    if (dir != nullptr)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            unsigned number;
+            char tail;
+            if (sscanf(entry->d_name, "pack-%8u%c", &number, &tail) == 1 && PackPath(number) == root + entry->d_name)
+            {
+                numbers.push_back(number);
+            }
+        }
+        closedir(dir);
+    }
+    std::sort(numbers.begin(), numbers.end());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < numbers.size(); i++)
+    {
+        Replay(numbers[i], i + 1 == numbers.size());
+    }
+    if (!numbers.empty())
+    {
+        active = numbers.back();
+    }
+    int64_t bytes = 0;
+    for (const auto &pack : packs)
+    {
+        bytes += pack.second->size;
+    }
+    dfs_log(LL_SYSINFO) << "Packs in " << root << " hold " << files.size() << " files in " << packs.size()
+                        << " packs of " << bytes << " bytes";
+
+    compactor = std::thread(&DFSPackStore::Run, this);
+}
+
+DFSPackStore::~DFSPackStore()
+{
+    {
+        std::lock_guard<std::mutex> lock(stop_mutex);
+        stopping = true;
+    }
+    stop_cv.notify_all();
+    compactor.join();
+}
+
+std::string DFSPackStore::PackPath(uint32_t number) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "pack-%08u", number);
+    return root + name;
+}
+
+void DFSPackStore::Replay(uint32_t number, bool verify)
+{
+    const std::string path = PackPath(number);
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0)
+    {
+        dfs_log(LL_ERROR) << "Failed to open pack " << path << ": " << strerror(errno);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
+    }
+    std::shared_ptr<Pack> pack = std::make_shared<Pack>(fd, file_stat.st_size);
+    packs[number] = pack;
+
+    PackRecord header;
+    std::string name;
+    std::string data;
+    int64_t offset = 0;
+    while (offset < pack->size)
+    {
+        if (!ReadRecord(fd, offset, pack->size, &header, &name, verify ? &data : nullptr))
+        {
+            if (verify)
+            {
+                // a store cut short by a crash; the next record goes in its place
+                dfs_log(LL_ERROR) << "Cutting pack " << path << " at a torn record at " << offset;
+                if (ftruncate(fd, offset) != 0)
+                {
+                    dfs_log(LL_ERROR) << "Failed to cut pack " << path << ": " << strerror(errno);
+                }
+                pack->size = offset;
+            }
+            else
+            {
+                dfs_log(LL_ERROR) << "Corrupt record in pack " << path << " at " << offset << ", skipping the rest";
+            }
+            break;
+        }
+        const int64_t record_length = sizeof(header) + header.name_length + header.size;
+        DropLocked(name);
+        if (header.kind == DFS_PACK_PUT)
+        {
+            files[name] = Entry{number, offset, record_length, header.size, header.modified_time, header.creation_time};
+            pack->live += record_length;
+        }
+        offset += record_length;
+    }
+}
+
+bool DFSPackStore::Accepts(int64_t size) const
+{
+    return size >= 0 && size <= options.small_bytes;
+}
+
+bool DFSPackStore::RotateLocked()
+{
+    auto iter = packs.find(active);
+    if (iter != packs.end() && iter->second->size < DFS_PACK_SIZE)
+    {
+        return true;
+    }
+    const uint32_t number = active + 1;
+    const std::string path = PackPath(number);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        dfs_log(LL_ERROR) << "Failed to create pack " << path << ": " << strerror(errno);
+        return false;
+    }
+    packs[number] = std::make_shared<Pack>(fd, 0);
+    active = number;
+    return true;
+}
+
+bool DFSPackStore::AppendLocked(bool tombstone, const std::string &path, const std::string &data, int64_t modified_time,
+                                int64_t creation_time, Entry *entry)
+{
+    if (path.empty() || path.size() > DFS_PACK_MAX_NAME || !RotateLocked())
+    {
+        return false;
+    }
+    Pack &pack = *packs[active];
+
+    PackRecord header;
+    header.magic = DFS_PACK_MAGIC;
+    header.kind = tombstone ? DFS_PACK_TOMBSTONE : DFS_PACK_PUT;
+    header.name_length = path.size();
+    header.size = data.size();
+    header.modified_time = modified_time;
+    header.creation_time = creation_time;
+    header.crc = RecordCrc(header, path.data(), data.data());
+
+    // one write per record; a failed one is overwritten by the next
+    std::string record;
+    record.reserve(sizeof(header) + path.size() + data.size());
+    record.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    record.append(path);
+    record.append(data);
+    size_t written = 0;
+    while (written < record.size())
+    {
+        ssize_t bytes = pwrite(pack.fd, record.data() + written, record.size() - written, pack.size + written);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes < 0)
+        {
+            dfs_log(LL_ERROR) << "Failed to write pack " << PackPath(active) << ": " << strerror(errno);
+            return false;
+        }
+        written += bytes;
+    }
+    *entry = Entry{active, pack.size, static_cast<int64_t>(record.size()), header.size, modified_time, creation_time};
+    pack.size += record.size();
+    return true;
+}
+
+void DFSPackStore::DropLocked(const std::string &path)
+{
+    auto iter = files.find(path);
+    if (iter == files.end())
+    {
+        return;
+    }
+    auto pack = packs.find(iter->second.pack);
+    if (pack != packs.end())
+    {
+        pack->second->live -= iter->second.record_length;
+    }
+    files.erase(iter);
+}
+
+bool DFSPackStore::Put(const std::string &path, const std::string &data, int64_t modified_time, bool *replaced)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry entry;
+    if (!AppendLocked(false, path, data, modified_time, time(nullptr), &entry))
+    {
+        return false;
+    }
+    if (replaced != nullptr)
+    {
+        *replaced = files.count(path) != 0;
+    }
+    DropLocked(path);
+    files[path] = entry;
+    packs[entry.pack]->live += entry.record_length;
+    return true;
+}
+
+bool DFSPackStore::Get(const std::string &path, Info *info, std::string *data)
+{
+    Entry entry;
+    std::shared_ptr<Pack> pack;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = files.find(path);
+        if (iter == files.end())
+        {
+            return false;
+        }
+        entry = iter->second;
+        // a compaction may remove the pack meanwhile; the open descriptor still reads it
+        pack = packs[entry.pack];
+    }
+    *info = Info{entry.size, entry.modified_time, entry.creation_time};
+    if (data == nullptr)
+    {
+        return true;
+    }
+
+    if (!ReadIndexedRecord(pack->fd, entry.offset, entry.record_length, path, data))
+    {
+        dfs_log(LL_ERROR) << "Corrupt record for " << path << " in pack " << PackPath(entry.pack) << " at " << entry.offset;
+        return false;
+    }
+    return true;
+}
+
+bool DFSPackStore::Remove(const std::string &path, bool *packed)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const bool found = files.count(path) != 0;
+    if (packed)
+    {
+        *packed = found;
+    }
+    if (!found)
+    {
+        return true;
+    }
+    Entry tombstone;
+    if (!AppendLocked(true, path, std::string(), 0, 0, &tombstone))
+    {
+        dfs_log(LL_ERROR) << "Failed to record the delete of " << path;
+        return false;
+    }
+    DropLocked(path);
+    return true;
+}
+
+void DFSPackStore::List(std::vector<DFSWalkEntry> *entries, bool top_only)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &file : files)
+    {
+        if (top_only && file.first.find('/') != std::string::npos)
+        {
+            continue;
+        }
+        entries->push_back(DFSWalkEntry{file.first, file.second.size, file.second.modified_time});
+    }
+}
+
+void DFSPackStore::Compact()
+{
+    std::lock_guard<std::mutex> compact_lock(compact_mutex);
+    std::vector<uint32_t> numbers;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &pack : packs)
+        {
+            if (pack.first != active && pack.second->live < pack.second->size * DFS_PACK_COMPACT_RATIO)
+            {
+                numbers.push_back(pack.first);
+            }
+        }
+    }
+    // oldest first, so tombstones stop being carried once nothing older is left
+    for (uint32_t number : numbers)
+    {
+        if (stopping || !CompactPack(number))
+        {
+            return;
+        }
+    }
+}
+
+bool DFSPackStore::CompactPack(uint32_t number)
+{
+    std::shared_ptr<Pack> pack;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pack = packs[number];
+    }
+    const int64_t dead = pack->size - pack->live;
+
+    PackRecord header;
+    std::string name;
+    std::string data;
+    int64_t offset = 0;
+    while (offset < pack->size)
+    {
+        if (!ReadRecord(pack->fd, offset, pack->size, &header, &name, nullptr))
+        {
+            // nothing past a corrupt record was replayed, so nothing past it is live
+            break;
+        }
+        const int64_t record_length = sizeof(header) + header.name_length + header.size;
+
+        // one record at a time, so requests are not held up for the whole pack
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = files.find(name);
+        const bool live = header.kind == DFS_PACK_PUT && iter != files.end() && iter->second.pack == number &&
+                          iter->second.offset == offset;
+        // a tombstone still hides older records of its name while older packs remain
+        const bool hiding = header.kind == DFS_PACK_TOMBSTONE && iter == files.end() && packs.begin()->first < number;
+        Entry entry;
+        if (live)
+        {
+            if (!ReadRecord(pack->fd, offset, pack->size, &header, &name, &data) ||
+                !AppendLocked(false, name, data, header.modified_time, header.creation_time, &entry))
+            {
+                dfs_log(LL_ERROR) << "Failed to compact pack " << PackPath(number);
+                return false;
+            }
+            pack->live -= record_length;
+            iter->second = entry;
+            packs[entry.pack]->live += entry.record_length;
+        }
+        else if (hiding && !AppendLocked(true, name, std::string(), 0, 0, &entry))
+        {
+            dfs_log(LL_ERROR) << "Failed to compact pack " << PackPath(number);
+            return false;
+        }
+        offset += record_length;
+    }
+
+    // the copies must be on disk before the originals go
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fdatasync(packs[active]->fd) != 0)
+    {
+        dfs_log(LL_ERROR) << "Failed to sync pack " << PackPath(active) << ": " << strerror(errno);
+        return false;
+    }
+    packs.erase(number);
+    if (unlink(PackPath(number).c_str()) != 0)
+    {
+        dfs_log(LL_ERROR) << "Failed to remove pack " << PackPath(number) << ": " << strerror(errno);
+    }
+    dfs_log(LL_SYSINFO) << "Compacted pack " << PackPath(number) << ", reclaimed " << dead << " bytes";
+    return true;
+}
+
+void DFSPackStore::Run()
+{
+    std::unique_lock<std::mutex> lock(stop_mutex);
+    while (!stop_cv.wait_for(lock, std::chrono::seconds(DFS_PACK_COMPACT_INTERVAL_S), [this]()
+                             { return stopping.load(); }))
+    {
+        lock.unlock();
+        Compact();
+        lock.lock();
+    }
+}
+
+DFSPackReader::DFSPackReader(std::string data, int64_t offset, int64_t length)
+    : data(std::move(data)), offset(std::min<int64_t>(std::max<int64_t>(offset, 0), this->data.size())), sent(false)
+{
+    if (length >= 0 && this->offset + length < static_cast<int64_t>(this->data.size()))
+    {
+        this->data.resize(this->offset + length);
+    }
+}
+
+bool DFSPackReader::Next(dfs_service::FileChunk *chunk)
+{
+    if (sent || offset >= static_cast<int64_t>(data.size()))
+    {
+        return false;
+    }
+    sent = true;
+    chunk->mutable_content()->assign(data, offset, std::string::npos);
+    chunk->set_chunk_num(0);
+    chunk->set_offset(offset);
+    chunk->set_hole_length(0);
+    chunk->set_raw_length(0);
+    return true;
+}
+
+bool DFSPackReader::Failed() const
+{
+    return false;
+}
@@ -0,0 +1,234 @@
+#ifndef _DFSLIB_PACKSTORE_H
+#define _DFSLIB_PACKSTORE_H
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "dfslib-walker-p1.h"
+#include "proto-src/dfs-service.pb.h"
+
+/** First bytes of every record in a pack **/
+#define DFS_PACK_MAGIC 0x4b505344
+
+/** A pack stops taking records past this many bytes **/
+#define DFS_PACK_SIZE (256LL * 1024 * 1024)
+
+/** Seconds between compaction passes **/
+#define DFS_PACK_COMPACT_INTERVAL_S 30
+
+/** A sealed pack is compacted once less than this share of it is live **/
+#define DFS_PACK_COMPACT_RATIO 0.5
+
+/**
+ * Settings of the small-file store
+ */
+struct DFSPackOptions
+{
+    /** Directory the packs are kept in, outside the mount (empty = no packing) **/
+    std::string pack_path;
+
+    /** Files of at most this many bytes are packed **/
+    int64_t small_bytes = 64 * 1024;
+};
+
+/**
+ * Keeps small files as records appended to a few large pack files.
+ *
+ * A stored file costs one pwrite into the open pack instead of a create,
+ * writes, a close and an utimes on its own inode, and a fetch or a stat
+ * is a lookup in memory and at most one pread. Every record holds a
+ * header (magic, kind, lengths, mtime, ctime and a CRC-32), the file's
+ * name and its contents; a delete appends a tombstone record. The packs
+ * are the log the index is rebuilt from on startup: they are replayed in
+ * order and the last record for a name wins. Only the newest pack is
+ * checked against its CRCs, since a crash can only tear its tail, which is
+ * cut off.
+ *
+ * Once the open pack reaches DFS_PACK_SIZE it is sealed and a new one is
+ * started. Every DFS_PACK_COMPACT_INTERVAL_S seconds the oldest sealed
+ * packs that are mostly dead (overwritten or deleted records) are
+ * compacted: their live records are appended to the open pack and the
+ * pack is removed. A tombstone is carried along while an older pack that
+ * may hold the name remains.
+ *
+ * A name lives in the packs or in the mount, not both: the server removes
+ * the other copy when it stores a file.
+ */
+class DFSPackStore
+{
+
+public:
+    /**
+     * Metadata of a packed file
+     */
+    struct Info
+    {
+        int64_t size;
+        int64_t modified_time;
+        int64_t creation_time;
+    };
+
+    /**
+     * Replay the packs and start the compactor.
+     *
+     * @param options
+     */
+    explicit DFSPackStore(const DFSPackOptions &options);
+    ~DFSPackStore();
+
+    DFSPackStore(const DFSPackStore &) = delete;
+    DFSPackStore &operator=(const DFSPackStore &) = delete;
+
+    /** Whether a file of `size` bytes belongs in the packs **/
+    bool Accepts(int64_t size) const;
+
+    /**
+     * Store a file, replacing any packed copy.
+     *
+     * @param path - relative to the mount
+     * @param data - its contents
+     * @param modified_time
+     * @param replaced - set to whether the file was packed already, unless null
+     * @return false on a write error
+     */
+    bool Put(const std::string &path, const std::string &data, int64_t modified_time, bool *replaced = nullptr);
+
+    /**
+     * Look up a file and, optionally, read it.
+     *
+     * @param path - relative to the mount
+     * @param info - set when found
+     * @param data - set to the contents when found, unless null
+     * @return false if the file is not packed or could not be read
+     */
+    bool Get(const std::string &path, Info *info, std::string *data = nullptr);
+
+    /**
+     * Delete a packed file. If its tombstone cannot be appended, the file
+     * stays packed, since it would come back on the next replay.
+     *
+     * @param path - relative to the mount
+     * @param packed - set to whether the file was packed, unless null
+     * @return false if the file was packed and is still packed
+     */
+    bool Remove(const std::string &path, bool *packed = nullptr);
+
+    /**
+     * The packed files.
+     *
+     * @param entries - appended to
+     * @param top_only - only files directly in the root
+     */
+    void List(std::vector<DFSWalkEntry> *entries, bool top_only);
+
+    /**
+     * Compact every sealed pack that is mostly dead, now.
+     */
+    void Compact();
+
+private:
+    struct Pack
+    {
+        int fd;
+        /** Bytes of records **/
+        int64_t size;
+        /** Bytes of records still in the index **/
+        int64_t live;
+
+        Pack(int fd, int64_t size) : fd(fd), size(size), live(0) {}
+        ~Pack();
+    };
+
+    struct Entry
+    {
+        uint32_t pack;
+        /** Where the record starts in the pack, and its total length **/
+        int64_t offset;
+        int64_t record_length;
+        int64_t size;
+        int64_t modified_time;
+        int64_t creation_time;
+    };
+
+    std::string root;
+    DFSPackOptions options;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> files;
+    std::map<uint32_t, std::shared_ptr<Pack>> packs;
+
+    /** The pack records are appended to **/
+    uint32_t active;
+
+    std::atomic<bool> stopping;
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+    std::thread compactor;
+
+    /** Serialises Compact() **/
+    std::mutex compact_mutex;
+
+    std::string PackPath(uint32_t number) const;
+
+    /**
+     * Read the records of one pack into the index.
+     *
+     * @param number
+     * @param verify - check the CRCs, and cut off a torn tail
+     */
+    void Replay(uint32_t number, bool verify);
+
+    /** Start a new pack once the open one is full; false if it could not be created **/
+    bool RotateLocked();
+
+    /**
+     * Append one record to the open pack.
+     *
+     * @param entry - set to the record's location on success
+     */
+    bool AppendLocked(bool tombstone, const std::string &path, const std::string &data, int64_t modified_time,
+                      int64_t creation_time, Entry *entry);
+
+    /** Forget a name's record, marking it dead in its pack **/
+    void DropLocked(const std::string &path);
+
+    /** Move the live records out of one sealed pack and remove it **/
+    bool CompactPack(uint32_t number);
+
+    void Run();
+};
+
+/**
+ * Sends a packed file, read whole into memory, as a single chunk; it is
+ * small enough to go in one message.
+ */
+class DFSPackReader
+{
+
+public:
+    /**
+     * @param data - the file's contents
+     * @param offset - where the range starts
+     * @param length - bytes in the range (-1 = to the end)
+     */
+    DFSPackReader(std::string data, int64_t offset = 0, int64_t length = -1);
+
+    bool Next(dfs_service::FileChunk *chunk);
+
+    bool Failed() const;
+
+private:
+    std::string data;
+    int64_t offset;
+    bool sent;
+};
+
+#endif
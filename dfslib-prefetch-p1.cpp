@@ -0,0 +1,303 @@
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dfslib-shared-p1.h"
+#include "dfslib-prefetch-p1.h"
+
+namespace
+{
+    /** Nanoseconds since the epoch **/
+    int64_t Nanos(const struct timespec &time)
+    {
+        return time.tv_sec * 1000000000LL + time.tv_nsec;
+    }
+
+    int64_t NowNanos()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+}
+
+DFSPrefetcher::DFSPrefetcher(const std::string &mount_path, const DFSPrefetchOptions &options, const FetchFunction &fetch)
+    : mount_path(mount_path), options(options), fetch(fetch), start(std::chrono::steady_clock::now()), budget_bytes(0),
+      stopping(false)
+{
+    Load();
+    for (int i = 0; i < std::max(1, options.workers); i++)
+    {
+        workers.emplace_back(&DFSPrefetcher::Work, this);
+    }
+}
+
+DFSPrefetcher::~DFSPrefetcher()
+{
+    {
+        // a short-lived client leaves its prefetches for the next run
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]()
+                     { return queue.empty() && running.empty(); });
+        stopping = true;
+    }
+    changed.notify_all();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+    Save();
+    dfs_log(LL_SYSINFO) << "Prefetch hits " << stats.hits << ", misses " << stats.misses << ", prefetched "
+                        << stats.prefetched_files << " files in " << stats.prefetched_bytes << " bytes, wasted "
+                        << stats.wasted_bytes << " bytes";
+}
+
+std::string DFSPrefetcher::StagingFor(const std::string &filename) const
+{
+    size_t slash = filename.rfind('/');
+    if (slash == std::string::npos)
+    {
+        return mount_path + DFS_PREFETCH_STAGING + filename;
+    }
+    return mount_path + filename.substr(0, slash + 1) + DFS_PREFETCH_STAGING + filename.substr(slash + 1);
+}
+
+bool DFSPrefetcher::Claim(const std::string &filename)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (queued.erase(filename) > 0)
+    {
+        // not started yet; the caller's own fetch is as quick
+        queue.erase(std::find(queue.begin(), queue.end(), filename));
+    }
+    changed.wait(lock, [&]()
+                 { return running.count(filename) == 0; });
+
+    const std::string staging = StagingFor(filename);
+    struct stat staged;
+    if (stat(staging.c_str(), &staged) != 0)
+    {
+        stats.misses++;
+        return false;
+    }
+    // the ctime is when the prefetch finished; the mtime is the server's
+    if (NowNanos() - Nanos(staged.st_ctim) > options.max_age_ms * 1000000LL ||
+        rename(staging.c_str(), (mount_path + filename).c_str()) != 0)
+    {
+        unlink(staging.c_str());
+        stats.wasted_bytes += staged.st_size;
+        stats.misses++;
+        return false;
+    }
+    stats.hits++;
+    return true;
+}
+
+void DFSPrefetcher::Fetched(const std::string &filename)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!last.empty() && last != filename)
+    {
+        std::map<std::string, uint32_t> &next = successors[last];
+        if (next.count(filename) == 0 && next.size() >= DFS_PREFETCH_SUCCESSORS)
+        {
+            next.erase(std::min_element(next.begin(), next.end(), [](const std::pair<const std::string, uint32_t> &a,
+                                                                      const std::pair<const std::string, uint32_t> &b)
+                                        { return a.second < b.second; }));
+        }
+        if (++next[filename] >= DFS_PREFETCH_MAX_COUNT)
+        {
+            for (auto &count : next)
+            {
+                count.second = std::max<uint32_t>(1, count.second / 2);
+            }
+        }
+    }
+    last = filename;
+    PredictLocked(filename);
+}
+
+void DFSPrefetcher::PredictLocked(const std::string &filename)
+{
+    auto iter = successors.find(filename);
+    if (iter == successors.end())
+    {
+        return;
+    }
+    std::vector<std::pair<uint32_t, std::string>> ranked;
+    uint64_t total = 0;
+    for (const auto &next : iter->second)
+    {
+        ranked.emplace_back(next.second, next.first);
+        total += next.second;
+    }
+    std::sort(ranked.rbegin(), ranked.rend());
+
+    const int64_t now = NowNanos();
+    int picked = 0;
+    for (const auto &next : ranked)
+    {
+        if (picked >= options.fanout || next.first < options.min_confidence * total ||
+            queue.size() >= DFS_PREFETCH_QUEUE)
+        {
+            break;
+        }
+        picked++;
+        if (next.second == filename || queued.count(next.second) > 0 || running.count(next.second) > 0)
+        {
+            continue;
+        }
+        // a copy that is still good need not be fetched again
+        struct stat staged;
+        if (stat(StagingFor(next.second).c_str(), &staged) == 0 &&
+            now - Nanos(staged.st_ctim) < options.max_age_ms * 1000000LL / 2)
+        {
+            continue;
+        }
+        queue.push_back(next.second);
+        queued.insert(next.second);
+        changed.notify_one();
+    }
+}
+
+DFSPrefetchStats DFSPrefetcher::Stats()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void DFSPrefetcher::Work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        changed.wait(lock, [this]()
+                     { return stopping || !queue.empty(); });
+        if (stopping)
+        {
+            return;
+        }
+        // keep the average rate under bytes_per_s, without saving up while idle
+        if (options.bytes_per_s > 0)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            const auto allowed = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                             std::chrono::duration<double>(budget_bytes / options.bytes_per_s));
+            if (allowed < now)
+            {
+                start = now;
+                budget_bytes = 0;
+            }
+            else if (changed.wait_until(lock, allowed, [this]()
+                                        { return stopping; }))
+            {
+                return;
+            }
+        }
+        if (queue.empty())
+        {
+            continue;
+        }
+        const std::string filename = queue.front();
+        queue.pop_front();
+        queued.erase(filename);
+        running.insert(filename);
+        lock.unlock();
+
+        // fetch beside the staging file, so a copy is never seen half written
+        const std::string staging = StagingFor(filename);
+        const std::string part = staging + "." + std::to_string(getpid());
+        struct stat before;
+        const bool replaced = stat(staging.c_str(), &before) == 0;
+        struct stat fetched;
+        bool ok = fetch(filename, part) == grpc::StatusCode::OK && stat(part.c_str(), &fetched) == 0 &&
+                  rename(part.c_str(), staging.c_str()) == 0;
+        if (!ok)
+        {
+            unlink(part.c_str());
+        }
+
+        lock.lock();
+        if (ok)
+        {
+            stats.prefetched_files++;
+            stats.prefetched_bytes += fetched.st_size;
+            budget_bytes += fetched.st_size;
+            if (replaced)
+            {
+                stats.wasted_bytes += before.st_size;
+            }
+        }
+        running.erase(filename);
+        changed.notify_all();
+    }
+}
+
+void DFSPrefetcher::Load()
+{
+    std::ifstream in(mount_path + DFS_PREFETCH_MODEL);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::vector<std::string> fields = dfs_split(line, '\t');
+        if (fields.size() == 2 && fields[0] == "last")
+        {
+            last = fields[1];
+        }
+        else if (fields.size() == 6 && fields[0] == "stats")
+        {
+            stats.hits = std::strtoull(fields[1].c_str(), nullptr, 10);
+            stats.misses = std::strtoull(fields[2].c_str(), nullptr, 10);
+            stats.prefetched_files = std::strtoull(fields[3].c_str(), nullptr, 10);
+            stats.prefetched_bytes = std::strtoull(fields[4].c_str(), nullptr, 10);
+            stats.wasted_bytes = std::strtoull(fields[5].c_str(), nullptr, 10);
+        }
+        else if (fields.size() == 4 && fields[0] == "next")
+        {
+            successors[fields[1]][fields[2]] = std::strtoul(fields[3].c_str(), nullptr, 10);
+        }
+    }
+}
+
+void DFSPrefetcher::Save()
+{
+    // one line per record, tab-separated; names with tabs or newlines are not kept
+    auto plain = [](const std::string &name)
+    { return name.find_first_of("\t\n") == std::string::npos; };
+    std::ostringstream out;
+    out << "stats\t" << stats.hits << "\t" << stats.misses << "\t" << stats.prefetched_files << "\t"
+        << stats.prefetched_bytes << "\t" << stats.wasted_bytes << "\n";
+    if (!last.empty() && plain(last))
+    {
+        out << "last\t" << last << "\n";
+    }
+    for (const auto &file : successors)
+    {
+        for (const auto &next : file.second)
+        {
+            if (plain(file.first) && plain(next.first))
+            {
+                out << "next\t" << file.first << "\t" << next.first << "\t" << next.second << "\n";
+            }
+        }
+    }
+
+    const std::string path = mount_path + DFS_PREFETCH_MODEL;
+    const std::string temporary = path + "." + std::to_string(getpid());
+    std::ofstream file(temporary, std::ios::out | std::ios::trunc);
+    file << out.str();
+    file.close();
+    if (!file || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        dfs_log(LL_ERROR) << "Failed to save the prefetch model to " << path;
+        unlink(temporary.c_str());
+    }
+}
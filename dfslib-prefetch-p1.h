@@ -0,0 +1,171 @@
+#ifndef _DFSLIB_PREFETCH_H
+#define _DFSLIB_PREFETCH_H
+
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+
+#include <grpcpp/grpcpp.h>
+
+/** Prefix of prefetched copies waiting next to their destination; never synced **/
+#define DFS_PREFETCH_STAGING ".dfs-prefetch-"
+
+/** The successor model, in the root of the mount **/
+#define DFS_PREFETCH_MODEL ".dfs-prefetch.model"
+
+/** Successors remembered per file; the least seen one is dropped for a new one **/
+#define DFS_PREFETCH_SUCCESSORS 8
+
+/** A file's successor counts are halved once one of them reaches this, so the model follows changes **/
+#define DFS_PREFETCH_MAX_COUNT 64
+
+/** Predictions waiting for a worker; later ones are dropped **/
+#define DFS_PREFETCH_QUEUE 16
+
+/**
+ * Settings of predictive prefetch
+ */
+struct DFSPrefetchOptions
+{
+    /** Prefetch at all **/
+    bool enabled = false;
+
+    /** Prefetches running at once **/
+    int workers = 2;
+
+    /** Predicted successors prefetched after each fetch at most **/
+    int fanout = 2;
+
+    /** Share of a file's observed successors a file must have been to be prefetched **/
+    double min_confidence = 0.25;
+
+    /** Bytes per second prefetches may transfer (0 = unlimited) **/
+    double bytes_per_s = 32 * 1024 * 1024;
+
+    /** Milliseconds a prefetched copy stays good for; older ones are fetched again **/
+    int max_age_ms = 30000;
+};
+
+/**
+ * Hit rate and waste of prefetching, since the model was created
+ */
+struct DFSPrefetchStats
+{
+    /** Fetches served from a prefetched copy **/
+    uint64_t hits = 0;
+
+    /** Fetches that went to the server **/
+    uint64_t misses = 0;
+
+    uint64_t prefetched_files = 0;
+    uint64_t prefetched_bytes = 0;
+
+    /** Prefetched bytes that expired or were replaced before any fetch used them **/
+    uint64_t wasted_bytes = 0;
+};
+
+/**
+ * Learns which file tends to be fetched after which, and fetches the
+ * likely next files in the background.
+ *
+ * The model is first order: for every file it counts the files fetched
+ * right after it. After each fetch, the `fanout` most frequent successors
+ * that make up at least `min_confidence` of the file's transitions are
+ * queued for prefetch. A fixed number of workers fetch them into a staging
+ * file next to their destination, named with DFS_PREFETCH_STAGING so sync
+ * and push ignore it, at most `bytes_per_s` on average.
+ *
+ * A fetch first looks for a staged copy. A copy younger than `max_age_ms`
+ * is renamed into place and the server is not asked; a fetch of a file
+ * still being prefetched waits for it. Older copies are removed and count
+ * as wasted. A hit may therefore be up to `max_age_ms` behind the server.
+ *
+ * The model, the last fetched file and the statistics are saved in the
+ * mount (DFS_PREFETCH_MODEL) when the prefetcher is destroyed, so runs of
+ * the command-line client learn from each other and use each other's
+ * staged copies.
+ */
+class DFSPrefetcher
+{
+
+public:
+    /** Fetches `filename` from the servers into the local file `path` **/
+    typedef std::function<grpc::StatusCode(const std::string &filename, const std::string &path)> FetchFunction;
+
+    /**
+     * Load the model and start the workers.
+     *
+     * @param mount_path - with a trailing '/'
+     * @param options
+     * @param fetch
+     */
+    DFSPrefetcher(const std::string &mount_path, const DFSPrefetchOptions &options, const FetchFunction &fetch);
+
+    /** Finish the queued and running prefetches and save the model **/
+    ~DFSPrefetcher();
+
+    DFSPrefetcher(const DFSPrefetcher &) = delete;
+    DFSPrefetcher &operator=(const DFSPrefetcher &) = delete;
+
+    /**
+     * Serve a fetch from a prefetched copy, waiting for one in progress.
+     *
+     * @param filename
+     * @return true if the file was moved into place
+     */
+    bool Claim(const std::string &filename);
+
+    /**
+     * Learn from a completed fetch and prefetch what is likely to follow it.
+     *
+     * @param filename
+     */
+    void Fetched(const std::string &filename);
+
+    DFSPrefetchStats Stats();
+
+private:
+    std::string mount_path;
+    DFSPrefetchOptions options;
+    FetchFunction fetch;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    /** Successor counts, by file **/
+    std::unordered_map<std::string, std::map<std::string, uint32_t>> successors;
+    std::string last;
+    DFSPrefetchStats stats;
+
+    std::deque<std::string> queue;
+    std::set<std::string> queued;
+    std::set<std::string> running;
+
+    /** Bytes prefetched since `start`, for the rate limit **/
+    std::chrono::steady_clock::time_point start;
+    uint64_t budget_bytes;
+
+    bool stopping;
+    std::vector<std::thread> workers;
+
+    std::string StagingFor(const std::string &filename) const;
+
+    /** Queue the likely successors of `filename` **/
+    void PredictLocked(const std::string &filename);
+
+    void Load();
+    void Save();
+
+    void Work();
+};
+
+#endif
@@ -0,0 +1,209 @@
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "src/dfs-utils.h"
+#include "dfslib-push-p1.h"
+#include "dfslib-shared-p1.h"
+#include "dfslib-notify-p1.h"
+#include "dfslib-walker-p1.h"
+
+/** File changes that restart a file's settle timer **/
+#define DFS_PUSH_MASK (IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+/** How often the notifier thread looks for settled files, in milliseconds **/
+#define DFS_PUSH_TICK_MS 50
+
+using grpc::StatusCode;
+
+DFSPushDaemon::DFSPushDaemon(DFSClientNode *node, const std::string &mount_path, const DFSPushOptions &options)
+    : node(node), mount_path(mount_path), options(options), stopping(false) {}
+
+bool DFSPushDaemon::Run()
+{
+    DFSTreeNotifier notifier(mount_path, DFS_PUSH_MASK);
+    if (!notifier.Ok())
+    {
+        return false;
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < std::max(1, options.workers); i++)
+    {
+        workers.emplace_back(&DFSPushDaemon::Upload, this);
+    }
+
+    DFSTreeNotifier::Handler handler = [this](const std::string &path, uint32_t mask)
+    {
+        if (mask & (IN_Q_OVERFLOW | IN_ISDIR))
+        {
+            Rescan(path);
+        }
+        else if (!dfs_is_temporary(path))
+        {
+            Touch(path);
+        }
+    };
+    dfs_log(LL_SYSINFO) << "Pushing changes under " << mount_path;
+    while (!stopping)
+    {
+        if (notifier.Poll(DFS_PUSH_TICK_MS))
+        {
+            notifier.Read(handler);
+        }
+        Schedule();
+    }
+
+    cv.notify_all();
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    return true;
+}
+
+void DFSPushDaemon::Stop()
+{
+    stopping = true;
+}
+
+void DFSPushDaemon::Touch(const std::string &path)
+{
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto inserted = pending.insert(std::make_pair(path, Change{now, now, 0}));
+    inserted.first->second.last_change = now;
+}
+
+void DFSPushDaemon::Schedule()
+{
+    auto now = std::chrono::steady_clock::now();
+    auto settle = std::chrono::milliseconds(options.settle_ms);
+    bool scheduled = false;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto iter = pending.begin(); iter != pending.end() && queue.size() < options.queue_size;)
+    {
+        const Change &change = iter->second;
+        if (now - change.last_change < settle || now < change.not_before || busy.count(iter->first) > 0)
+        {
+            ++iter;
+            continue;
+        }
+        queue.push_back(Task{iter->first, change.attempts});
+        busy.insert(iter->first);
+        iter = pending.erase(iter);
+        scheduled = true;
+    }
+    if (scheduled)
+    {
+        cv.notify_all();
+    }
+}
+
+void DFSPushDaemon::Upload()
+{
+    while (true)
+    {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]()
+                    { return !queue.empty() || stopping; });
+            if (queue.empty())
+            {
+                return;
+            }
+            task = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        // push the state the file is in now, whatever events led here
+        struct stat file_stat;
+        StatusCode status;
+        if (stat((mount_path + task.path).c_str(), &file_stat) == 0)
+        {
+            if (!S_ISREG(file_stat.st_mode))
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                busy.erase(task.path);
+                continue;
+            }
+            dfs_log(LL_SYSINFO) << "Pushing " << task.path;
+            status = node->Store(task.path);
+        }
+        else
+        {
+            dfs_log(LL_SYSINFO) << "Pushing delete of " << task.path;
+            status = node->Delete(task.path);
+            if (status == StatusCode::NOT_FOUND)
+            {
+                status = StatusCode::OK;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        busy.erase(task.path);
+        if (status == StatusCode::OK)
+        {
+            continue;
+        }
+        if (task.attempts + 1 >= DFS_PUSH_MAX_ATTEMPTS)
+        {
+            dfs_log(LL_ERROR) << "Giving up on " << task.path << " after " << DFS_PUSH_MAX_ATTEMPTS << " attempts";
+            continue;
+        }
+        // retry after settle_ms * 2^attempts, unless a newer change is already pending
+        auto now = std::chrono::steady_clock::now();
+        auto backoff = std::chrono::milliseconds(options.settle_ms) * (1 << (task.attempts + 1));
+        pending.insert(std::make_pair(task.path, Change{now, now + backoff, task.attempts + 1}));
+    }
+}
+
+void DFSPushDaemon::Rescan(const std::string &prefix)
+{
+    dfs_log(LL_SYSINFO) << "Rescanning \"" << prefix << "\" after lost notifications";
+    std::map<std::string, int> server_files;
+    if (node->List(&server_files, false) != StatusCode::OK)
+    {
+        dfs_log(LL_ERROR) << "Failed to list the servers for a rescan";
+        return;
+    }
+    std::vector<DFSWalkEntry> local_files;
+    DFSTreeWalker().Walk(mount_path, &local_files);
+
+    auto below = [&prefix](const std::string &path)
+    {
+        return prefix.empty() || (path.compare(0, prefix.size(), prefix) == 0 && path.size() > prefix.size() &&
+                                  path[prefix.size()] == '/');
+    };
+    for (const DFSWalkEntry &local : local_files)
+    {
+        if (!below(local.path) || dfs_is_temporary(local.path))
+        {
+            continue;
+        }
+        auto remote = server_files.find(local.path);
+        if (remote == server_files.end() || remote->second < local.modified_time)
+        {
+            Touch(local.path);
+        }
+        if (remote != server_files.end())
+        {
+            server_files.erase(remote);
+        }
+    }
+    // what is left exists only on the server. After an overflow we cannot tell
+    // our deletes from other clients' files, so only a lost subtree is deleted.
+    for (const auto &remote : server_files)
+    {
+        if (!prefix.empty() && below(remote.first))
+        {
+            Touch(remote.first);
+        }
+    }
+}
@@ -0,0 +1,118 @@
+#ifndef _DFSLIB_PUSH_H
+#define _DFSLIB_PUSH_H
+
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <atomic>
+#include <condition_variable>
+
+#include "src/dfslibx-clientnode-p1.h"
+
+/** Give up on a file after this many failed uploads in a row **/
+#define DFS_PUSH_MAX_ATTEMPTS 8
+
+/**
+ * Settings for the push daemon
+ */
+struct DFSPushOptions
+{
+    /** Quiet time after a file's last change before it is pushed, in milliseconds **/
+    int settle_ms = 300;
+
+    /** Uploads running at once **/
+    int workers = 4;
+
+    /** Uploads queued for the workers; further settled files wait until there is room **/
+    size_t queue_size = 64;
+};
+
+/**
+ * Pushes local changes in the mount to the servers as they happen.
+ *
+ * Changes are reported by inotify on the mount and its subdirectories.
+ * Every change to a file restarts its settle timer, so a burst of writes,
+ * or an editor saving through a temporary file and a rename, is pushed
+ * once, after the file has been quiet for settle_ms. What is pushed is
+ * decided by the file's state at that point rather than by the events: a
+ * file that exists is stored and a file that is gone is deleted. Editor
+ * temporaries (swap files, backups, lock files) are never pushed.
+ *
+ * Settled files go into a bounded queue served by a fixed number of upload
+ * workers. A file is never in the queue or uploading twice at once; if it
+ * changes during its upload it is pushed again once it settles. Failed
+ * uploads are retried with exponential backoff.
+ *
+ * When inotify loses events (queue overflow, a directory moved away) the
+ * affected subtree is compared with the server listing by mtime and the
+ * differences are pushed.
+ */
+class DFSPushDaemon
+{
+
+public:
+    /**
+     * @param node - the client node used for Store, Delete and List
+     * @param mount_path - with a trailing '/'
+     * @param options
+     */
+    DFSPushDaemon(DFSClientNode *node, const std::string &mount_path, const DFSPushOptions &options = DFSPushOptions());
+
+    /**
+     * Watch the mount and push changes until Stop() is called.
+     *
+     * @return false if the mount could not be watched
+     */
+    bool Run();
+
+    void Stop();
+
+private:
+    struct Change
+    {
+        std::chrono::steady_clock::time_point last_change;
+        std::chrono::steady_clock::time_point not_before;
+        int attempts;
+    };
+
+    struct Task
+    {
+        std::string path;
+        int attempts;
+    };
+
+    DFSClientNode *node;
+    std::string mount_path;
+    DFSPushOptions options;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    /** Files changed and not yet settled (or waiting to retry) **/
+    std::map<std::string, Change> pending;
+
+    /** Settled files waiting for a worker **/
+    std::deque<Task> queue;
+
+    /** Files queued or uploading **/
+    std::set<std::string> busy;
+
+    std::atomic<bool> stopping;
+
+    /** Record a change to a file **/
+    void Touch(const std::string &path);
+
+    /** Move settled files into the upload queue, as far as it has room **/
+    void Schedule();
+
+    /** Upload worker loop **/
+    void Upload();
+
+    /** Push the files below `prefix` whose local and server copies differ **/
+    void Rescan(const std::string &prefix);
+};
+
+#endif
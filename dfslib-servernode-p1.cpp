@@ -1,21 +1,46 @@
 #include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
 #include <chrono>
 #include <cstdio>
+#include <cstring>
+#include <memory>
 #include <string>
 #include <thread>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
 #include <errno.h>
 #include <iostream>
 #include <fstream>
 #include <getopt.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <grpcpp/grpcpp.h>
 
 #include "src/dfs-utils.h"
 #include "dfslib-shared-p1.h"
+#include "dfslib-chunkpool-p1.h"
+#include "dfslib-events-p1.h"
+#include "dfslib-walker-p1.h"
+#include "dfslib-listcodec-p1.h"
+#include "dfslib-trace-p1.h"
+#include "dfslib-optrace-p1.h"
+#include "dfslib-metaindex-p1.h"
+#include "dfslib-tiering-p1.h"
+#include "dfslib-zfile-p1.h"
+#include "dfslib-packstore-p1.h"
+#include "dfslib-upload-p1.h"
+#include "dfslib-admission-p1.h"
 #include "dfslib-servernode-p1.h"
 #include "proto-src/dfs-service.grpc.pb.h"
 
+using grpc::Channel;
+using grpc::ClientContext;
+using grpc::ClientWriter;
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
@@ -26,12 +51,41 @@ using grpc::StatusCode;
 
 using dfs_service::DFSService;
 using dfs_service::FileChunk;
+using dfs_service::FileEvent;
 using dfs_service::FileInfo;
 using dfs_service::FilePath;
 using dfs_service::FileStatus;
 using dfs_service::ListFilesRequest;
 using dfs_service::LSResponse;
 using dfs_service::ResponseStatus;
+using dfs_service::UploadHandle;
+using dfs_service::UploadRequest;
+using dfs_service::WatchRequest;
+
+/**
+ * A storeFile stream forwarded from the primary to one replica
+ */
+struct ReplicaStream
+{
+    ClientContext context;
+    ResponseStatus response;
+
+    /** The response of a forwarded writeFile **/
+    dfs_service::FileStatus written;
+    std::unique_ptr<ClientWriter<FileChunk>> writer;
+    bool healthy = true;
+};
+
+/**
+ * Replica acknowledgements collected for one forwarded store
+ */
+struct ReplicaAcks
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    int acked = 0;
+    int finished = 0;
+};
 
 //
 // STUDENT INSTRUCTION:
@@ -70,6 +124,490 @@ private:
     /** The mount path for the server **/
     std::string mount_path;
 
+    /** Stubs for the replicas that stores and deletes are forwarded to **/
+    std::vector<std::unique_ptr<DFSService::Stub>> replica_stubs;
+
+    /** Replicas that must acknowledge a store before the client is answered **/
+    int write_quorum;
+
+    /** Stores leave files compressed in the mount **/
+    bool compress_at_rest;
+
+    /** Admission control and load shedding **/
+    DFSAdmissionControl admission;
+
+    /** Per-client fair sharing of the transfer bandwidth **/
+    DFSBandwidthScheduler bandwidth;
+
+    /** Parallel walker serving recursive listings **/
+    DFSTreeWalker walker;
+
+    /** File changes fanned out to watch streams **/
+    DFSEventHub events;
+
+    /** File metadata kept across restarts; null unless a snapshot path is set **/
+    std::unique_ptr<DFSMetadataIndex> index;
+
+    /** Hot and cold storage tiers; null unless a cold tier is set **/
+    std::unique_ptr<DFSTierManager> tiers;
+
+    /** Small files appended to packs; null unless a pack path is set **/
+    std::unique_ptr<DFSPackStore> packs;
+
+    /** Records client operations for replay; null unless asked for **/
+    std::unique_ptr<DFSOpRecorder> recorder;
+
+    /** Striped uploads in progress; null unless an upload path is set **/
+    std::unique_ptr<DFSUploadTable> uploads;
+
+    /** Files being changed by writeFile; a second write to one waits for the first **/
+    std::mutex writing_mutex;
+    std::condition_variable writing_done;
+    std::set<std::string> writing;
+
+    /**
+     * Holds off every other request that changes one of its files while it
+     * exists: stores, writes, deletes, copies, renames and upload commits.
+     * A write's size check therefore still holds when it writes, and a
+     * copy never reads a file half rewritten. Taken before any tier pin.
+     */
+    class WriteLock
+    {
+
+    public:
+        WriteLock(DFSServiceImpl *service, const std::string &filename)
+            : WriteLock(service, std::vector<std::string>{filename})
+        {
+        }
+
+        /** All the files at once, so two requests on the same pair cannot wait for each other **/
+        WriteLock(DFSServiceImpl *service, const std::vector<std::string> &filenames)
+            : service(service), filenames(filenames)
+        {
+            std::unique_lock<std::mutex> lock(service->writing_mutex);
+            service->writing_done.wait(lock, [&]()
+                                       { return std::none_of(filenames.begin(), filenames.end(), [&](const std::string &filename)
+                                                             { return service->writing.count(filename) != 0; }); });
+            service->writing.insert(filenames.begin(), filenames.end());
+        }
+
+        ~WriteLock()
+        {
+            std::lock_guard<std::mutex> lock(service->writing_mutex);
+            for (const std::string &filename : filenames)
+            {
+                service->writing.erase(filename);
+            }
+            service->writing_done.notify_all();
+        }
+
+        WriteLock(const WriteLock &) = delete;
+        WriteLock &operator=(const WriteLock &) = delete;
+
+    private:
+        DFSServiceImpl *service;
+        std::vector<std::string> filenames;
+    };
+
+    /**
+     * Record an operation for replay, unless it is a forward from a primary.
+     *
+     * @param context
+     * @param op
+     * @param path
+     * @param size
+     */
+    void RecordOp(ServerContext *context, const char *op, const std::string &path, int64_t size)
+    {
+        if (recorder && context->client_metadata().count("replicated") == 0)
+        {
+            recorder->Record(op, path, size);
+        }
+    }
+
+    /**
+     * Fill in the status of one file, wherever it is kept.
+     *
+     * @param filename - as sent by the client
+     * @param response
+     * @return NOT_FOUND, INVALID_ARGUMENT or OK
+     */
+    grpc::Status StatPath(const std::string &filename, dfs_service::FileStatus *response)
+    {
+        if (!dfs_valid_path(filename))
+        {
+            dfs_log(LL_ERROR) << "Invalid filename: " << filename;
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid filename");
+        }
+        std::string path = WrapPath(filename);
+        struct stat file_stat;
+
+        if (tiers)
+        {
+            tiers->Touch(filename);
+        }
+        DFSPackStore::Info packed;
+        if (packs && packs->Get(filename, &packed))
+        {
+            // packed files have no content hash
+            response->set_size(packed.size);
+            response->set_modified_time(packed.modified_time);
+            response->set_creation_time(packed.creation_time);
+            return grpc::Status::OK;
+        }
+        DFSTierManager::Location location{path, false, false, 0, 0};
+        if (stat(path.c_str(), &file_stat) != 0)
+        {
+            if (!Locate(filename, &location) || stat(location.path.c_str(), &file_stat) != 0)
+            {
+                dfs_log(LL_ERROR) << "Failed to stat file: " << path;
+                return grpc::Status(StatusCode::NOT_FOUND, "File not found");
+            }
+            // a compressed file reports its logical size
+            file_stat.st_size = location.size;
+        }
+
+        response->set_size(file_stat.st_size);
+        response->set_modified_time(file_stat.st_mtime);
+        response->set_creation_time(file_stat.st_ctime);
+        if (index && !location.cold && !location.compressed && S_ISREG(file_stat.st_mode))
+        {
+            DFSSpan span("hash");
+            uint64_t hash;
+            if (index->Hash(filename, file_stat, &hash))
+            {
+                response->set_content_hash(hash);
+            }
+        }
+        dfs_log(LL_DEBUG) << "File " << path << " size: " << file_stat.st_size << " mtime: " << file_stat.st_mtime << " ctime: " << file_stat.st_ctime;
+        return grpc::Status::OK;
+    }
+
+    /**
+     * Check the names of a copy or rename.
+     *
+     * @param request
+     * @return INVALID_ARGUMENT or OK
+     */
+    grpc::Status CheckPair(const dfs_service::FilePair &request)
+    {
+        if (!dfs_valid_path(request.source()) || !dfs_valid_path(request.destination()))
+        {
+            dfs_log(LL_ERROR) << "Invalid filename: " << request.source() << " or " << request.destination();
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid filename");
+        }
+        if (request.source() == request.destination())
+        {
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Source and destination are the same file");
+        }
+        struct stat file_stat;
+        if (stat(WrapPath(request.destination()).c_str(), &file_stat) == 0 && S_ISDIR(file_stat.st_mode))
+        {
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Destination is a directory");
+        }
+        return grpc::Status::OK;
+    }
+
+    /** Whether a path in the mount is a file written before it is renamed into place: a tier move's or a copy's **/
+    static bool IsStaging(const std::string &path)
+    {
+        return DFSTierManager::IsStaging(path) ||
+               path.compare(path.rfind('/') + 1, strlen(DFS_COPY_STAGING), DFS_COPY_STAGING) == 0;
+    }
+
+    /**
+     * Copy a file of the mount or the cold tier into the mount, without
+     * moving its contents through the server where the filesystem allows
+     * (see dfs_copy_file). A compressed file is inflated.
+     *
+     * @param source - relative to the mount
+     * @param destination - relative to the mount, replaced if it exists
+     * @param modified_time - of the copy
+     * @return NOT_FOUND, INTERNAL or OK
+     */
+    grpc::Status CopyIntoMount(const std::string &source, const std::string &destination, int64_t modified_time)
+    {
+        DFSTierManager::Location location{WrapPath(source), false, false, 0, 0};
+        int in = open(location.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0 && Locate(source, &location))
+        {
+            in = open(location.path.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        struct stat file_stat;
+        if (in >= 0 && (fstat(in, &file_stat) != 0 || S_ISDIR(file_stat.st_mode)))
+        {
+            close(in);
+            in = -1;
+        }
+        if (in < 0)
+        {
+            dfs_log(LL_ERROR) << "File not found: " << location.path;
+            return grpc::Status(StatusCode::NOT_FOUND, "File not found");
+        }
+
+        // the copy is renamed into place whole, so a fetch never sees it half written
+        const std::string path = WrapPath(destination);
+        const size_t slash = path.rfind('/');
+        const std::string staging = path.substr(0, slash + 1) + DFS_COPY_STAGING + path.substr(slash + 1);
+        bool copied = dfs_make_parents(path);
+        if (copied && location.compressed)
+        {
+            DFSSpan span("inflate");
+            DFSZFileReader infile(in);
+            DFSChunkWriter outfile;
+            DFSChunkPool::Chunk chunk = DFSChunkPool::Acquire();
+            copied = outfile.Open(staging);
+            while (copied && infile.Next(chunk.get()))
+            {
+                copied = outfile.Write(*chunk);
+            }
+            copied = copied && !infile.Failed() && outfile.Close();
+        }
+        else if (copied)
+        {
+            DFSSpan span("copy");
+            int out = open(staging.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            copied = out >= 0 && dfs_copy_file(in, out);
+            if (out >= 0)
+            {
+                copied = close(out) == 0 && copied;
+            }
+        }
+        close(in);
+        if (copied && !dfs_set_mtime(staging, modified_time))
+        {
+            dfs_log(LL_ERROR) << "Failed to set mtime of " << staging;
+        }
+        if (!copied || rename(staging.c_str(), path.c_str()) != 0)
+        {
+            dfs_log(LL_ERROR) << "Failed to copy " << location.path << " to " << path << ": " << strerror(errno);
+            unlink(staging.c_str());
+            dfs_prune_parents(mount_path, destination);
+            return grpc::Status(StatusCode::INTERNAL, "Failed to copy file");
+        }
+        return grpc::Status::OK;
+    }
+
+    /**
+     * Find a file in the mount, as it is or compressed, or in the cold tier.
+     *
+     * @param filename - relative to the mount
+     * @param location - set when found
+     * @return false if no tier has it
+     */
+    bool Locate(const std::string &filename, DFSTierManager::Location *location)
+    {
+        return tiers ? tiers->Locate(filename, location) : DFSTierManager::LocateHot(mount_path, filename, location);
+    }
+
+    /** Whether a file in the mount is in the compressed format **/
+    static bool IsCompressed(const std::string &stored)
+    {
+        int fd = open(stored.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+        int64_t size;
+        const bool compressed = dfs_zfile_size(fd, &size);
+        close(fd);
+        return compressed;
+    }
+
+    /**
+     * Remove the compressed form of a file from the mount, after its plain
+     * form was written or the file was deleted. A client's own file that
+     * only carries the suffix is left alone.
+     *
+     * @param filename - relative to the mount
+     * @return whether there was a compressed form
+     */
+    bool DropCompressed(const std::string &filename)
+    {
+        const std::string stored = WrapPath(filename) + DFS_TIER_COMPRESSED;
+        return IsCompressed(stored) && unlink(stored.c_str()) == 0;
+    }
+
+    /**
+     * Replace a file just written to the mount with its compressed form,
+     * unless that comes out no smaller or the compressed name is taken by
+     * a client's own file. The caller holds the file's write lock.
+     *
+     * @param filename - relative to the mount
+     */
+    void CompressInMount(const std::string &filename)
+    {
+        DFSSpan span("compress");
+        const std::string path = WrapPath(filename);
+        const std::string stored = path + DFS_TIER_COMPRESSED;
+        const size_t slash = stored.rfind('/');
+        const std::string staging = stored.substr(0, slash + 1) + DFS_COPY_STAGING + stored.substr(slash + 1);
+        struct stat before, after;
+        if (stat(stored.c_str(), &after) == 0 && !IsCompressed(stored))
+        {
+            return;
+        }
+        int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in < 0)
+        {
+            return;
+        }
+        bool smaller = false;
+        int out = -1;
+        if (fstat(in, &before) == 0)
+        {
+            out = open(staging.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            smaller = out >= 0 && dfs_zfile_compress(in, out) && fstat(out, &after) == 0 && after.st_size < before.st_size;
+        }
+        if (out >= 0)
+        {
+            smaller = close(out) == 0 && smaller;
+        }
+        close(in);
+        // the compressed file is in place before the plain one goes, so a fetch finds one of them
+        if (!smaller || !dfs_set_mtime(staging, before.st_mtime) || rename(staging.c_str(), stored.c_str()) != 0)
+        {
+            unlink(staging.c_str());
+            DropCompressed(filename);
+            return;
+        }
+        unlink(path.c_str());
+    }
+
+    /**
+     * Give the compressed files in a listing of the mount the names and
+     * sizes clients know them by. One left next to its plain form by a
+     * compression cut short is left out.
+     *
+     * @param entries
+     */
+    void ResolveCompressed(std::vector<DFSWalkEntry> *entries)
+    {
+        std::vector<DFSWalkEntry> resolved;
+        resolved.reserve(entries->size());
+        struct stat file_stat;
+        for (DFSWalkEntry &entry : *entries)
+        {
+            std::string path;
+            int64_t size;
+            if (DFSTierManager::HotName(mount_path, entry.path, &path, &size))
+            {
+                if (stat(WrapPath(path).c_str(), &file_stat) == 0)
+                {
+                    continue;
+                }
+                entry.path = std::move(path);
+                entry.size = size;
+            }
+            resolved.push_back(std::move(entry));
+        }
+        entries->swap(resolved);
+    }
+
+    /** Whether an event is for a compressed file's stored name; handlers report those under the file's own name **/
+    bool IsCompressedEvent(const std::string &path)
+    {
+        const size_t suffix = strlen(DFS_TIER_COMPRESSED);
+        if (path.size() <= suffix || path.compare(path.size() - suffix, suffix, DFS_TIER_COMPRESSED) != 0)
+        {
+            return false;
+        }
+        const std::string stored = WrapPath(path);
+        struct stat file_stat;
+        return stat(stored.c_str(), &file_stat) != 0 || IsCompressed(stored);
+    }
+
+    /**
+     * Bring the index up to date for a file, under its own name and its
+     * compressed one.
+     *
+     * @param filename - relative to the mount
+     * @param touch - the file was written in place
+     */
+    void RefreshIndex(const std::string &filename, bool touch = false)
+    {
+        if (index)
+        {
+            index->Refresh(filename, touch);
+            index->Refresh(filename + DFS_TIER_COMPRESSED);
+        }
+    }
+
+    /**
+     * Repeat a unary request on the replicas, one after the other, unless
+     * the request is itself a forward.
+     *
+     * @param context
+     * @param call - issues the request on one replica
+     * @param metadata - sent along, e.g. the mtime the replicas give a copy
+     * @return the replicas that answered OK
+     */
+    template <typename Response>
+    int ForwardUnary(ServerContext *context,
+                     const std::function<grpc::Status(DFSService::Stub *, ClientContext *, Response *)> &call,
+                     const std::map<std::string, std::string> &metadata = {})
+    {
+        if (context->client_metadata().count("replicated") != 0)
+        {
+            return 0;
+        }
+        int acked = 0;
+        for (auto &stub : replica_stubs)
+        {
+            DFSSpan span("forward");
+            ClientContext replica_context;
+            replica_context.AddMetadata("replicated", "1");
+            for (const auto &entry : metadata)
+            {
+                replica_context.AddMetadata(entry.first, entry.second);
+            }
+            DFSTracer::Inject(&replica_context);
+            replica_context.set_deadline(context->deadline());
+            Response replica_response;
+            grpc::Status status = call(stub.get(), &replica_context, &replica_response);
+            if (!status.ok())
+            {
+                dfs_log(LL_ERROR) << "Failed to forward to replica: " << status.error_message();
+                continue;
+            }
+            acked++;
+        }
+        return acked;
+    }
+
+    /**
+     * Repeat a delete on the replicas. A replica that does not have the
+     * file counts as having applied it.
+     *
+     * @param context
+     * @param request
+     * @return the replicas that no longer have the file
+     */
+    int ForwardDelete(ServerContext *context, const dfs_service::FilePath &request)
+    {
+        return ForwardUnary<ResponseStatus>(context, [&request](DFSService::Stub *stub, ClientContext *replica_context, ResponseStatus *replica_response)
+                                            {
+            grpc::Status status = stub->deleteFile(replica_context, request, replica_response);
+            return status.error_code() == StatusCode::NOT_FOUND ? grpc::Status::OK : status; });
+    }
+
+    /**
+     * Pin both files of a copy or rename, in name order, so that two
+     * requests on the same pair of names cannot wait for each other.
+     *
+     * @param request
+     * @param pins - filled in when the server has tiers
+     */
+    void PinPair(const dfs_service::FilePair &request, std::unique_ptr<DFSTierManager::Pin> pins[2])
+    {
+        if (tiers)
+        {
+            const auto names = std::minmax(request.source(), request.destination());
+            pins[0].reset(new DFSTierManager::Pin(tiers.get(), names.first));
+            pins[1].reset(new DFSTierManager::Pin(tiers.get(), names.second));
+        }
+    }
+
     /**
      * Prepend the mount path to the filename.
      *
@@ -81,139 +619,1482 @@ private:
         return this->mount_path + filepath;
     }
 
-public:
-    DFSServiceImpl(const std::string &mount_path) : mount_path(mount_path)
+    /**
+     * Look up metadata the client sent.
+     *
+     * @param context
+     * @param key
+     * @param value - set if the client sent the key
+     * @return
+     */
+    bool MetadataOf(ServerContext *context, const char *key, std::string *value)
     {
+        const auto &metadata = context->client_metadata();
+        auto iter = metadata.find(key);
+        if (iter == metadata.end())
+        {
+            return false;
+        }
+        value->assign(iter->second.data(), iter->second.size());
+        return true;
     }
 
-    ~DFSServiceImpl() {}
-
-    //
-    // STUDENT INSTRUCTION:
-    //
-    // Add your additional code here, including
-    // implementations of your protocol service methods
-    //
-    ::grpc::Status storeFile(::grpc::ServerContext *context,
-                             ::grpc::ServerReader<::dfs_service::FileChunk> *reader,
-                             ::dfs_service::ResponseStatus *response) override
+    /**
+     * Identify the caller, by the client id it sends or else by its peer host.
+     *
+     * @param context
+     * @return
+     */
+    std::string ClientOf(ServerContext *context)
     {
-        // get the filename from the metadata
         const auto &metadata = context->client_metadata();
-        auto iter = metadata.find("filename");
+        auto iter = metadata.find("clientid");
+        if (iter != metadata.end())
+        {
+            return std::string(iter->second.data(), iter->second.size());
+        }
+        // "ipv4:10.0.0.1:54321" -> "ipv4:10.0.0.1"
+        std::string peer = context->peer();
+        return peer.substr(0, peer.rfind(':'));
+    }
 
-        if (iter == metadata.end())
+    /**
+     * Open a forwarding storeFile or writeFile stream to every replica.
+     *
+     * The forwarded calls carry the client's deadline and are marked as
+     * replicated, so a replica never forwards them any further.
+     *
+     * @param context
+     * @param metadata - the filename and whatever else the replicas need, e.g. the mtime
+     * @param open - starts the stream on one replica (null = storeFile)
+     * @return
+     */
+    std::vector<std::shared_ptr<ReplicaStream>> OpenReplicaStreams(
+        ServerContext *context, const std::map<std::string, std::string> &metadata,
+        const std::function<std::unique_ptr<ClientWriter<FileChunk>>(DFSService::Stub *, ReplicaStream *)> &open = nullptr)
+    {
+        std::vector<std::shared_ptr<ReplicaStream>> forwards;
+        for (auto &stub : replica_stubs)
+        {
+            auto forward = std::make_shared<ReplicaStream>();
+            for (const auto &entry : metadata)
+            {
+                forward->context.AddMetadata(entry.first, entry.second);
+            }
+            forward->context.AddMetadata("replicated", "1");
+            DFSTracer::Inject(&forward->context);
+            forward->context.set_deadline(context->deadline());
+            if (open)
+            {
+                forward->writer = open(stub.get(), forward.get());
+            }
+            else
+            {
+                forward->writer = stub->storeFile(&forward->context, &forward->response);
+            }
+            forwards.push_back(forward);
+        }
+        return forwards;
+    }
+
+    /**
+     * Close the forwarding streams and wait until `write_quorum` replicas
+     * have stored the file. The remaining replicas finish in the background.
+     *
+     * @param forwards
+     * @return true if the quorum was reached
+     */
+    bool AwaitReplicas(const std::vector<std::shared_ptr<ReplicaStream>> &forwards)
+    {
+        auto acks = std::make_shared<ReplicaAcks>();
+        for (auto &forward : forwards)
+        {
+            std::thread([forward, acks]()
+                        {
+                bool sent = forward->healthy && forward->writer->WritesDone();
+                grpc::Status status = forward->writer->Finish();
+                if (!status.ok())
+                {
+                    dfs_log(LL_ERROR) << "Replica failed to store file: " << status.error_message();
+                }
+                std::lock_guard<std::mutex> lock(acks->mutex);
+                acks->finished++;
+                if (sent && status.ok())
+                {
+                    acks->acked++;
+                }
+                acks->cv.notify_all(); })
+                .detach();
+        }
+
+        const int total = forwards.size();
+        std::unique_lock<std::mutex> lock(acks->mutex);
+        acks->cv.wait(lock, [&]()
+                      { return acks->acked >= write_quorum || acks->finished - acks->acked > total - write_quorum; });
+        return acks->acked >= write_quorum;
+    }
+
+    /**
+     * Stream a file to the client.
+     *
+     * @param context
+     * @param writer
+     * @param infile - a DFSChunkReader or DFSZFileReader
+     * @return
+     */
+    template <typename Reader>
+    grpc::Status SendChunks(ServerContext *context, ServerWriter<FileChunk> *writer, Reader *infile)
+    {
+        const std::string client = ClientOf(context);
+        const bool paced = bandwidth.Enabled();
+
+        DFSChunkPool::Chunk chunk = DFSChunkPool::Acquire();
+        for (;;)
+        {
+            {
+                DFSSpan span("disk_read");
+                if (!infile->Next(chunk.get()))
+                {
+                    break;
+                }
+            }
+            if (paced)
+            {
+                DFSSpan span("pace");
+                bandwidth.Acquire(client, chunk->content().size());
+            }
+            if (context->IsCancelled())
+            {
+                dfs_log(LL_SYSINFO) << "Client cancelled the request.";
+                return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
+            }
+            // serialization and any wait for flow control happen in Write
+            bool written;
+            {
+                DFSSpan span("stream_write");
+                written = writer->Write(*chunk);
+            }
+            if (!written)
+            {
+                dfs_log(LL_ERROR) << "Failed to write chunk to stream(from server to clinet)";
+                return grpc::Status(StatusCode::CANCELLED, "Failed to write chunk to client");
+            }
+            if (DFS_LOG_LEVEL >= LL_DEBUG)
+            {
+                DFSSpan span("log");
+                dfs_log(LL_DEBUG) << "Writing chunk: " << chunk->chunk_num() << " size: " << chunk->content().size() << " hole: " << chunk->hole_length();
+            }
+        }
+
+        if (infile->Failed())
+        {
+            return grpc::Status(StatusCode::INTERNAL, "Failed to read file");
+        }
+        return grpc::Status(StatusCode::OK, "File sent successfully");
+    }
+
+    /**
+     * Answer a recursive listing with every file below the mount.
+     *
+     * @param context
+     * @param response
+     * @return
+     */
+    grpc::Status ListTree(ServerContext *context, std::vector<DFSWalkEntry> *entries)
+    {
+        int error = walker.Walk(mount_path, entries, [context]()
+                                { return context->IsCancelled(); });
+        if (error == ECANCELED)
+        {
+            dfs_log(LL_SYSINFO) << "Client cancelled the request.";
+            return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
+        }
+        if (error != 0)
+        {
+            dfs_log(LL_ERROR) << "Failed to open directory: " << strerror(error);
+            return grpc::Status(grpc::INTERNAL, "Failed to open directory.");
+        }
+        return grpc::Status::OK;
+    }
+
+    grpc::Status ListTop(ServerContext *context, std::vector<DFSWalkEntry> *entries)
+    {
+        // Open the directory
+        DIR *dir = opendir(mount_path.c_str());
+        if (dir == nullptr)
+        {
+            dfs_log(LL_ERROR) << "Failed to open directory: " << strerror(errno);
+            return grpc::Status(grpc::INTERNAL, "Failed to open directory.");
+        }
+
+        // Read the directory
+        struct dirent *entry;
+        struct stat file_stat;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            if (context->IsCancelled())
+            {
+                dfs_log(LL_SYSINFO) << "Client cancelled the request.";
+                closedir(dir);
+                return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
+            }
+
+            const std::string filename = entry->d_name;
+            if (filename == "." || filename == "..")
+            {
+                continue;
+            }
+            const std::string wrapped_path = WrapPath(filename);
+            if (stat(wrapped_path.c_str(), &file_stat) != 0)
+            {
+                dfs_log(LL_ERROR) << "Failed to stat file: " << wrapped_path;
+                continue;
+            }
+            // subdirectories are listed by a recursive listing, as their files
+            if (!S_ISREG(file_stat.st_mode))
+            {
+                continue;
+            }
+
+            // record the file info
+            entries->push_back(DFSWalkEntry{filename, file_stat.st_size, file_stat.st_mtime});
+        }
+
+        closedir(dir);
+        return grpc::Status::OK;
+    }
+
+public:
+    DFSServiceImpl(const std::string &mount_path, const DFSServerOptions &options)
+        : mount_path(mount_path),
+          admission(options.max_inflight, options.max_queued_bytes, options.shed_late),
+          bandwidth(options.bandwidth_bytes, options.default_share, options.client_shares),
+          walker(options.walk_threads),
+          events(mount_path)
+    {
+        for (const std::string &address : options.replicas)
+        {
+            replica_stubs.push_back(DFSService::NewStub(grpc::CreateCustomChannel(
+                address, grpc::InsecureChannelCredentials(), options.transport.ChannelArguments())));
+        }
+        if (!options.snapshot_path.empty())
+        {
+            index.reset(new DFSMetadataIndex(mount_path, options.snapshot_path, options.snapshot_interval, &events));
+        }
+        if (!options.tiers.cold_path.empty())
+        {
+            DFSTierOptions tier_options = options.tiers;
+            tier_options.compress_hot = options.compress_at_rest;
+            tiers.reset(new DFSTierManager(mount_path, tier_options));
+        }
+        if (!options.packs.pack_path.empty())
+        {
+            packs.reset(new DFSPackStore(options.packs));
+        }
+        if (!options.uploads.upload_path.empty())
+        {
+            uploads.reset(new DFSUploadTable(options.uploads));
+        }
+        // a file demoted, packed or compressed out of its plain name in the mount still exists
+        events.SetFallback([this](const std::string &path, int64_t *modified_time)
+                           {
+            DFSPackStore::Info info;
+            if (packs && packs->Get(path, &info))
+            {
+                *modified_time = info.modified_time;
+                return true;
+            }
+            DFSTierManager::Location location;
+            if (!Locate(path, &location))
+            {
+                return false;
+            }
+            *modified_time = location.modified_time;
+            return true; });
+        if (!options.record_trace.empty())
+        {
+            recorder.reset(new DFSOpRecorder(options.record_trace));
+            if (!recorder->Ok())
+            {
+                dfs_log(LL_ERROR) << "Failed to open " << options.record_trace << ", not recording operations";
+                recorder.reset();
+            }
+        }
+        compress_at_rest = options.compress_at_rest;
+        write_quorum = options.write_quorum;
+        if (write_quorum < 0 || write_quorum > static_cast<int>(replica_stubs.size()))
+        {
+            write_quorum = replica_stubs.size();
+        }
+    }
+
+    ~DFSServiceImpl()
+    {
+        // the index follows the hub, and the hub thread calls the fallback, which uses
+        // tiers and packs; all of them are declared after events and would go first
+        index.reset();
+        events.Stop();
+    }
+
+    //
+    // STUDENT INSTRUCTION:
+    //
+    // Add your additional code here, including
+    // implementations of your protocol service methods
+    //
+    ::grpc::Status storeFile(::grpc::ServerContext *context,
+                             ::grpc::ServerReader<::dfs_service::FileChunk> *reader,
+                             ::dfs_service::ResponseStatus *response) override
+    {
+        // get the filename from the metadata
+        const auto &metadata = context->client_metadata();
+        auto iter = metadata.find("filename");
+
+        if (iter == metadata.end())
+        {
+            dfs_log(LL_ERROR) << "Filename not found in metadata";
+            return grpc::Status(StatusCode::CANCELLED, "Filename not found in metadata");
+        }
+
+        std::string filename = std::string(iter->second.data(), iter->second.size());
+        if (!dfs_valid_path(filename))
+        {
+            dfs_log(LL_ERROR) << "Invalid filename: " << filename;
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid filename");
+        }
+        // wrap the path
+        std::string filepath = WrapPath(filename);
+        DFSTrace trace(context, "storeFile", filename);
+
+        // admit the request before touching the disk
+        int64_t filesize = 0;
+        auto size_iter = metadata.find("filesize");
+        if (size_iter != metadata.end())
+        {
+            filesize = std::atoll(std::string(size_iter->second.data(), size_iter->second.size()).c_str());
+        }
+        std::string mtime;
+        auto mtime_iter = metadata.find("mtime");
+        if (mtime_iter != metadata.end())
+        {
+            mtime = std::string(mtime_iter->second.data(), mtime_iter->second.size());
+        }
+        RecordOp(context, "store", filename, filesize);
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status admitted;
+        {
+            DFSSpan span("admit");
+            admitted = admission.Admit(context, "store", filesize, &ticket);
+        }
+        if (!admitted.ok())
+        {
+            return admitted;
+        }
+
+        // the mover and other writers leave the file alone while it is written
+        WriteLock lock(this, filename);
+        std::unique_ptr<DFSTierManager::Pin> pin;
+        if (tiers)
+        {
+            pin.reset(new DFSTierManager::Pin(tiers.get(), filename));
+        }
+
+        // a small file is collected in memory and appended to a pack
+        bool small = packs && size_iter != metadata.end() && packs->Accepts(filesize);
+        std::string contents;
+
+        // otherwise open the file to writie the chunks, creating its directories first
+        DFSChunkWriter outfile;
+        if (!small && (!dfs_make_parents(filepath) || !outfile.Open(filepath)))
+        {
+            dfs_log(LL_ERROR) << "Failed to open file for writing: " << filepath;
+            return grpc::Status(StatusCode::INTERNAL, "Failed to open file for writing");
+        }
+
+        // forward the stream to the replicas, unless this store is itself a forward
+        std::vector<std::shared_ptr<ReplicaStream>> forwards;
+        if (metadata.find("replicated") == metadata.end())
+        {
+            std::map<std::string, std::string> forward_metadata{{"filename", filename}};
+            if (!mtime.empty())
+            {
+                forward_metadata["mtime"] = mtime;
+            }
+            forwards = OpenReplicaStreams(context, forward_metadata);
+        }
+
+        const std::string client = ClientOf(context);
+        const bool paced = bandwidth.Enabled();
+
+        // one pooled chunk receives every buffer of the stream
+        DFSChunkPool::Chunk chunk = DFSChunkPool::Acquire();
+        int64_t bytes_written = 0;
+        for (;;)
+        {
+            {
+                DFSSpan span("stream_read");
+                if (!reader->Read(chunk.get()))
+                {
+                    break;
+                }
+            }
+            const std::string &content = chunk->content();
+            if (chunk->offset() < 0 || chunk->hole_length() < 0)
+            {
+                dfs_log(LL_ERROR) << "Invalid chunk at " << chunk->offset() << " for " << filepath;
+                return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid chunk offset");
+            }
+            if (paced)
+            {
+                DFSSpan span("pace");
+                bandwidth.Acquire(client, content.size());
+            }
+            const int64_t end = chunk->offset() + (chunk->hole_length() > 0 ? chunk->hole_length() : content.size());
+            if (small && !packs->Accepts(end))
+            {
+                // larger than announced; it goes to the mount after all
+                DFSSpan span("disk_write");
+                small = false;
+                FileChunk collected;
+                collected.set_content(std::move(contents));
+                if (!dfs_make_parents(filepath) || !outfile.Open(filepath) || !outfile.Write(collected))
+                {
+                    dfs_log(LL_ERROR) << "Failed to write file: " << filepath;
+                    return grpc::Status(StatusCode::INTERNAL, "Failed to write file");
+                }
+            }
+            if (small)
+            {
+                if (static_cast<int64_t>(contents.size()) < end)
+                {
+                    contents.resize(end);
+                }
+                if (chunk->hole_length() == 0)
+                {
+                    contents.replace(chunk->offset(), content.size(), content);
+                }
+            }
+            // holes arrive as descriptors and are recreated without writing them
+            else
+            {
+                DFSSpan span("disk_write");
+                if (!outfile.Write(*chunk))
+                {
+                    dfs_log(LL_ERROR) << "Failed to write file: " << filepath;
+                    return grpc::Status(StatusCode::INTERNAL, "Failed to write file");
+                }
+            }
+            bytes_written += content.size();
+
+            for (auto &forward : forwards)
+            {
+                DFSSpan span("forward");
+                if (forward->healthy && !forward->writer->Write(*chunk))
+                {
+                    dfs_log(LL_ERROR) << "Failed to forward chunk to replica";
+                    forward->healthy = false;
+                }
+            }
+
+            // Check for client cancellation
+            if (context->IsCancelled())
+            {
+                dfs_log(LL_SYSINFO) << "Client cancelled the request.";
+                if (outfile.IsOpen())
+                {
+                    outfile.Close();
+                }
+                return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
+            }
+
+            // For debugging purposes
+            if (DFS_LOG_LEVEL >= LL_DEBUG)
+            {
+                DFSSpan span("log");
+                dfs_log(LL_DEBUG) << "Writing " << chunk->chunk_num() << " chunk: " << content.size() << " bytes at " << chunk->offset();
+            }
+        }
+        if (small)
+        {
+            bool replaced = false;
+            {
+                DFSSpan span("pack");
+                if (!packs->Put(filename, contents, mtime.empty() ? time(nullptr) : std::atoll(mtime.c_str()), &replaced))
+                {
+                    dfs_log(LL_ERROR) << "Failed to pack file: " << filename;
+                    return grpc::Status(StatusCode::INTERNAL, "Failed to write file");
+                }
+            }
+            // an earlier, larger version may be in the mount, unless the name was packed already
+            if (!replaced)
+            {
+                const bool compressed = DropCompressed(filename);
+                if (unlink(filepath.c_str()) == 0 || compressed)
+                {
+                    dfs_prune_parents(mount_path, filename);
+                }
+            }
+        }
+        else
+        {
+            bool closed;
+            {
+                DFSSpan span("close");
+                closed = outfile.Close();
+            }
+            if (!closed)
+            {
+                dfs_log(LL_ERROR) << "Failed to finish file: " << filepath;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to write file");
+            }
+            if (!mtime.empty() && !dfs_set_mtime(filepath, std::atoll(mtime.c_str())))
+            {
+                dfs_log(LL_ERROR) << "Failed to set mtime of " << filepath;
+            }
+            // and an earlier, smaller one in the packs, which would otherwise be served instead
+            if (packs && !packs->Remove(filename))
+            {
+                dfs_log(LL_ERROR) << "Failed to unpack the earlier version of " << filename;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to write file");
+            }
+            if (compress_at_rest)
+            {
+                CompressInMount(filename);
+            }
+            else
+            {
+                DropCompressed(filename);
+            }
+        }
+        if (tiers)
+        {
+            tiers->DropCold(filename);
+        }
+        RefreshIndex(filename, !small);
+        events.Publish(filename);
+
+        if (!forwards.empty())
+        {
+            DFSSpan span("await_replicas");
+            if (!AwaitReplicas(forwards))
+            {
+                dfs_log(LL_ERROR) << "Replication quorum not reached for " << filename;
+                return grpc::Status(StatusCode::UNAVAILABLE, "Replication quorum not reached");
+            }
+        }
+
+        response->set_descstatus("File stored successfully");
+
+        return grpc::Status::OK;
+    }
+
+    ::grpc::Status fetchFile(::grpc::ServerContext *context,
+                             const ::dfs_service::FilePath *request,
+                             ::grpc::ServerWriter<::dfs_service::FileChunk> *writer) override
+    {
+        if (!dfs_valid_path(request->path()))
+        {
+            dfs_log(LL_ERROR) << "Invalid filename: " << request->path();
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid filename");
+        }
+        if (request->offset() < 0 || request->length() < 0)
+        {
+            dfs_log(LL_ERROR) << "Invalid range: " << request->offset() << "+" << request->length();
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid range");
+        }
+        std::string wrapedPath = WrapPath(request->path());
+        DFSTrace trace(context, "fetchFile", request->path());
+        const int64_t length = request->length() > 0 ? request->length() : -1;
+
+        // admit the request before reading any data
+        struct stat file_stat;
+        int64_t filesize = 0;
+        DFSTierManager::Location location{wrapedPath, false, false, 0, 0};
+        DFSPackStore::Info packed;
+        const bool small = packs && packs->Get(request->path(), &packed);
+        if (small)
+        {
+            filesize = packed.size;
+        }
+        else if (stat(wrapedPath.c_str(), &file_stat) == 0)
+        {
+            if (S_ISDIR(file_stat.st_mode))
+            {
+                dfs_log(LL_ERROR) << "Not a file: " << wrapedPath;
+                return grpc::Status(StatusCode::NOT_FOUND, "File not found");
+            }
+            filesize = file_stat.st_size;
+        }
+        else if (Locate(request->path(), &location))
+        {
+            filesize = location.size;
+        }
+        if (tiers)
+        {
+            tiers->Touch(request->path());
+        }
+        // a ranged read is admitted for the bytes it covers
+        filesize = std::max<int64_t>(0, filesize - request->offset());
+        if (length >= 0)
+        {
+            filesize = std::min(filesize, length);
+        }
+        RecordOp(context, "fetch", request->path(), filesize);
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status admitted;
+        {
+            DFSSpan span("admit");
+            admitted = admission.Admit(context, "fetch", filesize, &ticket);
+        }
+        if (!admitted.ok())
+        {
+            return admitted;
+        }
+
+        if (small)
+        {
+            std::string contents;
+            {
+                DFSSpan span("disk_read");
+                if (!packs->Get(request->path(), &packed, &contents))
+                {
+                    dfs_log(LL_ERROR) << "File not found: " << wrapedPath;
+                    return grpc::Status(StatusCode::NOT_FOUND, "File not found");
+                }
+            }
+            context->AddInitialMetadata("mtime", std::to_string(packed.modified_time));
+            DFSPackReader infile(std::move(contents), request->offset(), length);
+            return SendChunks(context, writer, &infile);
+        }
+
+        int fd = open(location.path.c_str(), O_RDONLY);
+        if (fd < 0 && Locate(request->path(), &location))
+        {
+            // moved to the other tier since it was looked up
+            fd = open(location.path.c_str(), O_RDONLY);
+        }
+        // check if the file exists
+        if (fd < 0)
+        {
+            dfs_log(LL_ERROR) << "File not found: " << wrapedPath;
+            return grpc::Status(StatusCode::NOT_FOUND, "File not found");
+        }
+
+        // the client gives its copy the same mtime
+        if (fstat(fd, &file_stat) == 0)
+        {
+            context->AddInitialMetadata("mtime", std::to_string(file_stat.st_mtime));
+        }
+
+        grpc::Status status;
+        if (location.compressed)
+        {
+            // only the frames in the range are read, and sent as stored if the client inflates them
+            DFSZFileReader infile(fd, request->offset(), length, request->frames());
+            status = SendChunks(context, writer, &infile);
+        }
+        else
+        {
+            // only the data extents are read and sent, holes go out as descriptors
+            DFSChunkReader infile(fd, BUF_SIZE, request->offset(), length);
+            status = SendChunks(context, writer, &infile);
+        }
+        close(fd);
+        if (status.error_code() == StatusCode::INTERNAL)
+        {
+            dfs_log(LL_ERROR) << "Failed to read file: " << location.path;
+        }
+        return status;
+    }
+
+    ::grpc::Status deleteFile(::grpc::ServerContext *context,
+                              const ::dfs_service::FilePath *request,
+                              ::dfs_service::ResponseStatus *response) override
+    {
+        // check if the context is cancelled
+        if (context->IsCancelled())
+        {
+            dfs_log(LL_SYSINFO) << "Client cancelled the request.";
+            return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
+        }
+
+        DFSTrace trace(context, "deleteFile", request->path());
+        RecordOp(context, "delete", request->path(), 0);
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status admitted = admission.Admit(context, "delete", 0, &ticket);
+        if (!admitted.ok())
+        {
+            return admitted;
+        }
+
+        if (!dfs_valid_path(request->path()))
+        {
+            dfs_log(LL_ERROR) << "Invalid filename: " << request->path();
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid filename");
+        }
+        std::string path = WrapPath(request->path());
+        WriteLock lock(this, request->path());
+        std::unique_ptr<DFSTierManager::Pin> pin;
+        if (tiers)
+        {
+            pin.reset(new DFSTierManager::Pin(tiers.get(), request->path()));
+        }
+        // check if the file exists, in either tier
+        struct stat file_stat;
+        const bool hot = stat(path.c_str(), &file_stat) == 0 && !S_ISDIR(file_stat.st_mode);
+        bool small = false;
+        if (packs && !packs->Remove(request->path(), &small))
+        {
+            // the file would come back when the packs are replayed
+            dfs_log(LL_ERROR) << "Failed to delete packed file: " << request->path();
+            return grpc::Status(StatusCode::INTERNAL, "Failed to delete file");
+        }
+        const bool cold = tiers && tiers->DropCold(request->path());
+        const bool compressed = DropCompressed(request->path());
+        if (!hot && !cold && !small && !compressed)
+        {
+            // a retry after UNAVAILABLE finds the file gone here, and still reaches the replicas that missed it
+            ForwardDelete(context, *request);
+            dfs_log(LL_ERROR) << "File not found: " << path;
+            return grpc::Status(StatusCode::NOT_FOUND, "File not found");
+        }
+
+        // remove the file
+        if (hot)
+        {
+            DFSSpan span("unlink");
+            if (std::remove(path.c_str()) != 0)
+            {
+                dfs_log(LL_ERROR) << "Failed to delete file: " << path;
+                return grpc::Status(StatusCode::CANCELLED, "Failed to delete file");
+            }
+        }
+        // directories exist only to hold files, drop the ones this delete emptied
+        dfs_prune_parents(mount_path, request->path());
+        RefreshIndex(request->path());
+        events.Publish(request->path());
+
+        // a replica that missed the delete would keep serving the file to readers
+        if (context->client_metadata().count("replicated") == 0 && ForwardDelete(context, *request) < write_quorum)
+        {
+            dfs_log(LL_ERROR) << "Replication quorum not reached for " << request->path();
+            return grpc::Status(StatusCode::UNAVAILABLE, "Replication quorum not reached");
+        }
+
+        dfs_log(LL_SYSINFO) << "File deleted successfully";
+        return grpc::Status::OK;
+    }
+
+    ::grpc::Status copyFile(::grpc::ServerContext *context,
+                            const ::dfs_service::FilePair *request,
+                            ::dfs_service::ResponseStatus *response) override
+    {
+        DFSTrace trace(context, "copyFile", request->source());
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status status = admission.Admit(context, "copy", 0, &ticket);
+        if (!status.ok())
+        {
+            return status;
+        }
+        status = CheckPair(*request);
+        if (!status.ok())
+        {
+            return status;
+        }
+        const std::string &source = request->source();
+        const std::string &destination = request->destination();
+        WriteLock lock(this, {source, destination});
+        std::unique_ptr<DFSTierManager::Pin> pins[2];
+        PinPair(*request, pins);
+
+        // the copy is a new file; a forwarded one gets the primary's mtime
+        int64_t modified_time = time(nullptr);
+        const auto &metadata = context->client_metadata();
+        auto mtime = metadata.find("mtime");
+        if (mtime != metadata.end())
+        {
+            modified_time = std::atoll(std::string(mtime->second.data(), mtime->second.size()).c_str());
+        }
+
+        // a packed file is small, and its copy is packed too
+        DFSPackStore::Info packed;
+        std::string contents;
+        const bool small = packs && packs->Get(source, &packed, &contents);
+        if (small)
+        {
+            DFSSpan span("pack");
+            if (!packs->Put(destination, contents, modified_time))
+            {
+                dfs_log(LL_ERROR) << "Failed to pack file: " << destination;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to copy file");
+            }
+            const bool compressed = DropCompressed(destination);
+            if (unlink(WrapPath(destination).c_str()) == 0 || compressed)
+            {
+                dfs_prune_parents(mount_path, destination);
+            }
+        }
+        else
+        {
+            status = CopyIntoMount(source, destination, modified_time);
+            if (!status.ok())
+            {
+                return status;
+            }
+            if (packs && !packs->Remove(destination))
+            {
+                dfs_log(LL_ERROR) << "Failed to unpack the earlier version of " << destination;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to copy file");
+            }
+            if (compress_at_rest)
+            {
+                CompressInMount(destination);
+            }
+            else
+            {
+                DropCompressed(destination);
+            }
+        }
+        if (tiers)
+        {
+            tiers->DropCold(destination);
+        }
+        RefreshIndex(destination, !small);
+        events.Publish(destination);
+
+        // as for a store, write_quorum replicas must make the copy; they give it this copy's mtime
+        if (context->client_metadata().count("replicated") == 0 &&
+            ForwardUnary<ResponseStatus>(context, [request](DFSService::Stub *stub, ClientContext *replica_context, ResponseStatus *replica_response)
+                                         { return stub->copyFile(replica_context, *request, replica_response); },
+                                         {{"mtime", std::to_string(modified_time)}}) < write_quorum)
+        {
+            dfs_log(LL_ERROR) << "Replication quorum not reached for " << destination;
+            return grpc::Status(StatusCode::UNAVAILABLE, "Replication quorum not reached");
+        }
+
+        response->set_descstatus("File copied successfully");
+        return grpc::Status::OK;
+    }
+
+    ::grpc::Status renameFile(::grpc::ServerContext *context,
+                              const ::dfs_service::FilePair *request,
+                              ::dfs_service::ResponseStatus *response) override
+    {
+        DFSTrace trace(context, "renameFile", request->source());
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status status = admission.Admit(context, "rename", 0, &ticket);
+        if (!status.ok())
+        {
+            return status;
+        }
+        status = CheckPair(*request);
+        if (!status.ok())
+        {
+            return status;
+        }
+        const std::string &source = request->source();
+        const std::string &destination = request->destination();
+        const std::string source_path = WrapPath(source);
+        const std::string destination_path = WrapPath(destination);
+        WriteLock lock(this, {source, destination});
+        std::unique_ptr<DFSTierManager::Pin> pins[2];
+        PinPair(*request, pins);
+
+        // the file keeps its store and its mtime; the destination's copies in the other stores go
+        DFSPackStore::Info packed;
+        std::string contents;
+        DFSTierManager::Location location{source_path, false, false, 0, 0};
+        struct stat file_stat;
+        const bool small = packs && packs->Get(source, &packed, &contents);
+        if (small)
+        {
+            DFSSpan span("pack");
+            if (!packs->Put(destination, contents, packed.modified_time))
+            {
+                dfs_log(LL_ERROR) << "Failed to pack file: " << destination;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to rename file");
+            }
+            if (!packs->Remove(source))
+            {
+                dfs_log(LL_ERROR) << "Failed to unpack renamed file: " << source;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to rename file");
+            }
+            const bool compressed = DropCompressed(destination);
+            if (unlink(destination_path.c_str()) == 0 || compressed)
+            {
+                dfs_prune_parents(mount_path, destination);
+            }
+            if (tiers)
+            {
+                tiers->DropCold(destination);
+            }
+        }
+        else if (stat(source_path.c_str(), &file_stat) == 0 && !S_ISDIR(file_stat.st_mode))
+        {
+            DFSSpan span("rename");
+            if (!dfs_make_parents(destination_path) || rename(source_path.c_str(), destination_path.c_str()) != 0)
+            {
+                dfs_log(LL_ERROR) << "Failed to rename " << source_path << " to " << destination_path << ": " << strerror(errno);
+                return grpc::Status(StatusCode::INTERNAL, "Failed to rename file");
+            }
+            dfs_prune_parents(mount_path, source);
+            DropCompressed(destination);
+            if (packs && !packs->Remove(destination))
+            {
+                dfs_log(LL_ERROR) << "Failed to unpack the earlier version of " << destination;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to rename file");
+            }
+            if (tiers)
+            {
+                tiers->DropCold(destination);
+            }
+        }
+        else if (Locate(source, &location) && location.compressed && !location.cold)
+        {
+            // a compressed file in the mount keeps its suffix under the new name
+            DFSSpan span("rename");
+            const std::string stored = destination_path + DFS_TIER_COMPRESSED;
+            if (!dfs_make_parents(stored) || rename(location.path.c_str(), stored.c_str()) != 0)
+            {
+                dfs_log(LL_ERROR) << "Failed to rename " << location.path << " to " << stored << ": " << strerror(errno);
+                return grpc::Status(StatusCode::INTERNAL, "Failed to rename file");
+            }
+            dfs_prune_parents(mount_path, source);
+            unlink(destination_path.c_str());
+            if (packs && !packs->Remove(destination))
+            {
+                dfs_log(LL_ERROR) << "Failed to unpack the earlier version of " << destination;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to rename file");
+            }
+            if (tiers)
+            {
+                tiers->DropCold(destination);
+            }
+        }
+        else if (location.cold)
+        {
+            DFSSpan span("rename");
+            const bool compressed = DropCompressed(destination);
+            if (unlink(destination_path.c_str()) == 0 || compressed)
+            {
+                dfs_prune_parents(mount_path, destination);
+            }
+            if (packs && !packs->Remove(destination))
+            {
+                dfs_log(LL_ERROR) << "Failed to unpack the earlier version of " << destination;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to rename file");
+            }
+            tiers->DropCold(destination);
+            if (!tiers->RenameCold(source, destination))
+            {
+                dfs_log(LL_ERROR) << "Failed to rename cold file " << source << " to " << destination;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to rename file");
+            }
+        }
+        else
+        {
+            dfs_log(LL_ERROR) << "File not found: " << source_path;
+            return grpc::Status(StatusCode::NOT_FOUND, "File not found");
+        }
+        RefreshIndex(source);
+        RefreshIndex(destination);
+        events.Publish(source);
+        events.Publish(destination);
+
+        // a replica that missed the rename would still serve the file under its old name
+        if (context->client_metadata().count("replicated") == 0 &&
+            ForwardUnary<ResponseStatus>(context, [request](DFSService::Stub *stub, ClientContext *replica_context, ResponseStatus *replica_response)
+                                         { return stub->renameFile(replica_context, *request, replica_response); }) < write_quorum)
+        {
+            dfs_log(LL_ERROR) << "Replication quorum not reached for " << destination;
+            return grpc::Status(StatusCode::UNAVAILABLE, "Replication quorum not reached");
+        }
+
+        response->set_descstatus("File renamed successfully");
+        return grpc::Status::OK;
+    }
+
+    ::grpc::Status writeFile(::grpc::ServerContext *context,
+                             ::grpc::ServerReader<::dfs_service::FileChunk> *reader,
+                             ::dfs_service::FileStatus *response) override
+    {
+        std::string filename;
+        if (!MetadataOf(context, "filename", &filename))
+        {
+            dfs_log(LL_ERROR) << "Filename not found in metadata";
+            return grpc::Status(StatusCode::CANCELLED, "Filename not found in metadata");
+        }
+        if (!dfs_valid_path(filename))
+        {
+            dfs_log(LL_ERROR) << "Invalid filename: " << filename;
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid filename");
+        }
+        std::string value;
+        dfs_service::WriteMode mode = dfs_service::APPEND;
+        if (MetadataOf(context, "mode", &value) && !dfs_service::WriteMode_Parse(value, &mode))
+        {
+            dfs_log(LL_ERROR) << "Invalid write mode: " << value;
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid write mode");
+        }
+        const int64_t offset = MetadataOf(context, "offset", &value) ? std::atoll(value.c_str()) : 0;
+        const int64_t expected_size = MetadataOf(context, "expected_size", &value) ? std::atoll(value.c_str()) : -1;
+        const int64_t filesize = MetadataOf(context, "filesize", &value) ? std::atoll(value.c_str()) : 0;
+        if (offset < 0)
+        {
+            dfs_log(LL_ERROR) << "Invalid offset: " << offset;
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid offset");
+        }
+        // the file gets the client's mtime, or else the time of the write
+        const int64_t modified_time = MetadataOf(context, "mtime", &value) ? std::atoll(value.c_str()) : time(nullptr);
+        const std::string filepath = WrapPath(filename);
+        DFSTrace trace(context, "writeFile", filename);
+
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status status;
+        {
+            DFSSpan span("admit");
+            status = admission.Admit(context, "write", filesize, &ticket);
+        }
+        if (!status.ok())
+        {
+            return status;
+        }
+
+        // the size checked and appended to stays the size until the write is done
+        WriteLock lock(this, filename);
+        std::unique_ptr<DFSTierManager::Pin> pin;
+        if (tiers)
+        {
+            pin.reset(new DFSTierManager::Pin(tiers.get(), filename));
+        }
+
+        // the current size, wherever the file is kept; a missing file is empty
+        int64_t size = 0;
+        DFSPackStore::Info packed;
+        std::string contents;
+        DFSTierManager::Location location;
+        struct stat file_stat;
+        const bool small = packs && packs->Get(filename, &packed, &contents);
+        bool elsewhere = false;
+        if (small)
+        {
+            size = packed.size;
+        }
+        else if (stat(filepath.c_str(), &file_stat) == 0)
+        {
+            if (S_ISDIR(file_stat.st_mode))
+            {
+                return grpc::Status(StatusCode::INVALID_ARGUMENT, "File is a directory");
+            }
+            size = file_stat.st_size;
+        }
+        else if (Locate(filename, &location) && (location.cold || location.compressed))
+        {
+            elsewhere = true;
+            size = location.size;
+        }
+        if (expected_size >= 0 && size != expected_size)
         {
-            dfs_log(LL_ERROR) << "Filename not found in metadata";
-            return grpc::Status(StatusCode::CANCELLED, "Filename not found in metadata");
+            dfs_log(LL_ERROR) << "Size of " << filename << " is " << size << ", not " << expected_size;
+            return grpc::Status(StatusCode::FAILED_PRECONDITION, "File size is " + std::to_string(size));
         }
 
-        std::string filename = std::string(iter->second.data(), iter->second.size());
-        // wrap the path
-        std::string filepath = WrapPath(filename);
+        // the file is changed in place, so a packed, cold or compressed one moves into the mount first
+        if (small)
+        {
+            DFSSpan span("unpack");
+            DFSChunkWriter unpacked;
+            FileChunk collected;
+            collected.set_content(std::move(contents));
+            if (!dfs_make_parents(filepath) || !unpacked.Open(filepath) || !unpacked.Write(collected) || !unpacked.Close())
+            {
+                dfs_log(LL_ERROR) << "Failed to unpack file: " << filepath;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to write file");
+            }
+            if (!packs->Remove(filename))
+            {
+                dfs_log(LL_ERROR) << "Failed to unpack file: " << filename;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to write file");
+            }
+        }
+        else if (elsewhere)
+        {
+            status = CopyIntoMount(filename, filename, location.modified_time);
+            if (!status.ok())
+            {
+                return status;
+            }
+            if (tiers)
+            {
+                tiers->DropCold(filename);
+            }
+            DropCompressed(filename);
+        }
 
-        // open the file to writie the chunks
-        std::ofstream outfile(filepath, std::ios::out | std::ios::binary);
-        if (!outfile.is_open())
+        const int64_t base = mode == dfs_service::APPEND ? size : offset;
+        DFSChunkWriter outfile;
+        if (!dfs_make_parents(filepath) || !outfile.OpenAt(filepath, base, mode == dfs_service::TRUNCATE))
         {
             dfs_log(LL_ERROR) << "Failed to open file for writing: " << filepath;
             return grpc::Status(StatusCode::INTERNAL, "Failed to open file for writing");
         }
 
-        dfs_service::FileChunk chunk;
-        int64_t bytes_written = 0;
-        while (reader->Read(&chunk))
+        // the replicas write at the same place; an append cuts the file there
+        // first, so a replica that got ahead of this server ends up the same
+        std::vector<std::shared_ptr<ReplicaStream>> forwards;
+        if (context->client_metadata().count("replicated") == 0)
         {
-            const std::string &content = chunk.content();
-            outfile.write(content.data(), content.size());
-            bytes_written += content.size();
+            const dfs_service::WriteMode forward_mode = mode == dfs_service::OVERWRITE ? dfs_service::OVERWRITE : dfs_service::TRUNCATE;
+            forwards = OpenReplicaStreams(context,
+                                          {{"filename", filename},
+                                           {"mode", dfs_service::WriteMode_Name(forward_mode)},
+                                           {"offset", std::to_string(base)},
+                                           {"filesize", std::to_string(filesize)},
+                                           {"mtime", std::to_string(modified_time)}},
+                                          [](DFSService::Stub *stub, ReplicaStream *forward)
+                                          { return stub->writeFile(&forward->context, &forward->written); });
+        }
+
+        const std::string client = ClientOf(context);
+        const bool paced = bandwidth.Enabled();
+
+        DFSChunkPool::Chunk chunk = DFSChunkPool::Acquire();
+        for (;;)
+        {
+            {
+                DFSSpan span("stream_read");
+                if (!reader->Read(chunk.get()))
+                {
+                    break;
+                }
+            }
+            if (chunk->offset() < 0 || chunk->hole_length() < 0)
+            {
+                dfs_log(LL_ERROR) << "Invalid chunk at " << chunk->offset() << " for " << filepath;
+                return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid chunk offset");
+            }
+            if (paced)
+            {
+                DFSSpan span("pace");
+                bandwidth.Acquire(client, chunk->content().size());
+            }
+            {
+                DFSSpan span("disk_write");
+                if (!outfile.Write(*chunk))
+                {
+                    dfs_log(LL_ERROR) << "Failed to write file: " << filepath;
+                    return grpc::Status(StatusCode::INTERNAL, "Failed to write file");
+                }
+            }
+
+            for (auto &forward : forwards)
+            {
+                DFSSpan span("forward");
+                if (forward->healthy && !forward->writer->Write(*chunk))
+                {
+                    dfs_log(LL_ERROR) << "Failed to forward chunk to replica";
+                    forward->healthy = false;
+                }
+            }
 
-            // Check for client cancellation
             if (context->IsCancelled())
             {
                 dfs_log(LL_SYSINFO) << "Client cancelled the request.";
-                outfile.close();
+                outfile.Close();
                 return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
             }
+        }
+        {
+            DFSSpan span("close");
+            if (!outfile.Close())
+            {
+                dfs_log(LL_ERROR) << "Failed to finish file: " << filepath;
+                return grpc::Status(StatusCode::INTERNAL, "Failed to write file");
+            }
+        }
+        if (!dfs_set_mtime(filepath, modified_time))
+        {
+            dfs_log(LL_ERROR) << "Failed to set mtime of " << filepath;
+        }
+        RefreshIndex(filename, true);
+        events.Publish(filename);
 
-            // For debugging purposes
-            dfs_log(LL_DEBUG) << "Writing " << chunk.chunk_num() << " chunk: " << content.size() << " bytes";
+        if (!forwards.empty())
+        {
+            DFSSpan span("await_replicas");
+            if (!AwaitReplicas(forwards))
+            {
+                dfs_log(LL_ERROR) << "Replication quorum not reached for " << filename;
+                return grpc::Status(StatusCode::UNAVAILABLE, "Replication quorum not reached");
+            }
         }
-        outfile.close();
 
-        response->set_descstatus("File stored successfully");
+        if (stat(filepath.c_str(), &file_stat) == 0)
+        {
+            response->set_size(file_stat.st_size);
+            response->set_modified_time(file_stat.st_mtime);
+            response->set_creation_time(file_stat.st_ctime);
+        }
+        return grpc::Status::OK;
+    }
+
+    ::grpc::Status startUpload(::grpc::ServerContext *context,
+                               const ::dfs_service::UploadRequest *request,
+                               ::dfs_service::UploadHandle *response) override
+    {
+        DFSTrace trace(context, "startUpload", request->filename());
+        if (!uploads)
+        {
+            return grpc::Status(StatusCode::UNIMPLEMENTED, "Striped uploads are not enabled");
+        }
+        const std::string &filename = request->filename();
+        if (!dfs_valid_path(filename))
+        {
+            dfs_log(LL_ERROR) << "Invalid filename: " << filename;
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid filename");
+        }
+        struct stat file_stat;
+        if (stat(WrapPath(filename).c_str(), &file_stat) == 0 && S_ISDIR(file_stat.st_mode))
+        {
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "File is a directory");
+        }
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status status = admission.Admit(context, "upload", 0, &ticket);
+        if (!status.ok())
+        {
+            return status;
+        }
+
+        // a forwarded upload keeps the primary's id and mtime
+        std::string id;
+        MetadataOf(context, "upload", &id);
+        const int64_t modified_time = request->modified_time() > 0 ? request->modified_time() : time(nullptr);
+        {
+            DFSSpan span("preallocate");
+            status = uploads->Start(filename, request->size(), modified_time, &id);
+        }
+        if (!status.ok())
+        {
+            return status;
+        }
+
+        // a replica that missed the start fails the ranges, which count against the quorum
+        ForwardUnary<UploadHandle>(context, [request, modified_time](DFSService::Stub *stub, ClientContext *replica_context, UploadHandle *replica_response)
+                                   {
+            UploadRequest forwarded(*request);
+            forwarded.set_modified_time(modified_time);
+            return stub->startUpload(replica_context, forwarded, replica_response); },
+                                   {{"upload", id}});
 
+        response->set_id(id);
         return grpc::Status::OK;
     }
 
-    ::grpc::Status fetchFile(::grpc::ServerContext *context,
-                             const ::dfs_service::FilePath *request,
-                             ::grpc::ServerWriter<::dfs_service::FileChunk> *writer) override
+    ::grpc::Status uploadRange(::grpc::ServerContext *context,
+                               ::grpc::ServerReader<::dfs_service::FileChunk> *reader,
+                               ::dfs_service::ResponseStatus *response) override
     {
-        std::string wrapedPath = WrapPath(request->path());
-        std::ifstream infile(wrapedPath, std::ios::in | std::ios::binary);
-        // check if the file exists
-        if (!infile.is_open())
+        if (!uploads)
         {
-            dfs_log(LL_ERROR) << "File not found: " << wrapedPath;
-            return grpc::Status(StatusCode::NOT_FOUND, "File not found");
+            return grpc::Status(StatusCode::UNIMPLEMENTED, "Striped uploads are not enabled");
+        }
+        std::string id;
+        if (!MetadataOf(context, "upload", &id))
+        {
+            dfs_log(LL_ERROR) << "Upload not found in metadata";
+            return grpc::Status(StatusCode::CANCELLED, "Upload not found in metadata");
+        }
+        DFSTrace trace(context, "uploadRange", id);
+        std::string filesize;
+        MetadataOf(context, "filesize", &filesize);
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status status;
+        {
+            DFSSpan span("admit");
+            status = admission.Admit(context, "upload", std::atoll(filesize.c_str()), &ticket);
+        }
+        if (!status.ok())
+        {
+            return status;
+        }
+
+        DFSUploadTable::Range range(uploads.get(), id);
+        if (!range.Ok())
+        {
+            dfs_log(LL_ERROR) << "Upload not found: " << id;
+            return grpc::Status(StatusCode::NOT_FOUND, "Upload not found");
+        }
+        // every stream writes through a descriptor of its own, at the offsets of its chunks
+        DFSChunkWriter outfile;
+        if (!outfile.OpenAt(range.Staging(), 0, false))
+        {
+            dfs_log(LL_ERROR) << "Failed to open file for writing: " << range.Staging();
+            return grpc::Status(StatusCode::INTERNAL, "Failed to open file for writing");
+        }
+
+        std::vector<std::shared_ptr<ReplicaStream>> forwards;
+        if (context->client_metadata().count("replicated") == 0)
+        {
+            forwards = OpenReplicaStreams(context, {{"upload", id}, {"filesize", filesize}},
+                                          [](DFSService::Stub *stub, ReplicaStream *forward)
+                                          { return stub->uploadRange(&forward->context, &forward->response); });
         }
 
-        // prepare the buffer to read the file
-        char buffer[BUF_SIZE];
-        int32_t chunk_num = 0;
-        while (infile.read(buffer, BUF_SIZE) || infile.gcount())
+        const std::string client = ClientOf(context);
+        const bool paced = bandwidth.Enabled();
+
+        DFSChunkPool::Chunk chunk = DFSChunkPool::Acquire();
+        for (;;)
         {
-            dfs_service::FileChunk chunk;
-            chunk.set_content(buffer, infile.gcount());
-            chunk.set_chunk_num(chunk_num++);
+            {
+                DFSSpan span("stream_read");
+                if (!reader->Read(chunk.get()))
+                {
+                    break;
+                }
+            }
+            const int64_t end = chunk->offset() + (chunk->hole_length() > 0 ? chunk->hole_length() : chunk->content().size());
+            if (chunk->offset() < 0 || chunk->hole_length() < 0 || end > range.Size())
+            {
+                dfs_log(LL_ERROR) << "Chunk at " << chunk->offset() << " is outside upload " << id;
+                return grpc::Status(StatusCode::INVALID_ARGUMENT, "Chunk outside the file");
+            }
+            if (paced)
+            {
+                DFSSpan span("pace");
+                bandwidth.Acquire(client, chunk->content().size());
+            }
+            {
+                DFSSpan span("disk_write");
+                if (!outfile.Write(*chunk))
+                {
+                    dfs_log(LL_ERROR) << "Failed to write file: " << range.Staging();
+                    return grpc::Status(StatusCode::INTERNAL, "Failed to write file");
+                }
+            }
+            range.Wrote(chunk->offset(), end);
+
+            for (auto &forward : forwards)
+            {
+                DFSSpan span("forward");
+                if (forward->healthy && !forward->writer->Write(*chunk))
+                {
+                    dfs_log(LL_ERROR) << "Failed to forward chunk to replica";
+                    forward->healthy = false;
+                }
+            }
+
             if (context->IsCancelled())
             {
                 dfs_log(LL_SYSINFO) << "Client cancelled the request.";
-                infile.close();
                 return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
             }
-            if (!writer->Write(chunk))
+        }
+        {
+            DFSSpan span("close");
+            if (!outfile.Close())
             {
-                dfs_log(LL_ERROR) << "Failed to write chunk to stream(from server to clinet)";
-                infile.close();
-                return grpc::Status(StatusCode::CANCELLED, "Failed to write chunk to client");
+                dfs_log(LL_ERROR) << "Failed to finish file: " << range.Staging();
+                return grpc::Status(StatusCode::INTERNAL, "Failed to write file");
             }
-            dfs_log(LL_DEBUG) << "Writing chunk: " << chunk_num << " size: " << infile.gcount();
         }
-        infile.close();
 
-        return grpc::Status(StatusCode::OK, "File sent successfully");
+        if (!forwards.empty())
+        {
+            DFSSpan span("await_replicas");
+            if (!AwaitReplicas(forwards))
+            {
+                dfs_log(LL_ERROR) << "Replication quorum not reached for upload " << id;
+                return grpc::Status(StatusCode::UNAVAILABLE, "Replication quorum not reached");
+            }
+        }
+
+        response->set_descstatus("Range written successfully");
+        return grpc::Status::OK;
     }
 
-    ::grpc::Status deleteFile(::grpc::ServerContext *context,
-                              const ::dfs_service::FilePath *request,
-                              ::dfs_service::ResponseStatus *response) override
+    ::grpc::Status finishUpload(::grpc::ServerContext *context,
+                                const ::dfs_service::UploadHandle *request,
+                                ::dfs_service::FileStatus *response) override
     {
-        // check if the context is cancelled
-        if (context->IsCancelled())
+        DFSTrace trace(context, "finishUpload", request->id());
+        if (!uploads)
         {
-            dfs_log(LL_SYSINFO) << "Client cancelled the request.";
-            return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
+            return grpc::Status(StatusCode::UNIMPLEMENTED, "Striped uploads are not enabled");
+        }
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status status = admission.Admit(context, "upload", 0, &ticket);
+        if (!status.ok())
+        {
+            return status;
+        }
+        std::string filename;
+        if (!uploads->FilenameOf(request->id(), &filename))
+        {
+            dfs_log(LL_ERROR) << "Upload not found: " << request->id();
+            return grpc::Status(StatusCode::NOT_FOUND, "Upload not found");
         }
+        auto forward = [request](DFSService::Stub *stub, ClientContext *replica_context, FileStatus *replica_response)
+        { return stub->finishUpload(replica_context, *request, replica_response); };
 
-        std::string path = WrapPath(request->path());
-        // check if the file exists
-        struct stat file_stat;
-        if (stat(path.c_str(), &file_stat) != 0)
+        if (request->abort())
         {
-            dfs_log(LL_ERROR) << "File not found: " << path;
-            return grpc::Status(StatusCode::NOT_FOUND, "File not found");
+            status = uploads->Abort(request->id());
+            ForwardUnary<FileStatus>(context, forward);
+            return status;
         }
 
-        // remove the file
-        if (std::remove(path.c_str()) != 0)
+        WriteLock lock(this, filename);
+        std::unique_ptr<DFSTierManager::Pin> pin;
+        if (tiers)
+        {
+            pin.reset(new DFSTierManager::Pin(tiers.get(), filename));
+        }
+        const std::string filepath = WrapPath(filename);
+        {
+            DFSSpan span("commit");
+            status = uploads->Commit(request->id(), filepath);
+        }
+        if (!status.ok())
+        {
+            return status;
+        }
+        // the committed file replaces any other version of it
+        if (packs && !packs->Remove(filename))
+        {
+            dfs_log(LL_ERROR) << "Failed to unpack the earlier version of " << filename;
+            return grpc::Status(StatusCode::INTERNAL, "Failed to finish upload");
+        }
+        if (compress_at_rest)
+        {
+            CompressInMount(filename);
+        }
+        else
+        {
+            DropCompressed(filename);
+        }
+        if (tiers)
         {
-            dfs_log(LL_ERROR) << "Failed to delete file: " << path;
-            return grpc::Status(StatusCode::CANCELLED, "Failed to delete file");
+            tiers->DropCold(filename);
         }
+        RefreshIndex(filename, true);
+        events.Publish(filename);
 
-        dfs_log(LL_SYSINFO) << "File deleted successfully";
+        // as for a store, write_quorum replicas must commit their copies
+        if (context->client_metadata().count("replicated") == 0 && ForwardUnary<FileStatus>(context, forward) < write_quorum)
+        {
+            dfs_log(LL_ERROR) << "Replication quorum not reached for " << filename;
+            return grpc::Status(StatusCode::UNAVAILABLE, "Replication quorum not reached");
+        }
+
+        DFSTierManager::Location location;
+        struct stat file_stat;
+        if (Locate(filename, &location) && stat(location.path.c_str(), &file_stat) == 0)
+        {
+            response->set_size(location.size);
+            response->set_modified_time(file_stat.st_mtime);
+            response->set_creation_time(file_stat.st_ctime);
+        }
         return grpc::Status::OK;
     }
 
@@ -221,42 +2102,62 @@ public:
                              const ::dfs_service::ListFilesRequest *request,
                              ::dfs_service::LSResponse *response) override
     {
-        // Open the directory
-        DIR *dir = opendir(mount_path.c_str());
-        if (dir == nullptr)
+        DFSTrace trace(context, "listFiles");
+        RecordOp(context, "list", "", 0);
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status admitted = admission.Admit(context, "list", 0, &ticket);
+        if (!admitted.ok())
         {
-            dfs_log(LL_ERROR) << "Failed to open directory: " << strerror(errno);
-            return grpc::Status(grpc::INTERNAL, "Failed to open directory.");
+            return admitted;
         }
 
-        // Read the directory
-        struct dirent *entry;
-        struct stat file_stat;
-        while ((entry = readdir(dir)) != nullptr)
+        std::vector<DFSWalkEntry> entries;
+        grpc::Status status;
         {
-            if (context->IsCancelled())
+            DFSSpan span("walk");
+            if (request->recursive() && index)
             {
-                dfs_log(LL_SYSINFO) << "Client cancelled the request.";
-                closedir(dir);
-                return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
+                index->List(&entries);
             }
-
-            const std::string filename = entry->d_name;
-            const std::string wrapped_path = WrapPath(filename);
-            if (stat(wrapped_path.c_str(), &file_stat) != 0)
+            else
             {
-                dfs_log(LL_ERROR) << "Failed to stat file: " << wrapped_path;
-                continue;
+                status = request->recursive() ? ListTree(context, &entries) : ListTop(context, &entries);
             }
-
-            // record the file info
-            dfs_service::FileInfo *file_info = response->add_filesinfolist();
-            file_info->set_filename(filename);
-            file_info->set_modified_time(file_stat.st_mtime);
+        }
+        if (!status.ok())
+        {
+            return status;
+        }
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [](const DFSWalkEntry &entry)
+                                     { return IsStaging(entry.path); }),
+                      entries.end());
+        ResolveCompressed(&entries);
+        if (tiers)
+        {
+            tiers->ListCold(&entries, !request->recursive());
+        }
+        if (packs)
+        {
+            packs->List(&entries, !request->recursive());
         }
 
-        closedir(dir);
-        dfs_log(LL_SYSINFO) << "Sent file lists successfully";
+        DFSSpan span("encode");
+        if (request->packed())
+        {
+            dfs_pack_listing(entries, response->mutable_packed());
+        }
+        else
+        {
+            response->mutable_filesinfolist()->Reserve(entries.size());
+            for (DFSWalkEntry &entry : entries)
+            {
+                dfs_service::FileInfo *file_info = response->add_filesinfolist();
+                file_info->set_filename(std::move(entry.path));
+                file_info->set_modified_time(entry.modified_time);
+                file_info->set_size(entry.size);
+            }
+        }
+        dfs_log(LL_SYSINFO) << "Sent " << entries.size() << " files" << (request->packed() ? " packed" : "");
 
         return grpc::Status::OK;
     }
@@ -265,8 +2166,8 @@ public:
                               const ::dfs_service::FilePath *request,
                               ::dfs_service::FileStatus *response) override
     {
-        std::string path = WrapPath(request->path());
-        struct stat file_stat;
+        DFSTrace trace(context, "statusFile", request->path());
+        RecordOp(context, "stat", request->path(), 0);
 
         if (context->IsCancelled())
         {
@@ -274,20 +2175,155 @@ public:
             return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
         }
 
-        if (stat(path.c_str(), &file_stat) != 0)
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status admitted = admission.Admit(context, "stat", 0, &ticket);
+        if (!admitted.ok())
         {
-            dfs_log(LL_ERROR) << "Failed to stat file: " << path;
-            return grpc::Status(StatusCode::NOT_FOUND, "File not found");
+            return admitted;
         }
 
-        response->set_size(file_stat.st_size);
-        response->set_modified_time(file_stat.st_mtime);
-        response->set_creation_time(file_stat.st_ctime);
-        dfs_log(LL_DEBUG) << "File " << path << " size: " << file_stat.st_size << " mtime: " << file_stat.st_mtime << " ctime: " << file_stat.st_ctime;
-        dfs_log(LL_SYSINFO) << "File status retrieved successfully";
+        grpc::Status status = StatPath(request->path(), response);
+        if (status.ok())
+        {
+            dfs_log(LL_SYSINFO) << "File status retrieved successfully";
+        }
+        return status;
+    }
+
+    ::grpc::Status statusFiles(::grpc::ServerContext *context,
+                               const ::dfs_service::FilePaths *request,
+                               ::dfs_service::FileStatuses *response) override
+    {
+        DFSTrace trace(context, "statusFiles", std::to_string(request->paths_size()) + " files");
+        if (request->paths_size() > DFS_STAT_BATCH_MAX)
+        {
+            return grpc::Status(StatusCode::INVALID_ARGUMENT, "Too many files in one request");
+        }
+        if (context->IsCancelled())
+        {
+            dfs_log(LL_SYSINFO) << "Client cancelled the request.";
+            return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
+        }
+
+        std::unique_ptr<DFSAdmissionControl::Ticket> ticket;
+        grpc::Status admitted = admission.Admit(context, "stat", 0, &ticket);
+        if (!admitted.ok())
+        {
+            return admitted;
+        }
 
+        // answer what the metadata index knows from memory, and stat the rest on the disk
+        std::vector<int> misses;
+        for (const std::string &path : request->paths())
+        {
+            RecordOp(context, "stat", path, 0);
+            dfs_service::FileStatusEntry *entry = response->add_entries();
+            entry->set_path(path);
+            DFSMetadataIndex::Info info;
+            if (index && dfs_valid_path(path) && index->Lookup(path, &info))
+            {
+                if (tiers)
+                {
+                    tiers->Touch(path);
+                }
+                entry->set_code(StatusCode::OK);
+                entry->mutable_status()->set_size(info.size);
+                entry->mutable_status()->set_modified_time(info.modified_time);
+                entry->mutable_status()->set_creation_time(info.creation_time);
+                entry->mutable_status()->set_content_hash(info.hash);
+                continue;
+            }
+            misses.push_back(response->entries_size() - 1);
+        }
+
+        // each worker takes the next path; a stat costs a syscall at least, so a few run at once
+        std::atomic<size_t> next(0);
+        auto work = [&]()
+        {
+            for (size_t i = next++; i < misses.size() && !context->IsCancelled(); i = next++)
+            {
+                dfs_service::FileStatusEntry *entry = response->mutable_entries(misses[i]);
+                grpc::Status status = StatPath(entry->path(), entry->mutable_status());
+                entry->set_code(status.error_code());
+                if (!status.ok())
+                {
+                    entry->clear_status();
+                }
+            }
+        };
+        const size_t threads = std::min<size_t>(DFS_STAT_WORKERS, (misses.size() + DFS_STAT_PER_WORKER - 1) / DFS_STAT_PER_WORKER);
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < threads; i++)
+        {
+            workers.emplace_back(work);
+        }
+        work();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        if (context->IsCancelled())
+        {
+            return grpc::Status(StatusCode::DEADLINE_EXCEEDED, "Client cancelled the request.");
+        }
+        dfs_log(LL_SYSINFO) << "Status of " << response->entries_size() << " files retrieved, "
+                            << response->entries_size() - misses.size() << " from the index";
         return grpc::Status::OK;
     }
+
+    ::grpc::Status watch(::grpc::ServerContext *context,
+                         const ::dfs_service::WatchRequest *request,
+                         ::grpc::ServerWriter<::dfs_service::FileEvent> *writer) override
+    {
+        // watchers are long-lived and idle most of the time, so they bypass admission control
+        const std::string &prefix = request->prefix();
+        uint64_t cursor = events.Head();
+        std::vector<DFSEvent> batch;
+        bool resync;
+        dfs_service::FileEvent message;
+
+        dfs_log(LL_SYSINFO) << "Watcher " << ClientOf(context) << " subscribed at " << cursor;
+        while (!context->IsCancelled())
+        {
+            if (!events.Wait(&cursor, &batch, &resync, std::chrono::milliseconds(500)))
+            {
+                continue;
+            }
+            if (resync)
+            {
+                message.Clear();
+                message.set_kind(FileEvent::RESYNC);
+                message.set_sequence(cursor);
+                if (!writer->Write(message))
+                {
+                    dfs_log(LL_SYSINFO) << "Watcher went away";
+                    return grpc::Status::OK;
+                }
+            }
+            for (const DFSEvent &event : batch)
+            {
+                if ((event.path.compare(0, prefix.size(), prefix) != 0 && event.kind != DFSEvent::RESYNC) ||
+                    IsStaging(event.path) || IsCompressedEvent(event.path))
+                {
+                    continue;
+                }
+                message.set_filename(event.path);
+                message.set_kind(event.kind == DFSEvent::CHANGED   ? FileEvent::CHANGED
+                                 : event.kind == DFSEvent::DELETED ? FileEvent::DELETED
+                                                                   : FileEvent::RESYNC);
+                message.set_modified_time(event.modified_time);
+                message.set_sequence(event.sequence);
+                if (!writer->Write(message))
+                {
+                    dfs_log(LL_SYSINFO) << "Watcher went away";
+                    return grpc::Status::OK;
+                }
+            }
+        }
+
+        dfs_log(LL_SYSINFO) << "Watcher cancelled the request.";
+        return grpc::Status(StatusCode::CANCELLED, "Watch cancelled");
+    }
 };
 
 //
@@ -314,19 +2350,55 @@ DFSServerNode::DFSServerNode(const std::string &server_address,
 DFSServerNode::~DFSServerNode() noexcept
 {
     dfs_log(LL_SYSINFO) << "DFSServerNode shutting down";
-    this->server->Shutdown();
+    Shutdown();
+}
+
+void DFSServerNode::Shutdown()
+{
+    std::lock_guard<std::mutex> lock(this->server_mutex);
+    this->stopping = true;
+    if (this->server)
+    {
+        // a watch or a long transfer would otherwise hold up the shutdown forever
+        this->server->Shutdown(std::chrono::system_clock::now() + std::chrono::seconds(DFS_SHUTDOWN_GRACE));
+    }
 }
 
 /** Server start **/
 void DFSServerNode::Start()
 {
-    DFSServiceImpl service(this->mount_path);
+    DFSServiceImpl service(this->mount_path, this->options);
     ServerBuilder builder;
     builder.AddListeningPort(this->server_address, grpc::InsecureServerCredentials());
+    this->options.transport.ApplyTo(builder);
+    if (this->options.max_threads > 0 || this->options.memory_quota_bytes > 0)
+    {
+        // past the thread quota the sync server answers RESOURCE_EXHAUSTED on its own
+        grpc::ResourceQuota quota("dfs-server");
+        if (this->options.max_threads > 0)
+        {
+            quota.SetMaxThreads(this->options.max_threads);
+        }
+        if (this->options.memory_quota_bytes > 0)
+        {
+            quota.Resize(this->options.memory_quota_bytes);
+        }
+        builder.SetResourceQuota(quota);
+    }
     builder.RegisterService(&service);
-    this->server = builder.BuildAndStart();
+    {
+        std::lock_guard<std::mutex> lock(this->server_mutex);
+        this->server = builder.BuildAndStart();
+        if (this->stopping)
+        {
+            this->server->Shutdown();
+        }
+    }
     dfs_log(LL_SYSINFO) << "DFSServerNode server listening on " << this->server_address;
+    // returns after Shutdown(), and the service's destructor saves the index and flushes the recorder
     this->server->Wait();
+    std::lock_guard<std::mutex> lock(this->server_mutex);
+    this->server.reset();
 }
 
 //
@@ -334,3 +2406,7 @@ void DFSServerNode::Start()
 //
 // Add your additional DFSServerNode definitions here
 //
+void DFSServerNode::SetOptions(const DFSServerOptions &options)
+{
+    this->options = options;
+}
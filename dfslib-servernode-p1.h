@@ -2,12 +2,95 @@
 #define _DFSLIB_SERVERNODE_H
 
 #include <string>
+#include <vector>
 #include <iostream>
 #include <thread>
+#include <mutex>
 #include <grpcpp/grpcpp.h>
 
+#include "dfslib-shared-p1.h"
+#include "dfslib-bandwidth-p1.h"
+#include "dfslib-tiering-p1.h"
+#include "dfslib-packstore-p1.h"
+#include "dfslib-upload-p1.h"
+
 #define BUF_SIZE 1024
 
+/** Prefix of the file a copy is written to, next to its destination, before it is renamed into place **/
+#define DFS_COPY_STAGING ".dfs-copy-"
+
+/** Threads stating the files of one statusFiles request, at most **/
+#define DFS_STAT_WORKERS 8
+
+/** Files a statusFiles request has to stat on the disk for each of those threads **/
+#define DFS_STAT_PER_WORKER 64
+
+/** Seconds calls under way get to finish on shutdown before they are cancelled **/
+#define DFS_SHUTDOWN_GRACE 5
+
+/**
+ * Optional server features. The defaults give a plain single server.
+ */
+struct DFSServerOptions
+{
+    /** Replica servers that storeFile and deleteFile are forwarded to **/
+    std::vector<std::string> replicas;
+
+    /** Replicas that must hold a stored file before the client is answered (-1 = all) **/
+    int write_quorum = -1;
+
+    /** HTTP/2 settings for the listening port and the connections to replicas **/
+    DFSTransportOptions transport;
+
+    /** Streams admitted at once; more are rejected with RESOURCE_EXHAUSTED (0 = unlimited) **/
+    int max_inflight = 0;
+
+    /** Bytes of admitted transfers at once (0 = unlimited) **/
+    int64_t max_queued_bytes = 0;
+
+    /** Drop requests whose deadline is shorter than their expected service time **/
+    bool shed_late = false;
+
+    /** Threads the gRPC resource quota allows (0 = unlimited) **/
+    int max_threads = 0;
+
+    /** Memory the gRPC resource quota allows, in bytes (0 = unlimited) **/
+    int64_t memory_quota_bytes = 0;
+
+    /** Transfer rate shared by all clients, in bytes per second (0 = unlimited) **/
+    double bandwidth_bytes = 0;
+
+    /** Limits for clients without their own entry in client_shares **/
+    DFSClientShare default_share;
+
+    /** Per-client bandwidth ceilings and weights, keyed by client id **/
+    std::map<std::string, DFSClientShare> client_shares;
+
+    /** Threads walking the tree for a recursive listing (0 = one per core, at most 8) **/
+    int walk_threads = 0;
+
+    /** File the operations clients send are recorded to, for dfs-replay-p1 (empty = off) **/
+    std::string record_trace;
+
+    /** File the metadata index is kept in across restarts (empty = no index) **/
+    std::string snapshot_path;
+
+    /** Seconds between snapshots of the metadata index **/
+    int snapshot_interval = 60;
+
+    /** A cold tier that idle files move to (no cold_path = one tier) **/
+    DFSTierOptions tiers;
+
+    /** Keep stored files compressed in the mount, as DFS_TIER_COMPRESSED files (dfslib-zfile-p1.h) **/
+    bool compress_at_rest = false;
+
+    /** Pack files small files are appended to (no pack_path = a file per file) **/
+    DFSPackOptions packs;
+
+    /** Staging directory of striped uploads (no upload_path = no striped uploads) **/
+    DFSUploadOptions uploads;
+};
+
 class DFSServerNode
 {
 
@@ -21,15 +104,35 @@ private:
     /** The pointer to the grpc server instance **/
     std::unique_ptr<grpc::Server> server;
 
+    /** Guards server and stopping, as Shutdown() may come from another thread before Start() built the server **/
+    std::mutex server_mutex;
+    bool stopping = false;
+
     /** Server callback **/
     std::function<void()> grader_callback;
 
+    /** Optional features **/
+    DFSServerOptions options;
+
 public:
     DFSServerNode(const std::string &server_address, const std::string &mount_path, std::function<void()> callback);
     ~DFSServerNode();
+
+    /**
+     * Stops accepting calls and cancels those still running after
+     * DFS_SHUTDOWN_GRACE seconds, after which Start() returns. Safe to call
+     * from any thread, also before Start().
+     */
     void Shutdown();
     void Start();
 
+    /**
+     * Sets the optional server features. Must be called before Start().
+     *
+     * @param options
+     */
+    void SetOptions(const DFSServerOptions &options);
+
     //
     // STUDENT INSTRUCTION:
     //
@@ -2,7 +2,14 @@
 #include <iostream>
 #include <fstream>
 #include <cstddef>
+#include <sstream>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <grpc/grpc.h>
 
 #include "dfslib-shared-p1.h"
 #include "proto-src/dfs-service.grpc.pb.h"
@@ -23,3 +30,542 @@ dfs_log_level_e DFS_LOG_LEVEL = LL_ERROR;
 // Just be aware they are always submitted, so they should
 // be compilable.
 //
+
+DFSChunkReader::DFSChunkReader(int fd, size_t chunk_size, int64_t offset, int64_t length)
+    : fd(fd), chunk_size(chunk_size), extent_index(0), extent_done(0), chunk_num(0), failed(false)
+{
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+    {
+        failed = true;
+        return;
+    }
+    // only the range is described; lseek results past it are clipped
+    int64_t pos = std::min<int64_t>(std::max<int64_t>(offset, 0), file_stat.st_size);
+    const int64_t size = length < 0 ? file_stat.st_size : std::min<int64_t>(file_stat.st_size, pos + length);
+    while (pos < size)
+    {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0)
+        {
+            if (errno != ENXIO)
+            {
+                // SEEK_DATA is not supported here, treat the rest as data
+                extents.push_back({pos, size - pos, false});
+                break;
+            }
+            // no data after pos: the file ends with a hole
+            data = size;
+        }
+        if (data > pos)
+        {
+            extents.push_back({pos, data - pos, true});
+        }
+        if (data >= size)
+        {
+            break;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > size)
+        {
+            hole = size;
+        }
+        extents.push_back({data, hole - data, false});
+        pos = hole;
+    }
+}
+
+bool DFSChunkReader::Next(dfs_service::FileChunk *chunk)
+{
+    if (failed || extent_index >= extents.size())
+    {
+        return false;
+    }
+    const Extent &extent = extents[extent_index];
+    chunk->set_chunk_num(chunk_num++);
+
+    if (extent.hole)
+    {
+        chunk->clear_content();
+        chunk->set_offset(extent.offset);
+        chunk->set_hole_length(extent.length);
+        extent_index++;
+        return true;
+    }
+
+    const int64_t offset = extent.offset + extent_done;
+    const size_t length = std::min<int64_t>(chunk_size, extent.length - extent_done);
+    std::string *content = chunk->mutable_content();
+    content->resize(length);
+    ssize_t bytes = pread(fd, &(*content)[0], length, offset);
+    if (bytes <= 0)
+    {
+        failed = bytes < 0;
+        return false;
+    }
+    content->resize(bytes);
+    chunk->set_offset(offset);
+    chunk->set_hole_length(0);
+
+    extent_done += bytes;
+    if (extent_done >= extent.length)
+    {
+        extent_index++;
+        extent_done = 0;
+    }
+    return true;
+}
+
+bool DFSChunkReader::Failed() const
+{
+    return failed;
+}
+
+DFSChunkWriter::DFSChunkWriter() : fd(-1), end(0), base(0), size(0) {}
+
+DFSChunkWriter::~DFSChunkWriter()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+bool DFSChunkWriter::Open(const std::string &path)
+{
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    end = base = size = 0;
+    return fd >= 0;
+}
+
+bool DFSChunkWriter::OpenAt(const std::string &path, int64_t base, bool truncate)
+{
+    fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+    struct stat file_stat;
+    if (fd >= 0 && ((truncate && ftruncate(fd, base) != 0) || fstat(fd, &file_stat) != 0))
+    {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0)
+    {
+        return false;
+    }
+    this->base = base;
+    end = size = file_stat.st_size;
+    return true;
+}
+
+bool DFSChunkWriter::IsOpen() const
+{
+    return fd >= 0;
+}
+
+/**
+ * Zero a range of a file: punch it out where the filesystem can, else
+ * write zeros over it.
+ */
+static bool dfs_zero_range(int fd, int64_t offset, int64_t length)
+{
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)
+    {
+        return true;
+    }
+    static const std::string zeros(64 * 1024, '\0');
+    while (length > 0)
+    {
+        ssize_t bytes = pwrite(fd, zeros.data(), std::min<int64_t>(length, zeros.size()), offset);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        offset += bytes;
+        length -= bytes;
+    }
+    return true;
+}
+
+bool DFSChunkWriter::Write(const dfs_service::FileChunk &chunk)
+{
+    const int64_t offset = base + chunk.offset();
+    if (chunk.hole_length() > 0)
+    {
+        // nothing to write, the hole appears once the file is extended past it;
+        // only data the file had when it was opened must be zeroed
+        if (offset < size && !dfs_zero_range(fd, offset, std::min(chunk.hole_length(), size - offset)))
+        {
+            return false;
+        }
+        end = std::max<int64_t>(end, offset + chunk.hole_length());
+        return true;
+    }
+
+    const std::string &content = chunk.content();
+    size_t written = 0;
+    while (written < content.size())
+    {
+        ssize_t bytes = pwrite(fd, content.data() + written, content.size() - written, offset + written);
+        if (bytes < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        written += bytes;
+    }
+    end = std::max<int64_t>(end, offset + content.size());
+    return true;
+}
+
+bool DFSChunkWriter::Close()
+{
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = ftruncate(fd, end) == 0;
+    ok = close(fd) == 0 && ok;
+    fd = -1;
+    return ok;
+}
+
+uint64_t dfs_hash64(const char *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    // FNV alone clusters similar short keys ("host#1", "host#2"), so mix the bits
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+std::vector<std::string> dfs_split(const std::string &list, char delim)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, delim))
+    {
+        if (!item.empty())
+        {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+bool dfs_valid_path(const std::string &path)
+{
+    if (path.empty() || path[0] == '/' || path[path.size() - 1] == '/')
+    {
+        return false;
+    }
+    size_t start = 0;
+    while (start <= path.size())
+    {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos)
+        {
+            end = path.size();
+        }
+        const std::string component = path.substr(start, end - start);
+        if (component.empty() || component == "." || component == "..")
+        {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+bool dfs_make_parents(const std::string &filepath)
+{
+    size_t slash = filepath.find('/', 1);
+    while (slash != std::string::npos)
+    {
+        const std::string dir = filepath.substr(0, slash);
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            return false;
+        }
+        slash = filepath.find('/', slash + 1);
+    }
+    return true;
+}
+
+bool dfs_is_internal(const std::string &path)
+{
+    return path.compare(path.rfind('/') + 1, 5, ".dfs-") == 0;
+}
+
+bool dfs_is_temporary(const std::string &path)
+{
+    const std::string name = path.substr(path.rfind('/') + 1);
+    auto ends_with = [&name](const std::string &suffix)
+    {
+        return name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    // vim's write probe, emacs and LibreOffice locks, gedit's save stream
+    return dfs_is_internal(path) || name == "4913" || name.compare(0, 2, ".#") == 0 || name.compare(0, 7, ".~lock.") == 0 ||
+           name.compare(0, 15, ".goutputstream-") == 0 ||
+           ends_with("~") || ends_with(".swp") || ends_with(".swx") || ends_with(".tmp") ||
+           ends_with(".part") || ends_with(".crdownload");
+}
+
+bool dfs_set_mtime(const std::string &path, int64_t mtime)
+{
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = mtime;
+    times[1].tv_nsec = 0;
+    return utimensat(AT_FDCWD, path.c_str(), times, 0) == 0;
+}
+
+/**
+ * Copy `length` bytes at `offset` to the same offset, in the kernel until
+ * it refuses and then by reading and writing.
+ */
+static bool dfs_copy_range(int in_fd, int out_fd, off_t offset, off_t length, bool *in_kernel)
+{
+    std::vector<char> buffer;
+    while (length > 0)
+    {
+        ssize_t copied = -1;
+        if (*in_kernel)
+        {
+            off_t in_offset = offset;
+            off_t out_offset = offset;
+            copied = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, length, 0);
+            // older kernels do not copy across filesystems, or at all
+            if (copied < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                *in_kernel = false;
+            }
+            else if (copied < 0)
+            {
+                return false;
+            }
+        }
+        if (!*in_kernel)
+        {
+            buffer.resize(1 << 20);
+            copied = pread(in_fd, buffer.data(), std::min<off_t>(length, buffer.size()), offset);
+            if (copied > 0 && pwrite(out_fd, buffer.data(), copied, offset) != copied)
+            {
+                return false;
+            }
+        }
+        if (copied < 0)
+        {
+            return false;
+        }
+        if (copied == 0)
+        {
+            // the source got shorter
+            break;
+        }
+        offset += copied;
+        length -= copied;
+    }
+    return true;
+}
+
+bool dfs_copy_file(int in_fd, int out_fd)
+{
+    // a clone leaves the tail of a longer destination in place
+    if (ftruncate(out_fd, 0) != 0)
+    {
+        return false;
+    }
+    if (ioctl(out_fd, FICLONE, in_fd) == 0)
+    {
+        return true;
+    }
+    struct stat in_stat;
+    if (fstat(in_fd, &in_stat) != 0)
+    {
+        return false;
+    }
+    bool in_kernel = true;
+    off_t pos = 0;
+    while (pos < in_stat.st_size)
+    {
+        off_t data = lseek(in_fd, pos, SEEK_DATA);
+        off_t hole = in_stat.st_size;
+        if (data < 0 && errno == ENXIO)
+        {
+            // the file ends with a hole
+            break;
+        }
+        if (data < 0)
+        {
+            // SEEK_DATA is not supported here, copy the rest as data
+            data = pos;
+        }
+        else
+        {
+            hole = lseek(in_fd, data, SEEK_HOLE);
+            if (hole < 0 || hole > in_stat.st_size)
+            {
+                hole = in_stat.st_size;
+            }
+        }
+        if (!dfs_copy_range(in_fd, out_fd, data, hole - data, &in_kernel))
+        {
+            return false;
+        }
+        pos = hole;
+    }
+    // recreate a trailing hole
+    return ftruncate(out_fd, in_stat.st_size) == 0;
+}
+
+void dfs_prune_parents(const std::string &root, const std::string &path)
+{
+    size_t slash = path.rfind('/');
+    while (slash != std::string::npos && slash > 0)
+    {
+        // rmdir fails on the first directory that still has entries
+        if (rmdir((root + path.substr(0, slash)).c_str()) != 0)
+        {
+            return;
+        }
+        slash = path.rfind('/', slash - 1);
+    }
+}
+
+DFSHashRing::DFSHashRing(int vnodes) : vnodes(vnodes) {}
+
+void DFSHashRing::AddNode(const std::string &node)
+{
+    if (std::find(nodes.begin(), nodes.end(), node) != nodes.end())
+    {
+        return;
+    }
+    nodes.push_back(node);
+    for (int i = 0; i < vnodes; i++)
+    {
+        const std::string vnode = node + "#" + std::to_string(i);
+        // on the (very unlikely) collision the first node keeps the point
+        ring.insert(std::make_pair(dfs_hash64(vnode.data(), vnode.size()), node));
+    }
+}
+
+void DFSHashRing::RemoveNode(const std::string &node)
+{
+    auto found = std::find(nodes.begin(), nodes.end(), node);
+    if (found == nodes.end())
+    {
+        return;
+    }
+    nodes.erase(found);
+    for (auto iter = ring.begin(); iter != ring.end();)
+    {
+        if (iter->second == node)
+        {
+            iter = ring.erase(iter);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+}
+
+const std::string &DFSHashRing::NodeFor(const std::string &key) const
+{
+    static const std::string none;
+    if (ring.empty())
+    {
+        return none;
+    }
+    auto iter = ring.lower_bound(dfs_hash64(key.data(), key.size()));
+    if (iter == ring.end())
+    {
+        // wrap around the ring
+        iter = ring.begin();
+    }
+    return iter->second;
+}
+
+const std::vector<std::string> &DFSHashRing::Nodes() const
+{
+    return nodes;
+}
+
+bool DFSHashRing::Empty() const
+{
+    return ring.empty();
+}
+
+grpc::ChannelArguments DFSTransportOptions::ChannelArguments(int index) const
+{
+    grpc::ChannelArguments args;
+    if (channel_pool_size > 1)
+    {
+        // without a local subchannel pool, identical channels share one connection
+        args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+        args.SetInt("dfs.channel_index", index);
+    }
+    if (bdp_probe >= 0)
+    {
+        args.SetInt(GRPC_ARG_HTTP2_BDP_PROBE, bdp_probe);
+    }
+    if (initial_window_bytes > 0)
+    {
+        args.SetInt(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES, initial_window_bytes);
+    }
+    if (keepalive_time_ms > 0)
+    {
+        args.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS, keepalive_time_ms);
+        args.SetInt(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+        args.SetInt(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+    }
+    if (keepalive_timeout_ms > 0)
+    {
+        args.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, keepalive_timeout_ms);
+    }
+    return args;
+}
+
+void DFSTransportOptions::ApplyTo(grpc::ServerBuilder &builder) const
+{
+    if (bdp_probe >= 0)
+    {
+        builder.AddChannelArgument(GRPC_ARG_HTTP2_BDP_PROBE, bdp_probe);
+    }
+    if (initial_window_bytes > 0)
+    {
+        builder.AddChannelArgument(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES, initial_window_bytes);
+    }
+    if (max_concurrent_streams > 0)
+    {
+        builder.AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS, max_concurrent_streams);
+    }
+    if (keepalive_time_ms > 0)
+    {
+        builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIME_MS, keepalive_time_ms);
+        builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+        builder.AddChannelArgument(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+        // accept client pings at the same interval the server sends its own
+        builder.AddChannelArgument(GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS, keepalive_time_ms);
+    }
+    if (keepalive_timeout_ms > 0)
+    {
+        builder.AddChannelArgument(GRPC_ARG_KEEPALIVE_TIMEOUT_MS, keepalive_timeout_ms);
+    }
+}
@@ -5,21 +5,334 @@
 #include <cctype>
 #include <locale>
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <string>
+#include <vector>
 #include <sys/stat.h>
+#include <grpcpp/grpcpp.h>
 
 #include "src/dfs-utils.h"
 #include "proto-src/dfs-service.grpc.pb.h"
 
 #define DFS_RESET_TIMEOUT 5000
 
+/** Number of virtual nodes each server gets on the hash ring **/
+#define DFS_RING_VNODES 160
+
+/** Paths a client puts in one statusFiles request **/
+#define DFS_STAT_BATCH 1024
+
+/** Paths a server accepts in one statusFiles request **/
+#define DFS_STAT_BATCH_MAX 16384
+
 //
 // STUDENT INSTRUCTION:
 //
 // Add your additional code here
 //
 
+/**
+ * HTTP/2 transport settings shared by the client and the server.
+ *
+ * Zero (or -1 for flags) leaves the gRPC default in place.
+ */
+struct DFSTransportOptions
+{
+    /** Connections the client opens to each server **/
+    int channel_pool_size = 1;
+
+    /** Assign streams to the least loaded connection instead of round-robin **/
+    bool least_loaded = false;
+
+    /** Enable (1) or disable (0) BDP probing, which grows the flow-control window automatically **/
+    int bdp_probe = -1;
+
+    /** Initial HTTP/2 stream flow-control window in bytes **/
+    int initial_window_bytes = 0;
+
+    /** Maximum concurrent streams per connection (server only) **/
+    int max_concurrent_streams = 0;
+
+    /** Interval between keepalive pings in milliseconds **/
+    int keepalive_time_ms = 0;
+
+    /** Time to wait for a keepalive ack before closing the connection **/
+    int keepalive_timeout_ms = 0;
+
+    /**
+     * Channel arguments for connection `index` of a pool. Every connection
+     * gets its own subchannel pool, so each one is a separate TCP connection.
+     *
+     * @param index
+     * @return
+     */
+    grpc::ChannelArguments ChannelArguments(int index = 0) const;
+
+    /**
+     * Apply the settings to a server builder.
+     *
+     * @param builder
+     */
+    void ApplyTo(grpc::ServerBuilder &builder) const;
+};
+
+/**
+ * Reads a file as a sequence of FileChunks, skipping holes.
+ *
+ * The data extents are found with lseek(SEEK_DATA/SEEK_HOLE). Data is sent
+ * in chunks of at most `chunk_size` bytes, each carrying its offset, and
+ * every hole becomes a single chunk with `hole_length` set instead of
+ * content. On filesystems without SEEK_DATA support the whole file is
+ * read as data. A reader may be limited to a range of the file.
+ */
+class DFSChunkReader
+{
+
+private:
+    struct Extent
+    {
+        int64_t offset;
+        int64_t length;
+        bool hole;
+    };
+
+    int fd;
+    size_t chunk_size;
+    std::vector<Extent> extents;
+    size_t extent_index;
+    int64_t extent_done;
+    int32_t chunk_num;
+    bool failed;
+
+public:
+    /**
+     * @param fd - an open file, which the caller keeps ownership of
+     * @param chunk_size
+     * @param offset - where the range starts
+     * @param length - bytes in the range (-1 = to the end)
+     */
+    DFSChunkReader(int fd, size_t chunk_size, int64_t offset = 0, int64_t length = -1);
+
+    /**
+     * Fill in the next chunk.
+     *
+     * @param chunk
+     * @return false at the end of the file or on a read error
+     */
+    bool Next(dfs_service::FileChunk *chunk);
+
+    /**
+     * Whether Next() stopped because of a read error
+     */
+    bool Failed() const;
+};
+
+/**
+ * Writes FileChunks produced by DFSChunkReader to a file with pwrite.
+ *
+ * Holes are skipped rather than written, and the file is extended to its
+ * full length with ftruncate on Close(), so holes are recreated on the
+ * destination.
+ */
+class DFSChunkWriter
+{
+
+private:
+    int fd;
+    int64_t end;
+
+    /** Where offset 0 of the chunks is in the file **/
+    int64_t base;
+
+    /** The size of the file when it was opened **/
+    int64_t size;
+
+public:
+    DFSChunkWriter();
+    ~DFSChunkWriter();
+
+    /**
+     * Create or truncate the destination file.
+     *
+     * @param path
+     * @return
+     */
+    bool Open(const std::string &path);
+
+    /**
+     * Open a file to change part of it, creating it if it is missing.
+     * Chunks are written `base` bytes into the file, a hole over existing
+     * data zeroes it, and Close() never makes the file shorter.
+     *
+     * @param path
+     * @param base
+     * @param truncate - cut the file at `base` first
+     * @return
+     */
+    bool OpenAt(const std::string &path, int64_t base, bool truncate);
+
+    bool IsOpen() const;
+
+    /**
+     * @param chunk
+     * @return false on a write error
+     */
+    bool Write(const dfs_service::FileChunk &chunk);
+
+    /**
+     * Extend the file over any trailing hole and close it.
+     *
+     * @return false on an error
+     */
+    bool Close();
+};
+
+/**
+ * Stable 64-bit hash (FNV-1a with a final avalanche step).
+ *
+ * Every client has to agree on where a filename lives, so this must not
+ * depend on the standard library's std::hash implementation.
+ *
+ * @param data
+ * @param len
+ * @return
+ */
+uint64_t dfs_hash64(const char *data, size_t len);
+
+/**
+ * Split a delimited list (e.g. "host:1,host:2") into its non-empty items.
+ *
+ * @param list
+ * @param delim
+ * @return
+ */
+std::vector<std::string> dfs_split(const std::string &list, char delim);
+
+/**
+ * Check that a filename sent over the wire is a relative path that stays
+ * inside the mount: no leading '/', no empty, "." or ".." components.
+ *
+ * @param path
+ * @return
+ */
+bool dfs_valid_path(const std::string &path);
+
+/**
+ * Create the missing parent directories of a file path (like mkdir -p).
+ *
+ * @param filepath
+ * @return false if a parent could not be created
+ */
+bool dfs_make_parents(const std::string &filepath);
+
+/**
+ * Whether a path names one of the client's own ".dfs-" files: sync
+ * state, staging, hedged and prefetched copies.
+ *
+ * @param path
+ * @return
+ */
+bool dfs_is_internal(const std::string &path);
+
+/**
+ * Whether a path names a file that push never transfers: editor
+ * temporaries (swap files, backups, lock files) and the client's own
+ * ".dfs-" files.
+ *
+ * @param path
+ * @return
+ */
+bool dfs_is_temporary(const std::string &path);
+
+/**
+ * Set a file's modification time, so that a transferred copy keeps the
+ * mtime of its source and last-writer-wins comparisons stay stable.
+ *
+ * @param path
+ * @param mtime - seconds since the epoch
+ * @return
+ */
+bool dfs_set_mtime(const std::string &path, int64_t mtime);
+
+/**
+ * Copy the contents of one open file into another, without moving them
+ * through user space where the filesystem allows it: as a reflink that
+ * shares the source's extents (FICLONE, on btrfs or XFS), else with
+ * copy_file_range over each data extent, else with reads and writes.
+ * Holes stay holes, except across a reflink, which shares them anyway.
+ *
+ * @param in_fd - open for reading
+ * @param out_fd - open for writing; emptied first, so a longer file is cut to the copy's size
+ * @return false on an error
+ */
+bool dfs_copy_file(int in_fd, int out_fd);
+
+/**
+ * Remove the parent directories of `path` that became empty, stopping at `root`.
+ *
+ * @param root - the mount path, never removed
+ * @param path - a path relative to root
+ */
+void dfs_prune_parents(const std::string &root, const std::string &path);
+
+/**
+ * Consistent-hash ring with virtual nodes.
+ *
+ * Each node is placed on the ring DFS_RING_VNODES times, and a key belongs
+ * to the first virtual node clockwise from the key's hash. Adding or removing
+ * one of N nodes only moves about 1/N of the keys.
+ */
+class DFSHashRing
+{
+
+private:
+    /** Ring position -> node name **/
+    std::map<uint64_t, std::string> ring;
+
+    /** The distinct nodes on the ring **/
+    std::vector<std::string> nodes;
+
+    /** Virtual nodes per node **/
+    int vnodes;
+
+public:
+    DFSHashRing(int vnodes = DFS_RING_VNODES);
+
+    /**
+     * Add a node to the ring. Adding the same node twice is a no-op.
+     *
+     * @param node
+     */
+    void AddNode(const std::string &node);
+
+    /**
+     * Remove a node and all of its virtual nodes from the ring.
+     *
+     * @param node
+     */
+    void RemoveNode(const std::string &node);
+
+    /**
+     * Find the node that owns the given key.
+     *
+     * @param key
+     * @return the node name, or an empty string if the ring is empty
+     */
+    const std::string &NodeFor(const std::string &key) const;
+
+    /**
+     * All nodes currently on the ring, in insertion order
+     *
+     * @return
+     */
+    const std::vector<std::string> &Nodes() const;
+
+    bool Empty() const;
+};
+
 
 #endif
 
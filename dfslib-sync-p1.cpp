@@ -0,0 +1,303 @@
+#include <map>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <stdio.h>
+#include <errno.h>
+#include <cstring>
+#include <unistd.h>
+
+#include "src/dfs-utils.h"
+#include "dfslib-shared-p1.h"
+#include "dfslib-sync-p1.h"
+#include "dfslib-walker-p1.h"
+
+using grpc::StatusCode;
+
+DFSSyncEngine::DFSSyncEngine(DFSClientNodeP1 *node, const std::string &mount_path, int workers)
+    : node(node), mount_path(mount_path), workers(std::max(1, workers)) {}
+
+StatusCode DFSSyncEngine::Plan(std::vector<DFSSyncOp> *ops)
+{
+    ops->clear();
+    target.clear();
+    base = LoadState();
+
+    std::map<std::string, dfs_service::FileInfo> remote;
+    StatusCode status = node->ListDetails(&remote);
+    if (status != StatusCode::OK)
+    {
+        dfs_log(LL_ERROR) << "Failed to list the servers";
+        return status;
+    }
+
+    std::vector<DFSWalkEntry> scanned;
+    int error = DFSTreeWalker().Walk(mount_path, &scanned);
+    if (error != 0)
+    {
+        dfs_log(LL_ERROR) << "Failed to scan " << mount_path << ": " << strerror(error);
+        return StatusCode::CANCELLED;
+    }
+    std::map<std::string, const DFSWalkEntry *> local;
+    for (const DFSWalkEntry &entry : scanned)
+    {
+        // editor temporaries are the user's files as far as sync is concerned
+        if (!dfs_is_internal(entry.path))
+        {
+            local[entry.path] = &entry;
+        }
+    }
+
+    auto add = [ops](DFSSyncOp::Kind kind, const std::string &path, int64_t size, int64_t mtime)
+    {
+        ops->push_back(DFSSyncOp{kind, path, size, mtime});
+    };
+
+    for (const auto &entry : local)
+    {
+        const std::string &path = entry.first;
+        const DFSWalkEntry &mine = *entry.second;
+        auto theirs = remote.find(path);
+        auto last = base.find(path);
+
+        if (theirs != remote.end())
+        {
+            // on both sides: the last writer wins
+            const int64_t remote_mtime = theirs->second.modified_time();
+            if (mine.modified_time > remote_mtime)
+            {
+                add(DFSSyncOp::STORE, path, mine.size, mine.modified_time);
+            }
+            else if (mine.modified_time < remote_mtime)
+            {
+                add(DFSSyncOp::FETCH, path, theirs->second.size(), remote_mtime);
+            }
+            else
+            {
+                target[path] = mine.modified_time;
+            }
+            remote.erase(theirs);
+        }
+        else if (last != base.end() && mine.modified_time <= last->second)
+        {
+            // unchanged here since the last sync, so it was deleted on the server
+            add(DFSSyncOp::DELETE_LOCAL, path, 0, 0);
+        }
+        else
+        {
+            add(DFSSyncOp::STORE, path, mine.size, mine.modified_time);
+        }
+    }
+
+    // what is left exists only on the servers
+    for (const auto &theirs : remote)
+    {
+        const std::string &path = theirs.first;
+        if (dfs_is_internal(path))
+        {
+            continue;
+        }
+        // a name such as "../x" would be fetched outside the mount
+        if (!dfs_valid_path(path))
+        {
+            dfs_log(LL_ERROR) << "Skipping " << path << " listed by the servers: the name leaves the mount";
+            continue;
+        }
+        auto last = base.find(path);
+        if (last != base.end() && theirs.second.modified_time() <= last->second)
+        {
+            // unchanged on the server since the last sync, so it was deleted here
+            add(DFSSyncOp::DELETE_REMOTE, path, 0, 0);
+        }
+        else
+        {
+            add(DFSSyncOp::FETCH, path, theirs.second.size(), theirs.second.modified_time());
+        }
+    }
+
+    return StatusCode::OK;
+}
+
+StatusCode DFSSyncEngine::Sync(DFSSyncStats *stats)
+{
+    std::vector<DFSSyncOp> ops;
+    StatusCode status = Plan(&ops);
+    if (status != StatusCode::OK)
+    {
+        return status;
+    }
+    dfs_log(LL_SYSINFO) << "Sync plan: " << ops.size() << " operations";
+
+    std::vector<char> done;
+    Execute(ops, &done);
+
+    // paths that already agreed, plus every operation that went through;
+    // a failed operation keeps its old state so the next sync retries it
+    std::map<std::string, int64_t> state = target;
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        const DFSSyncOp &op = ops[i];
+        if (!done[i])
+        {
+            stats->failed++;
+            auto last = base.find(op.path);
+            if (last != base.end())
+            {
+                state[op.path] = last->second;
+            }
+            continue;
+        }
+        switch (op.kind)
+        {
+        case DFSSyncOp::FETCH:
+            stats->fetched++;
+            stats->bytes += op.size;
+            state[op.path] = op.mtime;
+            break;
+        case DFSSyncOp::STORE:
+            stats->stored++;
+            stats->bytes += op.size;
+            state[op.path] = op.mtime;
+            break;
+        case DFSSyncOp::DELETE_LOCAL:
+            stats->deleted_local++;
+            break;
+        case DFSSyncOp::DELETE_REMOTE:
+            stats->deleted_remote++;
+            break;
+        }
+    }
+
+    if (!SaveState(state))
+    {
+        dfs_log(LL_ERROR) << "Failed to save the sync state";
+    }
+    return StatusCode::OK;
+}
+
+void DFSSyncEngine::Execute(const std::vector<DFSSyncOp> &ops, std::vector<char> *done)
+{
+    // a byte per operation, since workers write their results concurrently
+    done->assign(ops.size(), 0);
+
+    // large transfers one per task, largest first; small ones batched behind them
+    std::vector<size_t> order(ops.size());
+    for (size_t i = 0; i < ops.size(); i++)
+    {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&ops](size_t a, size_t b)
+              { return ops[a].size > ops[b].size; });
+
+    std::vector<std::vector<size_t>> tasks;
+    int64_t batch_bytes = 0;
+    bool batching = false;
+    for (size_t index : order)
+    {
+        const DFSSyncOp &op = ops[index];
+        if (op.size > DFS_SYNC_SMALL_BYTES)
+        {
+            tasks.push_back(std::vector<size_t>{index});
+            continue;
+        }
+        if (!batching || tasks.back().size() >= DFS_SYNC_BATCH_FILES || batch_bytes + op.size > DFS_SYNC_BATCH_BYTES)
+        {
+            tasks.push_back(std::vector<size_t>());
+            batch_bytes = 0;
+            batching = true;
+        }
+        tasks.back().push_back(index);
+        batch_bytes += op.size;
+    }
+
+    std::atomic<size_t> next(0);
+    auto work = [&]()
+    {
+        for (size_t task = next++; task < tasks.size(); task = next++)
+        {
+            for (size_t index : tasks[task])
+            {
+                (*done)[index] = Apply(ops[index]) ? 1 : 0;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (int i = 0; i < std::min<int>(workers, tasks.size()); i++)
+    {
+        pool.emplace_back(work);
+    }
+    for (auto &thread : pool)
+    {
+        thread.join();
+    }
+}
+
+bool DFSSyncEngine::Apply(const DFSSyncOp &op)
+{
+    switch (op.kind)
+    {
+    case DFSSyncOp::FETCH:
+        dfs_log(LL_DEBUG) << "sync: fetch " << op.path;
+        return node->Fetch(op.path) == StatusCode::OK;
+    case DFSSyncOp::STORE:
+        dfs_log(LL_DEBUG) << "sync: store " << op.path;
+        return node->Store(op.path) == StatusCode::OK;
+    case DFSSyncOp::DELETE_LOCAL:
+        dfs_log(LL_DEBUG) << "sync: delete local " << op.path;
+        if (unlink((mount_path + op.path).c_str()) != 0 && errno != ENOENT)
+        {
+            return false;
+        }
+        dfs_prune_parents(mount_path, op.path);
+        return true;
+    case DFSSyncOp::DELETE_REMOTE:
+    {
+        dfs_log(LL_DEBUG) << "sync: delete remote " << op.path;
+        StatusCode status = node->Delete(op.path);
+        return status == StatusCode::OK || status == StatusCode::NOT_FOUND;
+    }
+    }
+    return false;
+}
+
+std::map<std::string, int64_t> DFSSyncEngine::LoadState()
+{
+    // one "<mtime> <path>" line per file
+    std::map<std::string, int64_t> state;
+    std::ifstream infile(mount_path + DFS_SYNC_STATE);
+    std::string line;
+    while (std::getline(infile, line))
+    {
+        size_t space = line.find(' ');
+        if (space == std::string::npos)
+        {
+            continue;
+        }
+        state[line.substr(space + 1)] = std::atoll(line.substr(0, space).c_str());
+    }
+    return state;
+}
+
+bool DFSSyncEngine::SaveState(const std::map<std::string, int64_t> &state)
+{
+    // written aside and renamed, so an interrupted save keeps the old state
+    const std::string path = mount_path + DFS_SYNC_STATE;
+    const std::string temporary = path + ".tmp";
+    {
+        std::ofstream outfile(temporary, std::ios::out | std::ios::trunc);
+        for (const auto &entry : state)
+        {
+            outfile << entry.second << ' ' << entry.first << '\n';
+        }
+        outfile.flush();
+        if (!outfile.good())
+        {
+            return false;
+        }
+    }
+    return rename(temporary.c_str(), path.c_str()) == 0;
+}
@@ -0,0 +1,126 @@
+#ifndef _DFSLIB_SYNC_H
+#define _DFSLIB_SYNC_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <grpcpp/grpcpp.h>
+
+#include "dfslib-clientnode-p1.h"
+
+/** File in the mount root recording the state of the last sync **/
+#define DFS_SYNC_STATE ".dfs-sync-state"
+
+/** Transfers up to this size are batched instead of scheduled one by one **/
+#define DFS_SYNC_SMALL_BYTES (256 * 1024)
+
+/** Limits of one batch of small operations **/
+#define DFS_SYNC_BATCH_FILES 64
+#define DFS_SYNC_BATCH_BYTES (4 * 1024 * 1024)
+
+/**
+ * One operation of a sync plan
+ */
+struct DFSSyncOp
+{
+    enum Kind
+    {
+        FETCH,
+        STORE,
+        DELETE_LOCAL,
+        DELETE_REMOTE
+    };
+
+    Kind kind;
+    std::string path;
+
+    /** Bytes to transfer (0 for deletes) **/
+    int64_t size;
+
+    /** The mtime the file has on both sides once the operation is done **/
+    int64_t mtime;
+};
+
+/**
+ * What a sync did
+ */
+struct DFSSyncStats
+{
+    int fetched = 0;
+    int stored = 0;
+    int deleted_local = 0;
+    int deleted_remote = 0;
+    int failed = 0;
+    int64_t bytes = 0;
+};
+
+/**
+ * Two-way sync between the mount and the servers.
+ *
+ * The plan compares three listings of every path: the local mount (walked
+ * with DFSTreeWalker), the servers (ListDetails) and the state recorded
+ * after the last sync. Where both sides have a file, the newer mtime wins
+ * (last writer wins). Where only one side has it, the recorded state tells
+ * a new file apart from a deleted one: a file that is unchanged since the
+ * last sync and gone from the other side was deleted there, and the delete
+ * is applied; anything else is copied over. Paths that agree are left
+ * alone, so the plan is the minimal set of transfers and deletes.
+ *
+ * The plan runs on a fixed pool of workers. Large transfers are scheduled
+ * largest first (longest-processing-time order), which keeps the pool busy
+ * until the end instead of leaving one big file running alone; small
+ * transfers and deletes are grouped into batches that follow them, so a
+ * tree of many tiny files is not dominated by per-task overhead.
+ *
+ * Transfers keep the source's mtime on the destination, so both sides
+ * agree after a sync and the next one finds nothing to do.
+ */
+class DFSSyncEngine
+{
+
+public:
+    /**
+     * @param node
+     * @param mount_path - with a trailing '/'
+     * @param workers - operations running at once
+     */
+    DFSSyncEngine(DFSClientNodeP1 *node, const std::string &mount_path, int workers = 8);
+
+    /**
+     * Compute the operations that bring both sides in sync.
+     *
+     * @param ops - filled in with the plan
+     * @return grpc::StatusCode of the server listing
+     */
+    grpc::StatusCode Plan(std::vector<DFSSyncOp> *ops);
+
+    /**
+     * Plan and run a sync, then record the new state.
+     *
+     * @param stats
+     * @return grpc::StatusCode - OK if the plan ran, even if some operations failed
+     */
+    grpc::StatusCode Sync(DFSSyncStats *stats);
+
+private:
+    DFSClientNodeP1 *node;
+    std::string mount_path;
+    int workers;
+
+    /** Path -> mtime of the files both sides held after the last sync **/
+    std::map<std::string, int64_t> base;
+
+    /** Path -> mtime the file will have on both sides if the plan succeeds **/
+    std::map<std::string, int64_t> target;
+
+    std::map<std::string, int64_t> LoadState();
+    bool SaveState(const std::map<std::string, int64_t> &state);
+
+    /** Run the plan; `done` says which operations succeeded **/
+    void Execute(const std::vector<DFSSyncOp> &ops, std::vector<char> *done);
+
+    bool Apply(const DFSSyncOp &op);
+};
+
+#endif
@@ -0,0 +1,670 @@
+#include <map>
+#include <set>
+#include <cmath>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dfslib-shared-p1.h"
+#include "dfslib-zfile-p1.h"
+#include "dfslib-tiering-p1.h"
+
+/** Bytes per read and write of a move **/
+#define DFS_TIER_MOVE_CHUNK (256 * 1024)
+
+/** Demotions for capacity stop once the hot tier is this full **/
+#define DFS_TIER_LOW_WATER 0.9
+
+namespace
+{
+    bool EndsWith(const std::string &text, const std::string &suffix)
+    {
+        return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    /** The staging file for a move of `path` into `root`, next to its destination **/
+    std::string StagingFor(const std::string &root, const std::string &path)
+    {
+        size_t slash = path.rfind('/');
+        if (slash == std::string::npos)
+        {
+            return root + DFS_TIER_STAGING + path;
+        }
+        return root + path.substr(0, slash + 1) + DFS_TIER_STAGING + path.substr(slash + 1);
+    }
+
+    /** Flush a file that was written and closed elsewhere **/
+    bool SyncFile(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+        bool ok = fsync(fd) == 0;
+        close(fd);
+        return ok;
+    }
+
+    bool SameFile(const struct stat &a, const struct stat &b)
+    {
+        return a.st_ino == b.st_ino && a.st_size == b.st_size && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+               a.st_mtim.tv_nsec == b.st_mtim.tv_nsec && a.st_ctim.tv_sec == b.st_ctim.tv_sec &&
+               a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+    }
+}
+
+DFSTierManager::Pin::Pin(DFSTierManager *tiers, const std::string &path) : tiers(tiers), path(path)
+{
+    std::unique_lock<std::mutex> lock(tiers->mutex);
+    tiers->unpinned.wait(lock, [&]()
+                         { return tiers->pinned.count(path) == 0; });
+    tiers->pinned.insert(path);
+}
+
+DFSTierManager::Pin::~Pin()
+{
+    tiers->Unpin(path);
+}
+
+DFSTierManager::DFSTierManager(const std::string &hot_root, const DFSTierOptions &options)
+    : hot_root(hot_root), cold_root(options.cold_path), options(options), walker(1),
+      throttle_bytes(0), stopping(false)
+{
+    if (cold_root.empty() || cold_root.back() != '/')
+    {
+        cold_root += '/';
+    }
+    if (!dfs_make_parents(cold_root))
+    {
+        dfs_log(LL_ERROR) << "Failed to create the cold tier " << cold_root;
+    }
+
+    // staging files are left over from moves cut short
+    std::vector<DFSWalkEntry> entries;
+    walker.Walk(this->hot_root, &entries);
+    for (const DFSWalkEntry &entry : entries)
+    {
+        if (IsStaging(entry.path))
+        {
+            unlink((this->hot_root + entry.path).c_str());
+        }
+    }
+
+    entries.clear();
+    walker.Walk(cold_root, &entries);
+    int64_t cold_bytes = 0;
+    for (const DFSWalkEntry &entry : entries)
+    {
+        const std::string stored = cold_root + entry.path;
+        if (IsStaging(entry.path))
+        {
+            unlink(stored.c_str());
+            continue;
+        }
+        ColdFile file{entry.size, entry.modified_time, false};
+        std::string path = entry.path;
+        if (EndsWith(path, DFS_TIER_COMPRESSED))
+        {
+            path.resize(path.size() - strlen(DFS_TIER_COMPRESSED));
+            int fd = open(stored.c_str(), O_RDONLY | O_CLOEXEC);
+            file.compressed = fd >= 0 && dfs_zfile_size(fd, &file.size);
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            if (!file.compressed && !Upgrade(path, entry.modified_time, &file.size))
+            {
+                // serving it under its stored name would hand out the compressed bytes
+                dfs_log(LL_ERROR) << "Leaving out unreadable compressed file " << stored;
+                continue;
+            }
+            file.compressed = true;
+        }
+        // a move that died before removing its source left two copies; the hot one wins
+        Location hot;
+        if (LocateHot(this->hot_root, path, &hot))
+        {
+            unlink(stored.c_str());
+            continue;
+        }
+        cold[path] = file;
+        cold_bytes += entry.size;
+    }
+    dfs_log(LL_SYSINFO) << "Cold tier " << cold_root << " holds " << cold.size() << " files in " << cold_bytes << " bytes";
+
+    mover = std::thread(&DFSTierManager::Run, this);
+}
+
+DFSTierManager::~DFSTierManager()
+{
+    {
+        std::lock_guard<std::mutex> lock(stop_mutex);
+        stopping = true;
+    }
+    stop_cv.notify_all();
+    mover.join();
+}
+
+bool DFSTierManager::Upgrade(const std::string &path, int64_t modified_time, int64_t *size)
+{
+    const std::string stored = cold_root + path + DFS_TIER_COMPRESSED;
+    const std::string staging = StagingFor(cold_root, path) + DFS_TIER_COMPRESSED;
+    int in = open(stored.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        return false;
+    }
+    int out = open(staging.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool upgraded = out >= 0 && dfs_zfile_upgrade(in, out) && dfs_zfile_size(out, size) && fsync(out) == 0;
+    if (out >= 0)
+    {
+        upgraded = close(out) == 0 && upgraded;
+    }
+    close(in);
+    if (!upgraded || !dfs_set_mtime(staging, modified_time) || rename(staging.c_str(), stored.c_str()) != 0)
+    {
+        unlink(staging.c_str());
+        return false;
+    }
+    dfs_log(LL_SYSINFO) << "Converted " << stored << " to compressed format version " << DFS_ZFILE_VERSION;
+    return true;
+}
+
+bool DFSTierManager::IsStaging(const std::string &path)
+{
+    return path.compare(path.rfind('/') + 1, strlen(DFS_TIER_STAGING), DFS_TIER_STAGING) == 0;
+}
+
+bool DFSTierManager::LocateHot(const std::string &hot_root, const std::string &path, Location *location)
+{
+    struct stat file_stat;
+    if (stat((hot_root + path).c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode))
+    {
+        *location = Location{hot_root + path, false, false, file_stat.st_size, file_stat.st_mtime};
+        return true;
+    }
+    const std::string stored = hot_root + path + DFS_TIER_COMPRESSED;
+    int fd = open(stored.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    int64_t size;
+    const bool found = fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && dfs_zfile_size(fd, &size);
+    close(fd);
+    if (found)
+    {
+        *location = Location{stored, false, true, size, file_stat.st_mtime};
+    }
+    return found;
+}
+
+bool DFSTierManager::HotName(const std::string &hot_root, const std::string &stored, std::string *path, int64_t *size)
+{
+    *path = stored;
+    if (!EndsWith(stored, DFS_TIER_COMPRESSED))
+    {
+        return false;
+    }
+    int fd = open((hot_root + stored).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    // a file of a client's that only happens to carry the suffix keeps its name
+    const bool compressed = dfs_zfile_size(fd, size);
+    close(fd);
+    if (compressed)
+    {
+        path->resize(path->size() - strlen(DFS_TIER_COMPRESSED));
+    }
+    return compressed;
+}
+
+void DFSTierManager::Touch(const std::string &path)
+{
+    const auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    const double heat = HeatLocked(path, now);
+    accesses[path] = Access{heat + 1, now};
+}
+
+double DFSTierManager::HeatLocked(const std::string &path, std::chrono::steady_clock::time_point now)
+{
+    auto iter = accesses.find(path);
+    if (iter == accesses.end())
+    {
+        return 0;
+    }
+    const double elapsed = std::chrono::duration<double>(now - iter->second.last).count();
+    return iter->second.heat * std::pow(0.5, elapsed / DFS_TIER_HALF_LIFE_S);
+}
+
+bool DFSTierManager::Locate(const std::string &path, Location *location)
+{
+    // a promotion renames into the hot tier before it leaves the catalog, so look there again
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (LocateHot(hot_root, path, location))
+        {
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = cold.find(path);
+        if (iter != cold.end())
+        {
+            const ColdFile &file = iter->second;
+            *location = Location{cold_root + path + (file.compressed ? DFS_TIER_COMPRESSED : ""), true,
+                                 file.compressed, file.size, file.modified_time};
+            return true;
+        }
+    }
+    return false;
+}
+
+bool DFSTierManager::DropCold(const std::string &path)
+{
+    std::string stored;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = cold.find(path);
+        if (iter == cold.end())
+        {
+            return false;
+        }
+        stored = cold_root + path + (iter->second.compressed ? DFS_TIER_COMPRESSED : "");
+        cold.erase(iter);
+    }
+    unlink(stored.c_str());
+    dfs_prune_parents(cold_root, path);
+    return true;
+}
+
+bool DFSTierManager::RenameCold(const std::string &from, const std::string &to)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = cold.find(from);
+        if (iter == cold.end())
+        {
+            return false;
+        }
+        const std::string suffix = iter->second.compressed ? DFS_TIER_COMPRESSED : "";
+        const std::string destination = cold_root + to + suffix;
+        if (!dfs_make_parents(destination) || rename((cold_root + from + suffix).c_str(), destination.c_str()) != 0)
+        {
+            return false;
+        }
+        cold[to] = iter->second;
+        cold.erase(iter);
+    }
+    dfs_prune_parents(cold_root, from);
+    return true;
+}
+
+void DFSTierManager::ListCold(std::vector<DFSWalkEntry> *entries, bool top_only)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &file : cold)
+    {
+        if (top_only && file.first.find('/') != std::string::npos)
+        {
+            continue;
+        }
+        entries->push_back(DFSWalkEntry{file.first, file.second.size, file.second.modified_time});
+    }
+}
+
+bool DFSTierManager::TryPin(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return pinned.insert(path).second;
+}
+
+void DFSTierManager::Unpin(const std::string &path)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pinned.erase(path);
+    }
+    unpinned.notify_all();
+}
+
+void DFSTierManager::Run()
+{
+    std::unique_lock<std::mutex> lock(stop_mutex);
+    while (!stop_cv.wait_for(lock, std::chrono::seconds(DFS_TIER_INTERVAL_S), [this]()
+                             { return stopping.load(); }))
+    {
+        lock.unlock();
+        Cycle();
+        lock.lock();
+    }
+}
+
+void DFSTierManager::Cycle()
+{
+    struct Candidate
+    {
+        std::string path;
+        /** Name in the hot tier, with DFS_TIER_COMPRESSED for a compressed file **/
+        std::string stored;
+        int64_t size;
+        double heat;
+        int64_t idle;
+    };
+
+    std::vector<DFSWalkEntry> entries;
+    if (walker.Walk(hot_root, &entries) != 0)
+    {
+        return;
+    }
+    // compressed files are known by their name without the suffix; reading that takes no lock
+    std::vector<std::string> names(entries.size());
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        int64_t size;
+        HotName(hot_root, entries[i].path, &names[i], &size);
+    }
+    throttle_start = std::chrono::steady_clock::now();
+    throttle_bytes = 0;
+    const auto now = std::chrono::steady_clock::now();
+    const int64_t wall_now = std::chrono::duration_cast<std::chrono::seconds>(
+                                 std::chrono::system_clock::now().time_since_epoch())
+                                 .count();
+
+    int64_t hot_bytes = 0;
+    std::vector<Candidate> candidates;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            DFSWalkEntry &entry = entries[i];
+            if (IsStaging(entry.path))
+            {
+                continue;
+            }
+            hot_bytes += entry.size;
+            auto access = accesses.find(names[i]);
+            const int64_t idle = access != accesses.end()
+                                     ? std::chrono::duration_cast<std::chrono::seconds>(now - access->second.last).count()
+                                     : wall_now - entry.modified_time;
+            const double heat = HeatLocked(names[i], now);
+            candidates.push_back(Candidate{std::move(names[i]), std::move(entry.path), entry.size, heat, idle});
+        }
+
+        // forget accesses that no longer count for anything
+        for (auto iter = accesses.begin(); iter != accesses.end();)
+        {
+            const int64_t idle = std::chrono::duration_cast<std::chrono::seconds>(now - iter->second.last).count();
+            if (HeatLocked(iter->first, now) < 0.01 && idle >= options.cold_after)
+            {
+                iter = accesses.erase(iter);
+            }
+            else
+            {
+                ++iter;
+            }
+        }
+    }
+
+    // coldest first: least heat, then longest idle
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b)
+              { return a.heat != b.heat ? a.heat < b.heat : a.idle > b.idle; });
+    const int64_t low_water = options.hot_bytes * DFS_TIER_LOW_WATER;
+    bool over = options.hot_bytes > 0 && hot_bytes > options.hot_bytes;
+    int demoted = 0, promoted = 0;
+    for (const Candidate &candidate : candidates)
+    {
+        if (stopping)
+        {
+            return;
+        }
+        bool idle = options.cold_after > 0 && candidate.idle >= options.cold_after;
+        if (idle && candidate.heat == 0)
+        {
+            // never accessed: a fresh store counts from its ctime, which a client cannot set
+            struct stat file_stat;
+            idle = stat((hot_root + candidate.stored).c_str(), &file_stat) == 0 &&
+                   wall_now - file_stat.st_ctime >= options.cold_after;
+        }
+        if (!idle && !over)
+        {
+            continue;
+        }
+        if (Demote(candidate.path))
+        {
+            hot_bytes -= candidate.size;
+            demoted++;
+            over = options.hot_bytes > 0 && hot_bytes > low_water;
+        }
+    }
+
+    std::vector<Candidate> warm;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &file : cold)
+        {
+            const double heat = HeatLocked(file.first, now);
+            if (heat >= options.promote_hits)
+            {
+                warm.push_back(Candidate{file.first, std::string(), file.second.size, heat, 0});
+            }
+        }
+    }
+    std::sort(warm.begin(), warm.end(), [](const Candidate &a, const Candidate &b)
+              { return a.heat > b.heat; });
+    for (const Candidate &candidate : warm)
+    {
+        if (stopping)
+        {
+            return;
+        }
+        if (options.hot_bytes > 0 && hot_bytes + candidate.size > options.hot_bytes)
+        {
+            continue;
+        }
+        if (Promote(candidate.path))
+        {
+            hot_bytes += candidate.size;
+            promoted++;
+        }
+    }
+    if (demoted > 0 || promoted > 0)
+    {
+        dfs_log(LL_SYSINFO) << "Tiering moved " << demoted << " files to the cold tier and " << promoted
+                            << " to the hot tier; hot tier holds " << hot_bytes << " bytes";
+    }
+}
+
+bool DFSTierManager::Demote(const std::string &path)
+{
+    // a file the hot tier keeps compressed moves as it is
+    Location location;
+    if (!LocateHot(hot_root, path, &location))
+    {
+        return false;
+    }
+    const std::string &source = location.path;
+    const bool compressed = options.compress || location.compressed;
+    const std::string destination = cold_root + path + (compressed ? DFS_TIER_COMPRESSED : "");
+    const std::string staging = StagingFor(cold_root, path) + (compressed ? DFS_TIER_COMPRESSED : "");
+
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        return false;
+    }
+    struct stat before;
+    bool copied = fstat(in, &before) == 0 && dfs_make_parents(destination);
+    if (copied && !location.compressed && options.compress)
+    {
+        int out = open(staging.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        copied = out >= 0 && dfs_zfile_compress(in, out, [this](size_t bytes)
+                                                { return Throttle(bytes); }) &&
+                 fsync(out) == 0;
+        if (out >= 0)
+        {
+            copied = close(out) == 0 && copied;
+        }
+    }
+    else if (copied)
+    {
+        copied = Copy(in, staging);
+    }
+    close(in);
+    if (!copied || !dfs_set_mtime(staging, before.st_mtime))
+    {
+        unlink(staging.c_str());
+        return false;
+    }
+
+    // commit only if no store or delete got to the file meanwhile
+    if (!TryPin(path))
+    {
+        unlink(staging.c_str());
+        return false;
+    }
+    struct stat after;
+    if (stat(source.c_str(), &after) != 0 || !SameFile(before, after) ||
+        rename(staging.c_str(), destination.c_str()) != 0)
+    {
+        Unpin(path);
+        unlink(staging.c_str());
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cold[path] = ColdFile{location.compressed ? location.size : before.st_size, before.st_mtime, compressed};
+    }
+    // a copy in the other format may be left from an earlier demotion
+    unlink((cold_root + path + (compressed ? "" : DFS_TIER_COMPRESSED)).c_str());
+    unlink(source.c_str());
+    dfs_prune_parents(hot_root, path);
+    Unpin(path);
+    dfs_log(LL_DEBUG) << "Demoted " << path;
+    return true;
+}
+
+bool DFSTierManager::Promote(const std::string &path)
+{
+    ColdFile file;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = cold.find(path);
+        if (iter == cold.end())
+        {
+            return false;
+        }
+        file = iter->second;
+    }
+    const std::string source = cold_root + path + (file.compressed ? DFS_TIER_COMPRESSED : "");
+    const bool inflate = file.compressed && !options.compress_hot;
+    const std::string suffix = file.compressed && !inflate ? DFS_TIER_COMPRESSED : "";
+    const std::string destination = hot_root + path + suffix;
+    const std::string staging = StagingFor(hot_root, path) + suffix;
+
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        return false;
+    }
+    bool copied = dfs_make_parents(destination) && (inflate ? Inflate(in, staging) : Copy(in, staging));
+    close(in);
+    if (!copied || !dfs_set_mtime(staging, file.modified_time))
+    {
+        unlink(staging.c_str());
+        return false;
+    }
+
+    if (!TryPin(path))
+    {
+        unlink(staging.c_str());
+        return false;
+    }
+    bool unchanged;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = cold.find(path);
+        unchanged = iter != cold.end() && iter->second.size == file.size &&
+                    iter->second.modified_time == file.modified_time && iter->second.compressed == file.compressed;
+    }
+    Location hot;
+    if (!unchanged || LocateHot(hot_root, path, &hot) || rename(staging.c_str(), destination.c_str()) != 0)
+    {
+        Unpin(path);
+        unlink(staging.c_str());
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cold.erase(path);
+    }
+    unlink(source.c_str());
+    dfs_prune_parents(cold_root, path);
+    Unpin(path);
+    dfs_log(LL_DEBUG) << "Promoted " << path;
+    return true;
+}
+
+bool DFSTierManager::Throttle(size_t bytes)
+{
+    if (options.move_bytes > 0)
+    {
+        throttle_bytes += bytes;
+        const auto due = throttle_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                              std::chrono::duration<double>(throttle_bytes / options.move_bytes));
+        std::unique_lock<std::mutex> lock(stop_mutex);
+        stop_cv.wait_until(lock, due, [this]()
+                           { return stopping.load(); });
+    }
+    return !stopping;
+}
+
+bool DFSTierManager::Copy(int from, const std::string &to)
+{
+    DFSChunkReader reader(from, DFS_TIER_MOVE_CHUNK);
+    DFSChunkWriter writer;
+    if (!writer.Open(to))
+    {
+        return false;
+    }
+    dfs_service::FileChunk chunk;
+    while (reader.Next(&chunk))
+    {
+        if (!Throttle(chunk.content().size()) || !writer.Write(chunk))
+        {
+            writer.Close();
+            return false;
+        }
+    }
+    return writer.Close() && !reader.Failed() && SyncFile(to);
+}
+
+bool DFSTierManager::Inflate(int from, const std::string &to)
+{
+    DFSZFileReader reader(from);
+    DFSChunkWriter writer;
+    if (!writer.Open(to))
+    {
+        return false;
+    }
+    dfs_service::FileChunk chunk;
+    while (reader.Next(&chunk))
+    {
+        if (!Throttle(chunk.content().size()) || !writer.Write(chunk))
+        {
+            writer.Close();
+            return false;
+        }
+    }
+    return writer.Close() && !reader.Failed() && SyncFile(to);
+}
@@ -0,0 +1,269 @@
+#ifndef _DFSLIB_TIERING_H
+#define _DFSLIB_TIERING_H
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <condition_variable>
+
+#include "dfslib-walker-p1.h"
+
+/** Prefix of the files a move is staged in; never listed **/
+#define DFS_TIER_STAGING ".dfs-tier-"
+
+/** Suffix of compressed files, in the cold tier and, with --compress_at_rest, in the hot tier **/
+#define DFS_TIER_COMPRESSED ".dfsz"
+
+/** Seconds between passes of the mover **/
+#define DFS_TIER_INTERVAL_S 10
+
+/** Seconds after which an access counts half as much toward a file's heat **/
+#define DFS_TIER_HALF_LIFE_S 600
+
+/**
+ * Settings of the cold tier
+ */
+struct DFSTierOptions
+{
+    /** Directory of the cold tier (empty = no tiering) **/
+    std::string cold_path;
+
+    /** Bytes the hot tier (the mount) may hold; the coldest files are demoted past it (0 = unlimited) **/
+    int64_t hot_bytes = 0;
+
+    /** Seconds without an access after which a file is demoted (0 = only when the hot tier is full) **/
+    int cold_after = 3600;
+
+    /** Recent accesses (decayed, see DFS_TIER_HALF_LIFE_S) that promote a cold file **/
+    double promote_hits = 3;
+
+    /** Bytes per second the mover reads, so moves do not starve requests **/
+    double move_bytes = 16 * 1024 * 1024;
+
+    /** Store demoted files compressed (dfslib-zfile-p1.h) **/
+    bool compress = false;
+
+    /** The hot tier keeps files compressed, so compressed files are promoted as they are **/
+    bool compress_hot = false;
+};
+
+/**
+ * Moves files between a fast hot tier (the mount) and a large cold tier.
+ *
+ * fetchFile and statusFile report accesses with Touch(). Each file's heat
+ * is its access count with every access decaying by half each
+ * DFS_TIER_HALF_LIFE_S. A background mover runs every DFS_TIER_INTERVAL_S
+ * seconds. It demotes files not accessed for `cold_after` seconds, and,
+ * while the hot tier holds more than `hot_bytes`, the coldest files
+ * first. It promotes cold files whose heat reaches `promote_hits` while
+ * they fit. A file that has never been accessed counts from its ctime,
+ * so a fresh store is hot. The mover reads at most `move_bytes` per second.
+ *
+ * A file lives in one tier at a time, under the same relative path; in
+ * the cold tier, and with `compress_hot` in the hot tier as well, it may be
+ * compressed and carry DFS_TIER_COMPRESSED. A compressed file moves as it
+ * is, and the mover counts its stored bytes against `hot_bytes`. A move
+ * copies the file into a staging file next to its destination, then,
+ * holding the file's pin, checks that the source did not change, renames
+ * the staging file into place and removes the source. Stores and deletes
+ * hold the pin for their whole run, so a move never races them; a fetch
+ * that already opened the source keeps reading the unlinked file. If the
+ * server dies between the rename and the removal, the copy in the hot tier
+ * wins on startup.
+ *
+ * The cold tier's files are kept in a catalog in memory, built by walking
+ * it on startup, so listing them costs no disk access.
+ */
+class DFSTierManager
+{
+
+public:
+    /**
+     * Where a file is stored
+     */
+    struct Location
+    {
+        /** Full path of the stored file **/
+        std::string path;
+
+        /** Whether it is in the cold tier **/
+        bool cold;
+
+        /** Whether it is in the compressed format **/
+        bool compressed;
+
+        /** Logical size and mtime **/
+        int64_t size;
+        int64_t modified_time;
+    };
+
+    /**
+     * Holds off the mover from one file while it exists
+     */
+    class Pin
+    {
+
+    public:
+        Pin(DFSTierManager *tiers, const std::string &path);
+        ~Pin();
+
+        Pin(const Pin &) = delete;
+        Pin &operator=(const Pin &) = delete;
+
+    private:
+        DFSTierManager *tiers;
+        std::string path;
+    };
+
+    /**
+     * Catalog the cold tier and start the mover.
+     *
+     * @param hot_root - the mount path, with a trailing '/'
+     * @param options
+     */
+    DFSTierManager(const std::string &hot_root, const DFSTierOptions &options);
+    ~DFSTierManager();
+
+    DFSTierManager(const DFSTierManager &) = delete;
+    DFSTierManager &operator=(const DFSTierManager &) = delete;
+
+    /** Whether a listed path is a move's staging file **/
+    static bool IsStaging(const std::string &path);
+
+    /**
+     * Find a file in the hot tier, as it is or compressed. Where both
+     * exist, a compression was cut short and the plain file wins.
+     *
+     * @param hot_root - the mount path, with a trailing '/'
+     * @param path - relative to the mount
+     * @param location - set when found
+     * @return false if the hot tier does not have it
+     */
+    static bool LocateHot(const std::string &hot_root, const std::string &path, Location *location);
+
+    /**
+     * The name a file is listed under, for a file stored in the hot tier
+     * under `stored`: a readable compressed file loses DFS_TIER_COMPRESSED.
+     *
+     * @param hot_root - the mount path, with a trailing '/'
+     * @param stored - relative to the mount
+     * @param path - set to the name the file is known by
+     * @param size - set to the logical size of a compressed file
+     * @return whether `stored` is a compressed file
+     */
+    static bool HotName(const std::string &hot_root, const std::string &stored, std::string *path, int64_t *size);
+
+    /**
+     * Count an access to a file.
+     *
+     * @param path - relative to the mount
+     */
+    void Touch(const std::string &path);
+
+    /**
+     * Find the tier holding a file.
+     *
+     * @param path - relative to the mount
+     * @param location - set when found
+     * @return false if neither tier has it
+     */
+    bool Locate(const std::string &path, Location *location);
+
+    /**
+     * Drop the cold copy of a file that was just stored to the hot tier,
+     * or is being deleted. The caller holds the file's pin.
+     *
+     * @param path - relative to the mount
+     * @return whether there was a cold copy
+     */
+    bool DropCold(const std::string &path);
+
+    /**
+     * Give the cold copy of a file another name, in the cold tier. The
+     * caller holds both pins and has dropped any cold copy of `to`.
+     *
+     * @param from - relative to the mount
+     * @param to - relative to the mount
+     * @return false if there was no cold copy or it could not be renamed
+     */
+    bool RenameCold(const std::string &from, const std::string &to);
+
+    /**
+     * The files of the cold tier.
+     *
+     * @param entries - appended to
+     * @param top_only - only files directly in the root
+     */
+    void ListCold(std::vector<DFSWalkEntry> *entries, bool top_only);
+
+private:
+    struct Access
+    {
+        double heat;
+        std::chrono::steady_clock::time_point last;
+    };
+
+    struct ColdFile
+    {
+        int64_t size;
+        int64_t modified_time;
+        bool compressed;
+    };
+
+    std::string hot_root;
+    std::string cold_root;
+    DFSTierOptions options;
+    DFSTreeWalker walker;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Access> accesses;
+    std::map<std::string, ColdFile> cold;
+
+    /** Files held by a Pin **/
+    std::set<std::string> pinned;
+    std::condition_variable unpinned;
+
+    /** Throttle of the mover's reads **/
+    std::chrono::steady_clock::time_point throttle_start;
+    int64_t throttle_bytes;
+
+    std::atomic<bool> stopping;
+    std::mutex stop_mutex;
+    std::condition_variable stop_cv;
+    std::thread mover;
+
+    /** Heat of a file now, decayed since its last access **/
+    double HeatLocked(const std::string &path, std::chrono::steady_clock::time_point now);
+
+    bool TryPin(const std::string &path);
+    void Unpin(const std::string &path);
+
+    /** One pass: demote what is idle or over capacity, then promote what became hot **/
+    void Cycle();
+    void Run();
+
+    bool Demote(const std::string &path);
+    bool Promote(const std::string &path);
+
+    /** Rewrite a cold file compressed in version 1 in the current format, keeping its mtime **/
+    bool Upgrade(const std::string &path, int64_t modified_time, int64_t *size);
+
+    /** Sleep as needed to keep the mover under move_bytes; false once stopping **/
+    bool Throttle(size_t bytes);
+
+    /** Copy `from` into a new file `to`, preserving holes **/
+    bool Copy(int from, const std::string &to);
+
+    /** Decompress `from` into a new file `to` **/
+    bool Inflate(int from, const std::string &to);
+};
+
+#endif
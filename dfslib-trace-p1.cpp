@@ -0,0 +1,305 @@
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "dfslib-trace-p1.h"
+
+namespace
+{
+    /** A complete span ('X') or one end of a client-to-server flow ('s', 'f') **/
+    struct Event
+    {
+        char phase;
+        const char *name;
+        int64_t start;
+        int64_t duration;
+        uint64_t trace;
+        std::string detail;
+    };
+
+    struct ThreadBuffer
+    {
+        /** Only contended while Write() reads the buffer **/
+        std::mutex mutex;
+        std::vector<Event> events;
+        long tid;
+    };
+
+    std::atomic<bool> enabled(false);
+    std::atomic<uint64_t> recorded(0);
+    std::atomic<uint64_t> dropped(0);
+    double sample_rate = 0;
+
+    std::mutex config_mutex;
+    std::string trace_path;
+    std::string process_name;
+
+    /** Every thread's buffer, kept after the thread exits so its spans are still written **/
+    std::mutex registry_mutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> registry;
+
+    thread_local std::shared_ptr<ThreadBuffer> local_buffer;
+    thread_local DFSTraceContext current;
+
+    int64_t Now()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    ThreadBuffer &Buffer()
+    {
+        if (!local_buffer)
+        {
+            local_buffer = std::make_shared<ThreadBuffer>();
+            local_buffer->tid = syscall(SYS_gettid);
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            registry.push_back(local_buffer);
+        }
+        return *local_buffer;
+    }
+
+    void Record(char phase, const char *name, int64_t start, int64_t duration, uint64_t trace, const std::string &detail = "")
+    {
+        if (recorded.fetch_add(1, std::memory_order_relaxed) >= DFS_TRACE_MAX_EVENTS)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        ThreadBuffer &buffer = Buffer();
+        std::lock_guard<std::mutex> lock(buffer.mutex);
+        buffer.events.push_back(Event{phase, name, start, duration, trace, detail});
+    }
+
+    std::mt19937_64 &Random()
+    {
+        thread_local std::mt19937_64 random(std::random_device{}() ^ (static_cast<uint64_t>(syscall(SYS_gettid)) << 32) ^ Now());
+        return random;
+    }
+
+    DFSTraceContext NewTrace()
+    {
+        DFSTraceContext context;
+        context.id = Random()() | 1;
+        context.sampled = sample_rate >= 1 || (sample_rate > 0 && std::uniform_real_distribution<double>(0, 1)(Random()) < sample_rate);
+        return context;
+    }
+
+    std::string Hex(uint64_t value)
+    {
+        char text[19];
+        snprintf(text, sizeof(text), "0x%llx", static_cast<unsigned long long>(value));
+        return text;
+    }
+
+    std::string Escape(const std::string &text)
+    {
+        std::string escaped;
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                escaped += '\\';
+                escaped += c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char code[7];
+                snprintf(code, sizeof(code), "\\u%04x", c);
+                escaped += code;
+            }
+            else
+            {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+}
+
+void DFSTracer::Configure(double rate, const std::string &path, const std::string &name)
+{
+    {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        trace_path = path;
+        process_name = name;
+    }
+    sample_rate = rate;
+    enabled = rate > 0 && !path.empty();
+}
+
+bool DFSTracer::Write()
+{
+    std::string path, name;
+    {
+        std::lock_guard<std::mutex> lock(config_mutex);
+        path = trace_path;
+        name = process_name;
+    }
+    if (path.empty())
+    {
+        return false;
+    }
+
+    // written aside and renamed, so a reader never sees half a trace
+    const std::string temporary = path + ".tmp";
+    std::ofstream out(temporary, std::ios::out | std::ios::trunc);
+    const long pid = getpid();
+    out << "{\"traceEvents\":[\n"
+        << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+        << ",\"args\":{\"name\":\"" << Escape(name) << "\"}}";
+
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        buffers = registry;
+    }
+    for (auto &buffer : buffers)
+    {
+        std::lock_guard<std::mutex> lock(buffer->mutex);
+        for (const Event &event : buffer->events)
+        {
+            out << ",\n{\"name\":\"" << event.name << "\",\"cat\":\"dfs\",\"ph\":\"" << event.phase
+                << "\",\"ts\":" << event.start << ",\"pid\":" << pid << ",\"tid\":" << buffer->tid;
+            if (event.phase == 'X')
+            {
+                out << ",\"dur\":" << event.duration << ",\"args\":{\"trace\":\"" << Hex(event.trace) << "\"";
+                if (!event.detail.empty())
+                {
+                    out << ",\"detail\":\"" << Escape(event.detail) << "\"";
+                }
+                out << "}";
+            }
+            else
+            {
+                // flow events bind to the span around them on either side
+                out << ",\"id\":\"" << Hex(event.trace) << "\",\"bp\":\"e\"";
+            }
+            out << "}";
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_spans\":" << dropped.load() << "}}\n";
+    out.close();
+    if (!out.good())
+    {
+        return false;
+    }
+    return rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+DFSTraceContext DFSTracer::Current()
+{
+    return current;
+}
+
+void DFSTracer::Inject(grpc::ClientContext *context)
+{
+    if (!enabled || current.id == 0)
+    {
+        return;
+    }
+    context->AddMetadata(DFS_TRACE_METADATA, Hex(current.id) + (current.sampled ? ";1" : ";0"));
+    if (current.sampled)
+    {
+        Record('s', "rpc", Now(), 0, current.id);
+    }
+}
+
+DFSTrace::DFSTrace(const char *name, const std::string &detail)
+    : previous(current), name(nullptr), start(0)
+{
+    if (!enabled)
+    {
+        return;
+    }
+    this->name = name;
+    Begin(NewTrace());
+    if (current.sampled)
+    {
+        this->detail = detail;
+    }
+}
+
+DFSTrace::DFSTrace(grpc::ServerContext *context, const char *name, const std::string &detail)
+    : previous(current), name(nullptr), start(0)
+{
+    if (!enabled)
+    {
+        return;
+    }
+    this->name = name;
+    const auto &metadata = context->client_metadata();
+    auto iter = metadata.find(DFS_TRACE_METADATA);
+    if (iter == metadata.end())
+    {
+        Begin(NewTrace());
+    }
+    else
+    {
+        // the client's sampling decision holds for the whole trace
+        const std::string value(iter->second.data(), iter->second.size());
+        DFSTraceContext client;
+        client.id = strtoull(value.c_str(), nullptr, 16);
+        client.sampled = value.size() > 2 && value.compare(value.size() - 2, 2, ";1") == 0;
+        Begin(client);
+        if (current.sampled)
+        {
+            Record('f', "rpc", start, 0, current.id);
+        }
+    }
+    if (current.sampled)
+    {
+        this->detail = detail;
+    }
+}
+
+DFSTrace::DFSTrace(const DFSTraceContext &parent)
+    : previous(current), name(nullptr), start(0)
+{
+    current = parent;
+}
+
+void DFSTrace::Begin(const DFSTraceContext &context)
+{
+    current = context;
+    if (current.sampled)
+    {
+        start = Now();
+    }
+}
+
+DFSTrace::~DFSTrace()
+{
+    if (name != nullptr && current.sampled)
+    {
+        Record('X', name, start, Now() - start, current.id, detail);
+    }
+    current = previous;
+}
+
+DFSSpan::DFSSpan(const char *name) : name(nullptr), start(0)
+{
+    if (current.sampled)
+    {
+        this->name = name;
+        start = Now();
+    }
+}
+
+DFSSpan::~DFSSpan()
+{
+    if (name != nullptr)
+    {
+        Record('X', name, start, Now() - start, current.id);
+    }
+}
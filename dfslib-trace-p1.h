@@ -0,0 +1,135 @@
+#ifndef _DFSLIB_TRACE_H
+#define _DFSLIB_TRACE_H
+
+#include <string>
+#include <cstdint>
+#include <grpcpp/grpcpp.h>
+
+/** Metadata key carrying "<trace id in hex>;<0|1 sampled>" from client to server **/
+#define DFS_TRACE_METADATA "dfs-trace"
+
+/** Spans kept in memory at most; later ones are counted and dropped **/
+#define DFS_TRACE_MAX_EVENTS (1 << 20)
+
+/**
+ * The trace a thread is working for
+ */
+struct DFSTraceContext
+{
+    uint64_t id = 0;
+    bool sampled = false;
+};
+
+/**
+ * Per-RPC phase tracing.
+ *
+ * A trace is started for each client operation (DFSTrace) and is sampled
+ * or not as a whole, at the configured rate. Its id and sampling decision
+ * go to the server in DFS_TRACE_METADATA, so the server records spans for
+ * the same traces the client does, and a flow event ties the client's call
+ * to the server's handler. Phases inside an RPC are marked with DFSSpan.
+ *
+ * Spans are recorded into a buffer owned by the recording thread, so the
+ * hot path takes no shared lock; a thread that is not in a sampled trace
+ * records nothing, which makes an unsampled span two thread-local reads.
+ * Write() exports every buffer as Chrome trace JSON, readable by
+ * chrome://tracing and Perfetto. Timestamps are wall-clock microseconds,
+ * so a client's and a server's file merge into one timeline.
+ */
+class DFSTracer
+{
+
+public:
+    /**
+     * Turn tracing on for this process. Until then nothing is recorded.
+     *
+     * @param sample_rate - share of traces recorded, 0 to 1
+     * @param path - where Write() puts the trace
+     * @param process_name - how the process is labelled in the trace
+     */
+    static void Configure(double sample_rate, const std::string &path, const std::string &process_name);
+
+    /**
+     * Write everything recorded so far to the configured path.
+     *
+     * @return false if tracing is off or the file could not be written
+     */
+    static bool Write();
+
+    /** The calling thread's trace **/
+    static DFSTraceContext Current();
+
+    /** Pass the calling thread's trace on to a server **/
+    static void Inject(grpc::ClientContext *context);
+};
+
+/**
+ * Makes a trace the calling thread's current one for its lifetime, and
+ * records a span covering it. The previous trace is restored afterwards.
+ */
+class DFSTrace
+{
+
+public:
+    /**
+     * Start a new trace, sampled at the configured rate.
+     *
+     * @param name - a string literal
+     * @param detail - shown with the span, e.g. the file name
+     */
+    DFSTrace(const char *name, const std::string &detail = "");
+
+    /**
+     * Continue the trace a client passed in the call's metadata. Without
+     * one, a new trace is started as above.
+     *
+     * @param context
+     * @param name - a string literal
+     * @param detail
+     */
+    DFSTrace(grpc::ServerContext *context, const char *name, const std::string &detail = "");
+
+    /**
+     * Continue a trace on another thread, without a span of its own.
+     *
+     * @param parent
+     */
+    explicit DFSTrace(const DFSTraceContext &parent);
+
+    ~DFSTrace();
+
+    DFSTrace(const DFSTrace &) = delete;
+    DFSTrace &operator=(const DFSTrace &) = delete;
+
+private:
+    DFSTraceContext previous;
+    const char *name;
+    std::string detail;
+    int64_t start;
+
+    void Begin(const DFSTraceContext &context);
+};
+
+/**
+ * One phase of the current trace, from construction to destruction
+ */
+class DFSSpan
+{
+
+public:
+    /**
+     * @param name - a string literal
+     */
+    explicit DFSSpan(const char *name);
+
+    ~DFSSpan();
+
+    DFSSpan(const DFSSpan &) = delete;
+    DFSSpan &operator=(const DFSSpan &) = delete;
+
+private:
+    const char *name;
+    int64_t start;
+};
+
+#endif
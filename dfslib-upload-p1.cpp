@@ -0,0 +1,301 @@
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <cstdio>
+#include <ctime>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dfslib-shared-p1.h"
+#include "dfslib-upload-p1.h"
+
+using grpc::StatusCode;
+
+typedef std::chrono::steady_clock Clock;
+
+/** Whether an id is one this table could have made, and so safe in a file name **/
+static bool dfs_valid_upload_id(const std::string &id)
+{
+    return id.size() == DFS_UPLOAD_ID_LENGTH &&
+           std::all_of(id.begin(), id.end(), [](char c)
+                       { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+}
+
+DFSUploadTable::Range::Range(DFSUploadTable *table, const std::string &id)
+    : table(table), id(id), size(0), ok(false), run_start(0), run_end(0)
+{
+    std::lock_guard<std::mutex> lock(table->mutex);
+    auto upload = table->uploads.find(id);
+    if (upload != table->uploads.end())
+    {
+        upload->second.streams++;
+        upload->second.active = Clock::now();
+        staging = upload->second.staging;
+        size = upload->second.size;
+        ok = true;
+    }
+}
+
+DFSUploadTable::Range::~Range()
+{
+    if (!ok)
+    {
+        return;
+    }
+    Flush();
+    std::lock_guard<std::mutex> lock(table->mutex);
+    Upload &upload = table->uploads[id];
+    upload.streams--;
+    upload.active = Clock::now();
+}
+
+bool DFSUploadTable::Range::Ok() const
+{
+    return ok;
+}
+
+const std::string &DFSUploadTable::Range::Staging() const
+{
+    return staging;
+}
+
+int64_t DFSUploadTable::Range::Size() const
+{
+    return size;
+}
+
+void DFSUploadTable::Range::Wrote(int64_t offset, int64_t end)
+{
+    if (offset != run_end || run_start == run_end)
+    {
+        Flush();
+        run_start = offset;
+    }
+    run_end = end;
+}
+
+void DFSUploadTable::Range::Flush()
+{
+    if (run_start == run_end)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(table->mutex);
+    Cover(&table->uploads[id], run_start, run_end);
+    run_start = run_end = 0;
+}
+
+DFSUploadTable::DFSUploadTable(const DFSUploadOptions &options)
+    : upload_path(options.upload_path), id_source(std::random_device()())
+{
+    if (upload_path.empty() || upload_path.back() != '/')
+    {
+        upload_path += '/';
+    }
+    if (!dfs_make_parents(upload_path))
+    {
+        dfs_log(LL_ERROR) << "Failed to create the upload directory " << upload_path;
+    }
+
+    // nobody can commit the uploads of an earlier run
+    DIR *dir = opendir(upload_path.c_str());
+    if (dir != nullptr)
+    {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            if (strncmp(entry->d_name, DFS_UPLOAD_STAGING, strlen(DFS_UPLOAD_STAGING)) == 0)
+            {
+                unlink((upload_path + entry->d_name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+}
+
+DFSUploadTable::~DFSUploadTable()
+{
+    for (auto &upload : uploads)
+    {
+        unlink(upload.second.staging.c_str());
+    }
+}
+
+grpc::Status DFSUploadTable::Start(const std::string &filename, int64_t size, int64_t modified_time, std::string *id)
+{
+    if (size < 0)
+    {
+        return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid size");
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    ExpireLocked();
+    if (id->empty())
+    {
+        char buffer[DFS_UPLOAD_ID_LENGTH + 1];
+        do
+        {
+            snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(id_source()));
+        } while (uploads.count(buffer) != 0);
+        *id = buffer;
+    }
+    else if (!dfs_valid_upload_id(*id) || uploads.count(*id) != 0)
+    {
+        return grpc::Status(StatusCode::INVALID_ARGUMENT, "Invalid upload id");
+    }
+
+    const std::string staging = upload_path + DFS_UPLOAD_STAGING + *id;
+    int fd = open(staging.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    // reserve the whole file in one go; a filesystem that cannot gets a sparse file instead
+    bool created = fd >= 0 && (size == 0 || fallocate(fd, 0, 0, size) == 0 ||
+                               ((errno == EOPNOTSUPP || errno == ENOSYS) && ftruncate(fd, size) == 0));
+    if (fd >= 0)
+    {
+        created = close(fd) == 0 && created;
+    }
+    if (!created)
+    {
+        dfs_log(LL_ERROR) << "Failed to create " << staging << " of " << size << " bytes: " << strerror(errno);
+        unlink(staging.c_str());
+        return grpc::Status(errno == ENOSPC ? StatusCode::RESOURCE_EXHAUSTED : StatusCode::INTERNAL,
+                            "Failed to create the upload");
+    }
+
+    Upload &upload = uploads[*id];
+    upload.filename = filename;
+    upload.staging = staging;
+    upload.size = size;
+    upload.modified_time = modified_time;
+    upload.streams = 0;
+    upload.active = Clock::now();
+    return grpc::Status::OK;
+}
+
+bool DFSUploadTable::FilenameOf(const std::string &id, std::string *filename)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto upload = uploads.find(id);
+    if (upload == uploads.end())
+    {
+        return false;
+    }
+    *filename = upload->second.filename;
+    return true;
+}
+
+grpc::Status DFSUploadTable::Commit(const std::string &id, const std::string &path)
+{
+    Upload upload;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto iter = uploads.find(id);
+        if (iter == uploads.end())
+        {
+            return grpc::Status(StatusCode::NOT_FOUND, "Upload not found");
+        }
+        if (iter->second.streams > 0)
+        {
+            return grpc::Status(StatusCode::FAILED_PRECONDITION, "Ranges are still being written");
+        }
+        const auto &covered = iter->second.covered;
+        const bool complete = iter->second.size == 0 ||
+                              (covered.size() == 1 && covered.begin()->first == 0 && covered.begin()->second >= iter->second.size);
+        if (!complete)
+        {
+            int64_t missing = covered.empty() || covered.begin()->first > 0 ? 0 : covered.begin()->second;
+            dfs_log(LL_ERROR) << "Upload " << id << " of " << iter->second.filename << " is missing bytes from " << missing;
+            return grpc::Status(StatusCode::FAILED_PRECONDITION, "Bytes from " + std::to_string(missing) + " are missing");
+        }
+        // taken out of the table, so no range stream can join it any more
+        upload = iter->second;
+        uploads.erase(iter);
+    }
+
+    const int64_t modified_time = upload.modified_time > 0 ? upload.modified_time : time(nullptr);
+    bool moved = dfs_set_mtime(upload.staging, modified_time) && dfs_make_parents(path);
+    if (moved && rename(upload.staging.c_str(), path.c_str()) != 0)
+    {
+        // the upload directory is on another filesystem
+        moved = false;
+        int in = errno == EXDEV ? open(upload.staging.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+        if (in >= 0)
+        {
+            int out = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+            moved = out >= 0 && dfs_copy_file(in, out);
+            if (out >= 0)
+            {
+                moved = close(out) == 0 && moved;
+            }
+            close(in);
+            moved = moved && dfs_set_mtime(path, modified_time);
+        }
+        unlink(upload.staging.c_str());
+    }
+    if (!moved)
+    {
+        dfs_log(LL_ERROR) << "Failed to move " << upload.staging << " to " << path << ": " << strerror(errno);
+        unlink(upload.staging.c_str());
+        return grpc::Status(StatusCode::INTERNAL, "Failed to commit the upload");
+    }
+    return grpc::Status::OK;
+}
+
+grpc::Status DFSUploadTable::Abort(const std::string &id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto upload = uploads.find(id);
+    if (upload == uploads.end())
+    {
+        return grpc::Status(StatusCode::NOT_FOUND, "Upload not found");
+    }
+    if (upload->second.streams > 0)
+    {
+        return grpc::Status(StatusCode::FAILED_PRECONDITION, "Ranges are still being written");
+    }
+    unlink(upload->second.staging.c_str());
+    uploads.erase(upload);
+    return grpc::Status::OK;
+}
+
+void DFSUploadTable::ExpireLocked()
+{
+    const Clock::time_point idle = Clock::now() - std::chrono::seconds(DFS_UPLOAD_IDLE_S);
+    for (auto upload = uploads.begin(); upload != uploads.end();)
+    {
+        if (upload->second.streams == 0 && upload->second.active < idle)
+        {
+            dfs_log(LL_SYSINFO) << "Dropping idle upload of " << upload->second.filename;
+            unlink(upload->second.staging.c_str());
+            upload = uploads.erase(upload);
+        }
+        else
+        {
+            ++upload;
+        }
+    }
+}
+
+void DFSUploadTable::Cover(Upload *upload, int64_t offset, int64_t end)
+{
+    auto &covered = upload->covered;
+    // merge with every range that overlaps or touches [offset, end)
+    auto next = covered.upper_bound(offset);
+    if (next != covered.begin() && std::prev(next)->second >= offset)
+    {
+        --next;
+        offset = next->first;
+        end = std::max(end, next->second);
+        next = covered.erase(next);
+    }
+    while (next != covered.end() && next->first <= end)
+    {
+        end = std::max(end, next->second);
+        next = covered.erase(next);
+    }
+    covered[offset] = end;
+}
@@ -0,0 +1,179 @@
+#ifndef _DFSLIB_UPLOAD_H
+#define _DFSLIB_UPLOAD_H
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <random>
+#include <string>
+#include <cstdint>
+
+#include <grpcpp/grpcpp.h>
+
+/** Prefix of the staging files in the upload directory **/
+#define DFS_UPLOAD_STAGING ".dfs-upload-"
+
+/** Seconds an upload may go without a range being written before it is dropped **/
+#define DFS_UPLOAD_IDLE_S 600
+
+/** Hex digits in an upload id **/
+#define DFS_UPLOAD_ID_LENGTH 16
+
+/**
+ * Settings of striped uploads
+ */
+struct DFSUploadOptions
+{
+    /** Directory uploads are staged in until they are committed (empty = no striped uploads) **/
+    std::string upload_path;
+};
+
+/**
+ * Uploads in progress: files written over several concurrent streams,
+ * each carrying a range of the file.
+ *
+ * Start() creates a staging file in the upload directory and preallocates
+ * the whole file with fallocate, so it is laid out in one piece instead of
+ * growing a chunk at a time. Range streams write into it in place and
+ * record which bytes they covered. Commit() checks that every byte was
+ * written and renames the staging file onto its name in the mount, so
+ * the file appears whole or not at all. The upload directory should be on
+ * the mount's filesystem; elsewhere the commit has to copy the file.
+ *
+ * The table lives in memory. Uploads left without a range stream for
+ * DFS_UPLOAD_IDLE_S are dropped when the next one starts, and staging
+ * files left over from a previous run are removed on startup.
+ */
+class DFSUploadTable
+{
+
+public:
+    /**
+     * A range stream's hold on an upload: the upload is neither
+     * committed nor dropped while it exists
+     */
+    class Range
+    {
+
+    public:
+        /**
+         * @param table
+         * @param id
+         */
+        Range(DFSUploadTable *table, const std::string &id);
+
+        /** Record the bytes written and let go of the upload **/
+        ~Range();
+
+        Range(const Range &) = delete;
+        Range &operator=(const Range &) = delete;
+
+        /** Whether the upload exists **/
+        bool Ok() const;
+
+        /** The staging file to write into **/
+        const std::string &Staging() const;
+
+        /** The size declared when the upload started **/
+        int64_t Size() const;
+
+        /**
+         * Record that [offset, end) of the file has been written.
+         *
+         * @param offset
+         * @param end
+         */
+        void Wrote(int64_t offset, int64_t end);
+
+    private:
+        DFSUploadTable *table;
+        std::string id;
+        std::string staging;
+        int64_t size;
+        bool ok;
+
+        /** The run of bytes written since the last flush, which chunks usually extend **/
+        int64_t run_start;
+        int64_t run_end;
+
+        void Flush();
+    };
+
+    /**
+     * @param options - with an upload path
+     */
+    explicit DFSUploadTable(const DFSUploadOptions &options);
+
+    /** Remove the staging files of uploads not committed **/
+    ~DFSUploadTable();
+
+    DFSUploadTable(const DFSUploadTable &) = delete;
+    DFSUploadTable &operator=(const DFSUploadTable &) = delete;
+
+    /**
+     * Start an upload: create its staging file and preallocate it.
+     *
+     * @param filename - the name in the mount it is committed to
+     * @param size
+     * @param modified_time - for the committed file (0 = the time of the commit)
+     * @param id - in: the id to use, from a primary forwarding the upload (empty = a new one); out: the id
+     * @return INVALID_ARGUMENT, INTERNAL or OK
+     */
+    grpc::Status Start(const std::string &filename, int64_t size, int64_t modified_time, std::string *id);
+
+    /**
+     * The name an upload is committed to.
+     *
+     * @param id
+     * @param filename
+     * @return false if there is no such upload
+     */
+    bool FilenameOf(const std::string &id, std::string *filename);
+
+    /**
+     * Move a completely written upload into place and forget it.
+     *
+     * @param id
+     * @param path - the file in the mount, replaced if it exists
+     * @return NOT_FOUND, FAILED_PRECONDITION (ranges missing or being written), INTERNAL or OK
+     */
+    grpc::Status Commit(const std::string &id, const std::string &path);
+
+    /**
+     * Drop an upload and its staging file.
+     *
+     * @param id
+     * @return NOT_FOUND, FAILED_PRECONDITION (ranges being written) or OK
+     */
+    grpc::Status Abort(const std::string &id);
+
+private:
+    struct Upload
+    {
+        std::string filename;
+        std::string staging;
+        int64_t size;
+        int64_t modified_time;
+
+        /** Written ranges, start -> end, merged so none touch **/
+        std::map<int64_t, int64_t> covered;
+
+        /** Range streams holding the upload **/
+        int streams;
+        std::chrono::steady_clock::time_point active;
+    };
+
+    std::string upload_path;
+
+    std::mutex mutex;
+    std::map<std::string, Upload> uploads;
+    std::mt19937_64 id_source;
+
+    /** Drop uploads idle for DFS_UPLOAD_IDLE_S **/
+    void ExpireLocked();
+
+    /** Add [offset, end) to the written ranges **/
+    static void Cover(Upload *upload, int64_t offset, int64_t end);
+};
+
+#endif
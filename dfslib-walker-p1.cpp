@@ -0,0 +1,213 @@
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "src/dfs-utils.h"
+#include "dfslib-walker-p1.h"
+
+DFSTreeWalker::DFSTreeWalker(int threads) : threads(threads)
+{
+    if (this->threads <= 0)
+    {
+        this->threads = std::min(8, std::max(1, static_cast<int>(std::thread::hardware_concurrency())));
+    }
+}
+
+DFSTreeWalker::DirHandle::~DirHandle()
+{
+    close(fd);
+}
+
+int DFSTreeWalker::Walk(const std::string &root, std::vector<DFSWalkEntry> *entries,
+                        const std::function<bool()> &cancelled)
+{
+    int root_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0)
+    {
+        return errno;
+    }
+
+    WalkState state(threads);
+    state.pending = 1;
+    state.queues[0].dirs.push_back(WalkDir{std::make_shared<DirHandle>(root_fd), std::string()});
+
+    std::vector<std::vector<DFSWalkEntry>> found(threads);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; i++)
+    {
+        workers.emplace_back(&DFSTreeWalker::Work, this, &state, i, &found[i], std::cref(cancelled));
+    }
+    Work(&state, 0, &found[0], cancelled);
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    for (auto &part : found)
+    {
+        if (entries->empty())
+        {
+            entries->swap(part);
+        }
+        else
+        {
+            entries->insert(entries->end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+        }
+    }
+    return state.stop ? ECANCELED : 0;
+}
+
+void DFSTreeWalker::Work(WalkState *state, int index, std::vector<DFSWalkEntry> *found,
+                         const std::function<bool()> &cancelled)
+{
+    WalkDir dir;
+    while (!state->stop)
+    {
+        if (Take(state, index, &dir))
+        {
+            ReadDirectory(state, index, dir, found);
+            // let the parent close once its last subdirectory is open
+            dir.parent.reset();
+            if (state->pending.fetch_sub(1) == 1)
+            {
+                // that was the last directory, release the idle workers
+                state->idle_cv.notify_all();
+                return;
+            }
+            if (cancelled && cancelled())
+            {
+                state->stop = true;
+                state->idle_cv.notify_all();
+                return;
+            }
+            continue;
+        }
+        if (state->pending == 0)
+        {
+            return;
+        }
+        // nothing to steal right now: wait for a push, with a timeout so a missed wakeup only costs 1ms
+        std::unique_lock<std::mutex> lock(state->idle_mutex);
+        state->idle_cv.wait_for(lock, std::chrono::milliseconds(1));
+    }
+}
+
+bool DFSTreeWalker::Take(WalkState *state, int index, WalkDir *dir)
+{
+    {
+        // our own work, newest first
+        WorkQueue &own = state->queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.dirs.empty())
+        {
+            *dir = std::move(own.dirs.back());
+            own.dirs.pop_back();
+            return true;
+        }
+    }
+    for (int i = 1; i < threads; i++)
+    {
+        // steal the oldest directory of another worker
+        WorkQueue &victim = state->queues[(index + i) % threads];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.dirs.empty())
+        {
+            *dir = std::move(victim.dirs.front());
+            victim.dirs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void DFSTreeWalker::ReadDirectory(WalkState *state, int index, const WalkDir &dir, std::vector<DFSWalkEntry> *found)
+{
+    // one name in the parent, or "." in the root's own handle
+    const std::string name = dir.path.empty() ? "." : dir.path.substr(dir.path.rfind('/') + 1);
+    int dir_fd = openat(dir.parent->fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dir_fd < 0)
+    {
+        dfs_log(LL_ERROR) << "Failed to open directory " << dir.path << ": " << strerror(errno);
+        return;
+    }
+    DIR *stream = fdopendir(dir_fd);
+    if (stream == nullptr)
+    {
+        dfs_log(LL_ERROR) << "Failed to read directory " << dir.path << ": " << strerror(errno);
+        close(dir_fd);
+        return;
+    }
+
+    const std::string prefix = dir.path.empty() ? dir.path : dir.path + "/";
+    std::vector<std::string> subdirs;
+    struct dirent *entry;
+    struct stat file_stat;
+    while ((entry = readdir(stream)) != nullptr)
+    {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        {
+            continue;
+        }
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            if (fstatat(dir_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+                continue;
+            }
+            type = S_ISDIR(file_stat.st_mode) ? DT_DIR : S_ISREG(file_stat.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        else if (type == DT_REG && fstatat(dir_fd, name, &file_stat, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            continue;
+        }
+
+        if (type == DT_DIR)
+        {
+            subdirs.push_back(prefix + name);
+        }
+        else if (type == DT_REG)
+        {
+            DFSWalkEntry file;
+            file.path = prefix + name;
+            file.size = file_stat.st_size;
+            file.modified_time = file_stat.st_mtime;
+            found->push_back(std::move(file));
+        }
+    }
+    if (subdirs.empty())
+    {
+        closedir(stream);
+        return;
+    }
+    // the subdirectories are opened relative to this one, by whichever workers take them
+    int keep_fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+    closedir(stream);
+    if (keep_fd < 0)
+    {
+        dfs_log(LL_ERROR) << "Failed to keep directory " << dir.path << " open: " << strerror(errno);
+        return;
+    }
+    std::shared_ptr<DirHandle> handle = std::make_shared<DirHandle>(keep_fd);
+    state->pending += subdirs.size();
+    {
+        WorkQueue &own = state->queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        for (auto &subdir : subdirs)
+        {
+            own.dirs.push_back(WalkDir{handle, std::move(subdir)});
+        }
+    }
+    state->idle_cv.notify_all();
+}
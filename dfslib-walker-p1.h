@@ -0,0 +1,119 @@
+#ifndef _DFSLIB_WALKER_H
+#define _DFSLIB_WALKER_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+/**
+ * A regular file found by the tree walker
+ */
+struct DFSWalkEntry
+{
+    /** Path relative to the walked root, '/'-separated **/
+    std::string path;
+
+    int64_t size;
+    int64_t modified_time;
+};
+
+/**
+ * Parallel walker for directory trees.
+ *
+ * Directories are the unit of work. Each worker keeps its own deque of
+ * directories still to be read: it pushes the subdirectories it finds to
+ * the back and pops from the back, so it walks depth-first and its open
+ * directories stay hot, while idle workers steal from the front of the
+ * other deques, which holds the oldest and usually largest subtrees.
+ *
+ * Every directory is opened with openat() by its name, relative to its
+ * parent's fd, and its entries are stat'ed with fstatat() relative to its
+ * own fd, so the kernel resolves one component per call however deep the
+ * tree is. A directory with subdirectories keeps a dup of its fd until
+ * the last of them has been opened. The d_type of each entry is
+ * used to recognise subdirectories and to skip symlinks and special files
+ * without a stat; only regular files (and entries whose filesystem does
+ * not report d_type) are stat'ed.
+ */
+class DFSTreeWalker
+{
+
+public:
+    /**
+     * @param threads - workers per walk (0 = one per core, at most 8)
+     */
+    DFSTreeWalker(int threads = 0);
+
+    /**
+     * Walk the tree under `root` and collect its regular files.
+     *
+     * Entries are collected per worker and returned in no particular order.
+     * Directories that cannot be opened are logged and skipped.
+     *
+     * @param root - the directory to walk
+     * @param entries - filled in with the files found
+     * @param cancelled - polled between directories; the walk stops early when it returns true
+     * @return 0, ECANCELED if the walk was cancelled, or the errno of opening the root
+     */
+    int Walk(const std::string &root, std::vector<DFSWalkEntry> *entries,
+             const std::function<bool()> &cancelled = nullptr);
+
+private:
+    /** An open directory, closed when the last of its queued subdirectories is taken and opened **/
+    struct DirHandle
+    {
+        int fd;
+
+        explicit DirHandle(int fd) : fd(fd) {}
+        ~DirHandle();
+    };
+
+    /** A directory still to be read **/
+    struct WalkDir
+    {
+        /** The directory it is in **/
+        std::shared_ptr<DirHandle> parent;
+
+        /** Path relative to the root, empty for the root itself **/
+        std::string path;
+    };
+
+    /** One worker's queue of directories **/
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<WalkDir> dirs;
+    };
+
+    int threads;
+
+    /** State shared by the workers of one Walk() call **/
+    struct WalkState
+    {
+        std::vector<WorkQueue> queues;
+
+        /** Directories queued or being read; the walk is over when it drops to 0 **/
+        std::atomic<int64_t> pending;
+        std::atomic<bool> stop;
+
+        std::mutex idle_mutex;
+        std::condition_variable idle_cv;
+
+        WalkState(int threads) : queues(threads), pending(0), stop(false) {}
+    };
+
+    void Work(WalkState *state, int index, std::vector<DFSWalkEntry> *found,
+              const std::function<bool()> &cancelled);
+
+    bool Take(WalkState *state, int index, WalkDir *dir);
+
+    void ReadDirectory(WalkState *state, int index, const WalkDir &dir, std::vector<DFSWalkEntry> *found);
+};
+
+#endif
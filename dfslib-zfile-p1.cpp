@@ -0,0 +1,410 @@
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dfslib-zfile-p1.h"
+
+/** Frame flags in the index **/
+#define DFS_ZFILE_DEFLATED 1
+#define DFS_ZFILE_ZERO 2
+
+namespace
+{
+    struct ZFileHeader
+    {
+        char magic[4];
+        uint32_t version;
+        int64_t size;
+        uint32_t frame_size;
+        uint32_t frame_count;
+        uint64_t index_offset;
+    };
+
+    static_assert(sizeof(ZFileHeader) == 32, "compressed file header must not have padding");
+
+    /** The header of a version 1 file, which one zlib stream of the contents follows **/
+    struct ZFileHeaderV1
+    {
+        char magic[4];
+        uint32_t version;
+        int64_t size;
+    };
+
+    static_assert(sizeof(ZFileHeaderV1) == 16, "version 1 header must not have padding");
+
+    struct ZFileFrame
+    {
+        uint64_t offset;
+        uint32_t stored_length;
+        uint32_t flags;
+    };
+
+    static_assert(sizeof(ZFileFrame) == 16, "compressed frame record must not have padding");
+
+    bool WriteAll(int fd, const char *data, size_t length, int64_t offset)
+    {
+        size_t written = 0;
+        while (written < length)
+        {
+            ssize_t bytes = pwrite(fd, data + written, length - written, offset + written);
+            if (bytes < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            written += bytes;
+        }
+        return true;
+    }
+
+    /** Read up to `length` bytes, short only at the end of the file; -1 on an error **/
+    ssize_t ReadAll(int fd, char *data, size_t length, int64_t offset)
+    {
+        size_t done = 0;
+        while (done < length)
+        {
+            ssize_t bytes = pread(fd, data + done, length - done, offset + done);
+            if (bytes < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return -1;
+            }
+            if (bytes == 0)
+            {
+                break;
+            }
+            done += bytes;
+        }
+        return done;
+    }
+
+    bool ReadHeader(int fd, ZFileHeader *header)
+    {
+        return ReadAll(fd, reinterpret_cast<char *>(header), sizeof(*header), 0) == static_cast<ssize_t>(sizeof(*header)) &&
+               memcmp(header->magic, DFS_ZFILE_MAGIC, sizeof(header->magic)) == 0 &&
+               header->version == DFS_ZFILE_VERSION && header->size >= 0 &&
+               header->frame_size > 0 && header->frame_size <= DFS_ZFILE_MAX_FRAME;
+    }
+
+    bool IsZero(const char *data, size_t length)
+    {
+        return length == 0 || (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
+    }
+
+    /** Fills `data` with up to `length` bytes of contents, short only at the end; -1 on an error **/
+    typedef std::function<ssize_t(char *data, size_t length)> ContentSource;
+
+    /** Write the contents `source` yields in the at-rest format **/
+    bool CompressFrom(const ContentSource &source, int out_fd, const std::function<bool(size_t)> &progress)
+    {
+        std::vector<char> raw(DFS_ZFILE_FRAME);
+        std::vector<char> deflated(compressBound(DFS_ZFILE_FRAME));
+        std::vector<ZFileFrame> frames;
+        int64_t read_offset = 0;
+        int64_t write_offset = sizeof(ZFileHeader);
+        for (;;)
+        {
+            ssize_t bytes = source(raw.data(), raw.size());
+            if (bytes < 0)
+            {
+                return false;
+            }
+            if (bytes == 0)
+            {
+                break;
+            }
+            read_offset += bytes;
+
+            ZFileFrame frame{static_cast<uint64_t>(write_offset), 0, 0};
+            if (IsZero(raw.data(), bytes))
+            {
+                frame.flags = DFS_ZFILE_ZERO;
+            }
+            else
+            {
+                uLongf deflated_length = deflated.size();
+                const char *stored = raw.data();
+                frame.stored_length = bytes;
+                if (compress2(reinterpret_cast<Bytef *>(deflated.data()), &deflated_length,
+                              reinterpret_cast<const Bytef *>(raw.data()), bytes, Z_DEFAULT_COMPRESSION) == Z_OK &&
+                    deflated_length < static_cast<uLongf>(bytes))
+                {
+                    stored = deflated.data();
+                    frame.stored_length = deflated_length;
+                    frame.flags = DFS_ZFILE_DEFLATED;
+                }
+                if (!WriteAll(out_fd, stored, frame.stored_length, write_offset))
+                {
+                    return false;
+                }
+                write_offset += frame.stored_length;
+            }
+            frames.push_back(frame);
+            if (progress && !progress(bytes))
+            {
+                return false;
+            }
+            if (bytes < static_cast<ssize_t>(raw.size()))
+            {
+                break;
+            }
+        }
+
+        if (!WriteAll(out_fd, reinterpret_cast<const char *>(frames.data()), frames.size() * sizeof(ZFileFrame), write_offset))
+        {
+            return false;
+        }
+
+        // the header goes last, so a file cut short has no valid header
+        ZFileHeader header;
+        memcpy(header.magic, DFS_ZFILE_MAGIC, sizeof(header.magic));
+        header.version = DFS_ZFILE_VERSION;
+        header.size = read_offset;
+        header.frame_size = DFS_ZFILE_FRAME;
+        header.frame_count = frames.size();
+        header.index_offset = write_offset;
+        return WriteAll(out_fd, reinterpret_cast<const char *>(&header), sizeof(header), 0) &&
+               ftruncate(out_fd, write_offset + frames.size() * sizeof(ZFileFrame)) == 0;
+    }
+}
+
+bool dfs_zfile_compress(int in_fd, int out_fd, const std::function<bool(size_t)> &progress)
+{
+    int64_t offset = 0;
+    return CompressFrom([in_fd, &offset](char *data, size_t length)
+                        {
+        ssize_t bytes = ReadAll(in_fd, data, length, offset);
+        offset += std::max<ssize_t>(bytes, 0);
+        return bytes; },
+                        out_fd, progress);
+}
+
+bool dfs_zfile_upgrade(int in_fd, int out_fd)
+{
+    ZFileHeaderV1 header;
+    if (ReadAll(in_fd, reinterpret_cast<char *>(&header), sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+        memcmp(header.magic, DFS_ZFILE_MAGIC, sizeof(header.magic)) != 0 || header.version != 1 || header.size < 0)
+    {
+        return false;
+    }
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK)
+    {
+        return false;
+    }
+
+    // inflate the old stream frame by frame into the new format
+    std::vector<char> input(DFS_ZFILE_FRAME);
+    int64_t input_offset = sizeof(header);
+    int64_t produced = 0;
+    bool ended = false;
+    const bool converted = CompressFrom([&](char *data, size_t length) -> ssize_t
+                                        {
+        stream.next_out = reinterpret_cast<Bytef *>(data);
+        stream.avail_out = length;
+        while (stream.avail_out > 0 && !ended)
+        {
+            if (stream.avail_in == 0)
+            {
+                ssize_t bytes = ReadAll(in_fd, input.data(), input.size(), input_offset);
+                if (bytes <= 0)
+                {
+                    // the stream must end before the file does
+                    return -1;
+                }
+                input_offset += bytes;
+                stream.next_in = reinterpret_cast<Bytef *>(input.data());
+                stream.avail_in = bytes;
+            }
+            int result = inflate(&stream, Z_NO_FLUSH);
+            if (result == Z_STREAM_END)
+            {
+                ended = true;
+            }
+            else if (result != Z_OK)
+            {
+                return -1;
+            }
+        }
+        produced += length - stream.avail_out;
+        return length - stream.avail_out; },
+                                        out_fd, nullptr);
+    inflateEnd(&stream);
+    return converted && ended && produced == header.size;
+}
+
+bool dfs_zfile_size(int fd, int64_t *size)
+{
+    ZFileHeader header;
+    if (!ReadHeader(fd, &header))
+    {
+        return false;
+    }
+    *size = header.size;
+    return true;
+}
+
+bool dfs_zfile_expand(dfs_service::FileChunk *chunk)
+{
+    if (chunk->raw_length() == 0)
+    {
+        return true;
+    }
+    if (chunk->raw_length() < 0 || chunk->raw_length() > DFS_ZFILE_MAX_FRAME)
+    {
+        return false;
+    }
+    std::string raw(chunk->raw_length(), '\0');
+    uLongf raw_length = raw.size();
+    const std::string &content = chunk->content();
+    if (uncompress(reinterpret_cast<Bytef *>(&raw[0]), &raw_length,
+                   reinterpret_cast<const Bytef *>(content.data()), content.size()) != Z_OK ||
+        raw_length != raw.size())
+    {
+        return false;
+    }
+    chunk->mutable_content()->swap(raw);
+    chunk->set_raw_length(0);
+    return true;
+}
+
+DFSZFileReader::DFSZFileReader(int fd, int64_t offset, int64_t length, bool frames)
+    : fd(fd), frames(frames), failed(false), size(0), frame_size(DFS_ZFILE_FRAME), position(0), end(0), chunk_num(0)
+{
+    if (!Load())
+    {
+        failed = true;
+        return;
+    }
+    position = std::min(std::max<int64_t>(offset, 0), size);
+    end = length < 0 ? size : std::min(size, position + length);
+}
+
+bool DFSZFileReader::Load()
+{
+    ZFileHeader header;
+    struct stat file_stat;
+    if (!ReadHeader(fd, &header) || fstat(fd, &file_stat) != 0)
+    {
+        return false;
+    }
+    size = header.size;
+    frame_size = header.frame_size;
+    const uint64_t frame_count = (size + frame_size - 1) / frame_size;
+    const uint64_t index_bytes = frame_count * sizeof(ZFileFrame);
+    if (header.frame_count != frame_count || header.index_offset < sizeof(ZFileHeader) ||
+        header.index_offset + index_bytes != static_cast<uint64_t>(file_stat.st_size))
+    {
+        return false;
+    }
+
+    std::vector<ZFileFrame> records(frame_count);
+    if (ReadAll(fd, reinterpret_cast<char *>(records.data()), index_bytes, header.index_offset) != static_cast<ssize_t>(index_bytes))
+    {
+        return false;
+    }
+    index.reserve(frame_count);
+    for (const ZFileFrame &record : records)
+    {
+        // every frame must lie between the header and the index
+        if (record.offset < sizeof(ZFileHeader) || record.offset + record.stored_length > header.index_offset ||
+            record.stored_length > static_cast<uint64_t>(compressBound(frame_size)))
+        {
+            return false;
+        }
+        index.push_back(Frame{record.offset, record.stored_length, record.flags});
+    }
+    return true;
+}
+
+bool DFSZFileReader::Next(dfs_service::FileChunk *chunk)
+{
+    if (failed || position >= end)
+    {
+        return false;
+    }
+    size_t number = position / frame_size;
+    const int64_t frame_start = number * frame_size;
+    const int64_t raw_length = std::min(frame_size, size - frame_start);
+    const Frame &frame = index[number];
+    int64_t chunk_end = std::min(end, frame_start + raw_length);
+
+    chunk->set_chunk_num(chunk_num++);
+    chunk->set_offset(position);
+    chunk->set_raw_length(0);
+    if (frame.flags & DFS_ZFILE_ZERO)
+    {
+        // a run of zero frames goes out as one hole
+        while (chunk_end < end && (index[number + 1].flags & DFS_ZFILE_ZERO))
+        {
+            number++;
+            chunk_end = std::min(end, static_cast<int64_t>(number + 1) * frame_size);
+        }
+        chunk->clear_content();
+        chunk->set_hole_length(chunk_end - position);
+        position = chunk_end;
+        return true;
+    }
+    chunk->set_hole_length(0);
+
+    std::string *content = chunk->mutable_content();
+    const bool deflated = frame.flags & DFS_ZFILE_DEFLATED;
+    const bool whole = position == frame_start && chunk_end == frame_start + raw_length;
+    if (!deflated || (frames && whole))
+    {
+        content->resize(frame.stored_length);
+        if ((!deflated && frame.stored_length != raw_length) ||
+            ReadAll(fd, &(*content)[0], frame.stored_length, frame.offset) != static_cast<ssize_t>(frame.stored_length))
+        {
+            failed = true;
+            return false;
+        }
+        if (deflated)
+        {
+            chunk->set_raw_length(raw_length);
+        }
+    }
+    else
+    {
+        std::string stored(frame.stored_length, '\0');
+        uLongf inflated = raw_length;
+        content->resize(raw_length);
+        if (ReadAll(fd, &stored[0], stored.size(), frame.offset) != static_cast<ssize_t>(stored.size()) ||
+            uncompress(reinterpret_cast<Bytef *>(&(*content)[0]), &inflated,
+                       reinterpret_cast<const Bytef *>(stored.data()), stored.size()) != Z_OK ||
+            inflated != static_cast<uLongf>(raw_length))
+        {
+            failed = true;
+            return false;
+        }
+    }
+    if (!chunk->raw_length())
+    {
+        // trim the frame to the range
+        content->resize(chunk_end - frame_start);
+        content->erase(0, position - frame_start);
+    }
+    position = chunk_end;
+    return true;
+}
+
+bool DFSZFileReader::Failed() const
+{
+    return failed;
+}
+
+int64_t DFSZFileReader::Size() const
+{
+    return size;
+}
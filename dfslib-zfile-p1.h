@@ -0,0 +1,131 @@
+#ifndef _DFSLIB_ZFILE_H
+#define _DFSLIB_ZFILE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <zlib.h>
+
+#include "proto-src/dfs-service.pb.h"
+
+/** First bytes of a compressed file **/
+#define DFS_ZFILE_MAGIC "DFSZ"
+
+/** Version 1 was a single zlib stream; such files are converted with dfs_zfile_upgrade() **/
+#define DFS_ZFILE_VERSION 2
+
+/** Logical bytes per frame **/
+#define DFS_ZFILE_FRAME (64 * 1024)
+
+/** Largest frame a reader accepts, from a file or from the wire **/
+#define DFS_ZFILE_MAX_FRAME (4 * 1024 * 1024)
+
+/**
+ * Compress a file into the at-rest format.
+ *
+ * The contents are cut into frames of DFS_ZFILE_FRAME logical bytes, each
+ * deflated on its own, so any range can be read by inflating only the
+ * frames it touches. A frame that does not shrink is stored as is, and a
+ * frame of zeros (a hole, usually) is not stored at all. The frames are
+ * followed by an index of their offsets and stored lengths; the header
+ * holding DFS_ZFILE_MAGIC, the version, the logical size and the index's
+ * offset goes first but is written last.
+ *
+ * @param in_fd - read from offset 0
+ * @param out_fd - written from offset 0
+ * @param progress - called with the bytes read after each frame; returning false aborts
+ * @return false on an error or when aborted
+ */
+bool dfs_zfile_compress(int in_fd, int out_fd, const std::function<bool(size_t)> &progress = nullptr);
+
+/**
+ * Rewrite a version 1 file, a single zlib stream that cannot be read in
+ * parts, in the current format.
+ *
+ * @param in_fd - a version 1 file
+ * @param out_fd - written from offset 0
+ * @return false if the file is not version 1, is corrupt, or on an error
+ */
+bool dfs_zfile_upgrade(int in_fd, int out_fd);
+
+/**
+ * Read the logical size from a compressed file's header.
+ *
+ * @param fd
+ * @param size - set on success
+ * @return false if the file is not in the at-rest format
+ */
+bool dfs_zfile_size(int fd, int64_t *size);
+
+/**
+ * Inflate a chunk sent as a compressed frame (raw_length set) in place.
+ *
+ * @param chunk
+ * @return false if the frame is corrupt
+ */
+bool dfs_zfile_expand(dfs_service::FileChunk *chunk);
+
+/**
+ * Streams a range of a compressed file as chunks, like DFSChunkReader
+ * does for a plain file: one chunk per frame, trimmed to the range, and a
+ * hole for each run of zero frames. Only the frames in the range are read.
+ *
+ * With `frames` set, a frame that lies wholly in the range is sent as it
+ * is stored, deflated, with raw_length holding its logical length, for
+ * the receiver to inflate with dfs_zfile_expand().
+ */
+class DFSZFileReader
+{
+
+public:
+    /**
+     * @param fd - a compressed file, which the caller keeps ownership of
+     * @param offset - logical offset the range starts at
+     * @param length - logical bytes in the range (-1 = to the end)
+     * @param frames - send whole frames compressed
+     */
+    DFSZFileReader(int fd, int64_t offset = 0, int64_t length = -1, bool frames = false);
+
+    DFSZFileReader(const DFSZFileReader &) = delete;
+    DFSZFileReader &operator=(const DFSZFileReader &) = delete;
+
+    /**
+     * Fill in the next chunk.
+     *
+     * @param chunk
+     * @return false at the end of the range or on an error
+     */
+    bool Next(dfs_service::FileChunk *chunk);
+
+    /**
+     * Whether Next() stopped because of a read error or corrupt data
+     */
+    bool Failed() const;
+
+    /** The logical size from the header **/
+    int64_t Size() const;
+
+private:
+    struct Frame
+    {
+        uint64_t offset;
+        uint32_t stored_length;
+        uint32_t flags;
+    };
+
+    int fd;
+    bool frames;
+    bool failed;
+    int64_t size;
+    int64_t frame_size;
+    std::vector<Frame> index;
+    int64_t position;
+    int64_t end;
+    int32_t chunk_num;
+
+    /** Read the header and the frame index **/
+    bool Load();
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include <map>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <errno.h>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <grpcpp/grpcpp.h>
+
+#include "dfs-utils.h"
+#include "../dfslib-shared-p1.h"
+#include "../dfslib-clientnode-p1.h"
+#include "../dfslib-servernode-p1.h"
+
+//
+// Allocation counting
+//
+// Every heap allocation in the process goes through these definitions, which
+// count it and forward to glibc's allocator. Server and client run in this
+// process, so the counts cover both ends of a transfer. The binary is built
+// without ASAN, which brings an allocator of its own.
+//
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+}
+
+static std::atomic<uint64_t> allocations(0);
+
+extern "C" void *malloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void *memalign(size_t alignment, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    *ptr = memalign(alignment, size);
+    return *ptr == NULL ? ENOMEM : 0;
+}
+
+extern "C" void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+using grpc::StatusCode;
+
+void Usage() {
+    std::cout <<
+        "\nUSAGE: dfs-allocbench-p1 [OPTIONS]\n"
+        "-a, --address <address>:  Address the in-process server listens on (default: 127.0.0.1:49790)\n"
+        "-m, --mount_path <path>:  Scratch directory; server/ and client/ are created below it (default: /tmp/dfs-allocbench)\n"
+        "-s, --size_mib <int>:     Size of the file stored and fetched (default: 16)\n"
+        "-n, --files <int>:        Files in the listing (default: 1000)\n"
+        "-r, --rounds <int>:       Measured repetitions of each operation (default: 10)\n"
+        "-h, --help:               Show help\n\n";
+    exit(1);
+}
+
+/** Runs `op` `rounds` times and returns the allocations it made per round **/
+template <typename Op>
+double AllocationsPerRound(int rounds, Op op) {
+    uint64_t start = allocations.load();
+    for (int i = 0; i < rounds; i++) {
+        if (op() != StatusCode::OK) {
+            std::cerr << "operation failed" << std::endl;
+            fflush(stdout);
+            _exit(1);
+        }
+    }
+    return static_cast<double>(allocations.load() - start) / rounds;
+}
+
+int main(int argc, char **argv) {
+    std::string address("127.0.0.1:49790");
+    std::string root("/tmp/dfs-allocbench");
+    int size_mib = 16;
+    int files = 1000;
+    int rounds = 10;
+
+    static struct option long_options[] = {
+        {"address", required_argument, NULL, 'a'},
+        {"mount_path", required_argument, NULL, 'm'},
+        {"size_mib", required_argument, NULL, 's'},
+        {"files", required_argument, NULL, 'n'},
+        {"rounds", required_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "a:m:s:n:r:h", long_options, NULL)) != -1) {
+        switch (ch) {
+            case 'a':
+                address = std::string(optarg);
+                break;
+            case 'm':
+                root = dfs_clean_path(optarg);
+                break;
+            case 's':
+                size_mib = std::max(1, atoi(optarg));
+                break;
+            case 'n':
+                files = std::max(1, atoi(optarg));
+                break;
+            case 'r':
+                rounds = std::max(1, atoi(optarg));
+                break;
+            case 'h':
+            default:
+                Usage();
+        }
+    }
+
+    const std::string server_path = dfs_clean_path(root + "/server");
+    const std::string client_path = dfs_clean_path(root + "/client");
+    mkdir(root.c_str(), 0755);
+    mkdir(server_path.c_str(), 0755);
+    mkdir(client_path.c_str(), 0755);
+
+    // the server runs until the process exits
+    std::thread([&]() {
+        DFSServerNode server(address, server_path, []() {});
+        server.Start();
+    }).detach();
+
+    DFSClientNodeP1 client;
+    client.SetMountPath(client_path);
+    client.SetDeadlineTimeout(60000);
+    client.AddServer(address, client.CreateChannels(address));
+
+    // wait for the server, which also sets up the channel
+    std::map<std::string, int> file_map;
+    for (int i = 0; client.List(&file_map) != StatusCode::OK; i++) {
+        if (i == 50) {
+            std::cerr << "server did not start" << std::endl;
+            _exit(1);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    const std::string name("dfs-allocbench.dat");
+    {
+        std::vector<char> block(1 << 20);
+        for (size_t i = 0; i < block.size(); i++) {
+            block[i] = static_cast<char>(i * 2654435761u >> 13);
+        }
+        std::ofstream out(client_path + name, std::ios::out | std::ios::binary);
+        for (int mib = 0; mib < size_mib; mib++) {
+            out.write(block.data(), block.size());
+        }
+    }
+    for (int i = 0; i < files; i++) {
+        std::ofstream(server_path + "list-" + std::to_string(i) + ".txt") << i;
+    }
+
+    // one untimed round of everything first, so pools and channels are warm
+    auto store = [&]() { return client.Store(name); };
+    auto fetch = [&]() { return client.Fetch(name); };
+    auto list = [&]() { file_map.clear(); return client.List(&file_map); };
+    auto stat = [&]() { return client.Stat(name); };
+    AllocationsPerRound(1, store);
+    AllocationsPerRound(1, fetch);
+    AllocationsPerRound(1, list);
+    AllocationsPerRound(1, stat);
+
+    const double store_allocs = AllocationsPerRound(rounds, store);
+    const double fetch_allocs = AllocationsPerRound(rounds, fetch);
+    const double list_allocs = AllocationsPerRound(rounds, list);
+    const double stat_allocs = AllocationsPerRound(rounds * 10, stat);
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "store " << size_mib << " MiB: " << store_allocs / size_mib << " allocations/MiB\n"
+              << "fetch " << size_mib << " MiB: " << fetch_allocs / size_mib << " allocations/MiB\n"
+              << "list " << file_map.size() << " files: " << list_allocs << " allocations/op, "
+              << std::setprecision(2) << list_allocs / file_map.size() << " per file\n"
+              << std::setprecision(1) << "stat: " << stat_allocs << " allocations/op\n";
+
+    client.Delete(name);
+    for (int i = 0; i < files; i++) {
+        std::remove((server_path + "list-" + std::to_string(i) + ".txt").c_str());
+    }
+    std::remove((client_path + name).c_str());
+
+    // the server thread is still serving, so skip the static destructors
+    fflush(stdout);
+    _exit(0);
+}
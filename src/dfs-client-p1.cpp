@@ -1,6 +1,7 @@
 #include <vector>
 #include <string>
 #include <thread>
+#include <chrono>
 #include <fstream>
 #include <errno.h>
 #include <csignal>
@@ -9,6 +10,7 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <algorithm>
+#include <random>
 #include <sys/inotify.h>
 #include <grpcpp/grpcpp.h>
 
@@ -16,6 +18,7 @@
 #include "dfs-client-p1.h"
 #include "../dfslib-shared-p1.h"
 #include "../dfslib-clientnode-p1.h"
+#include "../dfslib-trace-p1.h"
 
 using grpc::Status;
 using grpc::StatusCode;
@@ -46,7 +49,72 @@ void DFSClient::ProcessCommand(const std::string &command, const std::string &fi
 
     } else if (command == "stat") {
 
-        client_node.Stat(filename);
+        if (filename.find(',') == std::string::npos) {
+            client_node.Stat(filename);
+            return;
+        }
+        // several files are asked for in batches and printed one per line
+        std::vector<std::string> filenames = dfs_split(filename, ',');
+        std::map<std::string, dfs_service::FileStatus> statuses;
+        std::map<std::string, StatusCode> codes;
+        if (client_node.StatFiles(filenames, &statuses, &codes) != StatusCode::OK) {
+            dfs_log(LL_ERROR) << "Some servers did not answer";
+        }
+        for (const std::string &name : filenames) {
+            auto status = statuses.find(name);
+            if (status == statuses.end()) {
+                std::cout << name << " " << (codes.count(name) && codes[name] == StatusCode::NOT_FOUND ? "not found" : "unknown") << "\n";
+                continue;
+            }
+            std::cout << name << " " << status->second.size() << " " << status->second.modified_time() << " "
+                      << std::hex << status->second.content_hash() << std::dec << "\n";
+        }
+
+    } else if (command == "copy" || command == "rename") {
+
+        std::vector<std::string> names = dfs_split(filename, ',');
+        if (names.size() != 2) {
+            dfs_log(LL_ERROR) << command << " takes SOURCE,DESTINATION";
+            return;
+        }
+        if (command == "copy") {
+            client_node.Copy(names[0], names[1]);
+        } else {
+            client_node.Rename(names[0], names[1]);
+        }
+
+    } else if (command == "append") {
+
+        client_node.Append(filename);
+
+    } else if (command == "read") {
+
+        std::string data;
+        if (client_node.Read(filename, read_offset, read_length, &data) == StatusCode::OK) {
+            std::cout.write(data.data(), data.size());
+            std::cout.flush();
+        }
+
+    } else if (command == "bench") {
+
+        Benchmark(std::stoi(filename));
+
+    } else if (command == "sync") {
+
+        Sync();
+
+    } else if (command == "push") {
+
+        Push();
+
+    } else if (command == "watch") {
+
+        // runs until interrupted; the optional filename is a path prefix
+        client_node.Watch([](const dfs_service::FileEvent &event) {
+            static const char *kinds[] = {"changed", "deleted", "resync"};
+            std::cout << kinds[event.kind()] << " " << event.filename() << " " << event.modified_time() << std::endl;
+            return true;
+        }, filename);
 
     } else {
 
@@ -57,7 +125,18 @@ void DFSClient::ProcessCommand(const std::string &command, const std::string &fi
 }
 
 void DFSClient::InitializeClientNode(const std::string &server_address) {
-    this->client_node.CreateStub(grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials()));
+    // a comma-separated list of addresses shards the files across those servers,
+    // and "primary|replica|..." adds read replicas to a shard
+    for (const std::string &shard : dfs_split(server_address, ',')) {
+        std::vector<std::string> members = dfs_split(shard, '|');
+        if (members.empty()) {
+            continue;
+        }
+        this->client_node.AddServer(members[0], this->client_node.CreateChannels(members[0]));
+        for (size_t i = 1; i < members.size(); i++) {
+            this->client_node.AddReplica(members[0], members[i], this->client_node.CreateChannels(members[i]));
+        }
+    }
 }
 
 void DFSClient::SetMountPath(const std::string &path) {
@@ -70,36 +149,225 @@ void DFSClient::SetDeadlineTimeout(int deadline) {
     this->client_node.SetDeadlineTimeout(deadline);
 }
 
+void DFSClient::SetClientId(const std::string &id) {
+    this->client_node.SetClientId(id);
+}
+
+void DFSClient::SetTransportOptions(const DFSTransportOptions &options) {
+    this->transport_options = options;
+    this->client_node.SetTransportOptions(options);
+}
+
+void DFSClient::SetPushOptions(const DFSPushOptions &options) {
+    this->push_options = options;
+}
+
+void DFSClient::Push() {
+    DFSPushDaemon daemon(&client_node, mount_path, push_options);
+    if (!daemon.Run()) {
+        dfs_log(LL_ERROR) << "Failed to watch the mount path " << mount_path;
+    }
+}
+
+void DFSClient::SetSyncWorkers(int workers) {
+    this->sync_workers = workers;
+}
+
+void DFSClient::SetStripes(int streams) {
+    client_node.SetStripes(streams);
+}
+
+void DFSClient::SetPrefetchOptions(const DFSPrefetchOptions &options) {
+    DFSPrefetchStats stats = client_node.PrefetchStats();
+    client_node.SetPrefetchOptions(options);
+    if (!options.enabled && stats.hits + stats.misses > 0) {
+        std::cerr << "prefetch: " << stats.hits << " hits, " << stats.misses << " misses ("
+                  << std::fixed << std::setprecision(1) << 100.0 * stats.hits / (stats.hits + stats.misses)
+                  << "%), prefetched " << stats.prefetched_files << " files / " << stats.prefetched_bytes
+                  << " bytes, wasted " << stats.wasted_bytes << " bytes" << std::endl;
+    }
+}
+
+void DFSClient::SetHedgeOptions(const DFSHedgeOptions &options) {
+    std::map<std::string, DFSHedgeStats> stats = client_node.HedgeStats();
+    client_node.SetHedgeOptions(options);
+    if (options.enabled) {
+        return;
+    }
+    for (auto &kind : stats) {
+        if (kind.second.requests > 0) {
+            std::cerr << "hedge " << kind.first << ": " << kind.second.requests << " requests, "
+                      << kind.second.hedged << " hedged, " << kind.second.backup_wins << " won by the backup, "
+                      << kind.second.over_budget << " over budget" << std::endl;
+        }
+    }
+}
+
+void DFSClient::SetReadRange(int64_t offset, int64_t length) {
+    this->read_offset = offset;
+    this->read_length = length;
+}
+
+void DFSClient::Sync() {
+    DFSSyncEngine engine(&client_node, mount_path, sync_workers);
+    DFSSyncStats stats;
+    auto start = std::chrono::steady_clock::now();
+    if (engine.Sync(&stats) != StatusCode::OK) {
+        dfs_log(LL_ERROR) << "Sync failed";
+        return;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "fetched " << stats.fetched << ", stored " << stats.stored
+              << ", deleted " << stats.deleted_local << " local / " << stats.deleted_remote << " remote, "
+              << stats.failed << " failed, " << std::fixed << std::setprecision(1)
+              << stats.bytes / 1048576.0 << " MiB in " << std::setprecision(2) << seconds << "s" << std::endl;
+}
+
+void DFSClient::Benchmark(int size_mib) {
+    const std::vector<int> levels = {1, 2, 4, 8, 16};
+    const int max_streams = levels.back();
+
+    // one file per stream, so concurrent fetches never write the same local file
+    std::vector<std::string> names;
+    std::vector<char> block(1 << 20);
+    std::mt19937 rng(42);
+    std::generate(block.begin(), block.end(), [&]() { return static_cast<char>(rng()); });
+    for (int i = 0; i < max_streams; i++) {
+        names.push_back("dfs-bench-" + std::to_string(i) + ".dat");
+        std::ofstream out(this->mount_path + names.back(), std::ios::out | std::ios::binary);
+        for (int mib = 0; mib < size_mib; mib++) {
+            out.write(block.data(), block.size());
+        }
+    }
+
+    std::cout << "pool=" << this->transport_options.channel_pool_size
+              << " assign=" << (this->transport_options.least_loaded ? "least-loaded" : "round-robin")
+              << " bdp_probe=" << this->transport_options.bdp_probe
+              << " window=" << this->transport_options.initial_window_bytes
+              << " keepalive_ms=" << this->transport_options.keepalive_time_ms << "\n";
+    std::cout << std::left << std::setw(8) << "op" << std::setw(10) << "streams" << "MiB/s\n";
+
+    for (const std::string op : {"store", "fetch"}) {
+        for (int streams : levels) {
+            std::atomic<int> failures(0);
+            auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> workers;
+            for (int i = 0; i < streams; i++) {
+                workers.emplace_back([&, i]() {
+                    StatusCode code = op == "store" ? client_node.Store(names[i]) : client_node.Fetch(names[i]);
+                    if (code != StatusCode::OK) {
+                        failures++;
+                    }
+                });
+            }
+            for (auto &worker : workers) {
+                worker.join();
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::cout << std::left << std::setw(8) << op << std::setw(10) << streams
+                      << std::fixed << std::setprecision(1) << ((streams - failures) * size_mib) / seconds;
+            if (failures > 0) {
+                std::cout << " (" << failures << " failed)";
+            }
+            std::cout << "\n";
+        }
+    }
+
+    for (const std::string &name : names) {
+        client_node.Delete(name);
+        std::remove((this->mount_path + name).c_str());
+    }
+}
+
 #ifdef DFS_MAIN
 
 DFSClient client;
+
+/** Written to by HandleSignal, read by the thread that writes the trace and exits **/
+int signal_pipe[2];
+
 void HandleSignal(int signum) {
-    exit(0);
+    // only async-signal-safe calls here; the trace is written by the thread below
+    char byte = 1;
+    ssize_t written = write(signal_pipe[1], &byte, 1);
+    (void)written;
 }
 
 void Usage() {
     std::cout <<
         "\nUSAGE: dfs-client [OPTIONS] COMMAND [FILENAME]\n"
         "-a, --address <address>:  The rpc server address to connect to (default: 0.0.0.0:49704)\n"
+        "                          A comma-separated list shards files across several servers,\n"
+        "                          and \"primary|replica|...\" spreads reads over a server's replicas\n"
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
         "-m, --mount_path <path>:  The mount path this client attaches to\n"
         "-t, --deadline_timeout <int>:  The deadline timeout in milliseconds (default: 9000)\n"
+        "-p, --channel_pool <int>: Connections to open to each server (default: 1)\n"
+        "-l, --least_loaded:       Put each stream on the least loaded connection instead of round-robin\n"
+        "--bdp_probe <0|1>:        Enable or disable HTTP/2 BDP probing (default: gRPC default)\n"
+        "--window <bytes>:         Initial HTTP/2 stream flow-control window\n"
+        "--keepalive <ms>:         Keepalive ping interval\n"
+        "--keepalive_timeout <ms>: Time to wait for a keepalive ack\n"
+        "--client_id <id>:         Client id sent to the server (default: hostname and thread id)\n"
+        "--settle_ms <ms>:         push: quiet time after a file's last change before it is uploaded (default: 300)\n"
+        "--push_workers <int>:     push: uploads running at once (default: 4)\n"
+        "--sync_workers <int>:     sync: operations running at once (default: 8)\n"
+        "--trace_file <path>:      Write Chrome trace JSON of the client's RPC phases to this file on exit\n"
+        "--trace_sample <rate>:    Share of operations traced, 0 to 1 (default: 1)\n"
+        "--offset <bytes>:         read: where to start (default: 0)\n"
+        "--length <bytes>:         read: bytes to print (default: 0 = to the end of the file)\n"
+        "--prefetch:               Learn the order files are fetched in and prefetch the likely next ones\n"
+        "--prefetch_mib <rate>:    MiB/s prefetching may transfer (default: 32)\n"
+        "--prefetch_workers <int>: Prefetches running at once (default: 2)\n"
+        "--hedge:                  Send a backup of a slow stat or fetch to another replica of its server\n"
+        "--hedge_percentile <q>:   hedge: back up requests slower than this share of recent ones (default: 0.95)\n"
+        "--hedge_budget <share>:   hedge: backups as a share of requests at most (default: 0.05)\n"
+        "--stripes <int>:          store: streams a file over 64 MiB is uploaded over at once (default: 1)\n"
         "-h, --help:               Show help\n"
         "\n"
-        "COMMAND is one of fetch|store|delete|list|stat.\n"
-        "FILENAME is the filename to fetch, store, delete, or stat. The list command does not require a filename.\n\n";
+        "COMMAND is one of fetch|store|append|delete|list|stat|read|copy|rename|bench|watch|push|sync.\n"
+        "FILENAME is the filename to fetch, store, append, delete, stat or read. The list command does not require a filename.\n"
+        "stat takes several comma-separated filenames too, and prints the size, mtime and hash of each.\n"
+        "append sends the end of a local file that grew since it was last stored, not the whole file.\n"
+        "read prints part of a file to stdout without fetching the rest of it.\n"
+        "copy and rename take SOURCE,DESTINATION and act on the servers without transferring the file.\n"
+        "bench takes a file size in MiB and reports store/fetch goodput against the number of streams.\n"
+        "watch prints changes to files on the servers as they happen, optionally only below a path prefix.\n"
+        "push runs until interrupted and uploads local changes in the mount path as they happen.\n"
+        "sync brings the mount path and the servers in sync both ways; the newer copy of a file wins.\n\n";
     exit(1);
 }
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:t:h";
+    const char* const short_opts = "a:d:m:t:p:lh";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
         {"debug_level", optional_argument, nullptr, 'd'},
         {"mount_path", optional_argument, nullptr, 'm'},
         {"deadline_timeout", optional_argument, nullptr, 't'},
+        {"channel_pool", required_argument, nullptr, 'p'},
+        {"least_loaded", no_argument, nullptr, 'l'},
+        {"bdp_probe", required_argument, nullptr, 1000},
+        {"window", required_argument, nullptr, 1001},
+        {"keepalive", required_argument, nullptr, 1002},
+        {"keepalive_timeout", required_argument, nullptr, 1003},
+        {"client_id", required_argument, nullptr, 1004},
+        {"settle_ms", required_argument, nullptr, 1005},
+        {"push_workers", required_argument, nullptr, 1006},
+        {"sync_workers", required_argument, nullptr, 1007},
+        {"trace_file", required_argument, nullptr, 1008},
+        {"trace_sample", required_argument, nullptr, 1009},
+        {"offset", required_argument, nullptr, 1010},
+        {"length", required_argument, nullptr, 1011},
+        {"prefetch", no_argument, nullptr, 1012},
+        {"prefetch_mib", required_argument, nullptr, 1013},
+        {"prefetch_workers", required_argument, nullptr, 1014},
+        {"hedge", no_argument, nullptr, 1015},
+        {"hedge_percentile", required_argument, nullptr, 1016},
+        {"hedge_budget", required_argument, nullptr, 1017},
+        {"stripes", required_argument, nullptr, 1018},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
@@ -111,6 +379,17 @@ int main(int argc, char** argv) {
     int debug_level = static_cast<int>(LL_ERROR);
     std::string mount_path = "mnt/client";
     std::string filename = "";
+    DFSTransportOptions transport_options;
+    std::string client_id = "";
+    DFSPushOptions push_options;
+    int sync_workers = 8;
+    std::string trace_file = "";
+    double trace_sample = 1;
+    int64_t read_offset = 0;
+    int64_t read_length = 0;
+    DFSPrefetchOptions prefetch_options;
+    DFSHedgeOptions hedge_options;
+    int stripes = 1;
 
     char cwd[PATH_MAX];
     if (getcwd(cwd, sizeof(cwd)) == NULL) {
@@ -133,6 +412,69 @@ int main(int argc, char** argv) {
             case 't':
                 deadline_timeout = std::stoi(optarg);
                 break;
+            case 'p':
+                transport_options.channel_pool_size = std::stoi(optarg);
+                break;
+            case 'l':
+                transport_options.least_loaded = true;
+                break;
+            case 1000:
+                transport_options.bdp_probe = std::stoi(optarg);
+                break;
+            case 1001:
+                transport_options.initial_window_bytes = std::stoi(optarg);
+                break;
+            case 1002:
+                transport_options.keepalive_time_ms = std::stoi(optarg);
+                break;
+            case 1003:
+                transport_options.keepalive_timeout_ms = std::stoi(optarg);
+                break;
+            case 1004:
+                client_id = std::string(optarg);
+                break;
+            case 1005:
+                push_options.settle_ms = std::stoi(optarg);
+                break;
+            case 1006:
+                push_options.workers = std::stoi(optarg);
+                break;
+            case 1007:
+                sync_workers = std::stoi(optarg);
+                break;
+            case 1008:
+                trace_file = std::string(optarg);
+                break;
+            case 1009:
+                trace_sample = std::stod(optarg);
+                break;
+            case 1010:
+                read_offset = std::stoll(optarg);
+                break;
+            case 1011:
+                read_length = std::stoll(optarg);
+                break;
+            case 1012:
+                prefetch_options.enabled = true;
+                break;
+            case 1013:
+                prefetch_options.bytes_per_s = std::stod(optarg) * 1024 * 1024;
+                break;
+            case 1014:
+                prefetch_options.workers = std::stoi(optarg);
+                break;
+            case 1015:
+                hedge_options.enabled = true;
+                break;
+            case 1016:
+                hedge_options.percentile = std::stod(optarg);
+                break;
+            case 1017:
+                hedge_options.budget = std::stod(optarg);
+                break;
+            case 1018:
+                stripes = std::stoi(optarg);
+                break;
             case 'h':
                 Usage();
                 break;
@@ -179,27 +521,64 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    std::string commands("fetch store delete list stat");
+    std::string commands("fetch store append delete list stat read copy rename bench watch push sync");
     if (commands.find(command) == std::string::npos ) {
         std::cerr << "\nUnknown command!\n";
         Usage();
         return -1;
     }
 
-    std::string nonpath_commands("list");
+    std::string nonpath_commands("list watch push sync");
     if (filename.empty() && nonpath_commands.find(command) == std::string::npos ) {
         std::cerr << "\nMissing filename!\n";
         Usage();
         return -1;
     }
 
+    if (pipe(signal_pipe) != 0) {
+        std::cerr << "Cannot create the signal pipe" << std::endl;
+        return -1;
+    }
     signal(SIGINT, HandleSignal);
     signal(SIGTERM, HandleSignal);
 
+    if (!trace_file.empty()) {
+        DFSTracer::Configure(trace_sample, trace_file, "dfs-client " + command);
+    }
+
+    // watch, push and sync run until a signal; _exit leaves without running
+    // static destructors under the commands that are still going
+    std::thread([] {
+        char byte;
+        while (read(signal_pipe[0], &byte, 1) < 0 && errno == EINTR) {
+        }
+        DFSTracer::Write();
+        std::cout.flush();
+        _exit(0);
+    }).detach();
+
     client.SetMountPath(mount_path);
     client.SetDeadlineTimeout(deadline_timeout);
+    client.SetTransportOptions(transport_options);
+    client.SetPushOptions(push_options);
+    client.SetSyncWorkers(sync_workers);
+    client.SetReadRange(read_offset, read_length);
+    if (!client_id.empty()) {
+        client.SetClientId(client_id);
+    }
     client.InitializeClientNode(server_address);
+    client.SetStripes(stripes);
+    client.SetPrefetchOptions(prefetch_options);
+    client.SetHedgeOptions(hedge_options);
     client.ProcessCommand(command, filename);
+    if (prefetch_options.enabled) {
+        // wait for prefetches under way, so the next run can use them
+        client.SetPrefetchOptions(DFSPrefetchOptions());
+    }
+    if (hedge_options.enabled) {
+        client.SetHedgeOptions(DFSHedgeOptions());
+    }
+    DFSTracer::Write();
 
     return 0;
 }
@@ -7,6 +7,8 @@
 
 #include "../dfslib-shared-p1.h"
 #include "../dfslib-clientnode-p1.h"
+#include "../dfslib-push-p1.h"
+#include "../dfslib-sync-p1.h"
 
 class DFSClient {
 
@@ -14,6 +16,11 @@ protected:
 
         int deadline_timeout;
         std::string mount_path;
+        DFSTransportOptions transport_options;
+        DFSPushOptions push_options;
+        int sync_workers = 8;
+        int64_t read_offset = 0;
+        int64_t read_length = 0;
         DFSClientNodeP1 client_node;
 
 public:
@@ -23,6 +30,11 @@ public:
         /**
          * Initializes the client node library.
          *
+         * The address may be a comma-separated list of servers, in which
+         * case files are sharded across them by a consistent-hash ring.
+         * Each entry may be written as "primary|replica|..." to spread
+         * reads over the read replicas of that server.
+         *
          * @param server_address
          */
         void InitializeClientNode(const std::string& server_address);
@@ -51,5 +63,84 @@ public:
          */
         void SetDeadlineTimeout(int deadline);
 
+        /**
+         * Sets the client id the server uses to tell clients apart
+         *
+         * @param id
+         */
+        void SetClientId(const std::string& id);
+
+        /**
+         * Sets the connection pool and HTTP/2 settings.
+         * Must be called before InitializeClientNode.
+         *
+         * @param options
+         */
+        void SetTransportOptions(const DFSTransportOptions& options);
+
+        /**
+         * Measures store and fetch throughput against the number of
+         * concurrent streams, using files of the given size.
+         *
+         * @param size_mib
+         */
+        void Benchmark(int size_mib);
+
+        /**
+         * Sets the settle time and upload concurrency of the push command
+         *
+         * @param options
+         */
+        void SetPushOptions(const DFSPushOptions& options);
+
+        /**
+         * Watches the mount path and pushes local changes to the
+         * servers until interrupted.
+         */
+        void Push();
+
+        /**
+         * Sets the number of operations a sync runs at once
+         *
+         * @param workers
+         */
+        void SetSyncWorkers(int workers);
+
+        /**
+         * Sets the number of streams a large store is split over
+         *
+         * @param streams
+         */
+        void SetStripes(int streams);
+
+        /**
+         * Two-way sync of the mount path with the servers
+         */
+        void Sync();
+
+        /**
+         * Sets the part of a file the read command prints
+         *
+         * @param offset
+         * @param length - 0 = to the end of the file
+         */
+        void SetReadRange(int64_t offset, int64_t length);
+
+        /**
+         * Sets up predictive prefetch, or with disabled options stops it
+         * and prints its statistics
+         *
+         * @param options
+         */
+        void SetPrefetchOptions(const DFSPrefetchOptions& options);
+
+        /**
+         * Sets up hedged stat and fetch requests, or with disabled options
+         * stops hedging and prints what it did
+         *
+         * @param options
+         */
+        void SetHedgeOptions(const DFSHedgeOptions& options);
+
 };
 #endif
@@ -0,0 +1,169 @@
+#include <map>
+#include <string>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <getopt.h>
+
+#include "../dfslib-walker-p1.h"
+#include "../dfslib-listcodec-p1.h"
+#include "../proto-src/dfs-service.pb.h"
+
+//
+// Compares the plain listing (one FileInfo per file) with the packed one
+// on a synthetic tree: bytes on the wire, time to build the response, time
+// to parse it and walk the entries, and time to fill the client's file_map.
+//
+
+void Usage() {
+    std::cout <<
+        "\nUSAGE: dfs-listbench-p1 [OPTIONS]\n"
+        "-n, --files <int>:   Files in the listing (default: 200000)\n"
+        "-r, --rounds <int>:  Repetitions; the fastest one is reported (default: 5)\n"
+        "-h, --help:          Show help\n\n";
+    exit(1);
+}
+
+/** A tree of projects/modules/packages with long shared prefixes and files written in bursts **/
+std::vector<DFSWalkEntry> MakeTree(int files) {
+    std::mt19937 rng(42);
+    std::vector<DFSWalkEntry> entries;
+    int64_t mtime = 1700000000;
+    for (int i = 0; i < files; i++) {
+        const int package = i / 50;
+        std::string path = "projects/team-" + std::to_string(package / 400) +
+                           "/services/service-" + std::to_string(package / 40) +
+                           "/src/main/java/com/example/package" + std::to_string(package) +
+                           "/Generated" + std::to_string(i % 50) + "Handler.java";
+        mtime += rng() % 4 == 0 ? rng() % 86400 : rng() % 3;
+        entries.push_back(DFSWalkEntry{path, static_cast<int64_t>(rng() % 65536), mtime});
+    }
+    // the walker hands a directory's files over together, in readdir order,
+    // and the directories in the order its workers reach them
+    std::vector<std::vector<DFSWalkEntry>> directories;
+    for (size_t i = 0; i < entries.size(); i += 50) {
+        directories.emplace_back(entries.begin() + i, entries.begin() + std::min(entries.size(), i + 50));
+        std::shuffle(directories.back().begin(), directories.back().end(), rng);
+    }
+    std::shuffle(directories.begin(), directories.end(), rng);
+    entries.clear();
+    for (const auto &directory : directories) {
+        entries.insert(entries.end(), directory.begin(), directory.end());
+    }
+    return entries;
+}
+
+template <typename Fn>
+double FastestMs(int rounds, Fn fn) {
+    double best = 1e30;
+    for (int i = 0; i < rounds; i++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    int files = 200000;
+    int rounds = 5;
+
+    static struct option long_options[] = {
+        {"files", required_argument, NULL, 'n'},
+        {"rounds", required_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "n:r:h", long_options, NULL)) != -1) {
+        switch (ch) {
+            case 'n':
+                files = std::max(1, atoi(optarg));
+                break;
+            case 'r':
+                rounds = std::max(1, atoi(optarg));
+                break;
+            case 'h':
+            default:
+                Usage();
+        }
+    }
+
+    const std::vector<DFSWalkEntry> tree = MakeTree(files);
+    std::string plain_wire, packed_wire;
+    int64_t checksum = 0;
+
+    // server side: build and serialize the response
+    const double plain_encode = FastestMs(rounds, [&]() {
+        dfs_service::LSResponse response;
+        response.mutable_filesinfolist()->Reserve(tree.size());
+        for (const DFSWalkEntry &entry : tree) {
+            dfs_service::FileInfo *file_info = response.add_filesinfolist();
+            file_info->set_filename(entry.path);
+            file_info->set_modified_time(entry.modified_time);
+            file_info->set_size(entry.size);
+        }
+        response.SerializeToString(&plain_wire);
+    });
+    const double packed_encode = FastestMs(rounds, [&]() {
+        dfs_service::LSResponse response;
+        dfs_pack_listing(tree, response.mutable_packed());
+        response.SerializeToString(&packed_wire);
+    });
+
+    // client side: parse and visit every entry
+    const double plain_decode = FastestMs(rounds, [&]() {
+        dfs_service::LSResponse response;
+        response.ParseFromString(plain_wire);
+        for (const auto &file_info : response.filesinfolist()) {
+            checksum += file_info.filename().size() + file_info.modified_time();
+        }
+    });
+    const double packed_decode = FastestMs(rounds, [&]() {
+        dfs_service::LSResponse response;
+        response.ParseFromString(packed_wire);
+        DFSListDecoder decoder(response.packed());
+        while (decoder.Next()) {
+            checksum += decoder.Path().size() + decoder.ModifiedTime();
+        }
+    });
+
+    // client side: what List() does with it
+    std::map<std::string, int> plain_map, packed_map;
+    const double plain_map_ms = FastestMs(rounds, [&]() {
+        plain_map.clear();
+        dfs_service::LSResponse response;
+        response.ParseFromString(plain_wire);
+        for (const auto &file_info : response.filesinfolist()) {
+            plain_map.insert(std::pair<std::string, int>(file_info.filename(), file_info.modified_time()));
+        }
+    });
+    const double packed_map_ms = FastestMs(rounds, [&]() {
+        packed_map.clear();
+        dfs_service::LSResponse response;
+        response.ParseFromString(packed_wire);
+        DFSListDecoder decoder(response.packed());
+        while (decoder.Next()) {
+            packed_map.emplace_hint(packed_map.end(), decoder.Path(), decoder.ModifiedTime());
+        }
+    });
+    if (plain_map != packed_map) {
+        std::cerr << "packed listing does not match the plain one" << std::endl;
+        return 1;
+    }
+
+    std::cout << files << " files (checksum " << checksum % 1000 << ")\n"
+              << std::left << std::setw(8) << "format" << std::setw(14) << "bytes"
+              << std::setw(12) << "encode ms" << std::setw(12) << "decode ms" << "into map ms\n"
+              << std::fixed << std::setprecision(1)
+              << std::setw(8) << "plain" << std::setw(14) << plain_wire.size()
+              << std::setw(12) << plain_encode << std::setw(12) << plain_decode << plain_map_ms << "\n"
+              << std::setw(8) << "packed" << std::setw(14) << packed_wire.size()
+              << std::setw(12) << packed_encode << std::setw(12) << packed_decode << packed_map_ms << "\n";
+    return 0;
+}
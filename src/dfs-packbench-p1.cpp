@@ -0,0 +1,220 @@
+#include <string>
+#include <chrono>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dfs-utils.h"
+#include "../dfslib-shared-p1.h"
+#include "../dfslib-chunkpool-p1.h"
+#include "../dfslib-packstore-p1.h"
+#include "../dfslib-servernode-p1.h"
+
+//
+// Times the two places storeFile, fetchFile and statusFile keep a small
+// file: a file of its own in the mount, and a record in the packs. Each
+// operation does what the server's handler does with the disk for that
+// backend, without the RPC around it, so the figures compare the backends
+// alone.
+//
+
+void Usage() {
+    std::cout <<
+        "\nUSAGE: dfs-packbench-p1 [OPTIONS]\n"
+        "-m, --mount_path <path>:  Scratch directory; mount/ and packs/ are created below it (default: /tmp/dfs-packbench)\n"
+        "-n, --files <int>:        Files stored, fetched and stated (default: 20000)\n"
+        "-s, --size <bytes>:       Size of each file (default: 200)\n"
+        "-d, --directories <int>:  Directories the files are spread over (default: 100)\n"
+        "-r, --rounds <int>:       Repetitions; the fastest one is reported (default: 5)\n"
+        "-c, --drop_caches:        Drop the page cache before fetching and stating (needs root)\n"
+        "-h, --help:               Show help\n\n";
+    exit(1);
+}
+
+/** Runs `op` on every file and returns the operations per second **/
+template <typename Op>
+double Rate(const std::vector<std::string> &names, Op op) {
+    auto start = std::chrono::steady_clock::now();
+    for (const std::string &name : names) {
+        if (!op(name)) {
+            std::cerr << "operation failed on " << name << std::endl;
+            exit(1);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return names.size() / seconds;
+}
+
+/** Write back and drop the page cache, dentries and inodes, so the next reads go to the disk **/
+void DropCaches(bool cold) {
+    if (!cold) {
+        return;
+    }
+    sync();
+    FILE *control = fopen("/proc/sys/vm/drop_caches", "w");
+    if (control == NULL || fputs("3\n", control) < 0 || fclose(control) != 0) {
+        std::cerr << "cannot drop the page cache" << std::endl;
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string root("/tmp/dfs-packbench");
+    int files = 20000;
+    int size = 200;
+    int directories = 100;
+    int rounds = 5;
+    bool cold = false;
+
+    static struct option long_options[] = {
+        {"mount_path", required_argument, NULL, 'm'},
+        {"files", required_argument, NULL, 'n'},
+        {"size", required_argument, NULL, 's'},
+        {"directories", required_argument, NULL, 'd'},
+        {"rounds", required_argument, NULL, 'r'},
+        {"drop_caches", no_argument, NULL, 'c'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "m:n:s:d:r:ch", long_options, NULL)) != -1) {
+        switch (ch) {
+            case 'm':
+                root = dfs_clean_path(optarg);
+                break;
+            case 'n':
+                files = std::max(1, atoi(optarg));
+                break;
+            case 's':
+                size = std::max(1, atoi(optarg));
+                break;
+            case 'd':
+                directories = std::max(1, atoi(optarg));
+                break;
+            case 'r':
+                rounds = std::max(1, atoi(optarg));
+                break;
+            case 'c':
+                cold = true;
+                break;
+            case 'h':
+            default:
+                Usage();
+        }
+    }
+
+    const std::string mount = dfs_clean_path(root + "/mount");
+    DFSPackOptions pack_options;
+    pack_options.pack_path = dfs_clean_path(root + "/packs");
+    mkdir(root.c_str(), 0755);
+    mkdir(mount.c_str(), 0755);
+
+    std::vector<std::string> names;
+    for (int i = 0; i < files; i++) {
+        names.push_back("dir-" + std::to_string(i % directories) + "/file-" + std::to_string(i) + ".txt");
+    }
+    std::string contents(size, 'x');
+    const int64_t mtime = 1700000000;
+
+    // as storeFile writes a file to the mount: parents, create, write, close, mtime
+    auto mount_store = [&](const std::string &name) {
+        const std::string path = mount + name;
+        DFSChunkWriter outfile;
+        dfs_service::FileChunk chunk;
+        chunk.set_content(contents);
+        return dfs_make_parents(path) && outfile.Open(path) && outfile.Write(chunk) && outfile.Close() &&
+               dfs_set_mtime(path, mtime);
+    };
+    // as fetchFile reads one: stat, open, read the chunks, close
+    DFSChunkPool::Chunk chunk = DFSChunkPool::Acquire();
+    auto mount_fetch = [&](const std::string &name) {
+        const std::string path = mount + name;
+        struct stat file_stat;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (stat(path.c_str(), &file_stat) != 0 || fd < 0) {
+            return false;
+        }
+        DFSChunkReader infile(fd, BUF_SIZE);
+        int64_t read = 0;
+        while (infile.Next(chunk.get())) {
+            read += chunk->content().size();
+        }
+        close(fd);
+        return read == size;
+    };
+    auto mount_stat = [&](const std::string &name) {
+        struct stat file_stat;
+        return stat((mount + name).c_str(), &file_stat) == 0;
+    };
+
+    DFSPackStore packs(pack_options);
+    // as storeFile packs one: append the record, and drop a copy in the mount unless it was packed
+    auto pack_store = [&](const std::string &name) {
+        bool replaced = false;
+        if (!packs.Put(name, contents, mtime, &replaced)) {
+            return false;
+        }
+        if (!replaced) {
+            unlink((mount + name).c_str());
+        }
+        return true;
+    };
+    // as fetchFile reads one: look it up, then read it
+    auto pack_fetch = [&](const std::string &name) {
+        DFSPackStore::Info info;
+        std::string data;
+        return packs.Get(name, &info) && packs.Get(name, &info, &data) && static_cast<int>(data.size()) == size;
+    };
+    auto pack_stat = [&](const std::string &name) {
+        DFSPackStore::Info info;
+        return packs.Get(name, &info);
+    };
+
+    // every round stores new names, removed again untimed afterwards
+    double mount_store_rate = 0, mount_fetch_rate = 0, mount_stat_rate = 0;
+    double pack_store_rate = 0, pack_fetch_rate = 0, pack_stat_rate = 0;
+    for (int round = 0; round < rounds; round++) {
+        mount_store_rate = std::max(mount_store_rate, Rate(names, mount_store));
+        DropCaches(cold);
+        mount_fetch_rate = std::max(mount_fetch_rate, Rate(names, mount_fetch));
+        DropCaches(cold);
+        mount_stat_rate = std::max(mount_stat_rate, Rate(names, mount_stat));
+        for (const std::string &name : names) {
+            unlink((mount + name).c_str());
+        }
+
+        pack_store_rate = std::max(pack_store_rate, Rate(names, pack_store));
+        DropCaches(cold);
+        pack_fetch_rate = std::max(pack_fetch_rate, Rate(names, pack_fetch));
+        DropCaches(cold);
+        pack_stat_rate = std::max(pack_stat_rate, Rate(names, pack_stat));
+        for (const std::string &name : names) {
+            packs.Remove(name);
+        }
+    }
+    packs.Compact();
+
+    std::cout << files << " files of " << size << " bytes in " << directories << " directories"
+              << (cold ? ", page cache dropped before fetch and stat\n" : "\n")
+              << "op      mount/s       packs/s       speedup\n" << std::fixed;
+    auto row = [](const char *op, double mount_rate, double pack_rate) {
+        std::cout << std::left << std::setw(8) << op << std::setw(14) << std::setprecision(0) << mount_rate
+                  << std::setw(14) << pack_rate << std::setprecision(1) << pack_rate / mount_rate << "x\n";
+    };
+    row("store", mount_store_rate, pack_store_rate);
+    row("fetch", mount_fetch_rate, pack_fetch_rate);
+    row("stat", mount_stat_rate, pack_stat_rate);
+
+    for (int i = 0; i < directories; i++) {
+        rmdir((mount + "dir-" + std::to_string(i)).c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,347 @@
+#include <map>
+#include <set>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <condition_variable>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <grpcpp/grpcpp.h>
+
+#include "dfs-utils.h"
+#include "../dfslib-shared-p1.h"
+#include "../dfslib-optrace-p1.h"
+#include "../dfslib-clientnode-p1.h"
+
+//
+// Replays a workload trace (see dfslib-optrace-p1.h) against the servers.
+//
+// The replay is open-loop: every operation is issued at its recorded
+// arrival time, divided by the speed-up, whether or not earlier operations
+// have finished. Latency is measured from that intended time rather than
+// from when a worker got to the operation, so time spent queued behind a
+// slow server counts against it (no coordinated omission).
+//
+
+using grpc::StatusCode;
+
+typedef std::chrono::steady_clock Clock;
+
+void Usage() {
+    std::cout <<
+        "\nUSAGE: dfs-replay-p1 [OPTIONS] -f TRACE\n"
+        "-a, --address <address>:  The servers, as for dfs-client-p1 (default: 0.0.0.0:49704)\n"
+        "-m, --mount_path <path>:  Client directory the trace's files are generated in (default: mnt/replay)\n"
+        "-f, --trace <path>:       The trace to replay, e.g. one recorded with dfs-server-p1 --record_trace\n"
+        "-s, --speed <factor>:     Replay this many times faster than recorded (default: 1)\n"
+        "-c, --concurrency <int>:  Operations in flight at most; later ones wait, and the wait counts (default: 64)\n"
+        "-t, --deadline_timeout <int>:  Deadline of each operation in milliseconds (default: 30000)\n"
+        "-H, --hedge <q>:          Back up stats and fetches slower than this share of recent ones on another replica\n"
+        "-A, --async:              Issue the operations through the asynchronous API, -c at once, instead of -c threads\n"
+        "-h, --help:               Show help\n\n";
+    exit(1);
+}
+
+/** Deterministic, incompressible contents for a generated file **/
+bool MakeFile(const std::string &path, int64_t size) {
+    if (!dfs_make_parents(path)) {
+        return false;
+    }
+    std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    std::vector<char> block(1 << 16);
+    uint64_t state = std::hash<std::string>()(path) | 1;
+    for (int64_t written = 0; written < size; written += block.size()) {
+        for (char &c : block) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            c = static_cast<char>(state);
+        }
+        out.write(block.data(), std::min<int64_t>(block.size(), size - written));
+    }
+    return out.good();
+}
+
+/** Latencies of one kind of operation, in microseconds **/
+struct OpStats {
+    std::vector<int64_t> latencies;
+    int errors = 0;
+};
+
+double Percentile(const std::vector<int64_t> &sorted, double q) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = static_cast<size_t>(std::ceil(q * sorted.size()));
+    return sorted[std::max<size_t>(rank, 1) - 1] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    std::string server_address("0.0.0.0:49704");
+    std::string mount_path("mnt/replay");
+    std::string trace_path;
+    double speed = 1;
+    int concurrency = 64;
+    int deadline_timeout = 30000;
+    DFSHedgeOptions hedge_options;
+    bool async = false;
+
+    static struct option long_options[] = {
+        {"address", required_argument, NULL, 'a'},
+        {"mount_path", required_argument, NULL, 'm'},
+        {"trace", required_argument, NULL, 'f'},
+        {"speed", required_argument, NULL, 's'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"deadline_timeout", required_argument, NULL, 't'},
+        {"hedge", required_argument, NULL, 'H'},
+        {"async", no_argument, NULL, 'A'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, "a:m:f:s:c:t:H:Ah", long_options, NULL)) != -1) {
+        switch (ch) {
+            case 'a':
+                server_address = std::string(optarg);
+                break;
+            case 'm':
+                mount_path = std::string(optarg);
+                break;
+            case 'f':
+                trace_path = std::string(optarg);
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'c':
+                concurrency = std::max(1, atoi(optarg));
+                break;
+            case 't':
+                deadline_timeout = atoi(optarg);
+                break;
+            case 'H':
+                hedge_options.enabled = true;
+                hedge_options.percentile = atof(optarg);
+                break;
+            case 'A':
+                async = true;
+                break;
+            case 'h':
+            default:
+                Usage();
+        }
+    }
+    if (trace_path.empty() || speed <= 0) {
+        Usage();
+    }
+    mount_path = dfs_clean_path(mount_path);
+
+    std::vector<DFSOpRecord> records;
+    if (!dfs_read_op_trace(trace_path, &records) || records.empty()) {
+        std::cerr << "No operations in " << trace_path << std::endl;
+        return 1;
+    }
+
+    DFSClientNodeP1 client;
+    mkdir(mount_path.c_str(), 0755);
+    client.SetMountPath(mount_path);
+    client.SetDeadlineTimeout(deadline_timeout);
+    client.SetHedgeOptions(hedge_options);
+    DFSAsyncOptions async_options;
+    async_options.max_inflight = concurrency;
+    client.SetAsyncOptions(async_options);
+    for (const std::string &shard : dfs_split(server_address, ',')) {
+        std::vector<std::string> members = dfs_split(shard, '|');
+        if (members.empty()) {
+            continue;
+        }
+        client.AddServer(members[0], client.CreateChannels(members[0]));
+        for (size_t i = 1; i < members.size(); i++) {
+            client.AddReplica(members[0], members[i], client.CreateChannels(members[i]));
+        }
+    }
+
+    //
+    // Generate the files. Every file gets the largest size the trace gives
+    // it; files the trace reads before it stores them are put on the
+    // servers first, so the replay finds them there.
+    //
+    std::map<std::string, int64_t> sizes;
+    std::set<std::string> stored;
+    std::vector<std::string> preload;
+    for (const DFSOpRecord &record : records) {
+        if (record.op == "list" || record.path.empty()) {
+            continue;
+        }
+        int64_t &size = sizes[record.path];
+        size = std::max(size, record.size);
+        if (record.op == "store") {
+            stored.insert(record.path);
+        } else if (stored.insert(record.path).second) {
+            preload.push_back(record.path);
+        }
+    }
+    for (const auto &file : sizes) {
+        if (!MakeFile(mount_path + file.first, file.second)) {
+            std::cerr << "Failed to generate " << mount_path + file.first << std::endl;
+            return 1;
+        }
+    }
+    for (const std::string &path : preload) {
+        if (client.Store(path) != StatusCode::OK) {
+            std::cerr << "Failed to put " << path << " on the servers" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << records.size() << " operations on " << sizes.size() << " files ("
+              << preload.size() << " stored beforehand)" << std::endl;
+
+    //
+    // Replay. The dispatcher releases each operation at its intended time;
+    // the workers take them in order.
+    //
+    const int64_t first = records.front().time_us;
+    const Clock::time_point start = Clock::now() + std::chrono::milliseconds(100);
+    auto intended = [&](const DFSOpRecord &record) {
+        return start + std::chrono::microseconds(static_cast<int64_t>((record.time_us - first) / speed));
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<size_t> ready;
+    bool dispatched = false;
+    std::map<std::string, OpStats> stats;
+
+    auto work = [&]() {
+        std::map<std::string, OpStats> mine;
+        for (;;) {
+            size_t index;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]() { return !ready.empty() || dispatched; });
+                if (ready.empty()) {
+                    break;
+                }
+                index = ready.front();
+                ready.pop_front();
+            }
+            const DFSOpRecord &record = records[index];
+            StatusCode code = StatusCode::OK;
+            if (record.op == "store") {
+                code = client.Store(record.path);
+            } else if (record.op == "fetch") {
+                code = client.Fetch(record.path);
+            } else if (record.op == "stat") {
+                code = client.Stat(record.path);
+            } else if (record.op == "delete") {
+                code = client.Delete(record.path);
+            } else if (record.op == "list") {
+                std::map<std::string, int> file_map;
+                code = client.List(&file_map);
+            } else {
+                continue;
+            }
+            OpStats &op = mine[record.op];
+            op.latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - intended(record)).count());
+            if (code != StatusCode::OK) {
+                op.errors++;
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &entry : mine) {
+            OpStats &total = stats[entry.first];
+            total.latencies.insert(total.latencies.end(), entry.second.latencies.begin(), entry.second.latencies.end());
+            total.errors += entry.second.errors;
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int i = 0; !async && i < concurrency; i++) {
+        workers.emplace_back(work);
+    }
+
+    // with --async the dispatcher submits the operations itself, and the
+    // engine's limit holds back the ones beyond the concurrency
+    auto submit = [&](const DFSOpRecord &record) {
+        auto done = [&mutex, &stats, &record, &intended](StatusCode code) {
+            const int64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - intended(record)).count();
+            std::lock_guard<std::mutex> lock(mutex);
+            OpStats &op = stats[record.op];
+            op.latencies.push_back(latency);
+            if (code != StatusCode::OK) {
+                op.errors++;
+            }
+        };
+        if (record.op == "store") {
+            client.StoreAsync(record.path, done);
+        } else if (record.op == "fetch") {
+            client.FetchAsync(record.path, done);
+        } else if (record.op == "stat") {
+            client.StatAsync(record.path, nullptr, done);
+        } else if (record.op == "delete") {
+            client.DeleteAsync(record.path, done);
+        } else if (record.op == "list") {
+            auto file_map = std::make_shared<std::map<std::string, int>>();
+            client.ListAsync(file_map.get(), [done, file_map](StatusCode code) { done(code); });
+        }
+    };
+
+    int64_t worst_lag_us = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        std::this_thread::sleep_until(intended(records[i]));
+        worst_lag_us = std::max<int64_t>(worst_lag_us,
+            std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - intended(records[i])).count());
+        if (async) {
+            submit(records[i]);
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.push_back(i);
+        cv.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        dispatched = true;
+        cv.notify_all();
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    client.WaitAsync();
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    const double span = (records.back().time_us - first) / speed / 1e6;
+
+    std::cout << "replayed in " << std::fixed << std::setprecision(2) << seconds << "s (schedule "
+              << span << "s, speed x" << speed << ", dispatcher lag up to "
+              << worst_lag_us / 1000.0 << " ms)\n"
+              << "latency from intended start, ms\n"
+              << std::left << std::setw(8) << "op" << std::right << std::setw(8) << "count" << std::setw(8) << "errors"
+              << std::setw(10) << "p50" << std::setw(10) << "p90" << std::setw(10) << "p99"
+              << std::setw(10) << "p99.9" << std::setw(10) << "max" << "\n";
+    for (auto &entry : stats) {
+        std::vector<int64_t> &latencies = entry.second.latencies;
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << std::left << std::setw(8) << entry.first << std::right << std::setw(8) << latencies.size()
+                  << std::setw(8) << entry.second.errors << std::setprecision(2)
+                  << std::setw(10) << Percentile(latencies, 0.5) << std::setw(10) << Percentile(latencies, 0.9)
+                  << std::setw(10) << Percentile(latencies, 0.99) << std::setw(10) << Percentile(latencies, 0.999)
+                  << std::setw(10) << Percentile(latencies, 1.0) << "\n";
+    }
+    if (hedge_options.enabled) {
+        for (auto &kind : client.HedgeStats()) {
+            std::cout << "hedged " << kind.first << ": " << kind.second.hedged << " of " << kind.second.requests
+                      << ", backup won " << kind.second.backup_wins << ", over budget " << kind.second.over_budget << "\n";
+        }
+    }
+    return 0;
+}
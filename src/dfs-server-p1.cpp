@@ -3,12 +3,24 @@
 #include <iostream>
 #include <fstream>
 #include <csignal>
+#include <cerrno>
+#include <thread>
+#include <unistd.h>
 
 #include "dfs-utils.h"
+#include "../dfslib-shared-p1.h"
+#include "../dfslib-bandwidth-p1.h"
 #include "../dfslib-servernode-p1.h"
+#include "../dfslib-trace-p1.h"
+
+/** Written to by HandleSignal, read by the thread that shuts the server down **/
+int signal_pipe[2];
 
 void HandleSignal(int signum) {
-    exit(0);
+    // only async-signal-safe calls here; the rest of the shutdown runs in main
+    char byte = 1;
+    ssize_t written = write(signal_pipe[1], &byte, 1);
+    (void)written;
 }
 
 void Usage() {
@@ -17,18 +29,80 @@ void Usage() {
         "-a, --address <address>:    The server address to connect to (default: 0.0.0.0:49704)\n"
         "-d, --debug_level <level>:  The debug level to use: 0, 1, 2, 3 (default: 0 = no debug, higher numbers increase verbosity)\n"
         "-m, --mount_path <path>:    The mount storage path (default: mnt/server)\n"
+        "-r, --replicas <addresses>: Comma-separated replica servers that stores and deletes are forwarded to\n"
+        "-w, --write_quorum <int>:   Replicas that must hold a stored file before it is acknowledged (default: all)\n"
+        "--bdp_probe <0|1>:          Enable or disable HTTP/2 BDP probing (default: gRPC default)\n"
+        "--window <bytes>:           Initial HTTP/2 stream flow-control window\n"
+        "--max_streams <int>:        Maximum concurrent streams per connection\n"
+        "--keepalive <ms>:           Keepalive ping interval\n"
+        "--keepalive_timeout <ms>:   Time to wait for a keepalive ack\n"
+        "--max_inflight <int>:       Streams admitted at once; more are rejected with RESOURCE_EXHAUSTED\n"
+        "--max_queued_mib <int>:     MiB of admitted transfers at once\n"
+        "--shed_late:                Drop requests whose deadline is shorter than their expected service time\n"
+        "--max_threads <int>:        Thread limit of the gRPC resource quota\n"
+        "--memory_quota_mib <int>:   Memory limit of the gRPC resource quota\n"
+        "--bandwidth_mib <rate>:     Transfer rate shared by all clients, in MiB/s\n"
+        "--client_mib <rate>:        Default per-client ceiling, in MiB/s\n"
+        "--client_limits <spec>:     Per-client ceilings and weights: id=MiBps:weight,...\n"
+        "--walk_threads <int>:       Threads walking the tree for a recursive listing\n"
+        "--record_trace <path>:      Append every client operation to this file, for dfs-replay-p1\n"
+        "--snapshot <path>:          Keep a metadata index, saved to this file, for listings and content hashes\n"
+        "--snapshot_interval <sec>:  Seconds between snapshots of the metadata index (default: 60)\n"
+        "--cold_path <path>:         Directory of a cold tier that idle files are moved to\n"
+        "--hot_mib <int>:            MiB the mount may hold before the coldest files are moved out\n"
+        "--cold_after <sec>:         Seconds without an access before a file is moved out (default: 3600)\n"
+        "--promote_hits <n>:         Recent accesses that bring a cold file back (default: 3)\n"
+        "--tier_mib <rate>:          MiB/s the tier mover reads at most (default: 16)\n"
+        "--cold_compress:            Compress files in the cold tier\n"
+        "--compress_at_rest:         Compress stored files in the mount too\n"
+        "--pack_path <path>:         Append small files to pack files in this directory instead of a file each\n"
+        "--pack_kib <int>:           KiB up to which a file counts as small (default: 64)\n"
+        "--upload_path <path>:       Accept striped uploads, staged in this directory (best on the mount's filesystem)\n"
+        "--trace_file <path>:        Write Chrome trace JSON of the RPC phases to this file on exit\n"
+        "--trace_sample <rate>:      Share of traces recorded when the client sends none, 0 to 1 (default: 1)\n"
         "-h, --help:                 Show help\n\n";
     exit(1);
 }
 
 int main(int argc, char** argv) {
 
-    const char* const short_opts = "a:d:m:h";
+    const char* const short_opts = "a:d:m:r:w:h";
 
     const option long_opts[] = {
         {"address", optional_argument, nullptr, 'a'},
         {"debug_level", optional_argument, nullptr, 'd'},
         {"mount_path", optional_argument, nullptr, 'm'},
+        {"replicas", optional_argument, nullptr, 'r'},
+        {"write_quorum", optional_argument, nullptr, 'w'},
+        {"bdp_probe", required_argument, nullptr, 1000},
+        {"window", required_argument, nullptr, 1001},
+        {"keepalive", required_argument, nullptr, 1002},
+        {"keepalive_timeout", required_argument, nullptr, 1003},
+        {"max_streams", required_argument, nullptr, 1004},
+        {"max_inflight", required_argument, nullptr, 1005},
+        {"max_queued_mib", required_argument, nullptr, 1006},
+        {"shed_late", no_argument, nullptr, 1007},
+        {"max_threads", required_argument, nullptr, 1008},
+        {"memory_quota_mib", required_argument, nullptr, 1009},
+        {"bandwidth_mib", required_argument, nullptr, 1010},
+        {"client_mib", required_argument, nullptr, 1011},
+        {"client_limits", required_argument, nullptr, 1012},
+        {"walk_threads", required_argument, nullptr, 1013},
+        {"trace_file", required_argument, nullptr, 1014},
+        {"trace_sample", required_argument, nullptr, 1015},
+        {"record_trace", required_argument, nullptr, 1016},
+        {"snapshot", required_argument, nullptr, 1017},
+        {"snapshot_interval", required_argument, nullptr, 1018},
+        {"cold_path", required_argument, nullptr, 1019},
+        {"hot_mib", required_argument, nullptr, 1020},
+        {"cold_after", required_argument, nullptr, 1021},
+        {"promote_hits", required_argument, nullptr, 1022},
+        {"tier_mib", required_argument, nullptr, 1023},
+        {"cold_compress", no_argument, nullptr, 1024},
+        {"pack_path", required_argument, nullptr, 1025},
+        {"pack_kib", required_argument, nullptr, 1026},
+        {"upload_path", required_argument, nullptr, 1027},
+        {"compress_at_rest", no_argument, nullptr, 1028},
         {"help", no_argument, nullptr, 'h'},
         {nullptr, no_argument, nullptr, 0}
     };
@@ -37,6 +111,9 @@ int main(int argc, char** argv) {
     std::string mount_path = "mnt/server/";
     std::string server_address = "0.0.0.0:49704";
     int debug_level = static_cast<int>(LL_ERROR);
+    DFSServerOptions options;
+    std::string trace_file;
+    double trace_sample = 1;
 
     while((option_char = getopt_long(argc, argv, short_opts, long_opts, nullptr)) != -1) {
         switch(option_char) {
@@ -49,6 +126,99 @@ int main(int argc, char** argv) {
             case 'm':
                 mount_path = std::string(optarg);
                 break;
+            case 'r':
+                options.replicas = dfs_split(optarg, ',');
+                break;
+            case 'w':
+                options.write_quorum = std::stoi(optarg);
+                break;
+            case 1000:
+                options.transport.bdp_probe = std::stoi(optarg);
+                break;
+            case 1001:
+                options.transport.initial_window_bytes = std::stoi(optarg);
+                break;
+            case 1002:
+                options.transport.keepalive_time_ms = std::stoi(optarg);
+                break;
+            case 1003:
+                options.transport.keepalive_timeout_ms = std::stoi(optarg);
+                break;
+            case 1004:
+                options.transport.max_concurrent_streams = std::stoi(optarg);
+                break;
+            case 1005:
+                options.max_inflight = std::stoi(optarg);
+                break;
+            case 1006:
+                options.max_queued_bytes = std::stoll(optarg) << 20;
+                break;
+            case 1007:
+                options.shed_late = true;
+                break;
+            case 1008:
+                options.max_threads = std::stoi(optarg);
+                break;
+            case 1009:
+                options.memory_quota_bytes = std::stoll(optarg) << 20;
+                break;
+            case 1010:
+                options.bandwidth_bytes = std::stod(optarg) * (1 << 20);
+                break;
+            case 1011:
+                options.default_share.ceil_bytes = std::stod(optarg) * (1 << 20);
+                break;
+            case 1012:
+                options.client_shares = DFSBandwidthScheduler::ParseShares(optarg);
+                break;
+            case 1013:
+                options.walk_threads = std::stoi(optarg);
+                break;
+            case 1014:
+                trace_file = std::string(optarg);
+                break;
+            case 1015:
+                trace_sample = std::stod(optarg);
+                break;
+            case 1016:
+                options.record_trace = std::string(optarg);
+                break;
+            case 1017:
+                options.snapshot_path = std::string(optarg);
+                break;
+            case 1018:
+                options.snapshot_interval = std::stoi(optarg);
+                break;
+            case 1019:
+                options.tiers.cold_path = std::string(optarg);
+                break;
+            case 1020:
+                options.tiers.hot_bytes = std::stoll(optarg) * 1024 * 1024;
+                break;
+            case 1021:
+                options.tiers.cold_after = std::stoi(optarg);
+                break;
+            case 1022:
+                options.tiers.promote_hits = std::stod(optarg);
+                break;
+            case 1023:
+                options.tiers.move_bytes = std::stod(optarg) * 1024 * 1024;
+                break;
+            case 1024:
+                options.tiers.compress = true;
+                break;
+            case 1025:
+                options.packs.pack_path = std::string(optarg);
+                break;
+            case 1026:
+                options.packs.small_bytes = std::stoll(optarg) * 1024;
+                break;
+            case 1027:
+                options.uploads.upload_path = std::string(optarg);
+                break;
+            case 1028:
+                options.compress_at_rest = true;
+                break;
             case 'h':
             case '?':
             default:
@@ -61,12 +231,37 @@ int main(int argc, char** argv) {
         DFS_LOG_LEVEL = static_cast<dfs_log_level_e>(debug_level + 1);
     }
 
+    if (pipe(signal_pipe) != 0) {
+        std::cerr << "Cannot create the signal pipe" << std::endl;
+        return 1;
+    }
     signal(SIGINT, HandleSignal);
     signal(SIGTERM, HandleSignal);
 
+    if (!trace_file.empty()) {
+        DFSTracer::Configure(trace_sample, trace_file, "dfs-server " + server_address);
+    }
+
     DFSServerNode server_node(server_address, dfs_clean_path(mount_path), [&]{ return; });
+    server_node.SetOptions(options);
+    // a 1 is a signal, a 0 is main telling the thread that the server is down already
+    std::thread stopper([&server_node] {
+        char byte = 0;
+        while (read(signal_pipe[0], &byte, 1) < 0 && errno == EINTR) {
+        }
+        if (byte != 0) {
+            server_node.Shutdown();
+        }
+    });
     server_node.Start();
 
+    char done = 0;
+    if (write(signal_pipe[1], &done, 1) < 0) {
+        stopper.detach();
+    } else {
+        stopper.join();
+    }
+    DFSTracer::Write();
     return 0;
 
 }
@@ -1,4 +1,5 @@
 #include <mutex>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <thread>
@@ -19,6 +20,7 @@
 
 #include "dfs-utils.h"
 #include "dfslibx-clientnode-p1.h"
+#include "../dfslib-trace-p1.h"
 
 using grpc::Status;
 using grpc::Channel;
@@ -29,6 +31,66 @@ using grpc::ClientContext;
 
 extern dfs_log_level_e DFS_LOG_LEVEL;
 
+DFSPooledStub::DFSPooledStub(std::shared_ptr <Channel> channel)
+    : stub(dfs_service::DFSService::NewStub(channel)), inflight(0) {}
+
+DFSReplica::DFSReplica(const std::string &address, const std::vector<std::shared_ptr <Channel>> &channels,
+                       bool least_loaded)
+    : address(address), least_loaded(least_loaded), next(0), inflight(0), latency_us(0) {
+    for (auto &channel : channels) {
+        this->pool.emplace_back(new DFSPooledStub(channel));
+    }
+}
+
+int64_t DFSReplica::Score() const {
+    // a small floor keeps idle-but-slow servers from always losing to busy fast ones
+    return (this->latency_us.load() + 100) * (this->inflight.load() + 1);
+}
+
+DFSPooledStub* DFSReplica::Assign() {
+    if (!this->least_loaded) {
+        return this->pool[this->next++ % this->pool.size()].get();
+    }
+    DFSPooledStub* best = this->pool.front().get();
+    for (auto &connection : this->pool) {
+        if (connection->inflight.load() < best->inflight.load()) {
+            best = connection.get();
+        }
+    }
+    return best;
+}
+
+DFSReplicaCall::DFSReplicaCall(DFSReplica *replica, bool timed)
+    : replica(replica), connection(replica->Assign()), start(std::chrono::steady_clock::now()),
+      timed(timed), failed(false) {
+    this->replica->inflight++;
+    this->connection->inflight++;
+}
+
+DFSReplicaCall::~DFSReplicaCall() {
+    this->replica->inflight--;
+    this->connection->inflight--;
+    if (!this->timed && !this->failed) {
+        return;
+    }
+    int64_t sample = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - this->start).count();
+    if (this->failed) {
+        sample = std::max<int64_t>(sample, DFS_REPLICA_FAILURE_US);
+    }
+    int64_t average = this->replica->latency_us.load();
+    // exponentially weighted moving average, alpha = 1/4
+    this->replica->latency_us.store(average == 0 ? sample : average + (sample - average) / 4);
+}
+
+dfs_service::DFSService::Stub* DFSReplicaCall::Stub() {
+    return this->connection->stub.get();
+}
+
+void DFSReplicaCall::Failed() {
+    this->failed = true;
+}
+
 DFSClientNode::DFSClientNode() : mount_path("mnt/client/") {
     char host[HOST_NAME_MAX];
     std::ostringstream ss_id;
@@ -44,8 +106,38 @@ const std::string DFSClientNode::ClientId() {
     return this->client_id;
 }
 
+void DFSClientNode::SetClientId(const std::string &id) {
+    this->client_id = id;
+}
+
 void DFSClientNode::CreateStub(std::shared_ptr <Channel> channel) {
-    this->service_stub = dfs_service::DFSService::NewStub(channel);
+    this->AddServer("default", {channel});
+}
+
+void DFSClientNode::SetTransportOptions(const DFSTransportOptions &options) {
+    this->transport_options = options;
+}
+
+std::vector<std::shared_ptr <Channel>> DFSClientNode::CreateChannels(const std::string &server_address) {
+    std::vector<std::shared_ptr <Channel>> channels;
+    for (int i = 0; i < std::max(1, this->transport_options.channel_pool_size); i++) {
+        channels.push_back(grpc::CreateCustomChannel(server_address, grpc::InsecureChannelCredentials(),
+                                                     this->transport_options.ChannelArguments(i)));
+    }
+    return channels;
+}
+
+void DFSClientNode::AddServer(const std::string &server_address, const std::vector<std::shared_ptr <Channel>> &channels) {
+    auto &group = this->server_groups[server_address];
+    group.clear();
+    group.emplace_back(new DFSReplica(server_address, channels, this->transport_options.least_loaded));
+    this->server_ring.AddNode(server_address);
+}
+
+void DFSClientNode::AddReplica(const std::string &primary_address, const std::string &replica_address,
+                               const std::vector<std::shared_ptr <Channel>> &channels) {
+    this->server_groups.at(primary_address).emplace_back(
+        new DFSReplica(replica_address, channels, this->transport_options.least_loaded));
 }
 
 void DFSClientNode::SetMountPath(const std::string &path) {
@@ -64,4 +156,42 @@ std::string DFSClientNode::WrapPath(const std::string &filepath) {
     return this->mount_path + filepath;
 }
 
+void DFSClientNode::PrepareContext(grpc::ClientContext *context, bool deadline) {
+    if (deadline) {
+        context->set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(this->deadline_timeout));
+    }
+    context->AddMetadata("clientid", this->client_id);
+    DFSTracer::Inject(context);
+}
+
+DFSReplica* DFSClientNode::PrimaryFor(const std::string &filename) {
+    return this->server_groups.at(this->server_ring.NodeFor(filename)).front().get();
+}
 
+DFSReplica* DFSClientNode::ReplicaFor(const std::string &filename) {
+    auto &group = this->server_groups.at(this->server_ring.NodeFor(filename));
+    DFSReplica* best = group.front().get();
+    for (auto &replica : group) {
+        if (replica->Score() < best->Score()) {
+            best = replica.get();
+        }
+    }
+    return best;
+}
+
+std::vector<DFSReplica*> DFSClientNode::ReplicasFor(const std::string &filename) {
+    // scores change under us, so take each one once before sorting
+    std::vector<std::pair<int64_t, DFSReplica*>> scored;
+    for (auto &replica : this->server_groups.at(this->server_ring.NodeFor(filename))) {
+        scored.emplace_back(replica->Score(), replica.get());
+    }
+    std::stable_sort(scored.begin(), scored.end(),
+                     [](const std::pair<int64_t, DFSReplica*> &a, const std::pair<int64_t, DFSReplica*> &b) {
+                         return a.first < b.first;
+                     });
+    std::vector<DFSReplica*> replicas;
+    for (auto &entry : scored) {
+        replicas.push_back(entry.second);
+    }
+    return replicas;
+}
@@ -7,10 +7,96 @@
 #include <limits.h>
 #include <chrono>
 #include <mutex>
+#include <atomic>
 
 #include <grpcpp/grpcpp.h>
+#include "../dfslib-shared-p1.h"
 #include "../proto-src/dfs-service.grpc.pb.h"
 
+/** Latency charged to a replica for a failed request, in microseconds **/
+#define DFS_REPLICA_FAILURE_US 1000000
+
+/**
+ * One connection of a server's channel pool
+ */
+struct DFSPooledStub {
+
+    /** The service stub bound to this connection **/
+    std::unique_ptr<dfs_service::DFSService::Stub> stub;
+
+    /** Streams currently open on this connection **/
+    std::atomic<int> inflight;
+
+    DFSPooledStub(std::shared_ptr<grpc::Channel> channel);
+};
+
+/**
+ * One server endpoint, its connection pool and the load this client has observed on it
+ */
+struct DFSReplica {
+
+    /** The server address **/
+    std::string address;
+
+    /** The connections to this server **/
+    std::vector<std::unique_ptr<DFSPooledStub>> pool;
+
+    /** Pick the connection with the fewest open streams instead of round-robin **/
+    bool least_loaded;
+
+    /** Round-robin cursor into the pool **/
+    std::atomic<unsigned int> next;
+
+    /** Requests currently outstanding on this server **/
+    std::atomic<int> inflight;
+
+    /** Smoothed request latency in microseconds (0 until the first sample) **/
+    std::atomic<int64_t> latency_us;
+
+    DFSReplica(const std::string& address, const std::vector<std::shared_ptr<grpc::Channel>>& channels,
+               bool least_loaded = false);
+
+    /**
+     * Load score used to pick a replica; lower is better.
+     */
+    int64_t Score() const;
+
+    /**
+     * Pick the connection the next stream should use.
+     */
+    DFSPooledStub* Assign();
+};
+
+/**
+ * Tracks one request against a replica: assigns it a pooled connection,
+ * counts it as in flight while the object lives and, for timed requests,
+ * feeds its latency into the replica's average.
+ */
+class DFSReplicaCall {
+
+private:
+    DFSReplica* replica;
+    DFSPooledStub* connection;
+    std::chrono::steady_clock::time_point start;
+    bool timed;
+    bool failed;
+
+public:
+    DFSReplicaCall(DFSReplica* replica, bool timed = true);
+    ~DFSReplicaCall();
+
+    /**
+     * The stub of the connection assigned to this request
+     */
+    dfs_service::DFSService::Stub* Stub();
+
+    /**
+     * Marks the request as failed so the replica is charged
+     * DFS_REPLICA_FAILURE_US instead of its (fast) failure latency.
+     */
+    void Failed();
+};
+
 class DFSClientNode {
 
 protected:
@@ -24,8 +110,17 @@ protected:
     /** The mount path **/
     std::string mount_path;
 
-    /** The service stub **/
-    std::unique_ptr<dfs_service::DFSService::Stub> service_stub;
+    /**
+     * The servers, keyed by primary address. The first entry of every
+     * group is the primary, the others are its read replicas.
+     */
+    std::map<std::string, std::vector<std::unique_ptr<DFSReplica>>> server_groups;
+
+    /** Consistent-hash ring that assigns each filename to a primary server **/
+    DFSHashRing server_ring;
+
+    /** Connection pool and HTTP/2 settings **/
+    DFSTransportOptions transport_options;
 
     /**
      * Utility function to wrap a filename with the mount path.
@@ -35,6 +130,41 @@ protected:
      */
     std::string WrapPath(const std::string& filepath);
 
+    /**
+     * Sets the deadline of a request and tags it with the client id,
+     * which the server uses for per-client bandwidth sharing.
+     *
+     * @param context
+     * @param deadline - false for long-lived streams such as watch
+     */
+    void PrepareContext(grpc::ClientContext* context, bool deadline = true);
+
+    /**
+     * Find the primary server that owns the given filename.
+     * Writes and deletes must go to the primary.
+     *
+     * @param filename
+     * @return
+     */
+    DFSReplica* PrimaryFor(const std::string& filename);
+
+    /**
+     * Pick the least loaded server holding the given filename,
+     * judged by observed latency and requests in flight.
+     *
+     * @param filename
+     * @return
+     */
+    DFSReplica* ReplicaFor(const std::string& filename);
+
+    /**
+     * All the servers holding the given filename, least loaded first.
+     *
+     * @param filename
+     * @return
+     */
+    std::vector<DFSReplica*> ReplicasFor(const std::string& filename);
+
 public:
     /**
      * Constructor for the DFSClientNode class
@@ -69,6 +199,13 @@ public:
      */
     const std::string ClientId();
 
+    /**
+     * Replace the generated client id with a stable one, e.g. so that
+     * per-client server limits apply across runs
+     * @param id
+     */
+    void SetClientId(const std::string& id);
+
     /**
      * Creates the RPC channel to be used by the library
      * to connect to the remote GRPC service.
@@ -77,6 +214,42 @@ public:
      */
     void CreateStub(std::shared_ptr<grpc::Channel> channel);
 
+    /**
+     * Sets the connection pool and HTTP/2 settings used by CreateChannels
+     * @param options
+     */
+    void SetTransportOptions(const DFSTransportOptions& options);
+
+    /**
+     * Opens the pool of channels to a server, as configured by the transport options.
+     *
+     * @param server_address
+     * @return
+     */
+    std::vector<std::shared_ptr<grpc::Channel>> CreateChannels(const std::string& server_address);
+
+    /**
+     * Adds a server to the set of servers files are sharded across.
+     *
+     * Files are routed to servers through a consistent-hash ring, so adding
+     * a server only moves about 1/N of the filenames to it.
+     *
+     * @param server_address
+     * @param channels - the connection pool to the server
+     */
+    void AddServer(const std::string& server_address, const std::vector<std::shared_ptr<grpc::Channel>>& channels);
+
+    /**
+     * Adds a read replica of a server already added with AddServer.
+     * Fetch and Stat requests are spread over the primary and its replicas.
+     *
+     * @param primary_address
+     * @param replica_address
+     * @param channels - the connection pool to the replica
+     */
+    void AddReplica(const std::string& primary_address, const std::string& replica_address,
+                    const std::vector<std::shared_ptr<grpc::Channel>>& channels);
+
     /**
      * Store a file from the mount path on to the RPC server
      * @param filename